@@ -0,0 +1,677 @@
+/* Micro-benchmarks for pound hot paths.
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each benchmark runs its operation in a loop, increasing the number
+ * of iterations until the loop takes at least the minimal time (-t).
+ * The results are reported as time per operation and operations per
+ * second, either in tabular form or in JSON (-j).
+ *
+ * The benchmarks operate on the data structures built by parsing a
+ * synthetic configuration file, i.e. the same way pound sets them up.
+ */
+#include "pound.h"
+#include "extern.h"
+#include <fnmatch.h>
+#include "json.h"
+
+/* Number of URL-dispatched services in the synthetic configuration. */
+#define NSERVICES 32
+/* Number of backends in the balancer services. */
+#define NBACKENDS 8
+/* Number of client addresses used by the session benchmark. */
+#define NCLIENTS 4096
+/* Number of CIDRs in the ACL. */
+#define NCIDRS 1000
+
+static double min_time = 0.5;
+static int json_option;
+
+/* Results are stored here, to prevent the compiler from optimizing out
+   the benchmarked calls. */
+static volatile unsigned long sink;
+
+static LISTENER *listener;
+
+static void
+die (char const *fmt, ...)
+{
+  va_list ap;
+
+  fprintf (stderr, "%s: ", progname);
+  va_start (ap, fmt);
+  vfprintf (stderr, fmt, ap);
+  va_end (ap);
+  fputc ('\n', stderr);
+  exit (1);
+}
+
+/*
+ * Synthetic configuration.
+ */
+static char *
+config_create (void)
+{
+  char const *tmpdir;
+  char *name;
+  int fd;
+  FILE *fp;
+  int i, j;
+
+  if ((tmpdir = getenv ("TMPDIR")) == NULL)
+    tmpdir = "/tmp";
+  name = xmalloc (strlen (tmpdir) + sizeof ("/microbench.XXXXXX"));
+  strcat (strcpy (name, tmpdir), "/microbench.XXXXXX");
+  if ((fd = mkstemp (name)) == -1)
+    die ("can't create temporary file %s: %s", name, strerror (errno));
+  if ((fp = fdopen (fd, "w")) == NULL)
+    die ("fdopen: %s", strerror (errno));
+
+  fprintf (fp,
+	   "Daemon 0\n"
+	   "LogLevel 0\n"
+	   "ListenHTTP\n"
+	   "  Address 127.0.0.1\n"
+	   "  Port 8080\n");
+  for (i = 0; i < NSERVICES; i++)
+    fprintf (fp,
+	     "  Service \"svc%d\"\n"
+	     "    Host \"www%d.example.org\"\n"
+	     "    URL \"^/app%d/\"\n"
+	     "    Backend\n"
+	     "      Address 127.0.0.1\n"
+	     "      Port %d\n"
+	     "    End\n"
+	     "  End\n",
+	     i, i, i, 8000 + i);
+
+  fprintf (fp,
+	   "  Service \"random\"\n"
+	   "    Balancer random\n");
+  for (j = 0; j < NBACKENDS; j++)
+    fprintf (fp,
+	     "    Backend\n"
+	     "      Address 127.0.0.1\n"
+	     "      Port %d\n"
+	     "      Priority %d\n"
+	     "    End\n",
+	     9000 + j, j + 1);
+  fprintf (fp, "  End\n");
+
+  fprintf (fp,
+	   "  Service \"iwrr\"\n"
+	   "    Balancer iwrr\n");
+  for (j = 0; j < NBACKENDS; j++)
+    fprintf (fp,
+	     "    Backend\n"
+	     "      Address 127.0.0.1\n"
+	     "      Port %d\n"
+	     "      Priority %d\n"
+	     "    End\n",
+	     9100 + j, j + 1);
+  fprintf (fp, "  End\n");
+
+  fprintf (fp,
+	   "  Service \"session\"\n"
+	   "    Session\n"
+	   "      Type IP\n"
+	   "      TTL 300\n"
+	   "    End\n");
+  for (j = 0; j < NBACKENDS; j++)
+    fprintf (fp,
+	     "    Backend\n"
+	     "      Address 127.0.0.1\n"
+	     "      Port %d\n"
+	     "    End\n",
+	     9200 + j);
+  fprintf (fp,
+	   "  End\n"
+	   "End\n");
+  if (fclose (fp))
+    die ("error writing %s: %s", name, strerror (errno));
+  return name;
+}
+
+static void
+config_load (void)
+{
+  char *name = config_create ();
+  char *argv[] = { (char*) progname, "-e", "-f", name, NULL };
+
+  optind = 1;
+  config_parse (4, argv);
+  unlink (name);
+  free (name);
+  listener = SLIST_FIRST (&listeners);
+}
+
+static SERVICE *
+service_find (char const *name)
+{
+  SERVICE *svc;
+
+  SLIST_FOREACH (svc, &listener->services, next)
+    {
+      if (svc->name && strcmp (svc->name, name) == 0)
+	return svc;
+    }
+  die ("service %s not found", name);
+  return NULL;
+}
+
+/*
+ * Requests used by the benchmarks.
+ */
+static char const request_fmt[] =
+  "GET /app%d/static/images/logo.png?width=120&height=40&lang=en HTTP/1.1\r\n"
+  "Host: www%d.example.org\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101"
+  " Firefox/128.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Referer: https://www.example.org/index.html\r\n"
+  "Cookie: session=8d2f0c1b6a4e4f1fa3c5; theme=dark; consent=1\r\n"
+  "Connection: keep-alive\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "\r\n";
+
+static char *
+request_text (int n)
+{
+  struct stringbuf sb;
+
+  xstringbuf_init (&sb);
+  stringbuf_printf (&sb, request_fmt, n, n);
+  return stringbuf_finish (&sb);
+}
+
+/* Parsed requests, one per URL service. */
+static POUND_HTTP requests[NSERVICES];
+
+static void
+requests_init (void)
+{
+  int i;
+
+  arena_set_current (NULL);
+  for (i = 0; i < NSERVICES; i++)
+    {
+      char *text = request_text (i);
+      BIO *bio = BIO_new_mem_buf (text, -1);
+      POUND_HTTP *phttp = &requests[i];
+
+      memset (phttp, 0, sizeof (*phttp));
+      phttp->lstn = listener;
+      if (bench_http_request_parse (bio, listener, &phttp->request)
+	  != HTTP_STATUS_OK)
+	die ("can't parse request %d", i);
+      BIO_free (bio);
+    }
+}
+
+/*
+ * Benchmarks.
+ */
+
+/* Request reading and parsing. */
+static BIO *hdr_bio;
+static char *hdr_text;
+static struct arena hdr_arena;
+
+static int
+header_parse_setup (void)
+{
+  hdr_text = request_text (1);
+  hdr_bio = BIO_new_mem_buf (hdr_text, -1);
+  BIO_set_mem_eof_return (hdr_bio, 0);
+  return 0;
+}
+
+static void
+header_parse_run (unsigned long n)
+{
+  struct http_request req;
+
+  arena_set_current (&hdr_arena);
+  while (n--)
+    {
+      BIO_reset (hdr_bio);
+      if (bench_http_request_parse (hdr_bio, listener, &req)
+	  != HTTP_STATUS_OK)
+	die ("header_parse: can't parse request");
+      sink += req.method;
+      http_request_free (&req);
+      arena_reset (&hdr_arena);
+    }
+  arena_set_current (NULL);
+}
+
+/* Pattern matching. */
+static char const genpat_subject[] = "/static/images/2025/logo-large.png";
+static GENPAT genpat;
+
+static int
+genpat_setup (int type, char const *pattern)
+{
+  if (genpat_compile (&genpat, type, pattern, 0))
+    {
+      if (genpat)
+	genpat_free (genpat);
+      genpat = NULL;
+      return -1;
+    }
+  return 0;
+}
+
+static void
+genpat_run (unsigned long n)
+{
+  while (n--)
+    sink += genpat_match (genpat, genpat_subject, 0, NULL);
+}
+
+static void
+genpat_teardown (void)
+{
+  genpat_free (genpat);
+  genpat = NULL;
+}
+
+static int
+genpat_exact_setup (void)
+{
+  return genpat_setup (GENPAT_EXACT, genpat_subject);
+}
+
+static int
+genpat_prefix_setup (void)
+{
+  return genpat_setup (GENPAT_PREFIX, "/static/images/");
+}
+
+static int
+genpat_suffix_setup (void)
+{
+  return genpat_setup (GENPAT_SUFFIX, ".png");
+}
+
+static int
+genpat_contain_setup (void)
+{
+  return genpat_setup (GENPAT_CONTAIN, "/images/");
+}
+
+static char const genpat_regex[] = "^/static/[^/]+/[0-9]+/.*\\.(png|jpg|gif)$";
+
+static int
+genpat_posix_setup (void)
+{
+  return genpat_setup (GENPAT_POSIX, genpat_regex);
+}
+
+static int
+genpat_pcre_setup (void)
+{
+  return genpat_setup (GENPAT_PCRE, genpat_regex);
+}
+
+/* ACL matching. */
+static ACL *acl;
+static struct sockaddr_in acl_addr[NCLIENTS];
+
+static int
+acl_setup (void)
+{
+  int i;
+
+  acl = acl_new ("bench");
+  for (i = 0; i < NCIDRS; i++)
+    {
+      char buf[80];
+      snprintf (buf, sizeof (buf), "10.%d.%d.0/24", i / 256, i % 256);
+      if (acl_add (acl, buf))
+	die ("can't add %s to ACL", buf);
+    }
+
+  for (i = 0; i < NCLIENTS; i++)
+    {
+      acl_addr[i].sin_family = AF_INET;
+      /* Half of the addresses match the ACL. */
+      acl_addr[i].sin_addr.s_addr =
+	htonl (((i % 2 ? 10 : 192) << 24) | (i % NCIDRS) << 8 | (i & 0xff));
+    }
+  return 0;
+}
+
+static void
+acl_run (unsigned long n)
+{
+  unsigned long i;
+
+  for (i = 0; i < n; i++)
+    sink += acl_match (acl, (struct sockaddr *) &acl_addr[i % NCLIENTS]);
+}
+
+/* Expansion of compiled strings. */
+static EXPAND_PROG *expand_prog;
+
+static int
+expand_setup (void)
+{
+  expand_prog = expand_compile ("https://%[host]%[path]?%[query]");
+  return 0;
+}
+
+static void
+expand_run (unsigned long n)
+{
+  unsigned long i;
+
+  for (i = 0; i < n; i++)
+    {
+      char *s = bench_expand_string (expand_prog, &requests[i % NSERVICES]);
+      if (!s)
+	die ("expand_string failed");
+      sink += s[0];
+    }
+}
+
+/* Service selection. */
+static void
+get_service_run (unsigned long n)
+{
+  unsigned long i;
+
+  for (i = 0; i < n; i++)
+    {
+      SERVICE *svc = get_service (&requests[i % NSERVICES]);
+      if (!svc)
+	die ("get_service: no service found");
+      sink += (unsigned long) svc;
+    }
+}
+
+/* Backend selection. */
+static POUND_HTTP be_http;
+static struct sockaddr_in be_addr[NCLIENTS];
+
+static int
+balancer_setup (char const *name)
+{
+  int i;
+
+  be_http = requests[0];
+  be_http.svc = service_find (name);
+  for (i = 0; i < NCLIENTS; i++)
+    {
+      be_addr[i].sin_family = AF_INET;
+      be_addr[i].sin_addr.s_addr = htonl ((172 << 24) | (16 << 16) | i);
+    }
+  be_http.from_host.ai_family = AF_INET;
+  be_http.from_host.ai_addrlen = sizeof (be_addr[0]);
+  be_http.from_host.ai_addr = (struct sockaddr *) &be_addr[0];
+  return 0;
+}
+
+static int
+balancer_random_setup (void)
+{
+  return balancer_setup ("random");
+}
+
+static int
+balancer_iwrr_setup (void)
+{
+  return balancer_setup ("iwrr");
+}
+
+static int
+session_ip_setup (void)
+{
+  return balancer_setup ("session");
+}
+
+static void
+balancer_run (unsigned long n)
+{
+  unsigned long i;
+
+  for (i = 0; i < n; i++)
+    {
+      BACKEND *be;
+
+      be_http.from_host.ai_addr = (struct sockaddr *) &be_addr[i % NCLIENTS];
+      if ((be = get_backend (&be_http)) == NULL)
+	die ("get_backend: no backend found");
+      sink += (unsigned long) be;
+      backend_unref (be);
+    }
+}
+
+struct benchmark
+{
+  char const *name;           /* Benchmark name. */
+  char const *descr;          /* Short description. */
+  int (*setup) (void);        /* Setup function; returns -1 to skip. */
+  void (*run) (unsigned long);/* Run the operation given number of times. */
+  void (*teardown) (void);    /* Cleanup function. */
+};
+
+static struct benchmark benchmarks[] = {
+  { "header_parse", "read and parse an HTTP request",
+    header_parse_setup, header_parse_run },
+  { "genpat_exact", "exact string match",
+    genpat_exact_setup, genpat_run, genpat_teardown },
+  { "genpat_prefix", "prefix match",
+    genpat_prefix_setup, genpat_run, genpat_teardown },
+  { "genpat_suffix", "suffix match",
+    genpat_suffix_setup, genpat_run, genpat_teardown },
+  { "genpat_contain", "substring match",
+    genpat_contain_setup, genpat_run, genpat_teardown },
+  { "genpat_posix", "POSIX regular expression match",
+    genpat_posix_setup, genpat_run, genpat_teardown },
+  { "genpat_pcre", "PCRE match",
+    genpat_pcre_setup, genpat_run, genpat_teardown },
+  { "acl_match", "match IPv4 address against a " "1000-entry ACL",
+    acl_setup, acl_run },
+  { "expand_string", "expand a compiled string",
+    expand_setup, expand_run },
+  { "get_service", "select service among " "32 URL services",
+    NULL, get_service_run },
+  { "balancer_random", "select backend (random balancer)",
+    balancer_random_setup, balancer_run },
+  { "balancer_iwrr", "select backend (IWRR balancer)",
+    balancer_iwrr_setup, balancer_run },
+  { "session_ip", "look up IP session among 4096 clients",
+    session_ip_setup, balancer_run },
+  { NULL }
+};
+
+static double
+elapsed (struct timespec const *start, struct timespec const *end)
+{
+  return (end->tv_sec - start->tv_sec)
+    + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Run benchmark BP until it takes at least min_time seconds.  Return
+ * number of iterations in *RET_N and total time in *RET_T.
+ */
+static void
+benchmark_run (struct benchmark *bp, unsigned long *ret_n, double *ret_t)
+{
+  unsigned long n = 1;
+  double t;
+
+  for (;;)
+    {
+      struct timespec start, end;
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      bp->run (n);
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      t = elapsed (&start, &end);
+      if (t >= min_time)
+	break;
+      /* Predict the number of iterations needed, with 20% margin. */
+      if (t * 100 < min_time)
+	n *= 100;
+      else
+	n = n * (min_time / t) * 1.2 + 1;
+    }
+  *ret_n = n;
+  *ret_t = t;
+}
+
+static int
+benchmark_selected (struct benchmark *bp, int argc, char **argv)
+{
+  int i;
+
+  if (argc == 0)
+    return 1;
+  for (i = 0; i < argc; i++)
+    if (fnmatch (argv[i], bp->name, 0) == 0)
+      return 1;
+  return 0;
+}
+
+static void
+write_string (void *data, char const *str, size_t len)
+{
+  fwrite (str, len, 1, (FILE*)data);
+}
+
+static void
+usage (FILE *fp)
+{
+  fprintf (fp, "usage: %s [-hjl] [-t SECONDS] [NAME...]\n", progname);
+  fprintf (fp, "Run pound micro-benchmarks.\n\n");
+  fprintf (fp, "Options are:\n");
+  fprintf (fp, "  -h          show this help summary\n");
+  fprintf (fp, "  -j          output results in JSON format\n");
+  fprintf (fp, "  -l          list available benchmarks\n");
+  fprintf (fp, "  -t SECONDS  minimal running time of each benchmark"
+	   " (default %g)\n", min_time);
+  fprintf (fp, "\nNAME arguments are globbing patterns selecting the"
+	   " benchmarks to run.\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  int c;
+  struct benchmark *bp;
+  struct json_value *results = NULL;
+  char *p;
+
+  set_progname (argv[0]);
+  while ((c = getopt (argc, argv, "hjlt:")) != EOF)
+    switch (c)
+      {
+      case 'h':
+	usage (stdout);
+	exit (0);
+
+      case 'j':
+	json_option = 1;
+	break;
+
+      case 'l':
+	for (bp = benchmarks; bp->name; bp++)
+	  printf ("%-16s %s\n", bp->name, bp->descr);
+	exit (0);
+
+      case 't':
+	errno = 0;
+	min_time = strtod (optarg, &p);
+	if (errno || *p || min_time <= 0)
+	  die ("invalid time: %s", optarg);
+	break;
+
+      default:
+	usage (stderr);
+	exit (1);
+      }
+  argc -= optind;
+  argv += optind;
+
+  pound_init ();
+  config_load ();
+  requests_init ();
+
+  if (json_option)
+    results = json_new_array ();
+  else
+    printf ("%-16s %12s %12s %14s\n",
+	    "benchmark", "iterations", "ns/op", "ops/s");
+
+  for (bp = benchmarks; bp->name; bp++)
+    {
+      unsigned long n;
+      double t;
+
+      if (!benchmark_selected (bp, argc, argv))
+	continue;
+
+      if (bp->setup && bp->setup ())
+	{
+	  if (!json_option)
+	    printf ("%-16s %12s\n", bp->name, "skipped");
+	  continue;
+	}
+      benchmark_run (bp, &n, &t);
+      if (bp->teardown)
+	bp->teardown ();
+
+      if (json_option)
+	{
+	  struct json_value *obj = json_new_object ();
+	  json_object_set (obj, "name", json_new_string (bp->name));
+	  json_object_set (obj, "description", json_new_string (bp->descr));
+	  json_object_set (obj, "iterations", json_new_integer (n));
+	  json_object_set (obj, "ns_per_op", json_new_number (t * 1e9 / n));
+	  json_object_set (obj, "ops_per_sec", json_new_number (n / t));
+	  json_array_append (results, obj);
+	}
+      else
+	printf ("%-16s %12lu %12.1f %14.0f\n",
+		bp->name, n, t * 1e9 / n, n / t);
+      fflush (stdout);
+    }
+
+  if (json_option)
+    {
+      struct json_value *obj = json_new_object ();
+      struct json_format format = {
+	.indent = 2,
+	.precision = 2,
+	.write = write_string,
+	.data = stdout
+      };
+
+      json_object_set (obj, "version", json_new_string (PACKAGE_VERSION));
+      json_object_set (obj, "min_time", json_new_number (min_time));
+      json_object_set (obj, "benchmarks", results);
+      json_value_format (obj, &format, 0);
+      fputc ('\n', stdout);
+      json_value_free (obj);
+    }
+  return 0;
+}
@@ -0,0 +1,1349 @@
+/* Load generator for pound.
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This program starts a stub backend and a pound instance proxying to
+ * it, then runs a series of load scenarios against pound.  Each scenario
+ * uses a number of concurrent connections, each served by its own thread,
+ * which issue requests back to back for the given amount of time.  For
+ * each scenario the number of requests per second and latency percentiles
+ * are reported, either in tabular form or in JSON (-j).
+ *
+ * The stub backend serves the following URLs:
+ *
+ *   /fixed     response with Content-Length
+ *   /chunked   response with chunked transfer encoding
+ *   /ws        WebSocket echo service
+ */
+#include "pound.h"
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include <openssl/evp.h>
+#include "json.h"
+
+static char *pound_program = "pound";
+static unsigned nconn = 16;
+static double duration = 5;
+static size_t payload_size = 1024;
+static int json_option;
+static int keep_option;
+
+static char *tmpdir;
+static char *payload;
+static int stop;
+
+static int http_port;
+static int https_port;
+static int backend_port;
+static pid_t pound_pid;
+static SSL_CTX *client_ctx;
+
+void
+xnomem (void)
+{
+  fprintf (stderr, "%s: out of memory\n", progname);
+  exit (1);
+}
+
+static void
+die (char const *fmt, ...)
+{
+  va_list ap;
+
+  fprintf (stderr, "%s: ", progname);
+  va_start (ap, fmt);
+  vfprintf (stderr, fmt, ap);
+  va_end (ap);
+  fputc ('\n', stderr);
+  if (pound_pid > 0)
+    kill (pound_pid, SIGTERM);
+  exit (1);
+}
+
+static char *
+tmpfile_name (char const *name)
+{
+  char *s = xmalloc (strlen (tmpdir) + strlen (name) + 2);
+  sprintf (s, "%s/%s", tmpdir, name);
+  return s;
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Latency histogram.
+ *
+ * Values (in nanoseconds) below HIST_SUB are counted exactly.  Each
+ * following power of two is divided into HIST_SUB equal buckets, which
+ * gives relative error of at most 1/HIST_SUB.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+struct histogram
+{
+  unsigned long count[HIST_SIZE];
+  unsigned long total;
+  uint64_t sum;
+  uint64_t max;
+};
+
+static inline int
+hist_index (uint64_t v)
+{
+  int shift;
+
+  if (v < HIST_SUB)
+    return v;
+  shift = 63 - __builtin_clzll (v) - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+/* Return the mid-point of the bucket I. */
+static double
+hist_value (int i)
+{
+  int shift;
+
+  if (i < HIST_SUB)
+    return i;
+  shift = i / HIST_SUB - 1;
+  return (double) ((uint64_t) (i % HIST_SUB + HIST_SUB) << shift)
+    + ((uint64_t) 1 << shift) / 2.0;
+}
+
+static void
+hist_add (struct histogram *h, uint64_t v)
+{
+  h->count[hist_index (v)]++;
+  h->total++;
+  h->sum += v;
+  if (v > h->max)
+    h->max = v;
+}
+
+static void
+hist_merge (struct histogram *dst, struct histogram const *src)
+{
+  int i;
+
+  for (i = 0; i < HIST_SIZE; i++)
+    dst->count[i] += src->count[i];
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+/* Return the value below which fraction Q of the samples fall. */
+static double
+hist_quantile (struct histogram const *h, double q)
+{
+  unsigned long n, rank;
+  int i;
+
+  if (h->total == 0)
+    return 0;
+  rank = q * h->total;
+  if (rank >= h->total)
+    rank = h->total - 1;
+  for (i = 0, n = 0; i < HIST_SIZE; i++)
+    {
+      n += h->count[i];
+      if (n > rank)
+	{
+	  double v = hist_value (i);
+	  return v > h->max ? h->max : v;
+	}
+    }
+  return h->max;
+}
+
+/*
+ * Buffered connection, optionally over TLS.
+ */
+#define CONN_BUFSIZE 16384
+
+struct conn
+{
+  int fd;
+  SSL *ssl;
+  char buf[CONN_BUFSIZE];
+  size_t start, end;
+};
+
+static void
+conn_init (struct conn *c, int fd)
+{
+  c->fd = fd;
+  c->ssl = NULL;
+  c->start = c->end = 0;
+}
+
+static void
+conn_close (struct conn *c)
+{
+  if (c->ssl)
+    {
+      SSL_shutdown (c->ssl);
+      SSL_free (c->ssl);
+      c->ssl = NULL;
+    }
+  if (c->fd != -1)
+    {
+      close (c->fd);
+      c->fd = -1;
+    }
+}
+
+static int
+conn_fill (struct conn *c)
+{
+  ssize_t n;
+
+  if (c->start < c->end)
+    return 0;
+  c->start = c->end = 0;
+  if (c->ssl)
+    n = SSL_read (c->ssl, c->buf, sizeof (c->buf));
+  else
+    {
+      while ((n = read (c->fd, c->buf, sizeof (c->buf))) == -1
+	     && errno == EINTR)
+	;
+    }
+  if (n <= 0)
+    return -1;
+  c->end = n;
+  return 0;
+}
+
+/* Read N bytes into DST.  If DST is NULL, discard them. */
+static int
+conn_read (struct conn *c, void *dst, size_t n)
+{
+  while (n > 0)
+    {
+      size_t len;
+
+      if (conn_fill (c))
+	return -1;
+      len = c->end - c->start;
+      if (len > n)
+	len = n;
+      if (dst)
+	{
+	  memcpy (dst, c->buf + c->start, len);
+	  dst = (char*) dst + len;
+	}
+      c->start += len;
+      n -= len;
+    }
+  return 0;
+}
+
+/* Read a line, removing the trailing CRLF.  Return its length or -1. */
+static int
+conn_getline (struct conn *c, char *line, size_t size)
+{
+  size_t len = 0;
+
+  for (;;)
+    {
+      int ch;
+
+      if (conn_fill (c))
+	return -1;
+      ch = c->buf[c->start++];
+      if (ch == '\n')
+	break;
+      if (len + 1 < size)
+	line[len++] = ch;
+    }
+  if (len > 0 && line[len-1] == '\r')
+    len--;
+  line[len] = 0;
+  return len;
+}
+
+static int
+conn_write (struct conn *c, void const *data, size_t n)
+{
+  while (n > 0)
+    {
+      ssize_t rc;
+
+      if (c->ssl)
+	rc = SSL_write (c->ssl, data, n);
+      else
+	rc = write (c->fd, data, n);
+      if (rc <= 0)
+	{
+	  if (rc == -1 && errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      data = (char const *) data + rc;
+      n -= rc;
+    }
+  return 0;
+}
+
+static int
+conn_connect (struct conn *c, int port, int tls)
+{
+  struct sockaddr_in sin;
+  struct timeval tv = { 10, 0 };
+  int fd;
+  int t = 1;
+
+  conn_init (c, -1);
+  if ((fd = socket (AF_INET, SOCK_STREAM, 0)) == -1)
+    return -1;
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &t, sizeof (t));
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sin.sin_port = htons (port);
+  if (connect (fd, (struct sockaddr *) &sin, sizeof (sin)))
+    {
+      close (fd);
+      return -1;
+    }
+  c->fd = fd;
+  if (tls)
+    {
+      if ((c->ssl = SSL_new (client_ctx)) == NULL
+	  || !SSL_set_fd (c->ssl, fd)
+	  || SSL_connect (c->ssl) != 1)
+	{
+	  conn_close (c);
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+/*
+ * WebSocket frames.
+ */
+enum
+  {
+    WS_BINARY = 2,
+    WS_CLOSE = 8
+  };
+
+static int
+ws_frame_write (struct conn *c, int opcode, int mask, char const *data,
+		size_t len)
+{
+  unsigned char *frame;
+  size_t hlen = 2;
+  int rc;
+
+  /*
+   * Compose the frame in a single buffer, so that it is sent in one
+   * segment.
+   */
+  frame = xmalloc (len + 14);
+  frame[0] = 0x80 | opcode;
+  if (len < 126)
+    frame[1] = len;
+  else if (len < 65536)
+    {
+      frame[1] = 126;
+      frame[2] = len >> 8;
+      frame[3] = len;
+      hlen = 4;
+    }
+  else
+    {
+      int i;
+      frame[1] = 127;
+      for (i = 0; i < 8; i++)
+	frame[2 + i] = (uint64_t) len >> (56 - 8 * i);
+      hlen = 10;
+    }
+  if (mask)
+    {
+      unsigned char *key = frame + hlen;
+      long r = random ();
+      size_t i;
+
+      frame[1] |= 0x80;
+      memcpy (key, &r, 4);
+      hlen += 4;
+      for (i = 0; i < len; i++)
+	frame[hlen + i] = data[i] ^ key[i % 4];
+    }
+  else
+    memcpy (frame + hlen, data, len);
+  rc = conn_write (c, frame, hlen + len);
+  free (frame);
+  return rc;
+}
+
+/*
+ * Read a frame into BUF (of SIZE bytes).  Excess data are discarded.
+ * Return payload length or -1 on error.  Store opcode in *OPCODE.
+ */
+static ssize_t
+ws_frame_read (struct conn *c, int *opcode, char *buf, size_t size)
+{
+  unsigned char hdr[8];
+  unsigned char key[4];
+  uint64_t len;
+  size_t n, i;
+  int masked;
+
+  if (conn_read (c, hdr, 2))
+    return -1;
+  *opcode = hdr[0] & 0x0f;
+  masked = hdr[1] & 0x80;
+  len = hdr[1] & 0x7f;
+  if (len == 126)
+    {
+      if (conn_read (c, hdr, 2))
+	return -1;
+      len = (hdr[0] << 8) | hdr[1];
+    }
+  else if (len == 127)
+    {
+      if (conn_read (c, hdr, 8))
+	return -1;
+      for (i = 0, len = 0; i < 8; i++)
+	len = (len << 8) | hdr[i];
+    }
+  if (masked && conn_read (c, key, 4))
+    return -1;
+  n = len < size ? len : size;
+  if (conn_read (c, buf, n) || conn_read (c, NULL, len - n))
+    return -1;
+  if (masked)
+    for (i = 0; i < n; i++)
+      buf[i] ^= key[i % 4];
+  return len;
+}
+
+static char *
+ws_accept_key (char const *key)
+{
+  static char const guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  char *str;
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned mdlen;
+  char *res;
+
+  str = xmalloc (strlen (key) + sizeof (guid));
+  strcat (strcpy (str, key), guid);
+  EVP_Digest (str, strlen (str), md, &mdlen, EVP_sha1 (), NULL);
+  free (str);
+  res = xmalloc (4 * ((mdlen + 2) / 3) + 1);
+  EVP_EncodeBlock ((unsigned char *) res, md, mdlen);
+  return res;
+}
+
+/*
+ * Stub backend.
+ */
+static void
+backend_websocket (struct conn *c)
+{
+  char *buf = xmalloc (payload_size);
+
+  for (;;)
+    {
+      int opcode;
+      ssize_t n;
+
+      if ((n = ws_frame_read (c, &opcode, buf, payload_size)) == -1)
+	break;
+      if (n > payload_size)
+	n = payload_size;
+      if (ws_frame_write (c, opcode, 0, buf, n) || opcode == WS_CLOSE)
+	break;
+    }
+  free (buf);
+}
+
+static int
+backend_response (struct conn *c, char const *path, char const *ws_key)
+{
+  struct stringbuf sb;
+  int rc = 0;
+
+  xstringbuf_init (&sb);
+  if (strcmp (path, "/fixed") == 0)
+    {
+      stringbuf_printf (&sb,
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: %zu\r\n"
+			"\r\n",
+			payload_size);
+      stringbuf_add (&sb, payload, payload_size);
+    }
+  else if (strcmp (path, "/chunked") == 0)
+    {
+      size_t off, len, chunk = (payload_size + 3) / 4;
+
+      stringbuf_add_string (&sb,
+			    "HTTP/1.1 200 OK\r\n"
+			    "Content-Type: text/plain\r\n"
+			    "Transfer-Encoding: chunked\r\n"
+			    "\r\n");
+      for (off = 0; off < payload_size; off += len)
+	{
+	  len = payload_size - off;
+	  if (len > chunk)
+	    len = chunk;
+	  stringbuf_printf (&sb, "%zx\r\n", len);
+	  stringbuf_add (&sb, payload + off, len);
+	  stringbuf_add_string (&sb, "\r\n");
+	}
+      stringbuf_add_string (&sb, "0\r\n\r\n");
+    }
+  else if (strcmp (path, "/ws") == 0 && ws_key)
+    {
+      char *accept = ws_accept_key (ws_key);
+      stringbuf_printf (&sb,
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n"
+			"\r\n",
+			accept);
+      free (accept);
+      rc = 1;
+    }
+  else
+    stringbuf_add_string (&sb,
+			  "HTTP/1.1 404 Not Found\r\n"
+			  "Content-Length: 0\r\n"
+			  "\r\n");
+  if (conn_write (c, stringbuf_value (&sb), stringbuf_len (&sb)))
+    rc = -1;
+  stringbuf_free (&sb);
+  return rc;
+}
+
+static void *
+backend_thread (void *arg)
+{
+  struct conn *c = arg;
+  char line[1024];
+  char path[1024];
+  char *ws_key = NULL;
+
+  for (;;)
+    {
+      long clen = 0;
+      int rc;
+
+      if (conn_getline (c, line, sizeof (line)) <= 0
+	  || sscanf (line, "%*s %1023s", path) != 1)
+	break;
+      while ((rc = conn_getline (c, line, sizeof (line))) > 0)
+	{
+	  if (strncasecmp (line, "Content-Length:", 15) == 0)
+	    clen = strtol (line + 15, NULL, 10);
+	  else if (strncasecmp (line, "Sec-WebSocket-Key:", 18) == 0)
+	    {
+	      free (ws_key);
+	      ws_key = xstrdup (line + 18 + strspn (line + 18, " \t"));
+	    }
+	}
+      if (rc == -1 || conn_read (c, NULL, clen))
+	break;
+      rc = backend_response (c, path, ws_key);
+      if (rc == 1)
+	backend_websocket (c);
+      if (rc)
+	break;
+    }
+  free (ws_key);
+  conn_close (c);
+  free (c);
+  return NULL;
+}
+
+static void *
+backend_acceptor (void *arg)
+{
+  int lfd = *(int*) arg;
+  int t = 1;
+
+  for (;;)
+    {
+      int fd;
+      struct conn *c;
+      pthread_t tid;
+
+      if ((fd = accept (lfd, NULL, NULL)) == -1)
+	{
+	  if (errno == EINTR || errno == ECONNABORTED)
+	    continue;
+	  die ("accept: %s", strerror (errno));
+	}
+      setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &t, sizeof (t));
+      c = xmalloc (sizeof (*c));
+      conn_init (c, fd);
+      if (pthread_create (&tid, NULL, backend_thread, c))
+	{
+	  close (fd);
+	  free (c);
+	  continue;
+	}
+      pthread_detach (tid);
+    }
+  return NULL;
+}
+
+/* Create socket bound to a free port on the loopback interface. */
+static int
+socket_bind (int *port)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof (sin);
+  int fd;
+
+  if ((fd = socket (AF_INET, SOCK_STREAM, 0)) == -1)
+    die ("socket: %s", strerror (errno));
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (bind (fd, (struct sockaddr *) &sin, sizeof (sin))
+      || getsockname (fd, (struct sockaddr *) &sin, &len))
+    die ("bind: %s", strerror (errno));
+  *port = ntohs (sin.sin_port);
+  return fd;
+}
+
+static int
+free_port (void)
+{
+  int port;
+  close (socket_bind (&port));
+  return port;
+}
+
+static void
+backend_start (void)
+{
+  static int fd;
+  pthread_t tid;
+
+  fd = socket_bind (&backend_port);
+  if (listen (fd, 128))
+    die ("listen: %s", strerror (errno));
+  if (pthread_create (&tid, NULL, backend_acceptor, &fd))
+    die ("can't start backend thread");
+  pthread_detach (tid);
+}
+
+/*
+ * Pound setup.
+ */
+
+/* Create self-signed certificate and key in FILE. */
+static void
+cert_create (char const *file)
+{
+  EVP_PKEY_CTX *pctx;
+  EVP_PKEY *pkey = NULL;
+  X509 *x509;
+  X509_NAME *name;
+  FILE *fp;
+
+  if ((pctx = EVP_PKEY_CTX_new_id (EVP_PKEY_EC, NULL)) == NULL
+      || EVP_PKEY_keygen_init (pctx) <= 0
+      || EVP_PKEY_CTX_set_ec_paramgen_curve_nid (pctx,
+						 NID_X9_62_prime256v1) <= 0
+      || EVP_PKEY_keygen (pctx, &pkey) <= 0)
+    die ("can't generate private key");
+  EVP_PKEY_CTX_free (pctx);
+
+  if ((x509 = X509_new ()) == NULL)
+    xnomem ();
+  X509_set_version (x509, 2);
+  ASN1_INTEGER_set (X509_get_serialNumber (x509), 1);
+  X509_gmtime_adj (X509_getm_notBefore (x509), 0);
+  X509_gmtime_adj (X509_getm_notAfter (x509), 86400);
+  X509_set_pubkey (x509, pkey);
+  name = X509_get_subject_name (x509);
+  X509_NAME_add_entry_by_txt (name, "CN", MBSTRING_ASC,
+			      (unsigned char const *) "localhost", -1, -1, 0);
+  X509_set_issuer_name (x509, name);
+  if (!X509_sign (x509, pkey, EVP_sha256 ()))
+    die ("can't sign certificate");
+
+  if ((fp = fopen (file, "w")) == NULL)
+    die ("can't create %s: %s", file, strerror (errno));
+  if (!PEM_write_PrivateKey (fp, pkey, NULL, NULL, 0, NULL, NULL)
+      || !PEM_write_X509 (fp, x509)
+      || fclose (fp))
+    die ("error writing %s", file);
+  X509_free (x509);
+  EVP_PKEY_free (pkey);
+}
+
+static char *
+pound_config (void)
+{
+  char *cert_file = tmpfile_name ("cert.pem");
+  char *conf_file = tmpfile_name ("pound.cfg");
+  FILE *fp;
+
+  cert_create (cert_file);
+  http_port = free_port ();
+  https_port = free_port ();
+
+  if ((fp = fopen (conf_file, "w")) == NULL)
+    die ("can't create %s: %s", conf_file, strerror (errno));
+  fprintf (fp,
+	   "Daemon 0\n"
+	   "LogLevel 0\n"
+	   "ListenHTTP\n"
+	   "  Address 127.0.0.1\n"
+	   "  Port %d\n"
+	   "End\n"
+	   "ListenHTTPS\n"
+	   "  Address 127.0.0.1\n"
+	   "  Port %d\n"
+	   "  Cert \"%s\"\n"
+	   "End\n"
+	   "Service\n"
+	   "  Backend\n"
+	   "    Address 127.0.0.1\n"
+	   "    Port %d\n"
+	   "  End\n"
+	   "End\n",
+	   http_port, https_port, cert_file, backend_port);
+  if (fclose (fp))
+    die ("error writing %s", conf_file);
+  free (cert_file);
+  return conf_file;
+}
+
+static void
+pound_log_dump (char const *log_file)
+{
+  FILE *fp;
+  char buf[1024];
+
+  if ((fp = fopen (log_file, "r")) == NULL)
+    return;
+  while (fgets (buf, sizeof (buf), fp))
+    fputs (buf, stderr);
+  fclose (fp);
+}
+
+static void
+pound_start (void)
+{
+  char *conf_file = pound_config ();
+  char *pid_file = tmpfile_name ("pound.pid");
+  char *log_file = tmpfile_name ("pound.log");
+  uint64_t deadline;
+
+  switch (pound_pid = fork ())
+    {
+    case -1:
+      die ("fork: %s", strerror (errno));
+
+    case 0:
+      {
+	int fd = open (log_file, O_CREAT|O_TRUNC|O_WRONLY, 0600);
+	if (fd == -1)
+	  _exit (127);
+	dup2 (fd, 1);
+	dup2 (fd, 2);
+	close (fd);
+	execlp (pound_program, pound_program, "-e", "-f", conf_file,
+		"-p", pid_file, "-W", "no-dns", "-W", "no-include-dir",
+		(char *) NULL);
+	fprintf (stderr, "can't run %s: %s\n", pound_program,
+		 strerror (errno));
+	_exit (127);
+      }
+    }
+
+  /* Wait for the listeners to become available. */
+  deadline = now_ns () + 10 * (uint64_t) 1000000000;
+  for (;;)
+    {
+      struct conn c;
+      int status;
+
+      if (waitpid (pound_pid, &status, WNOHANG) == pound_pid)
+	{
+	  pound_pid = 0;
+	  pound_log_dump (log_file);
+	  die ("pound terminated prematurely");
+	}
+      if (conn_connect (&c, http_port, 0) == 0)
+	{
+	  conn_close (&c);
+	  if (conn_connect (&c, https_port, 0) == 0)
+	    {
+	      conn_close (&c);
+	      break;
+	    }
+	}
+      if (now_ns () > deadline)
+	{
+	  pound_log_dump (log_file);
+	  die ("timed out waiting for pound to start");
+	}
+      usleep (50000);
+    }
+  free (conf_file);
+  free (pid_file);
+  free (log_file);
+}
+
+static void
+pound_stop (void)
+{
+  int status;
+
+  kill (pound_pid, SIGTERM);
+  waitpid (pound_pid, &status, 0);
+  pound_pid = 0;
+}
+
+static void
+cleanup (void)
+{
+  static char const *files[] = {
+    "cert.pem", "pound.cfg", "pound.pid", "pound.log", NULL
+  };
+  int i;
+
+  if (keep_option)
+    {
+      fprintf (stderr, "%s: temporary files left in %s\n", progname, tmpdir);
+      return;
+    }
+  for (i = 0; files[i]; i++)
+    {
+      char *name = tmpfile_name (files[i]);
+      unlink (name);
+      free (name);
+    }
+  rmdir (tmpdir);
+}
+
+/*
+ * Scenarios.
+ */
+
+/* Read HTTP response.  Return its status code or -1 on error. */
+static int
+http_response_read (struct conn *c, size_t *nbytes)
+{
+  char line[1024];
+  long clen = -1;
+  int chunked = 0;
+  int status;
+  int rc;
+
+  if (conn_getline (c, line, sizeof (line)) <= 0
+      || sscanf (line, "HTTP/1.%*d %d", &status) != 1)
+    return -1;
+  while ((rc = conn_getline (c, line, sizeof (line))) > 0)
+    {
+      if (strncasecmp (line, "Content-Length:", 15) == 0)
+	clen = strtol (line + 15, NULL, 10);
+      else if (strncasecmp (line, "Transfer-Encoding:", 18) == 0
+	       && strstr (line + 18, "chunked"))
+	chunked = 1;
+    }
+  if (rc == -1)
+    return -1;
+
+  *nbytes = 0;
+  if (status == 101)
+    return status;
+  if (chunked)
+    {
+      for (;;)
+	{
+	  unsigned long len;
+
+	  if (conn_getline (c, line, sizeof (line)) <= 0)
+	    return -1;
+	  len = strtoul (line, NULL, 16);
+	  if (len == 0)
+	    break;
+	  if (conn_read (c, NULL, len)
+	      || conn_getline (c, line, sizeof (line)) != 0)
+	    return -1;
+	  *nbytes += len;
+	}
+      /* Skip trailer. */
+      while ((rc = conn_getline (c, line, sizeof (line))) > 0)
+	;
+      if (rc == -1)
+	return -1;
+    }
+  else if (clen >= 0)
+    {
+      if (conn_read (c, NULL, clen))
+	return -1;
+      *nbytes = clen;
+    }
+  else
+    /* Response delimited by connection close is not expected. */
+    return -1;
+  return status;
+}
+
+static int
+http_get (struct conn *c, char const *path, size_t *nbytes)
+{
+  char buf[256];
+  int n;
+
+  n = snprintf (buf, sizeof (buf),
+		"GET %s HTTP/1.1\r\n"
+		"Host: localhost\r\n"
+		"\r\n",
+		path);
+  if (conn_write (c, buf, n) || http_response_read (c, nbytes) != 200)
+    return -1;
+  return 0;
+}
+
+static int
+fixed_request (struct conn *c, size_t *nbytes)
+{
+  return http_get (c, "/fixed", nbytes);
+}
+
+static int
+chunked_request (struct conn *c, size_t *nbytes)
+{
+  return http_get (c, "/chunked", nbytes);
+}
+
+static int
+ws_open (struct conn *c)
+{
+  static char const req[] =
+    "GET /ws HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+  size_t n;
+
+  if (conn_write (c, req, sizeof (req) - 1)
+      || http_response_read (c, &n) != 101)
+    return -1;
+  return 0;
+}
+
+static int
+ws_request (struct conn *c, size_t *nbytes)
+{
+  char buf[64];
+  int opcode;
+  ssize_t n;
+
+  if (ws_frame_write (c, WS_BINARY, 1, payload, payload_size)
+      || (n = ws_frame_read (c, &opcode, buf, sizeof (buf))) == -1
+      || opcode != WS_BINARY
+      || n != payload_size)
+    return -1;
+  *nbytes = n;
+  return 0;
+}
+
+struct scenario
+{
+  char const *name;           /* Scenario name. */
+  char const *descr;          /* Short description. */
+  int tls;                    /* Use HTTPS listener. */
+  int (*open) (struct conn *);/* Called after connecting. */
+  int (*request) (struct conn *, size_t *); /* Run one request. */
+};
+
+static struct scenario scenarios[] = {
+  { "keepalive", "keep-alive requests, Content-Length responses",
+    0, NULL, fixed_request },
+  { "tls", "keep-alive requests over TLS",
+    1, NULL, fixed_request },
+  { "chunked", "keep-alive requests, chunked responses",
+    0, NULL, chunked_request },
+  { "websocket", "WebSocket message round trips",
+    0, ws_open, ws_request },
+  { NULL }
+};
+
+struct client
+{
+  pthread_t tid;
+  struct scenario *scn;
+  struct histogram hist;
+  unsigned long requests;
+  unsigned long errors;
+  uint64_t bytes;
+};
+
+static void *
+client_thread (void *arg)
+{
+  struct client *cl = arg;
+  struct scenario *scn = cl->scn;
+  struct conn *c = xmalloc (sizeof (*c));
+  int port = scn->tls ? https_port : http_port;
+
+  conn_init (c, -1);
+  while (!__atomic_load_n (&stop, __ATOMIC_RELAXED))
+    {
+      uint64_t start, end;
+      size_t n;
+
+      if (c->fd == -1)
+	{
+	  if (conn_connect (c, port, scn->tls)
+	      || (scn->open && scn->open (c)))
+	    {
+	      cl->errors++;
+	      conn_close (c);
+	      usleep (1000);
+	      continue;
+	    }
+	}
+
+      start = now_ns ();
+      if (scn->request (c, &n))
+	{
+	  if (!__atomic_load_n (&stop, __ATOMIC_RELAXED))
+	    cl->errors++;
+	  conn_close (c);
+	  continue;
+	}
+      end = now_ns ();
+      /* Don't count requests completed after the end of the run. */
+      if (__atomic_load_n (&stop, __ATOMIC_RELAXED))
+	break;
+      cl->requests++;
+      cl->bytes += n;
+      hist_add (&cl->hist, end - start);
+    }
+  conn_close (c);
+  free (c);
+  return NULL;
+}
+
+struct result
+{
+  struct histogram hist;
+  unsigned long requests;
+  unsigned long errors;
+  uint64_t bytes;
+  double seconds;
+};
+
+static void
+scenario_run (struct scenario *scn, struct result *res)
+{
+  struct client *clients = xcalloc (nconn, sizeof (clients[0]));
+  struct timespec ts;
+  uint64_t start;
+  unsigned i;
+
+  __atomic_store_n (&stop, 0, __ATOMIC_RELAXED);
+  start = now_ns ();
+  for (i = 0; i < nconn; i++)
+    {
+      clients[i].scn = scn;
+      if (pthread_create (&clients[i].tid, NULL, client_thread, &clients[i]))
+	die ("can't create client thread");
+    }
+
+  ts.tv_sec = duration;
+  ts.tv_nsec = (duration - ts.tv_sec) * 1e9;
+  while (nanosleep (&ts, &ts) == -1 && errno == EINTR)
+    ;
+  __atomic_store_n (&stop, 1, __ATOMIC_RELAXED);
+  res->seconds = (now_ns () - start) / 1e9;
+
+  memset (res, 0, offsetof (struct result, seconds));
+  for (i = 0; i < nconn; i++)
+    {
+      pthread_join (clients[i].tid, NULL);
+      hist_merge (&res->hist, &clients[i].hist);
+      res->requests += clients[i].requests;
+      res->errors += clients[i].errors;
+      res->bytes += clients[i].bytes;
+    }
+  free (clients);
+}
+
+/*
+ * Output.
+ */
+static void
+result_print (struct scenario *scn, struct result *res)
+{
+  struct histogram *h = &res->hist;
+
+  printf ("%-10s %10lu %7lu %11.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+	  scn->name, res->requests, res->errors,
+	  res->requests / res->seconds,
+	  h->total ? (double) h->sum / h->total / 1e3 : 0,
+	  hist_quantile (h, 0.5) / 1e3,
+	  hist_quantile (h, 0.99) / 1e3,
+	  hist_quantile (h, 0.999) / 1e3,
+	  h->max / 1e3);
+  fflush (stdout);
+}
+
+static struct json_value *
+result_to_json (struct scenario *scn, struct result *res)
+{
+  struct histogram *h = &res->hist;
+  struct json_value *obj = json_new_object ();
+  struct json_value *lat = json_new_object ();
+
+  json_object_set (obj, "name", json_new_string (scn->name));
+  json_object_set (obj, "description", json_new_string (scn->descr));
+  json_object_set (obj, "requests", json_new_integer (res->requests));
+  json_object_set (obj, "errors", json_new_integer (res->errors));
+  json_object_set (obj, "seconds", json_new_number (res->seconds));
+  json_object_set (obj, "rps", json_new_number (res->requests / res->seconds));
+  json_object_set (obj, "bytes", json_new_number (res->bytes));
+
+  json_object_set (lat, "mean",
+		   json_new_number (h->total
+				    ? (double) h->sum / h->total / 1e3 : 0));
+  json_object_set (lat, "p50", json_new_number (hist_quantile (h, 0.5) / 1e3));
+  json_object_set (lat, "p90", json_new_number (hist_quantile (h, 0.9) / 1e3));
+  json_object_set (lat, "p99",
+		   json_new_number (hist_quantile (h, 0.99) / 1e3));
+  json_object_set (lat, "p999",
+		   json_new_number (hist_quantile (h, 0.999) / 1e3));
+  json_object_set (lat, "max", json_new_number (h->max / 1e3));
+  json_object_set (obj, "latency_us", lat);
+  return obj;
+}
+
+static void
+write_string (void *data, char const *str, size_t len)
+{
+  fwrite (str, len, 1, (FILE*)data);
+}
+
+static int
+scenario_selected (struct scenario *scn, int argc, char **argv)
+{
+  int i;
+
+  if (argc == 0)
+    return 1;
+  for (i = 0; i < argc; i++)
+    if (strcmp (argv[i], scn->name) == 0)
+      return 1;
+  return 0;
+}
+
+static void
+usage (FILE *fp)
+{
+  struct scenario *scn;
+
+  fprintf (fp, "usage: %s [-hjkl] [-c CONNS] [-d SECONDS] [-p PROGRAM]"
+	   " [-s SIZE] [SCENARIO...]\n", progname);
+  fprintf (fp, "Run load scenarios against pound.\n\n");
+  fprintf (fp, "Options are:\n");
+  fprintf (fp, "  -c CONNS     number of concurrent connections"
+	   " (default %u)\n", nconn);
+  fprintf (fp, "  -d SECONDS   duration of each scenario (default %g)\n",
+	   duration);
+  fprintf (fp, "  -h           show this help summary\n");
+  fprintf (fp, "  -j           output results in JSON format\n");
+  fprintf (fp, "  -k           keep temporary files\n");
+  fprintf (fp, "  -l           list available scenarios\n");
+  fprintf (fp, "  -p PROGRAM   pound binary to use (default %s)\n",
+	   pound_program);
+  fprintf (fp, "  -s SIZE      response and message payload size"
+	   " (default %zu)\n", payload_size);
+  fprintf (fp, "\nScenarios are:\n");
+  for (scn = scenarios; scn->name; scn++)
+    fprintf (fp, "  %-12s %s\n", scn->name, scn->descr);
+}
+
+static unsigned long
+numarg (char const *arg, unsigned long max)
+{
+  char *p;
+  unsigned long n;
+
+  errno = 0;
+  n = strtoul (arg, &p, 10);
+  if (errno || *p || n == 0 || n > max)
+    die ("invalid numeric argument: %s", arg);
+  return n;
+}
+
+int
+main (int argc, char **argv)
+{
+  int c;
+  struct scenario *scn;
+  struct json_value *results = NULL;
+  char *p;
+  char const *dir;
+
+  set_progname (argv[0]);
+  while ((c = getopt (argc, argv, "c:d:hjklp:s:")) != EOF)
+    switch (c)
+      {
+      case 'c':
+	nconn = numarg (optarg, 65536);
+	break;
+
+      case 'd':
+	errno = 0;
+	duration = strtod (optarg, &p);
+	if (errno || *p || duration <= 0)
+	  die ("invalid duration: %s", optarg);
+	break;
+
+      case 'h':
+	usage (stdout);
+	exit (0);
+
+      case 'j':
+	json_option = 1;
+	break;
+
+      case 'k':
+	keep_option = 1;
+	break;
+
+      case 'l':
+	for (scn = scenarios; scn->name; scn++)
+	  printf ("%-12s %s\n", scn->name, scn->descr);
+	exit (0);
+
+      case 'p':
+	pound_program = optarg;
+	break;
+
+      case 's':
+	payload_size = numarg (optarg, 16 * 1024 * 1024);
+	break;
+
+      default:
+	usage (stderr);
+	exit (1);
+      }
+  argc -= optind;
+  argv += optind;
+
+  for (c = 0; c < argc; c++)
+    {
+      for (scn = scenarios; scn->name; scn++)
+	if (strcmp (argv[c], scn->name) == 0)
+	  break;
+      if (!scn->name)
+	die ("unknown scenario: %s", argv[c]);
+    }
+
+  signal (SIGPIPE, SIG_IGN);
+  srandom (getpid ());
+
+  payload = xmalloc (payload_size);
+  memset (payload, 'x', payload_size);
+
+  if ((dir = getenv ("TMPDIR")) == NULL)
+    dir = "/tmp";
+  tmpdir = xmalloc (strlen (dir) + sizeof ("/poundload.XXXXXX"));
+  strcat (strcpy (tmpdir, dir), "/poundload.XXXXXX");
+  if (mkdtemp (tmpdir) == NULL)
+    die ("can't create temporary directory: %s", strerror (errno));
+
+  if ((client_ctx = SSL_CTX_new (TLS_client_method ())) == NULL)
+    die ("can't create SSL context");
+  SSL_CTX_set_verify (client_ctx, SSL_VERIFY_NONE, NULL);
+
+  backend_start ();
+  pound_start ();
+
+  if (json_option)
+    results = json_new_array ();
+  else
+    printf ("%-10s %10s %7s %11s %9s %9s %9s %9s %9s\n",
+	    "scenario", "requests", "errors", "rps",
+	    "mean(us)", "p50", "p99", "p999", "max");
+
+  for (scn = scenarios; scn->name; scn++)
+    {
+      struct result *res;
+
+      if (!scenario_selected (scn, argc, argv))
+	continue;
+      res = xmalloc (sizeof (*res));
+      scenario_run (scn, res);
+      if (json_option)
+	json_array_append (results, result_to_json (scn, res));
+      else
+	result_print (scn, res);
+      free (res);
+    }
+
+  pound_stop ();
+  cleanup ();
+
+  if (json_option)
+    {
+      struct json_value *obj = json_new_object ();
+      struct json_format format = {
+	.indent = 2,
+	.precision = 2,
+	.write = write_string,
+	.data = stdout
+      };
+
+      json_object_set (obj, "version", json_new_string (PACKAGE_VERSION));
+      json_object_set (obj, "connections", json_new_integer (nconn));
+      json_object_set (obj, "duration", json_new_number (duration));
+      json_object_set (obj, "payload", json_new_integer (payload_size));
+      json_object_set (obj, "scenarios", results);
+      json_value_format (obj, &format, 0);
+      fputc ('\n', stdout);
+      json_value_free (obj);
+    }
+  return 0;
+}
@@ -0,0 +1,640 @@
+/* Asynchronous access log writer for pound
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each thread that logs requests owns a ring buffer.  The thread
+ * appends records to it without locking: the producer is the only one
+ * to advance the head, and the writer thread is the only one to advance
+ * the tail.  The writer thread wakes up periodically (or when a ring
+ * becomes half full), collects the records and writes them to the
+ * target in batches, using writev.  Each record carries a global
+ * sequence number, which the writer uses to merge the rings, so that
+ * records are written in the order they were logged.
+ *
+ * The writer_mut mutex protects the list of rings and the writer state.
+ * It is released while the writer thread does output, so that threads
+ * creating new rings or waiting for free space are not blocked by slow
+ * I/O.
+ */
+#include "pound.h"
+#include "extern.h"
+#include <sys/uio.h>
+
+#ifndef HOST_NAME_MAX
+# define HOST_NAME_MAX 255
+#endif
+
+struct access_log_config access_log_config = {
+  .bufsize = DEFAULT_ACCESS_LOG_BUFSIZE,
+  .overflow = ACCESS_LOG_DROP,
+  .flush_interval = DEFAULT_ACCESS_LOG_FLUSH_INTERVAL
+};
+
+/* Each record in the ring is prefixed with this header. */
+typedef struct
+{
+  uint64_t seq;                 /* Sequence number. */
+  uint32_t len;                 /* Length of the record. */
+} RECHDR;
+
+/* Sequence number of the next record. */
+static uint64_t log_seq;
+
+struct log_ring
+{
+  char *buf;                    /* Ring storage. */
+  size_t size;                  /* Size of buf (power of 2). */
+  size_t head;                  /* Write offset, advanced by the owner. */
+  size_t tail;                  /* Read offset, advanced by the writer. */
+  int orphan;                   /* Owner thread has terminated. */
+  /* Writer state: */
+  size_t rd_off;                /* Offset of the next record to send. */
+  size_t rd_head;               /* Head offset at the start of drain. */
+  uint64_t rd_seq;              /* Sequence number of the record at rd_off. */
+  DLIST_ENTRY (log_ring) link;
+};
+
+typedef DLIST_HEAD (,log_ring) LOG_RING_HEAD;
+
+/* Writer state. */
+static int log_fd = -1;               /* Output descriptor. */
+static struct sockaddr_storage log_addr; /* Syslog server address. */
+static socklen_t log_addrlen;
+static char log_hostname[HOST_NAME_MAX+1];
+static time_t log_reconnect_time;     /* Time of the last connection attempt. */
+
+static int access_log_active;         /* Writer thread is running. */
+static unsigned long dropped_count;   /* Number of dropped records. */
+
+static pthread_mutex_t writer_mut = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+/* Signaled when the writer releases space in the rings. */
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static LOG_RING_HEAD ring_head = DLIST_HEAD_INITIALIZER (ring_head);
+static int writer_stop;
+static int writer_kick;               /* Drain requested by a producer. */
+static pthread_t writer_tid;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Ring management.
+ */
+static void
+ring_orphan (void *data)
+{
+  struct log_ring *ring = data;
+
+  pthread_mutex_lock (&writer_mut);
+  ring->orphan = 1;
+  pthread_mutex_unlock (&writer_mut);
+  pthread_cond_signal (&writer_cond);
+}
+
+static void
+ring_key_create (void)
+{
+  pthread_key_create (&ring_key, ring_orphan);
+}
+
+/* Return the ring of the calling thread, creating it if necessary. */
+static struct log_ring *
+ring_get (void)
+{
+  struct log_ring *ring;
+
+  pthread_once (&ring_key_once, ring_key_create);
+  if ((ring = pthread_getspecific (ring_key)) == NULL)
+    {
+      if ((ring = calloc (1, sizeof (*ring))) == NULL)
+	{
+	  lognomem ();
+	  return NULL;
+	}
+      ring->size = access_log_config.bufsize;
+      if ((ring->buf = malloc (ring->size)) == NULL)
+	{
+	  lognomem ();
+	  free (ring);
+	  return NULL;
+	}
+      pthread_mutex_lock (&writer_mut);
+      DLIST_INSERT_TAIL (&ring_head, ring, link);
+      pthread_mutex_unlock (&writer_mut);
+      pthread_setspecific (ring_key, ring);
+    }
+  return ring;
+}
+
+static void
+ring_free (struct log_ring *ring)
+{
+  free (ring->buf);
+  free (ring);
+}
+
+/* Copy LEN bytes from PTR to the ring at offset OFF. */
+static void
+ring_put (struct log_ring *ring, size_t off, void const *ptr, size_t len)
+{
+  size_t pos = off & (ring->size - 1);
+  size_t n = ring->size - pos;
+
+  if (n >= len)
+    memcpy (ring->buf + pos, ptr, len);
+  else
+    {
+      memcpy (ring->buf + pos, ptr, n);
+      memcpy (ring->buf, (char const *) ptr + n, len - n);
+    }
+}
+
+/* Copy LEN bytes from the ring at offset OFF to PTR. */
+static void
+ring_get_bytes (struct log_ring *ring, size_t off, void *ptr, size_t len)
+{
+  size_t pos = off & (ring->size - 1);
+  size_t n = ring->size - pos;
+
+  if (n >= len)
+    memcpy (ptr, ring->buf + pos, len);
+  else
+    {
+      memcpy (ptr, ring->buf + pos, n);
+      memcpy ((char *) ptr + n, ring->buf, len - n);
+    }
+}
+
+/*
+ * Wait until RING has at least NEED bytes of free space.  Return the
+ * new value of its tail, or (size_t)-1 if the writer thread has been
+ * stopped.
+ */
+static size_t
+ring_wait_space (struct log_ring *ring, size_t need)
+{
+  size_t tail;
+
+  pthread_mutex_lock (&writer_mut);
+  for (;;)
+    {
+      tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+      if (ring->size - (ring->head - tail) >= need)
+	break;
+      if (writer_stop)
+	{
+	  tail = (size_t) -1;
+	  break;
+	}
+      writer_kick = 1;
+      pthread_cond_signal (&writer_cond);
+      pthread_cond_wait (&space_cond, &writer_mut);
+    }
+  pthread_mutex_unlock (&writer_mut);
+  return tail;
+}
+
+/*
+ * Queue access log record MSG of length LEN for writing.
+ * Return 0 on success and -1 if the record has been dropped.
+ */
+int
+access_log_write (char const *msg, size_t len)
+{
+  struct log_ring *ring;
+  size_t head, tail, need;
+  RECHDR hdr;
+
+  need = sizeof (hdr) + len;
+  if ((ring = ring_get ()) == NULL || need > ring->size)
+    goto drop;
+
+  head = ring->head;
+  tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  if (ring->size - (head - tail) < need)
+    {
+      if (access_log_config.overflow == ACCESS_LOG_DROP
+	  || (tail = ring_wait_space (ring, need)) == (size_t) -1)
+	goto drop;
+    }
+
+  hdr.seq = __atomic_fetch_add (&log_seq, 1, __ATOMIC_RELAXED);
+  hdr.len = len;
+  ring_put (ring, head, &hdr, sizeof (hdr));
+  ring_put (ring, head + sizeof (hdr), msg, len);
+  __atomic_store_n (&ring->head, head + need, __ATOMIC_RELEASE);
+
+  if (head + need - tail >= ring->size / 2)
+    pthread_cond_signal (&writer_cond);
+  return 0;
+
+ drop:
+  __atomic_add_fetch (&dropped_count, 1, __ATOMIC_RELAXED);
+  return -1;
+}
+
+/* Return the number of records dropped so far. */
+unsigned long
+access_log_dropped (void)
+{
+  return __atomic_load_n (&dropped_count, __ATOMIC_RELAXED);
+}
+
+/* Return true if access log records are handled by the writer thread. */
+int
+access_log_enabled (void)
+{
+  return access_log_active;
+}
+
+/*
+ * Output.
+ */
+static int
+log_connect (void)
+{
+  time_t now = time (NULL);
+  int fd;
+
+  if (now == log_reconnect_time)
+    return -1;
+  log_reconnect_time = now;
+
+  if ((fd = socket (log_addr.ss_family, SOCK_STREAM, 0)) == -1)
+    {
+      logmsg (LOG_ERR, "access log: socket: %s", strerror (errno));
+      return -1;
+    }
+  if (connect (fd, (struct sockaddr *) &log_addr, log_addrlen))
+    {
+      logmsg (LOG_ERR, "access log: can't connect to %s: %s",
+	      access_log_config.name, strerror (errno));
+      close (fd);
+      return -1;
+    }
+  log_fd = fd;
+  return 0;
+}
+
+/*
+ * Write IOVCNT elements of IOV to the output.  Handle partial writes.
+ * Return 0 on success, -1 on error.
+ */
+static int
+log_writev (struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0)
+    {
+      ssize_t n = writev (log_fd, iov, iovcnt);
+
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      while (iovcnt > 0 && (size_t) n >= iov->iov_len)
+	{
+	  n -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
+	}
+      if (iovcnt > 0)
+	{
+	  iov->iov_base = (char *) iov->iov_base + n;
+	  iov->iov_len -= n;
+	}
+    }
+  return 0;
+}
+
+/*
+ * Format syslog header for records written at time T into BUF.
+ * Return its length.
+ */
+static size_t
+syslog_header (char *buf, size_t size, time_t t)
+{
+  struct tm tm;
+  char tbuf[32];
+  int n;
+
+  localtime_r (&t, &tm);
+  strftime (tbuf, sizeof tbuf, "%b %e %H:%M:%S", &tm);
+  n = snprintf (buf, size, "<%d>%s %s %s[%lu]: ",
+		(log_facility == -1 ? LOG_DAEMON : log_facility) | LOG_INFO,
+		tbuf, log_hostname,
+		syslog_tag ? syslog_tag : progname,
+		(unsigned long) getpid ());
+  if (n < 0)
+    return 0;
+  return (size_t) n < size ? n : size - 1;
+}
+
+/* Maximum number of records written by a single writev call. */
+#define LOG_BATCH 64
+
+/* Read the sequence number of the record at RING->rd_off. */
+static void
+ring_peek (struct log_ring *ring)
+{
+  if (ring->rd_off != ring->rd_head)
+    {
+      RECHDR hdr;
+      ring_get_bytes (ring, ring->rd_off, &hdr, sizeof (hdr));
+      ring->rd_seq = hdr.seq;
+    }
+}
+
+/*
+ * Return the ring whose next unsent record has the smallest sequence
+ * number, or NULL if all records have been collected.
+ */
+static struct log_ring *
+ring_next (void)
+{
+  struct log_ring *ring, *best = NULL;
+
+  DLIST_FOREACH (ring, &ring_head, link)
+    {
+      if (ring->rd_off != ring->rd_head
+	  && (best == NULL || ring->rd_seq < best->rd_seq))
+	best = ring;
+    }
+  return best;
+}
+
+/*
+ * Write out the records from all rings, in the order of their sequence
+ * numbers, and dispose of the rings whose owners have terminated.  Must
+ * be called with writer_mut locked.  The mutex is released while writing
+ * each batch.
+ */
+static void
+rings_drain (void)
+{
+  struct iovec iov[4 * LOG_BATCH];
+  int recend[LOG_BATCH];
+  char hdr[512];
+  size_t hdrlen = 0;
+  int type = access_log_config.type;
+  struct log_ring *ring, *next;
+  int pending = 0;
+
+  DLIST_FOREACH (ring, &ring_head, link)
+    {
+      ring->rd_head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+      ring->rd_off = ring->tail;
+      ring_peek (ring);
+      if (ring->rd_off != ring->rd_head)
+	pending = 1;
+    }
+
+  if (pending && (type == ACCESS_LOG_UDP || type == ACCESS_LOG_TCP))
+    hdrlen = syslog_header (hdr, sizeof hdr, time (NULL));
+
+  while (pending)
+    {
+      int iovcnt = 0;
+      int nrec = 0;
+      int i, rc = 0;
+
+      /*
+       * Collect the batch.  The records stay in the rings until their
+       * tails are advanced, and the rings themselves are freed only by
+       * this thread, so the batch remains valid after unlocking.
+       */
+      while (nrec < LOG_BATCH && (ring = ring_next ()) != NULL)
+	{
+	  RECHDR rh;
+	  size_t pos, n;
+
+	  ring_get_bytes (ring, ring->rd_off, &rh, sizeof (rh));
+	  ring->rd_off += sizeof (rh);
+	  pos = ring->rd_off & (ring->size - 1);
+	  n = ring->size - pos;
+
+	  if (hdrlen)
+	    {
+	      iov[iovcnt].iov_base = hdr;
+	      iov[iovcnt].iov_len = hdrlen;
+	      iovcnt++;
+	    }
+	  iov[iovcnt].iov_base = ring->buf + pos;
+	  if (n >= rh.len)
+	    iov[iovcnt++].iov_len = rh.len;
+	  else
+	    {
+	      iov[iovcnt++].iov_len = n;
+	      iov[iovcnt].iov_base = ring->buf;
+	      iov[iovcnt++].iov_len = rh.len - n;
+	    }
+	  if (type != ACCESS_LOG_UDP)
+	    {
+	      iov[iovcnt].iov_base = "\n";
+	      iov[iovcnt++].iov_len = 1;
+	    }
+	  ring->rd_off += rh.len;
+	  ring_peek (ring);
+	  recend[nrec++] = iovcnt;
+	}
+
+      if (nrec == 0)
+	break;
+
+      pthread_mutex_unlock (&writer_mut);
+      if (type == ACCESS_LOG_UDP)
+	{
+	  /* Each record is sent in a separate datagram. */
+	  for (i = 0; i < nrec; i++)
+	    {
+	      int start = i ? recend[i-1] : 0;
+	      if (writev (log_fd, iov + start, recend[i] - start) == -1)
+		__atomic_add_fetch (&dropped_count, 1, __ATOMIC_RELAXED);
+	    }
+	}
+      else if (type == ACCESS_LOG_TCP && log_fd == -1 && log_connect ())
+	/* Keep the records until the next attempt. */
+	rc = -1;
+      else if (log_writev (iov, iovcnt) != 0)
+	{
+	  logmsg (LOG_ERR, "access log: write error: %s", strerror (errno));
+	  __atomic_add_fetch (&dropped_count, nrec, __ATOMIC_RELAXED);
+	  if (type == ACCESS_LOG_TCP)
+	    {
+	      close (log_fd);
+	      log_fd = -1;
+	    }
+	}
+      pthread_mutex_lock (&writer_mut);
+
+      if (rc)
+	return;
+
+      /* Release the space occupied by the records just written. */
+      DLIST_FOREACH (ring, &ring_head, link)
+	{
+	  if (ring->tail != ring->rd_off)
+	    __atomic_store_n (&ring->tail, ring->rd_off, __ATOMIC_RELEASE);
+	}
+      pthread_cond_broadcast (&space_cond);
+    }
+
+  DLIST_FOREACH_SAFE (ring, next, &ring_head, link)
+    {
+      if (ring->orphan
+	  && ring->tail == __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE))
+	{
+	  DLIST_REMOVE (&ring_head, ring, link);
+	  ring_free (ring);
+	}
+    }
+}
+
+static void *
+thr_access_log (void *arg)
+{
+  unsigned long reported = 0, n;
+  time_t report_time = 0;
+
+  pthread_mutex_lock (&writer_mut);
+  while (!writer_stop)
+    {
+      struct timespec ts;
+
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_sec += access_log_config.flush_interval / 1000;
+      ts.tv_nsec += (access_log_config.flush_interval % 1000) * 1000000;
+      if (ts.tv_nsec >= 1000000000)
+	{
+	  ts.tv_sec++;
+	  ts.tv_nsec -= 1000000000;
+	}
+      if (!writer_kick)
+	pthread_cond_timedwait (&writer_cond, &writer_mut, &ts);
+      writer_kick = 0;
+
+      rings_drain ();
+
+      if ((n = access_log_dropped ()) != reported
+	  && ts.tv_sec - report_time >= 60)
+	{
+	  logmsg (LOG_WARNING, "access log: %lu records dropped",
+		  n - reported);
+	  reported = n;
+	  report_time = ts.tv_sec;
+	}
+    }
+  rings_drain ();
+  pthread_mutex_unlock (&writer_mut);
+  return NULL;
+}
+
+/*
+ * Open the access log target.  This is called before dropping
+ * privileges, so that the log file can be placed where the unprivileged
+ * user has no access.
+ */
+void
+access_log_open (void)
+{
+  struct addrinfo hints, *res;
+  char *host, *port;
+  int rc;
+
+  switch (access_log_config.type)
+    {
+    case ACCESS_LOG_FILE:
+      if ((log_fd = open (access_log_config.name,
+			  O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1)
+	abend ("can't open access log file %s: %s",
+	       access_log_config.name, strerror (errno));
+      break;
+
+    case ACCESS_LOG_STDOUT:
+      log_fd = 1;
+      break;
+
+    case ACCESS_LOG_UDP:
+    case ACCESS_LOG_TCP:
+      host = xstrdup (access_log_config.name);
+      if (*host == '[' && (port = strchr (host, ']')) != NULL)
+	{
+	  *port++ = 0;
+	  memmove (host, host + 1, strlen (host));
+	  if (*port == ':')
+	    port++;
+	  else
+	    port = NULL;
+	}
+      else if ((port = strrchr (host, ':')) != NULL)
+	*port++ = 0;
+
+      memset (&hints, 0, sizeof (hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = access_log_config.type == ACCESS_LOG_UDP
+			    ? SOCK_DGRAM : SOCK_STREAM;
+      if ((rc = getaddrinfo (host, port && *port ? port : "514",
+			     &hints, &res)) != 0)
+	abend ("access log: can't resolve %s: %s",
+	       access_log_config.name, gai_strerror (rc));
+      memcpy (&log_addr, res->ai_addr, res->ai_addrlen);
+      log_addrlen = res->ai_addrlen;
+      freeaddrinfo (res);
+      free (host);
+
+      if (gethostname (log_hostname, sizeof (log_hostname) - 1))
+	strcpy (log_hostname, "-");
+
+      if (access_log_config.type == ACCESS_LOG_UDP)
+	{
+	  if ((log_fd = socket (log_addr.ss_family, SOCK_DGRAM, 0)) == -1)
+	    abend ("access log: socket: %s", strerror (errno));
+	  if (connect (log_fd, (struct sockaddr *) &log_addr, log_addrlen))
+	    abend ("access log: can't connect to %s: %s",
+		   access_log_config.name, strerror (errno));
+	}
+      break;
+    }
+}
+
+/* Start the writer thread. */
+void
+access_log_start (void)
+{
+  int rc;
+
+  if ((rc = pthread_create (&writer_tid, NULL, thr_access_log, NULL)) != 0)
+    abend ("can't create access log thread: %s", strerror (rc));
+  access_log_active = 1;
+}
+
+/* Stop the writer thread, flushing out all pending records. */
+void
+access_log_stop (void)
+{
+  if (!access_log_active)
+    return;
+  pthread_mutex_lock (&writer_mut);
+  writer_stop = 1;
+  pthread_mutex_unlock (&writer_mut);
+  pthread_cond_signal (&writer_cond);
+  pthread_cond_broadcast (&space_cond);
+  pthread_join (writer_tid, NULL);
+  access_log_active = 0;
+}
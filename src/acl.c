@@ -0,0 +1,467 @@
+/* Access control lists for pound
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CIDRs of an ACL are kept in a path-compressed binary radix tree, one
+ * per address family.  Each node holds a network prefix; its children
+ * hold longer prefixes whose next bit after the parent's prefix is 0
+ * and 1, respectively.  Nodes marked as leaves correspond to CIDRs from
+ * the ACL.  Since an ACL only tells whether an address belongs to any of
+ * its CIDRs, prefixes covered by a shorter one are not stored.  Thus,
+ * the number of nodes is at most twice the number of CIDRs, and a lookup
+ * takes at most as many steps as there are bits in the address.
+ */
+#include "pound.h"
+#include "extern.h"
+#include "resolver.h"
+
+struct acl_node
+{
+  struct acl_node *child[2];    /* Subtrees. */
+  unsigned char masklen;        /* Prefix length in bits. */
+  unsigned char leaf;           /* True if this is a CIDR from the ACL. */
+  unsigned char addr[1];        /* Network address. */
+};
+
+/* Source file of an ACL. */
+struct acl_file
+{
+  WORKDIR *wd;                  /* Directory the file is located in. */
+  char *filename;               /* File name relative to WD. */
+  struct timespec mtim;         /* Modification time of the loaded copy. */
+  time_t last_check;            /* Time of the last check for modification. */
+  pthread_mutex_t mutex;        /* Serializes reloads. */
+  pthread_rwlock_t rwl;         /* Protects the trees. */
+};
+
+static void
+stat_mtime (struct stat const *st, struct timespec *ts)
+{
+#if HAVE_STRUCT_STAT_ST_MTIM
+  *ts = st->st_mtim;
+#else
+  ts->tv_sec = st->st_mtime;
+  ts->tv_nsec = 0;
+#endif
+}
+
+/* Index of the tree for the given address family. */
+static int
+acl_tree_index (int family)
+{
+  return family == AF_INET6;
+}
+
+static inline int
+addr_bit (unsigned char const *addr, int n)
+{
+  return (addr[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+/* Return the length of the common prefix of A and B, not exceeding MAX. */
+static int
+prefix_common (unsigned char const *a, unsigned char const *b, int max)
+{
+  int i, n;
+
+  for (i = 0; i * 8 < max; i++)
+    {
+      unsigned x = a[i] ^ b[i];
+      if (x)
+	{
+	  n = i * 8 + __builtin_clz (x) - (sizeof (x) - 1) * 8;
+	  return n < max ? n : max;
+	}
+    }
+  return max;
+}
+
+/* Return true if the first MASKLEN bits of A and B are the same. */
+static inline int
+prefix_match (unsigned char const *a, unsigned char const *b, int masklen)
+{
+  int n = masklen >> 3;
+
+  if (memcmp (a, b, n))
+    return 0;
+  if (masklen & 7)
+    {
+      unsigned mask = (0xff00 >> (masklen & 7)) & 0xff;
+      return ((a[n] ^ b[n]) & mask) == 0;
+    }
+  return 1;
+}
+
+static struct acl_node *
+acl_node_new (unsigned char const *addr, size_t len, int masklen, int leaf)
+{
+  struct acl_node *node;
+
+  node = xmalloc (offsetof (struct acl_node, addr) + len);
+  node->child[0] = node->child[1] = NULL;
+  node->masklen = masklen;
+  node->leaf = leaf;
+  memcpy (node->addr, addr, len);
+  return node;
+}
+
+static void
+acl_tree_free (struct acl_node *node)
+{
+  if (node)
+    {
+      acl_tree_free (node->child[0]);
+      acl_tree_free (node->child[1]);
+      free (node);
+    }
+}
+
+/*
+ * Insert the network ADDR/MASKLEN into the tree at ROOT.  LEN is the
+ * address length.  Bits of ADDR past MASKLEN must be zero.
+ */
+static void
+acl_tree_insert (struct acl_node **root, unsigned char const *addr, size_t len,
+		 int masklen)
+{
+  struct acl_node **pp = root, *node, *inner;
+  int n;
+
+  while ((node = *pp) != NULL)
+    {
+      n = prefix_common (node->addr, addr,
+			 node->masklen < masklen ? node->masklen : masklen);
+      if (n == node->masklen)
+	{
+	  if (node->leaf)
+	    /* Already covered. */
+	    return;
+	  if (n == masklen)
+	    {
+	      /* The new CIDR covers the whole subtree. */
+	      acl_tree_free (node->child[0]);
+	      acl_tree_free (node->child[1]);
+	      node->child[0] = node->child[1] = NULL;
+	      node->leaf = 1;
+	      return;
+	    }
+	  pp = &node->child[addr_bit (addr, n)];
+	}
+      else if (n == masklen)
+	{
+	  /* The new CIDR covers this node. */
+	  acl_tree_free (node);
+	  break;
+	}
+      else
+	{
+	  /* Split at the first differing bit. */
+	  inner = acl_node_new (addr, len, n, 0);
+	  inner->child[addr_bit (node->addr, n)] = node;
+	  inner->child[addr_bit (addr, n)] = acl_node_new (addr, len, masklen, 1);
+	  *pp = inner;
+	  return;
+	}
+    }
+  *pp = acl_node_new (addr, len, masklen, 1);
+}
+
+static int
+acl_tree_lookup (struct acl_node const *node, unsigned char const *addr)
+{
+  while (node)
+    {
+      if (!prefix_match (node->addr, addr, node->masklen))
+	break;
+      if (node->leaf)
+	return 0;
+      node = node->child[addr_bit (addr, node->masklen)];
+    }
+  return 1;
+}
+
+static char const *acl_errstr[] = {
+  [ACL_OK] = "no error",
+  [ACL_BAD_ADDR] = "invalid IP address",
+  [ACL_BAD_FAMILY] = "unsupported address family",
+  [ACL_BAD_MASK] = "invalid netmask"
+};
+
+char const *
+acl_strerror (int ec)
+{
+  if (ec < 0 || ec >= sizeof (acl_errstr) / sizeof (acl_errstr[0]))
+    return "unknown error";
+  return acl_errstr[ec];
+}
+
+/*
+ * Add the CIDR STR to the trees at ROOT.  Return one of the ACL_* error
+ * codes.
+ */
+static int
+acl_tree_add (struct acl_node **root, char const *str)
+{
+  char buf[INET6_ADDRSTRLEN + 5];
+  char *mask, *end;
+  unsigned long masklen;
+  struct addrinfo hints, *res;
+  unsigned char addr[16], *p;
+  int len, i, family;
+
+  if (strlen (str) >= sizeof (buf))
+    return ACL_BAD_ADDR;
+  strcpy (buf, str);
+
+  if ((mask = strchr (buf, '/')) != NULL)
+    {
+      *mask++ = 0;
+
+      errno = 0;
+      masklen = strtoul (mask, &end, 10);
+      if (errno || *end || end == mask)
+	return ACL_BAD_MASK;
+    }
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = AI_NUMERICHOST;
+
+  if (getaddrinfo (buf, NULL, &hints, &res))
+    return ACL_BAD_ADDR;
+  family = res->ai_family;
+  if ((len = sockaddr_bytes (res->ai_addr, &p)) == -1)
+    {
+      freeaddrinfo (res);
+      return ACL_BAD_FAMILY;
+    }
+  memcpy (addr, p, len);
+  freeaddrinfo (res);
+
+  if (!mask)
+    masklen = len * 8;
+  else if (masklen > len * 8)
+    return ACL_BAD_MASK;
+
+  /* Fix-up network address, just in case */
+  i = masklen / 8;
+  if (masklen % 8)
+    addr[i++] &= (0xff00 >> (masklen % 8)) & 0xff;
+  for (; i < len; i++)
+    addr[i] = 0;
+
+  acl_tree_insert (&root[acl_tree_index (family)], addr, len, masklen);
+  return ACL_OK;
+}
+
+/* Create a new ACL. */
+ACL *
+acl_new (char const *name)
+{
+  ACL *acl;
+
+  XZALLOC (acl);
+  if (name)
+    acl->name = xstrdup (name);
+  else
+    acl->name = NULL;
+  return acl;
+}
+
+/* Add the CIDR STR to ACL.  Return one of the ACL_* error codes. */
+int
+acl_add (ACL *acl, char const *str)
+{
+  return acl_tree_add (acl->tree, str);
+}
+
+/*
+ * Read CIDRs from the source file of ACL into the trees at ROOT.  Store
+ * the file status in ST.  Return 0 on success and -1 on error.
+ */
+static int
+acl_file_read (ACL *acl, struct acl_node **root, struct stat *st)
+{
+  struct acl_file *af = acl->file;
+  FILE *fp;
+  char buf[MAXBUF];
+  char *p;
+  size_t len;
+  int line = 0;
+  int rc = 0;
+
+  if ((fp = fopen_wd (af->wd, af->filename)) == NULL)
+    {
+      logmsg (LOG_ERR, "can't open ACL file %s: %s", af->filename,
+	      strerror (errno));
+      return -1;
+    }
+  if (fstat (fileno (fp), st))
+    {
+      logmsg (LOG_ERR, "fstat(%s) failed: %s", af->filename,
+	      strerror (errno));
+      fclose (fp);
+      return -1;
+    }
+
+  while ((p = fgets (buf, sizeof buf, fp)) != NULL)
+    {
+      int ec;
+
+      line++;
+      p += strspn (p, " \t");
+      for (len = strlen (p);
+	   len > 0 && (p[len-1] == ' ' || p[len-1] == '\t'|| p[len-1] == '\n');
+	   len--)
+	;
+      if (len == 0 || *p == '#')
+	continue;
+      p[len] = 0;
+      if ((ec = acl_tree_add (root, p)) != ACL_OK)
+	{
+	  logmsg (LOG_ERR, "%s:%d: %s", af->filename, line, acl_strerror (ec));
+	  rc = -1;
+	  break;
+	}
+    }
+  fclose (fp);
+
+  if (rc)
+    {
+      acl_tree_free (root[0]);
+      acl_tree_free (root[1]);
+      root[0] = root[1] = NULL;
+    }
+  return rc;
+}
+
+/*
+ * Load ACL from FILENAME.  Unless the name is absolute, it is looked up
+ * in the include directory WD.  Return 0 on success and -1 on error.
+ */
+int
+acl_load_file (ACL *acl, WORKDIR *wd, char const *filename)
+{
+  struct acl_file *af;
+  struct stat st;
+
+  XZALLOC (af);
+  if (filename[0] == '/')
+    {
+      /*
+       * Keep the directory open, so that the file can be reread in
+       * chroot environment.
+       */
+      char *dir = xstrdup (filename);
+      char *p = strrchr (dir, '/');
+
+      *p++ = 0;
+      af->filename = xstrdup (p);
+      if ((af->wd = workdir_get (dir[0] ? dir : "/")) == NULL)
+	{
+	  logmsg (LOG_ERR, "can't open directory %s: %s", dir,
+		  strerror (errno));
+	  free (dir);
+	  free (af->filename);
+	  free (af);
+	  return -1;
+	}
+      free (dir);
+    }
+  else
+    {
+      af->filename = xstrdup (filename);
+      af->wd = workdir_ref (wd);
+    }
+  pthread_mutex_init (&af->mutex, NULL);
+  pthread_rwlock_init (&af->rwl, NULL);
+  acl->file = af;
+
+  if (acl_file_read (acl, acl->tree, &st))
+    return -1;
+  stat_mtime (&st, &af->mtim);
+  af->last_check = time (NULL);
+  return 0;
+}
+
+/*
+ * Reread the source file of ACL, if it has been modified.  The check is
+ * done at most once per second.  On error, the old content is retained.
+ */
+static void
+acl_file_check (ACL *acl)
+{
+  struct acl_file *af = acl->file;
+  time_t now = time (NULL);
+  struct stat st, rst;
+  struct timespec mtim;
+  struct acl_node *root[2] = { NULL, NULL }, *old[2];
+
+  if (__atomic_load_n (&af->last_check, __ATOMIC_RELAXED) == now
+      || pthread_mutex_trylock (&af->mutex))
+    return;
+
+  if (af->last_check != now)
+    {
+      __atomic_store_n (&af->last_check, now, __ATOMIC_RELAXED);
+      if (fstatat (af->wd->fd, af->filename, &st, 0) == 0
+	  && (stat_mtime (&st, &mtim), timespec_cmp (&af->mtim, &mtim)))
+	{
+	  if (acl_file_read (acl, root, &rst) == 0)
+	    {
+	      pthread_rwlock_wrlock (&af->rwl);
+	      old[0] = acl->tree[0];
+	      old[1] = acl->tree[1];
+	      acl->tree[0] = root[0];
+	      acl->tree[1] = root[1];
+	      pthread_rwlock_unlock (&af->rwl);
+
+	      acl_tree_free (old[0]);
+	      acl_tree_free (old[1]);
+	      logmsg (LOG_INFO, "ACL file %s reloaded", af->filename);
+	    }
+	  /* Don't retry the same version of a broken file. */
+	  af->mtim = mtim;
+	}
+    }
+  pthread_mutex_unlock (&af->mutex);
+}
+
+/*
+ * Match sockaddr SA against ACL.  Return 0 if it matches, 1 if it does not
+ * and -1 on error (invalid address family).
+ */
+int
+acl_match (ACL *acl, struct sockaddr *sa)
+{
+  unsigned char *ap;
+  int rc;
+
+  if (sockaddr_bytes (sa, &ap) == -1)
+    return -1;
+
+  if (acl->file)
+    {
+      acl_file_check (acl);
+      pthread_rwlock_rdlock (&acl->file->rwl);
+      rc = acl_tree_lookup (acl->tree[acl_tree_index (sa->sa_family)], ap);
+      pthread_rwlock_unlock (&acl->file->rwl);
+    }
+  else
+    rc = acl_tree_lookup (acl->tree[acl_tree_index (sa->sa_family)], ap);
+  return rc;
+}
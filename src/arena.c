@@ -0,0 +1,240 @@
+/* Per-request memory arenas for pound
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An arena is a bump allocator: memory is carved sequentially from
+ * large chunks and is never freed individually.  Instead, the whole
+ * arena is reset when the request is finished.  The first chunk is
+ * retained across resets, so that a keep-alive connection serving
+ * typical requests does not call malloc at all.
+ */
+#include "pound.h"
+
+/* Size of the base chunk. */
+#define ARENA_CHUNK_SIZE 8192
+/* Allocations larger than that get a chunk of their own. */
+#define ARENA_LARGE_SIZE (ARENA_CHUNK_SIZE / 4)
+
+#define ARENA_ALIGN (2 * sizeof (void *))
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_chunk
+{
+  struct arena_chunk *next;     /* Next (older) chunk. */
+  size_t size;                  /* Size of data. */
+  size_t used;                  /* Number of bytes used. */
+  union
+  {
+    void *ptr;
+    long double ld;
+    char data[1];
+  } u;
+};
+
+#define CHUNK_DATA(c) ((c)->u.data)
+
+static size_t high_water;       /* Max. number of bytes used by an arena. */
+static unsigned long extra_chunks; /* Number of extra chunks allocated. */
+
+static struct arena_chunk *
+arena_chunk_new (size_t size)
+{
+  struct arena_chunk *chunk;
+
+  if ((chunk = malloc (offsetof (struct arena_chunk, u) + size)) == NULL)
+    return NULL;
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+/*
+ * Allocate N bytes from the arena A.  Return NULL if out of memory.
+ */
+void *
+arena_alloc (struct arena *a, size_t n)
+{
+  struct arena_chunk *chunk;
+  void *p;
+
+  n = ARENA_ROUND (n ? n : 1);
+
+  if (a->chunks == NULL)
+    {
+      if ((a->base = arena_chunk_new (ARENA_CHUNK_SIZE)) == NULL)
+	return NULL;
+      a->chunks = a->base;
+    }
+
+  chunk = a->chunks;
+  if (chunk->size - chunk->used < n)
+    {
+      if ((chunk = arena_chunk_new (n > ARENA_LARGE_SIZE
+				    ? n : ARENA_CHUNK_SIZE)) == NULL)
+	return NULL;
+      __atomic_add_fetch (&extra_chunks, 1, __ATOMIC_RELAXED);
+      if (n > ARENA_LARGE_SIZE)
+	{
+	  /*
+	   * Link a large chunk after the current one, which remains
+	   * available for small allocations.
+	   */
+	  chunk->next = a->chunks->next;
+	  a->chunks->next = chunk;
+	}
+      else
+	{
+	  chunk->next = a->chunks;
+	  a->chunks = chunk;
+	}
+    }
+
+  p = CHUNK_DATA (chunk) + chunk->used;
+  chunk->used += n;
+  a->used += n;
+  return p;
+}
+
+char *
+arena_strndup (struct arena *a, char const *s, size_t n)
+{
+  char *p;
+
+  if ((p = arena_alloc (a, n + 1)) != NULL)
+    {
+      memcpy (p, s, n);
+      p[n] = 0;
+    }
+  return p;
+}
+
+char *
+arena_strdup (struct arena *a, char const *s)
+{
+  return arena_strndup (a, s, strlen (s));
+}
+
+static void
+arena_release (struct arena *a)
+{
+  struct arena_chunk *chunk, *next;
+
+  /*
+   * Large chunks can be linked anywhere in the list, so the base chunk
+   * is not necessarily the last one.
+   */
+  for (chunk = a->chunks; chunk; chunk = next)
+    {
+      next = chunk->next;
+      if (chunk != a->base)
+	free (chunk);
+    }
+  a->base->next = NULL;
+  a->base->used = 0;
+  a->chunks = a->base;
+  a->used = 0;
+}
+
+/*
+ * Release all memory allocated from the arena A, except for its base
+ * chunk, and update the high-water mark.  This is called when a request
+ * is finished.
+ */
+void
+arena_reset (struct arena *a)
+{
+  size_t hw;
+
+  if (a->used == 0)
+    return;
+
+  hw = __atomic_load_n (&high_water, __ATOMIC_RELAXED);
+  while (a->used > hw
+	 && !__atomic_compare_exchange_n (&high_water, &hw, a->used, 1,
+					  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  arena_release (a);
+}
+
+/*
+ * Free the arena A.  Unlike arena_reset, this does not update the
+ * high-water mark, so that aborted requests don't affect it.
+ */
+void
+arena_free (struct arena *a)
+{
+  if (a->chunks)
+    {
+      arena_release (a);
+      free (a->base);
+      a->chunks = a->base = NULL;
+    }
+}
+
+/* Return the total size of the chunks held by the arena A. */
+size_t
+arena_size (struct arena const *a)
+{
+  struct arena_chunk const *chunk;
+  size_t size = 0;
+
+  for (chunk = a->chunks; chunk; chunk = chunk->next)
+    size += chunk->size;
+  return size;
+}
+
+/* Maximum number of bytes allocated from a single arena between resets. */
+size_t
+arena_high_water (void)
+{
+  return __atomic_load_n (&high_water, __ATOMIC_RELAXED);
+}
+
+/* Number of chunks allocated in addition to the base ones. */
+unsigned long
+arena_extra_chunks (void)
+{
+  return __atomic_load_n (&extra_chunks, __ATOMIC_RELAXED);
+}
+
+/*
+ * Current arena of the calling thread.  Request data allocated while it
+ * is set are taken from it.
+ */
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void
+arena_key_create (void)
+{
+  pthread_key_create (&arena_key, NULL);
+}
+
+void
+arena_set_current (struct arena *a)
+{
+  pthread_once (&arena_key_once, arena_key_create);
+  pthread_setspecific (arena_key, a);
+}
+
+struct arena *
+arena_current (void)
+{
+  pthread_once (&arena_key_once, arena_key_create);
+  return pthread_getspecific (arena_key);
+}
@@ -0,0 +1,591 @@
+/* Response cache for pound
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Responses of services that have a Cache section are kept in memory
+ * and returned to subsequent requests for the same resource without
+ * contacting the backend.  Each cache is split into shards, each one
+ * with its own mutex, hash table and LRU list, so that requests for
+ * different resources rarely contend for a lock.
+ *
+ * The response body is captured, as it is sent to the client, by a
+ * filter BIO inserted on top of the client connection.  While the
+ * response is being received, its entry stays in pending state.
+ * Requests for the same resource arriving during that time wait for the
+ * entry to become ready instead of being passed to the backend
+ * themselves (request coalescing).
+ */
+#include "pound.h"
+#include "extern.h"
+
+enum cache_state
+  {
+    CACHE_PENDING,   /* Response is being received. */
+    CACHE_READY,     /* Response is stored. */
+    CACHE_FAILED     /* Response turned out to be not cacheable. */
+  };
+
+typedef struct cache_entry
+{
+  char *name;                 /* Key: scheme://host/url */
+  struct cache_shard *shard;  /* Shard this entry belongs to. */
+  enum cache_state state;     /* Entry state. */
+  unsigned refcount;          /* Reference count. */
+  int code;                   /* HTTP status code. */
+  int chunked;                /* Body uses chunked transfer encoding. */
+  time_t stored;              /* Time the response was stored. */
+  time_t expires;             /* Expiration time. */
+  unsigned age;               /* Age of the response when received. */
+  char *data;                 /* Response text. */
+  size_t len;                 /* Length of the response text. */
+  size_t alloc;               /* Allocated size of data. */
+  size_t head_len;            /* Length of the status line and headers. */
+  int overflow;               /* Response is larger than the limit. */
+  DLIST_ENTRY (cache_entry) link; /* Link in the LRU list of the shard. */
+} CACHE_ENTRY;
+
+#define HT_TYPE CACHE_ENTRY
+#define HT_NO_FOREACH
+#include "ht.h"
+
+typedef struct cache_shard
+{
+  pthread_mutex_t mut;          /* Mutex for this shard. */
+  pthread_cond_t cond;          /* Signaled when a pending entry is done. */
+  struct http_cache *cache;     /* Cache this shard belongs to. */
+  CACHE_ENTRY_HASH *hash;       /* Entries indexed by key. */
+  DLIST_HEAD (,cache_entry) lru; /* Ready entries, most recently used first. */
+  size_t size;                  /* Size of ready entries. */
+  size_t count;                 /* Number of ready entries. */
+} CACHE_SHARD;
+
+struct http_cache
+{
+  struct cache_conf conf;       /* Configuration. */
+  size_t shard_size;            /* Size limit of a shard. */
+  CACHE_SHARD shard[CACHE_SHARDS];
+  unsigned long stat[CACHE_STAT_MAX]; /* Request counters. */
+  unsigned long evictions;      /* Number of entries evicted. */
+};
+
+struct http_cache *
+http_cache_new (struct cache_conf const *conf)
+{
+  struct http_cache *cache;
+  int i;
+
+  XZALLOC (cache);
+  cache->conf = *conf;
+  cache->shard_size = conf->size / CACHE_SHARDS;
+  /* An object must fit into a shard. */
+  if (cache->conf.max_object_size > cache->shard_size)
+    cache->conf.max_object_size = cache->shard_size;
+  for (i = 0; i < CACHE_SHARDS; i++)
+    {
+      CACHE_SHARD *shard = &cache->shard[i];
+
+      pthread_mutex_init (&shard->mut, NULL);
+      pthread_cond_init (&shard->cond, NULL);
+      shard->cache = cache;
+      if ((shard->hash = CACHE_ENTRY_HASH_NEW ()) == NULL)
+	xnomem ();
+      DLIST_INIT (&shard->lru);
+    }
+  return cache;
+}
+
+struct cache_conf const *
+http_cache_conf (struct http_cache *cache)
+{
+  return &cache->conf;
+}
+
+static CACHE_SHARD *
+cache_shard (struct http_cache *cache, char const *key)
+{
+  /* FNV-1a hash */
+  uint32_t h = 2166136261u;
+  unsigned char const *p;
+
+  for (p = (unsigned char const *) key; *p; p++)
+    {
+      h ^= *p;
+      h *= 16777619;
+    }
+  return &cache->shard[h % CACHE_SHARDS];
+}
+
+static inline size_t
+cache_entry_size (CACHE_ENTRY *ent)
+{
+  return sizeof (*ent) + strlen (ent->name) + ent->alloc;
+}
+
+static void
+cache_entry_free (CACHE_ENTRY *ent)
+{
+  free (ent->data);
+  free (ent->name);
+  free (ent);
+}
+
+/*
+ * Release a reference to the entry.  The shard mutex must be locked.
+ */
+static void
+cache_entry_release (CACHE_ENTRY *ent)
+{
+  if (--ent->refcount == 0)
+    cache_entry_free (ent);
+}
+
+/*
+ * Remove the ready entry from its shard.  The shard mutex must be
+ * locked.
+ */
+static void
+cache_entry_remove (CACHE_SHARD *shard, CACHE_ENTRY *ent)
+{
+  CACHE_ENTRY_DELETE (shard->hash, ent);
+  DLIST_REMOVE (&shard->lru, ent, link);
+  shard->size -= cache_entry_size (ent);
+  shard->count--;
+  cache_entry_release (ent);
+}
+
+static inline void
+cache_stat_incr (struct http_cache *cache, int n)
+{
+  __atomic_add_fetch (&cache->stat[n], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Look up the response for KEY in CACHE.  If FILL is true, the caller
+ * is willing to fetch the response from the backend if it is not in the
+ * cache.  CHUNKED_OK is true if the client accepts chunked transfer
+ * encoding.  Return value and the value stored in *RET are:
+ *
+ *   CACHE_HIT     - the response is found; *RET is the entry to serve;
+ *   CACHE_MISS    - the response is not found; *RET is a pending entry,
+ *                   which the caller must fill (see cache_entry_fill_begin);
+ *   CACHE_BYPASS  - the response is not found and FILL is false, or it
+ *                   can't be served to this client, or it is being fetched
+ *                   by another thread, which failed to complete within the
+ *                   lock timeout; *RET is NULL.
+ *
+ * The entry returned in *RET must be released with cache_entry_unref
+ * (when serving it) or cache_entry_fill_end (when filling it).
+ */
+int
+cache_lookup (struct http_cache *cache, char const *key, int fill,
+	      int chunked_ok, CACHE_ENTRY **ret)
+{
+  CACHE_SHARD *shard = cache_shard (cache, key);
+  CACHE_ENTRY *ent, keyent;
+  struct timespec ts;
+  time_t now = time (NULL);
+  int coalesced = 0;
+  enum cache_state state;
+  int rc;
+
+  keyent.name = (char *) key;
+  *ret = NULL;
+  pthread_mutex_lock (&shard->mut);
+  while ((ent = CACHE_ENTRY_RETRIEVE (shard->hash, &keyent)) != NULL)
+    {
+      if (ent->state == CACHE_READY)
+	{
+	  if (ent->expires > now)
+	    break;
+	  cache_entry_remove (shard, ent);
+	  ent = NULL;
+	  break;
+	}
+
+      /* Wait for the response that is being fetched. */
+      if (!coalesced)
+	{
+	  clock_gettime (CLOCK_REALTIME, &ts);
+	  ts.tv_sec += cache->conf.lock_timeout;
+	  coalesced = 1;
+	}
+      ent->refcount++;
+      do
+	rc = pthread_cond_timedwait (&shard->cond, &shard->mut, &ts);
+      while (rc == 0 && ent->state == CACHE_PENDING);
+      state = ent->state;
+      cache_entry_release (ent);
+      if (state == CACHE_PENDING)
+	{
+	  /* Timed out. */
+	  pthread_mutex_unlock (&shard->mut);
+	  cache_stat_incr (cache, CACHE_BYPASS);
+	  return CACHE_BYPASS;
+	}
+      /*
+       * Retry the lookup: the entry could have been evicted meanwhile,
+       * or, if fetching failed, another thread may have started over.
+       */
+    }
+
+  if (ent && ent->chunked && !chunked_ok)
+    {
+      ent = NULL;
+      rc = CACHE_BYPASS;
+    }
+  else if (ent)
+    {
+      /* Move it to the head of the LRU list. */
+      if (DLIST_PREV (ent, link))
+	{
+	  DLIST_REMOVE (&shard->lru, ent, link);
+	  DLIST_INSERT_HEAD (&shard->lru, ent, link);
+	}
+      ent->refcount++;
+      rc = CACHE_HIT;
+      cache_stat_incr (cache, coalesced ? CACHE_COALESCED : CACHE_HIT);
+    }
+  else if (fill)
+    {
+      if ((ent = calloc (1, sizeof (*ent))) == NULL
+	  || (ent->name = strdup (key)) == NULL)
+	{
+	  free (ent);
+	  ent = NULL;
+	  lognomem ();
+	  rc = CACHE_BYPASS;
+	}
+      else
+	{
+	  ent->shard = shard;
+	  ent->state = CACHE_PENDING;
+	  /* One reference for the hash table, another one for the caller. */
+	  ent->refcount = 2;
+	  CACHE_ENTRY_INSERT (shard->hash, ent);
+	  rc = CACHE_MISS;
+	}
+    }
+  else
+    rc = CACHE_BYPASS;
+  pthread_mutex_unlock (&shard->mut);
+
+  if (rc != CACHE_HIT)
+    cache_stat_incr (cache, rc);
+  *ret = ent;
+  return rc;
+}
+
+/* Count a request that was not eligible for caching. */
+void
+http_cache_bypass (struct http_cache *cache)
+{
+  cache_stat_incr (cache, CACHE_BYPASS);
+}
+
+/* Release the entry obtained from a successful cache_lookup. */
+void
+cache_entry_unref (CACHE_ENTRY *ent)
+{
+  CACHE_SHARD *shard = ent->shard;
+
+  pthread_mutex_lock (&shard->mut);
+  cache_entry_release (ent);
+  pthread_mutex_unlock (&shard->mut);
+}
+
+/*
+ * Append N bytes from BUF to the response text of ENT.  If it grows
+ * beyond the size limit, discard the text and set the overflow flag.
+ */
+static void
+cache_entry_append (CACHE_ENTRY *ent, char const *buf, size_t n)
+{
+  struct http_cache *cache = ent->shard->cache;
+
+  if (ent->overflow)
+    return;
+  if (ent->len + n > cache->conf.max_object_size)
+    goto overflow;
+  if (ent->len + n > ent->alloc)
+    {
+      size_t size = ent->alloc ? ent->alloc : 1024;
+      char *p;
+
+      while (size < ent->len + n)
+	size *= 2;
+      if (size > cache->conf.max_object_size)
+	size = cache->conf.max_object_size;
+      if ((p = realloc (ent->data, size)) == NULL)
+	goto overflow;
+      ent->data = p;
+      ent->alloc = size;
+    }
+  memcpy (ent->data + ent->len, buf, n);
+  ent->len += n;
+  return;
+
+ overflow:
+  ent->overflow = 1;
+  free (ent->data);
+  ent->data = NULL;
+  ent->len = ent->alloc = 0;
+}
+
+/*
+ * Tee BIO: a filter that passes the data written to it over to the
+ * next BIO in chain, capturing a copy of them in the cache entry.
+ */
+static int
+tee_write (BIO *bio, const char *buf, int len)
+{
+  BIO *next = BIO_next (bio);
+  int n;
+
+  if (next == NULL)
+    return 0;
+  n = BIO_write (next, buf, len);
+  BIO_clear_retry_flags (bio);
+  BIO_copy_next_retry (bio);
+  if (n > 0)
+    cache_entry_append (BIO_get_data (bio), buf, n);
+  return n;
+}
+
+static int
+tee_puts (BIO *bio, const char *str)
+{
+  return tee_write (bio, str, strlen (str));
+}
+
+static long
+tee_ctrl (BIO *bio, int cmd, long num, void *ptr)
+{
+  BIO *next = BIO_next (bio);
+
+  switch (cmd)
+    {
+    case BIO_CTRL_PUSH:
+    case BIO_CTRL_POP:
+      return 1;
+
+    default:
+      if (next == NULL)
+	return 0;
+      return BIO_ctrl (next, cmd, num, ptr);
+    }
+}
+
+static int
+tee_create (BIO *bio)
+{
+  BIO_set_init (bio, 1);
+  return 1;
+}
+
+static BIO_METHOD *tee_method;
+static pthread_once_t tee_method_once = PTHREAD_ONCE_INIT;
+
+static void
+tee_method_create (void)
+{
+  tee_method = BIO_meth_new (BIO_get_new_index () | BIO_TYPE_FILTER,
+			     "pound cache tee");
+  if (tee_method == NULL)
+    xnomem ();
+  BIO_meth_set_write (tee_method, tee_write);
+  BIO_meth_set_puts (tee_method, tee_puts);
+  BIO_meth_set_ctrl (tee_method, tee_ctrl);
+  BIO_meth_set_create (tee_method, tee_create);
+}
+
+/*
+ * Remove the pending entry ENT from the hash, wake up the threads
+ * waiting for it and release it.  The shard mutex must be locked.
+ */
+static void
+cache_entry_abort (CACHE_ENTRY *ent)
+{
+  CACHE_SHARD *shard = ent->shard;
+
+  ent->state = CACHE_FAILED;
+  CACHE_ENTRY_DELETE (shard->hash, ent);
+  pthread_cond_broadcast (&shard->cond);
+  /*
+   * Drop the hash table reference.  The entry stays alive, because the
+   * caller still holds its one.
+   */
+  ent->refcount--;
+  cache_entry_release (ent);
+}
+
+/*
+ * Start filling the pending entry ENT with the response.  HEAD (of
+ * HEAD_LEN bytes) is the status line and headers to store, each one
+ * terminated with CRLF.  CODE is the response status code, TTL is its
+ * lifetime, AGE is its age as reported by the backend, and CHUNKED is
+ * true if its body is chunked.  Return the BIO to write the response
+ * body to.  This is a filter pushed on top of OUT.  On error, abandon
+ * the entry and return NULL.
+ */
+BIO *
+cache_entry_fill_begin (CACHE_ENTRY *ent, BIO *out,
+			char const *head, size_t head_len,
+			int code, time_t ttl, unsigned age, int chunked)
+{
+  BIO *tee;
+
+  pthread_once (&tee_method_once, tee_method_create);
+  if ((tee = BIO_new (tee_method)) == NULL)
+    {
+      lognomem ();
+      cache_entry_fill_end (ent, NULL, 0);
+      return NULL;
+    }
+  BIO_set_data (tee, ent);
+  cache_entry_append (ent, head, head_len);
+  cache_entry_append (ent, "\r\n", 2);
+  ent->head_len = head_len;
+  ent->code = code;
+  ent->stored = time (NULL);
+  ent->expires = ent->stored + ttl;
+  ent->age = age;
+  ent->chunked = chunked;
+  return BIO_push (tee, out);
+}
+
+/*
+ * Finish filling the pending entry ENT.  TEE is the BIO returned by
+ * cache_entry_fill_begin, or NULL if filling didn't start.  OK is true
+ * if the response has been received and passed to the client
+ * successfully.  In this case the entry is made available for other
+ * requests.  Otherwise, it is discarded.  In any case the reference
+ * obtained by cache_lookup is released.
+ */
+void
+cache_entry_fill_end (CACHE_ENTRY *ent, BIO *tee, int ok)
+{
+  CACHE_SHARD *shard = ent->shard;
+  struct http_cache *cache = shard->cache;
+  char *p;
+
+  if (tee)
+    {
+      BIO_pop (tee);
+      BIO_free (tee);
+    }
+  else
+    ok = 0;
+
+  if (ok && !ent->overflow)
+    {
+      /* Trim the buffer. */
+      if (ent->alloc > ent->len
+	  && (p = realloc (ent->data, ent->len)) != NULL)
+	{
+	  ent->data = p;
+	  ent->alloc = ent->len;
+	}
+    }
+  else
+    ok = 0;
+
+  pthread_mutex_lock (&shard->mut);
+  if (ok)
+    {
+      size_t size = cache_entry_size (ent);
+      CACHE_ENTRY *victim;
+
+      ent->state = CACHE_READY;
+      DLIST_INSERT_HEAD (&shard->lru, ent, link);
+      shard->size += size;
+      shard->count++;
+      while (shard->size > cache->shard_size
+	     && (victim = DLIST_LAST (&shard->lru)) != NULL)
+	{
+	  cache_entry_remove (shard, victim);
+	  __atomic_add_fetch (&cache->evictions, 1, __ATOMIC_RELAXED);
+	}
+      pthread_cond_broadcast (&shard->cond);
+      cache_entry_release (ent);
+    }
+  else
+    cache_entry_abort (ent);
+  pthread_mutex_unlock (&shard->mut);
+}
+
+/*
+ * Return the status line and headers of the response stored in ENT.
+ * Store their length in *LEN.
+ */
+char const *
+cache_entry_head (CACHE_ENTRY *ent, size_t *len)
+{
+  *len = ent->head_len;
+  return ent->data;
+}
+
+/*
+ * Send the response stored in ENT to OUT.  If HEAD is true, omit the
+ * response body.  Add the number of body bytes sent to *RES_BYTES.
+ * Return the response status code on success and -1 on error.
+ */
+int
+cache_entry_send (CACHE_ENTRY *ent, BIO *out, int head,
+		  CONTENT_LENGTH *res_bytes)
+{
+  time_t now = time (NULL);
+  size_t body_len = ent->len - ent->head_len - 2;
+
+  if (BIO_write (out, ent->data, ent->head_len) != ent->head_len
+      || BIO_printf (out, "Age: %lu\r\n",
+		     (unsigned long) (ent->age + (now - ent->stored))) <= 0)
+    return -1;
+  if (head)
+    {
+      if (BIO_puts (out, "\r\n") <= 0)
+	return -1;
+    }
+  else
+    {
+      if (BIO_write (out, ent->data + ent->head_len, ent->len - ent->head_len)
+	  != ent->len - ent->head_len)
+	return -1;
+      *res_bytes += body_len;
+    }
+  return BIO_flush (out) == 1 ? ent->code : -1;
+}
+
+/* Get cache statistics. */
+void
+http_cache_stats (struct http_cache *cache, struct http_cache_stats *st)
+{
+  int i;
+
+  for (i = 0; i < CACHE_STAT_MAX; i++)
+    st->requests[i] = __atomic_load_n (&cache->stat[i], __ATOMIC_RELAXED);
+  st->evictions = __atomic_load_n (&cache->evictions, __ATOMIC_RELAXED);
+  st->entries = 0;
+  st->size = 0;
+  for (i = 0; i < CACHE_SHARDS; i++)
+    {
+      CACHE_SHARD *shard = &cache->shard[i];
+      pthread_mutex_lock (&shard->mut);
+      st->entries += shard->count;
+      st->size += shard->size;
+      pthread_mutex_unlock (&shard->mut);
+    }
+}
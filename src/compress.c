@@ -0,0 +1,555 @@
+/* Response compression for pound
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Responses of services that have a Compression section are compressed
+ * on the fly, if the client accepts one of the configured content
+ * codings.  The body is compressed by a filter BIO, pushed on top of
+ * the client connection (or of the cache tee BIO, so that the cache
+ * keeps the compressed response).  Compressed data are written out in
+ * chunked transfer encoding, using a buffer of fixed size, so that the
+ * memory used by a connection doesn't depend on the response size.
+ */
+#include "pound.h"
+#include <zlib.h>
+#ifdef ENABLE_BROTLI
+# include <brotli/encode.h>
+#endif
+
+/* Size of the output buffer of a compressor. */
+#define COMPRESS_BUFSIZE 16384
+
+/* Base 2 logarithm of the brotli window size. */
+#define COMPRESS_BROTLI_LGWIN 18
+
+struct http_compress
+{
+  struct compress_conf conf;       /* Configuration. */
+  unsigned long responses[COMPRESS_MAX]; /* Counters. */
+  unsigned long bytes_in[COMPRESS_MAX];
+  unsigned long bytes_out[COMPRESS_MAX];
+};
+
+static char const *coding_names[] = {
+  [COMPRESS_GZIP] = "gzip",
+  [COMPRESS_BROTLI] = "br",
+};
+
+char const *
+compress_coding_name (int enc)
+{
+  return coding_names[enc];
+}
+
+/*
+ * Return the index of the content coding NAME, or -1 if it is not
+ * supported.
+ */
+int
+compress_coding_lookup (char const *name)
+{
+  if (strcasecmp (name, "gzip") == 0)
+    return COMPRESS_GZIP;
+#ifdef ENABLE_BROTLI
+  if (strcasecmp (name, "br") == 0)
+    return COMPRESS_BROTLI;
+#endif
+  return -1;
+}
+
+/* Default content types to compress. */
+static char *default_types[] = {
+  "text/html",
+  "text/plain",
+  "text/css",
+  "text/xml",
+  "text/javascript",
+  "application/javascript",
+  "application/json",
+  "application/*+json",
+  "application/xml",
+  "application/*+xml",
+  "image/svg+xml",
+};
+
+struct http_compress *
+http_compress_new (struct compress_conf const *conf)
+{
+  struct http_compress *comp;
+  size_t i;
+
+  XZALLOC (comp);
+  comp->conf = *conf;
+  if (comp->conf.encc == 0)
+    {
+#ifdef ENABLE_BROTLI
+      comp->conf.encv[comp->conf.encc++] = COMPRESS_BROTLI;
+#endif
+      comp->conf.encv[comp->conf.encc++] = COMPRESS_GZIP;
+    }
+  if (comp->conf.ntypes == 0)
+    {
+      comp->conf.types = default_types;
+      comp->conf.ntypes = sizeof (default_types) / sizeof (default_types[0]);
+    }
+  else
+    {
+      /* Content types are compared in lower case. */
+      for (i = 0; i < comp->conf.ntypes; i++)
+	{
+	  char *p;
+	  for (p = comp->conf.types[i]; *p; p++)
+	    *p = tolower (*p);
+	}
+    }
+  return comp;
+}
+
+void
+http_compress_stats (struct http_compress *comp,
+		     struct http_compress_stats *st)
+{
+  int i;
+
+  for (i = 0; i < COMPRESS_MAX; i++)
+    {
+      st->responses[i] = __atomic_load_n (&comp->responses[i],
+					  __ATOMIC_RELAXED);
+      st->bytes_in[i] = __atomic_load_n (&comp->bytes_in[i], __ATOMIC_RELAXED);
+      st->bytes_out[i] = __atomic_load_n (&comp->bytes_out[i],
+					  __ATOMIC_RELAXED);
+    }
+}
+
+CONTENT_LENGTH
+compress_min_size (struct http_compress *comp)
+{
+  return comp->conf.min_size;
+}
+
+/*
+ * Parse the quality value from the parameters of an Accept-Encoding
+ * element.  P points past the coding name, END to the end of the
+ * element.
+ */
+static double
+accept_quality (char const *p, char const *end)
+{
+  while (p < end)
+    {
+      p += strspn (p, " \t;");
+      if (end - p > 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=')
+	return strtod (p + 2, NULL);
+      while (p < end && *p != ';')
+	p++;
+    }
+  return 1;
+}
+
+/*
+ * Select the content coding for the response, given the value of the
+ * Accept-Encoding request header.  Among the codings acceptable to the
+ * client, the one with the highest quality value wins.  Ties are
+ * resolved in the order of preference defined by the configuration.
+ * Return the coding index, or -1 if none is acceptable.
+ */
+int
+compress_negotiate (struct http_compress *comp, char const *accept)
+{
+  double q[COMPRESS_MAX];
+  double qstar = -1, best_q = 0;
+  int best = -1;
+  int i;
+
+  for (i = 0; i < COMPRESS_MAX; i++)
+    q[i] = -1;
+
+  while (*accept)
+    {
+      char const *end, *name;
+      size_t len;
+      double qv;
+
+      accept += strspn (accept, " \t,");
+      if (!*accept)
+	break;
+      end = accept + strcspn (accept, ",");
+      name = accept;
+      len = strcspn (name, " \t;,");
+      qv = accept_quality (name + len, end);
+
+      if (len == 1 && *name == '*')
+	qstar = qv;
+      else if ((len == 4 && strncasecmp (name, "gzip", 4) == 0)
+	       || (len == 6 && strncasecmp (name, "x-gzip", 6) == 0))
+	q[COMPRESS_GZIP] = qv;
+      else if (len == 2 && strncasecmp (name, "br", 2) == 0)
+	q[COMPRESS_BROTLI] = qv;
+      accept = end;
+    }
+
+  for (i = 0; i < comp->conf.encc; i++)
+    {
+      int enc = comp->conf.encv[i];
+      double qv = q[enc] >= 0 ? q[enc] : qstar;
+      if (qv > best_q)
+	{
+	  best = enc;
+	  best_q = qv;
+	}
+    }
+  return best;
+}
+
+/*
+ * Return true if the response of the given content TYPE (the value of
+ * the Content-Type header) should be compressed.
+ */
+int
+compress_content_type_ok (struct http_compress *comp, char const *type)
+{
+  char buf[128];
+  size_t i, len;
+
+  type += strspn (type, " \t");
+  len = strcspn (type, " \t;");
+  if (len == 0 || len >= sizeof (buf))
+    return 0;
+  for (i = 0; i < len; i++)
+    buf[i] = tolower (type[i]);
+  buf[len] = 0;
+
+  for (i = 0; i < comp->conf.ntypes; i++)
+    if (fnmatch (comp->conf.types[i], buf, 0) == 0)
+      return 1;
+  return 0;
+}
+
+/*
+ * Compressor state, kept as the data of the compression BIO.
+ */
+struct compress_stream
+{
+  struct http_compress *comp;   /* Service compression settings. */
+  int enc;                      /* Content coding. */
+  int error;                    /* True if an error occurred. */
+  CONTENT_LENGTH bytes_in;      /* Number of bytes received. */
+  CONTENT_LENGTH bytes_out;     /* Number of compressed bytes produced. */
+  union
+  {
+    z_stream zs;                /* COMPRESS_GZIP */
+#ifdef ENABLE_BROTLI
+    BrotliEncoderState *br;     /* COMPRESS_BROTLI */
+#endif
+  };
+  unsigned char buf[COMPRESS_BUFSIZE]; /* Output buffer. */
+};
+
+/*
+ * Send N bytes of compressed data from the output buffer of CS as a
+ * chunk to the BIO NEXT.
+ */
+static int
+compress_emit (struct compress_stream *cs, BIO *next, size_t n)
+{
+  if (n == 0)
+    return 0;
+  if (BIO_printf (next, "%zx\r\n", n) <= 0
+      || BIO_write (next, cs->buf, n) != n
+      || BIO_write (next, "\r\n", 2) != 2)
+    return -1;
+  cs->bytes_out += n;
+  return 0;
+}
+
+/*
+ * Compress LEN bytes from BUF and pass the output to NEXT.  If FINISH
+ * is true, terminate the compressed stream.  Return 0 on success, -1 on
+ * error.
+ */
+static int
+compress_run (struct compress_stream *cs, BIO *next,
+	      unsigned char const *buf, size_t len, int finish)
+{
+  switch (cs->enc)
+    {
+    case COMPRESS_GZIP:
+      {
+	int rc;
+
+	cs->zs.next_in = (unsigned char *) buf;
+	cs->zs.avail_in = len;
+	do
+	  {
+	    cs->zs.next_out = cs->buf;
+	    cs->zs.avail_out = sizeof (cs->buf);
+	    rc = deflate (&cs->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+	    if (rc == Z_STREAM_ERROR)
+	      {
+		logmsg (LOG_ERR, "(%"PRItid") deflate error", POUND_TID ());
+		return -1;
+	      }
+	    if (compress_emit (cs, next, sizeof (cs->buf) - cs->zs.avail_out))
+	      return -1;
+	  }
+	while (cs->zs.avail_out == 0 || (finish && rc != Z_STREAM_END));
+      }
+      break;
+
+#ifdef ENABLE_BROTLI
+    case COMPRESS_BROTLI:
+      {
+	size_t avail_in = len;
+	uint8_t const *next_in = buf;
+
+	do
+	  {
+	    size_t avail_out = sizeof (cs->buf);
+	    uint8_t *next_out = cs->buf;
+
+	    if (!BrotliEncoderCompressStream (cs->br,
+					      finish ? BROTLI_OPERATION_FINISH
+						     : BROTLI_OPERATION_PROCESS,
+					      &avail_in, &next_in,
+					      &avail_out, &next_out, NULL))
+	      {
+		logmsg (LOG_ERR, "(%"PRItid") brotli encoder error",
+			POUND_TID ());
+		return -1;
+	      }
+	    if (compress_emit (cs, next, sizeof (cs->buf) - avail_out))
+	      return -1;
+	  }
+	while (avail_in > 0
+	       || BrotliEncoderHasMoreOutput (cs->br)
+	       || (finish && !BrotliEncoderIsFinished (cs->br)));
+      }
+      break;
+#endif
+    }
+  return 0;
+}
+
+/*
+ * Compression BIO: a filter that compresses the data written to it and
+ * passes them to the next BIO in chain, in chunked transfer encoding.
+ */
+static int
+compress_write (BIO *bio, const char *buf, int len)
+{
+  struct compress_stream *cs = BIO_get_data (bio);
+  BIO *next = BIO_next (bio);
+
+  BIO_clear_retry_flags (bio);
+  if (next == NULL || cs->error)
+    return -1;
+  if (len <= 0)
+    return 0;
+  if (compress_run (cs, next, (unsigned char const *) buf, len, 0))
+    {
+      cs->error = 1;
+      return -1;
+    }
+  cs->bytes_in += len;
+  return len;
+}
+
+static int
+compress_puts (BIO *bio, const char *str)
+{
+  return compress_write (bio, str, strlen (str));
+}
+
+static long
+compress_ctrl (BIO *bio, int cmd, long num, void *ptr)
+{
+  BIO *next = BIO_next (bio);
+
+  switch (cmd)
+    {
+    case BIO_CTRL_PUSH:
+    case BIO_CTRL_POP:
+      return 1;
+
+    case BIO_CTRL_PENDING:
+    case BIO_CTRL_WPENDING:
+      /*
+       * Data retained by the compressor are not reported: they can't be
+       * flushed without affecting the compression ratio.
+       */
+    default:
+      if (next == NULL)
+	return 0;
+      return BIO_ctrl (next, cmd, num, ptr);
+    }
+}
+
+static int
+compress_create (BIO *bio)
+{
+  BIO_set_init (bio, 1);
+  return 1;
+}
+
+static int
+compress_destroy (BIO *bio)
+{
+  struct compress_stream *cs = BIO_get_data (bio);
+
+  if (cs)
+    {
+      struct http_compress *comp = cs->comp;
+
+      switch (cs->enc)
+	{
+	case COMPRESS_GZIP:
+	  deflateEnd (&cs->zs);
+	  break;
+
+#ifdef ENABLE_BROTLI
+	case COMPRESS_BROTLI:
+	  BrotliEncoderDestroyInstance (cs->br);
+	  break;
+#endif
+	}
+      __atomic_add_fetch (&comp->bytes_in[cs->enc], cs->bytes_in,
+			  __ATOMIC_RELAXED);
+      __atomic_add_fetch (&comp->bytes_out[cs->enc], cs->bytes_out,
+			  __ATOMIC_RELAXED);
+      free (cs);
+      BIO_set_data (bio, NULL);
+    }
+  return 1;
+}
+
+static BIO_METHOD *compress_method;
+static pthread_once_t compress_method_once = PTHREAD_ONCE_INIT;
+
+static void
+compress_method_create (void)
+{
+  compress_method = BIO_meth_new (BIO_get_new_index () | BIO_TYPE_FILTER,
+				  "pound compressor");
+  if (compress_method == NULL)
+    xnomem ();
+  BIO_meth_set_write (compress_method, compress_write);
+  BIO_meth_set_puts (compress_method, compress_puts);
+  BIO_meth_set_ctrl (compress_method, compress_ctrl);
+  BIO_meth_set_create (compress_method, compress_create);
+  BIO_meth_set_destroy (compress_method, compress_destroy);
+}
+
+/*
+ * Create a BIO compressing the data written to it with the content
+ * coding ENC, and push it on top of OUT.  Return the BIO, or NULL on
+ * error.
+ */
+BIO *
+compress_bio_new (struct http_compress *comp, int enc, BIO *out)
+{
+  struct compress_stream *cs;
+  BIO *bio;
+
+  pthread_once (&compress_method_once, compress_method_create);
+  if ((cs = calloc (1, sizeof (*cs))) == NULL)
+    {
+      lognomem ();
+      return NULL;
+    }
+  cs->comp = comp;
+  cs->enc = enc;
+
+  switch (enc)
+    {
+    case COMPRESS_GZIP:
+      /* Window bits 15 + 16 select the gzip wrapper. */
+      if (deflateInit2 (&cs->zs, comp->conf.level[enc], Z_DEFLATED,
+			15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+	  logmsg (LOG_ERR, "(%"PRItid") can't initialize deflate: %s",
+		  POUND_TID (), cs->zs.msg ? cs->zs.msg : "unknown error");
+	  free (cs);
+	  return NULL;
+	}
+      break;
+
+#ifdef ENABLE_BROTLI
+    case COMPRESS_BROTLI:
+      if ((cs->br = BrotliEncoderCreateInstance (NULL, NULL, NULL)) == NULL)
+	{
+	  lognomem ();
+	  free (cs);
+	  return NULL;
+	}
+      BrotliEncoderSetParameter (cs->br, BROTLI_PARAM_QUALITY,
+				 comp->conf.level[enc]);
+      BrotliEncoderSetParameter (cs->br, BROTLI_PARAM_LGWIN,
+				 COMPRESS_BROTLI_LGWIN);
+      break;
+#endif
+
+    default:
+      free (cs);
+      return NULL;
+    }
+
+  if ((bio = BIO_new (compress_method)) == NULL)
+    {
+      lognomem ();
+      if (enc == COMPRESS_GZIP)
+	deflateEnd (&cs->zs);
+#ifdef ENABLE_BROTLI
+      else
+	BrotliEncoderDestroyInstance (cs->br);
+#endif
+      free (cs);
+      return NULL;
+    }
+  BIO_set_data (bio, cs);
+  return BIO_push (bio, out);
+}
+
+/*
+ * Terminate the compressed stream and the chunked body.  Return 0 on
+ * success and -1 on error.
+ */
+int
+compress_bio_finish (BIO *bio)
+{
+  struct compress_stream *cs = BIO_get_data (bio);
+  BIO *next = BIO_next (bio);
+
+  if (next == NULL || cs->error
+      || compress_run (cs, next, NULL, 0, 1)
+      || BIO_puts (next, "0\r\n\r\n") <= 0)
+    {
+      cs->error = 1;
+      return -1;
+    }
+  __atomic_add_fetch (&cs->comp->responses[cs->enc], 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ * Remove the compression BIO from its chain and free it.
+ */
+void
+compress_bio_free (BIO *bio)
+{
+  BIO_pop (bio);
+  BIO_free (bio);
+}
@@ -323,54 +323,9 @@ assign_cert (void *call_data, void *section_data)
  * ACL support
  */
 
-/* Max. number of bytes in an inet address (suitable for both v4 and v6) */
-#define MAX_INADDR_BYTES 16
-
-typedef struct cidr
-{
-  int family;                           /* Address family */
-  int len;                              /* Address length */
-  unsigned char addr[MAX_INADDR_BYTES]; /* Network address */
-  unsigned char mask[MAX_INADDR_BYTES]; /* Address mask */
-  SLIST_ENTRY (cidr) next;              /* Link to next CIDR */
-} CIDR;
-
-/* Create a new ACL. */
-static ACL *
-new_acl (char const *name)
-{
-  ACL *acl;
-
-  XZALLOC (acl);
-  if (name)
-    acl->name = xstrdup (name);
-  else
-    acl->name = NULL;
-  SLIST_INIT (&acl->head);
-
-  return acl;
-}
-
-/* Match cidr against inet address ap/len.  Return 0 on match, 1 otherwise. */
-static int
-cidr_match (CIDR *cidr, unsigned char *ap, size_t len)
-{
-  size_t i;
-
-  if (cidr->len == len)
-    {
-      for (i = 0; i < len; i++)
-	{
-	  if (cidr->addr[i] != (ap[i] & cidr->mask[i]))
-	    return 1;
-	}
-    }
-  return 0;
-}
-
 /*
  * Split the inet address of SA to address pointer and length, suitable
- * for use with the above functions.  Store pointer in RET_PTR.  Return
+ * for use with the ACL functions.  Store pointer in RET_PTR.  Return
  * address length in bytes, or -1 if SA has invalid address family.
  */
 int
@@ -392,109 +347,51 @@ sockaddr_bytes (struct sockaddr *sa, unsigned char **ret_ptr)
   return -1;
 }
 
-/*
- * Match sockaddr SA against ACL.  Return 0 if it matches, 1 if it does not
- * and -1 on error (invalid address family).
- */
-int
-acl_match (ACL *acl, struct sockaddr *sa)
-{
-  CIDR *cidr;
-  unsigned char *ap;
-  size_t len;
-
-  if ((len = sockaddr_bytes (sa, &ap)) == -1)
-    return -1;
-
-  SLIST_FOREACH (cidr, &acl->head, next)
-    {
-      if (cidr->family == sa->sa_family && cidr_match (cidr, ap, len) == 0)
-	return 0;
-    }
-
-  return 1;
-}
-
-static void
-masklen_to_netmask (unsigned char *buf, size_t len, size_t masklen)
-{
-  int i, cnt;
-
-  cnt = masklen / 8;
-  for (i = 0; i < cnt; i++)
-    buf[i] = 0xff;
-  if (i == MAX_INADDR_BYTES)
-    return;
-  cnt = 8 - masklen % 8;
-  buf[i++] = (0xff >> cnt) << cnt;
-  for (; i < MAX_INADDR_BYTES; i++)
-    buf[i] = 0;
-}
-
 /* Parse CIDR at the current point of the input. */
 static int
 parse_cidr (ACL *acl)
 {
   struct token *tok;
-  char *mask;
-  struct addrinfo hints, *res;
-  unsigned long masklen;
   int rc;
 
   if ((tok = gettkn_expect (T_STRING)) == NULL)
     return CFGPARSER_FAIL;
 
-  if ((mask = strchr (tok->str, '/')) != NULL)
+  if ((rc = acl_add (acl, tok->str)) != ACL_OK)
     {
-      char *p;
-
-      *mask++ = 0;
-
-      errno = 0;
-      masklen = strtoul (mask, &p, 10);
-      if (errno || *p)
-	{
-	  conf_error ("%s", "invalid netmask");
-	  return CFGPARSER_FAIL;
-	}
+      conf_error ("%s", acl_strerror (rc));
+      return CFGPARSER_FAIL;
     }
+  return CFGPARSER_OK;
+}
 
-  memset (&hints, 0, sizeof (hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_flags = AI_NUMERICHOST;
-
-  if ((rc = getaddrinfo (tok->str, NULL, &hints, &res)) == 0)
-    {
-      CIDR *cidr;
-      int len, i;
-      unsigned char *p;
+/*
+ * Parse the file name after "-file" and load ACL from that file.
+ */
+static int
+parse_acl_file (ACL *acl)
+{
+  struct token *tok;
+  WORKDIR *wd;
 
-      if ((len = sockaddr_bytes (res->ai_addr, &p)) == -1)
-	{
-	  conf_error ("%s", "unsupported address family");
-	  return CFGPARSER_FAIL;
-	}
-      XZALLOC (cidr);
-      cidr->family = res->ai_family;
-      cidr->len = len;
-      memcpy (cidr->addr, p, len);
-      if (!mask)
-	masklen = len * 8;
-      masklen_to_netmask (cidr->mask, cidr->len, masklen);
-      /* Fix-up network address, just in case */
-      for (i = 0; i < len; i++)
-	cidr->addr[i] &= cidr->mask[i];
-      SLIST_PUSH (&acl->head, cidr, next);
-      freeaddrinfo (res);
-    }
-  else
+  if ((tok = gettkn_expect (T_STRING)) == NULL)
+    return CFGPARSER_FAIL;
+  if ((wd = get_include_wd_at_locus_range (&tok->locus)) == NULL)
+    return CFGPARSER_FAIL;
+  if (acl_load_file (acl, wd, tok->str))
     {
-      conf_error ("%s", "invalid IP address: %s", gai_strerror (rc));
+      conf_error ("%s", "can't load ACL");
       return CFGPARSER_FAIL;
     }
   return CFGPARSER_OK;
 }
 
+static inline int
+is_acl_file_option (struct token *tok)
+{
+  return tok->type == T_LITERAL && strcmp (tok->str, "-file") == 0;
+}
+
 /*
  * List of named ACLs.
  * There shouldn't be many of them, so it's perhaps no use in implementing
@@ -583,9 +480,15 @@ parse_named_acl (void *call_data, void *section_data)
       return CFGPARSER_FAIL;
     }
 
-  acl = new_acl (tok->str);
+  acl = acl_new (tok->str);
   SLIST_PUSH (&acl_list, acl, next);
 
+  if ((tok = gettkn_any ()) == NULL)
+    return CFGPARSER_FAIL;
+  if (is_acl_file_option (tok))
+    return parse_acl_file (acl);
+  putback_tkn (tok);
+
   return parse_acl (acl);
 }
 
@@ -608,10 +511,16 @@ parse_acl_ref (ACL **ret_acl)
   if (tok->type == '\n')
     {
       putback_tkn (tok);
-      acl = new_acl (NULL);
+      acl = acl_new (NULL);
       *ret_acl = acl;
       return parse_acl (acl);
     }
+  else if (is_acl_file_option (tok))
+    {
+      acl = acl_new (NULL);
+      *ret_acl = acl;
+      return parse_acl_file (acl);
+    }
   else if (tok->type == T_STRING)
     {
       if ((acl = acl_by_name (tok->str)) == NULL)
@@ -724,6 +633,12 @@ backend_parse_https (void *call_data, void *section_data)
 				  stringbuf_len (&sb));
   stringbuf_free (&sb);
 
+  /* Remember sessions established with the backend for resumption. */
+  SSL_CTX_set_session_cache_mode (be->v.mtx.ctx,
+				  SSL_SESS_CACHE_CLIENT
+				  | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb (be->v.mtx.ctx, backend_ssl_new_session);
+
   POUND_SSL_CTX_init (be->v.mtx.ctx);
 
   return CFGPARSER_OK;
@@ -876,6 +791,8 @@ assign_resolve_mode (void *call_data, void *section_data)
   return res;
 }
 
+static int backend_parse_health_check (void *call_data, void *section_data);
+
 static CFGPARSER_TABLE backend_parsetab[] = {
   {
     .name = "End",
@@ -936,6 +853,16 @@ static CFGPARSER_TABLE backend_parsetab[] = {
     .parser = cfg_assign_timeout,
     .off = offsetof (BACKEND, v.mtx.conn_to)
   },
+  {
+    .name = "ConnPool",
+    .parser = cfg_assign_unsigned,
+    .off = offsetof (BACKEND, v.mtx.pool_size)
+  },
+  {
+    .name = "ConnPoolTimeOut",
+    .parser = cfg_assign_timeout,
+    .off = offsetof (BACKEND, v.mtx.pool_to)
+  },
   {
     .name = "HTTPS",
     .parser = backend_parse_https
@@ -963,6 +890,10 @@ static CFGPARSER_TABLE backend_parsetab[] = {
     .parser = cfg_assign_string,
     .off = offsetof (BACKEND, v.mtx.servername)
   },
+  {
+    .name = "HealthCheck",
+    .parser = backend_parse_health_check
+  },
   { NULL }
 };
 
@@ -1005,6 +936,120 @@ parser_loop (CFGPARSER_TABLE *ptab,
 			 retrange);
 }
 
+static int
+assign_health_check_status (void *call_data, void *section_data)
+{
+  struct health_check *hc = call_data;
+  struct token *tok;
+  int n;
+
+  if ((tok = gettkn_expect (T_NUMBER)) == NULL)
+    return CFGPARSER_FAIL;
+  n = atoi (tok->str);
+  if (n < 100 || n > 599)
+    {
+      conf_error ("%s", "invalid status code");
+      return CFGPARSER_FAIL;
+    }
+  hc->status_min = hc->status_max = n;
+
+  if ((tok = gettkn_any ()) == NULL)
+    return CFGPARSER_FAIL;
+  if (tok->type != T_NUMBER)
+    {
+      putback_tkn (tok);
+      return CFGPARSER_OK;
+    }
+  n = atoi (tok->str);
+  if (n < hc->status_min || n > 599)
+    {
+      conf_error ("%s", "invalid status code range");
+      return CFGPARSER_FAIL;
+    }
+  hc->status_max = n;
+  return CFGPARSER_OK;
+}
+
+static CFGPARSER_TABLE health_check_parsetab[] = {
+  {
+    .name = "End",
+    .parser = cfg_parse_end
+  },
+  {
+    .name = "URL",
+    .parser = cfg_assign_string,
+    .off = offsetof (struct health_check, url)
+  },
+  {
+    .name = "Host",
+    .parser = cfg_assign_string,
+    .off = offsetof (struct health_check, host)
+  },
+  {
+    .name = "Interval",
+    .parser = cfg_assign_timeout,
+    .off = offsetof (struct health_check, interval)
+  },
+  {
+    .name = "TimeOut",
+    .parser = cfg_assign_timeout,
+    .off = offsetof (struct health_check, timeout)
+  },
+  {
+    .name = "Rise",
+    .parser = cfg_assign_unsigned,
+    .off = offsetof (struct health_check, rise)
+  },
+  {
+    .name = "Fall",
+    .parser = cfg_assign_unsigned,
+    .off = offsetof (struct health_check, fall)
+  },
+  {
+    .name = "Status",
+    .parser = assign_health_check_status
+  },
+  { NULL }
+};
+
+static int
+backend_parse_health_check (void *call_data, void *section_data)
+{
+  BACKEND *be = call_data;
+  struct health_check *hc;
+  struct locus_range range;
+
+  XZALLOC (hc);
+  hc->interval = DEFAULT_HEALTH_CHECK_INTERVAL;
+  hc->timeout = DEFAULT_HEALTH_CHECK_TIMEOUT;
+  hc->rise = DEFAULT_HEALTH_CHECK_RISE;
+  hc->fall = DEFAULT_HEALTH_CHECK_FALL;
+  hc->status_min = 200;
+  hc->status_max = 399;
+
+  if (parser_loop (health_check_parsetab, hc, section_data, &range))
+    return CFGPARSER_FAIL;
+
+  if (!hc->url)
+    hc->url = xstrdup ("/");
+  else if (hc->url[0] != '/')
+    {
+      conf_error_at_locus_range (&range, "%s", "URL must begin with a slash");
+      return CFGPARSER_FAIL;
+    }
+  if (hc->interval == 0)
+    hc->interval = 1;
+  if (hc->timeout == 0)
+    hc->timeout = 1;
+  if (hc->rise == 0)
+    hc->rise = 1;
+  if (hc->fall == 0)
+    hc->fall = 1;
+
+  be->v.mtx.health_check = hc;
+  return CFGPARSER_OK;
+}
+
 static BACKEND *
 parse_backend_internal (CFGPARSER_TABLE *table, POUND_DEFAULTS *dfl,
 			struct locus_point *beg)
@@ -1016,6 +1061,7 @@ parse_backend_internal (CFGPARSER_TABLE *table, POUND_DEFAULTS *dfl,
   be->v.mtx.to = dfl->be_to;
   be->v.mtx.conn_to = dfl->be_connto;
   be->v.mtx.ws_to = dfl->ws_to;
+  be->v.mtx.pool_to = DEFAULT_CONN_POOL_TO;
 
   if (parser_loop (table, be, dfl, &range))
     return NULL;
@@ -1313,6 +1359,20 @@ host_prefix_regex (struct stringbuf *sb, int *gp_type, char const *expr)
   return stringbuf_finish (sb);
 }
 
+/*
+ * If the Host pattern EXPR of type GP_TYPE is a literal one, save it in
+ * COND for use by the service dispatch index.  Both exact and prefix
+ * patterns are translated to the same anchored regex by host_prefix_regex,
+ * so in either case EXPR is a prefix of any matching host name.
+ */
+static void
+host_literal (SERVICE_COND *cond, int gp_type, char const *expr)
+{
+  if ((gp_type == GENPAT_EXACT || gp_type == GENPAT_PREFIX)
+      && !isspace (*expr))
+    cond->host.prefix = xstrdup (expr);
+}
+
 static int
 parse_regex_compat (GENPAT *regex, int dfl_re_type, int gp_type, int flags)
 {
@@ -1360,6 +1420,116 @@ string_ref_free (STRING_REF *ref)
     free (ref);
 }
 
+/*
+ * Return true if COND is a simple condition whose pattern is a literal
+ * one (or a set of such), and can therefore participate in a pattern set.
+ * Store its case-insensitivity flag in *CI.
+ */
+static int
+cond_is_literal (SERVICE_COND *cond, int *ci)
+{
+  int type;
+  char const *str;
+
+  switch (cond->type)
+    {
+    case COND_URL:
+    case COND_PATH:
+    case COND_QUERY:
+    case COND_HDR:
+      return genpat_literal (cond->re, 0, &type, &str, ci) == 0;
+
+    default:
+      break;
+    }
+  return 0;
+}
+
+/*
+ * Fuse runs of adjacent literal matchers of the same kind and case
+ * sensitivity within the disjunction COND into single conditions using
+ * pattern sets, so that each of them is matched in a single pass over
+ * the subject.
+ */
+static void
+cond_fuse_literals (SERVICE_COND *cond)
+{
+  SERVICE_COND *first;
+  int *typev = NULL;
+  char const **patv = NULL;
+  size_t *groupv = NULL;
+  size_t patmax = 0;
+
+  assert (cond->type == COND_BOOL && cond->bool.op == BOOL_OR);
+  for (first = SLIST_FIRST (&cond->bool.head); first;
+       first = SLIST_NEXT (first, next))
+    {
+      SERVICE_COND *last, *stop, *sc;
+      int ci, sci;
+      size_t patc, i, n, group;
+      GENPAT set;
+
+      if (!cond_is_literal (first, &ci))
+	continue;
+
+      /* Find the end of the run. */
+      for (last = first, n = genpat_literal_count (first->re);
+	   (sc = SLIST_NEXT (last, next)) != NULL
+	     && sc->type == first->type
+	     && cond_is_literal (sc, &sci) && sci == ci;
+	   last = sc)
+	n += genpat_literal_count (sc->re);
+
+      if (last == first)
+	continue;
+
+      /* Collect the patterns. */
+      if (n > patmax)
+	{
+	  patmax = n;
+	  typev = xrealloc (typev, patmax * sizeof (typev[0]));
+	  patv = xrealloc (patv, patmax * sizeof (patv[0]));
+	  groupv = xrealloc (groupv, patmax * sizeof (groupv[0]));
+	}
+      /*
+       * Each of the fused conditions becomes a group of the set.  When
+       * matching, the number of the first matching group determines the
+       * number of submatch queue entries to push, so that back-references
+       * are not affected by the fusion (see match_cond in http.c).
+       */
+      patc = 0;
+      group = 0;
+      for (sc = first; ; sc = SLIST_NEXT (sc, next))
+	{
+	  for (i = 0; genpat_literal (sc->re, i, &typev[patc], &patv[patc],
+				      &sci) == 0; i++)
+	    groupv[patc++] = group + genpat_set_member_group (sc->re, i);
+	  group += genpat_set_groups (sc->re) ? genpat_set_groups (sc->re) : 1;
+	  if (sc == last)
+	    break;
+	}
+
+      genpat_set_compile (&set, patc, typev, patv, groupv,
+			  ci ? GENPAT_ICASE : 0);
+
+      /* Replace the run with its first element. */
+      stop = SLIST_NEXT (last, next);
+      while ((sc = SLIST_NEXT (first, next)) != stop)
+	{
+	  SLIST_NEXT (first, next) = SLIST_NEXT (sc, next);
+	  genpat_free (sc->re);
+	  free (sc);
+	}
+      if (SLIST_NEXT (first, next) == NULL)
+	cond->bool.head.sl_last = first;
+      genpat_free (first->re);
+      first->re = set;
+    }
+  free (typev);
+  free (patv);
+  free (groupv);
+}
+
 static int
 parse_cond_matcher_0 (SERVICE_COND *top_cond,
 		      enum service_cond_type type,
@@ -1386,6 +1556,7 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond,
       char *p;
       char buf[MAXBUF];
       STRING_REF *ref = NULL;
+      EXPAND_PROG *prog = NULL;
 
       if ((fp = fopen_include (tok->str)) == NULL)
 	{
@@ -1398,8 +1569,10 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond,
 
       switch (type)
 	{
-	case COND_QUERY_PARAM:
 	case COND_STRING_MATCH:
+	  prog = expand_compile (string);
+	  /* fall through */
+	case COND_QUERY_PARAM:
 	  ref = string_ref_alloc (string);
 	  break;
 	default:
@@ -1420,15 +1593,16 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond,
 	    continue;
 	  p[len] = 0;
 
+	  hc = service_cond_append (cond, type);
 	  if (type == COND_HOST)
 	    {
+	      host_literal (hc, gp_type, p);
 	      stringbuf_reset (&sb);
 	      expr = host_prefix_regex (&sb, &gp_type, p);
 	    }
 	  else
 	    expr = p;
 
-	  hc = service_cond_append (cond, type);
 	  rc = genpat_compile (&hc->re, gp_type, expr, flags);
 	  if (rc)
 	    {
@@ -1442,6 +1616,7 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond,
 	    case COND_STRING_MATCH:
 	      memmove (&hc->sm.re, &hc->re, sizeof (hc->sm.re));
 	      hc->sm.string = string_ref_incr (ref);
+	      hc->sm.prog = prog;
 	      break;
 
 	    default:
@@ -1450,12 +1625,16 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond,
 	}
       string_ref_free (ref);
       fclose (fp);
+      cond_fuse_literals (cond);
     }
   else
     {
       cond = service_cond_append (top_cond, type);
       if (type == COND_HOST)
-	expr = host_prefix_regex (&sb, &gp_type, tok->str);
+	{
+	  host_literal (cond, gp_type, tok->str);
+	  expr = host_prefix_regex (&sb, &gp_type, tok->str);
+	}
       else
 	expr = tok->str;
       rc = genpat_compile (&cond->re, gp_type, expr, flags);
@@ -1471,6 +1650,8 @@ parse_cond_matcher_0 (SERVICE_COND *top_cond,
 	case COND_STRING_MATCH:
 	  memmove (&cond->sm.re, &cond->re, sizeof (cond->sm.re));
 	  cond->sm.string = string_ref_alloc (string);
+	  if (type == COND_STRING_MATCH)
+	    cond->sm.prog = expand_compile (string);
 	  break;
 
 	default:
@@ -1625,6 +1806,125 @@ parse_cond_client_cert (void *call_data, void *section_data)
   return assign_cert (&cond->x509, NULL);
 }
 
+/*
+ * Parse rate specification: N[/UNIT], where N is a decimal number and
+ * UNIT is one of "s" (default), "m" or "h".  Return the rate in
+ * requests per second, or -1 on error.
+ */
+static double
+parse_rate (char const *str)
+{
+  double n;
+  char *p;
+
+  errno = 0;
+  n = strtod (str, &p);
+  if (errno || p == str || n <= 0)
+    return -1;
+  if (*p == 0)
+    return n;
+  if (*p++ != '/')
+    return -1;
+  if (strcmp (p, "s") == 0)
+    return n;
+  if (strcmp (p, "m") == 0)
+    return n / 60;
+  if (strcmp (p, "h") == 0)
+    return n / 3600;
+  return -1;
+}
+
+static int
+parse_cond_rate_limit (void *call_data, void *section_data)
+{
+  SERVICE_COND *cond;
+  struct token *tok;
+  struct locus_range range;
+  char *key = NULL;
+  double rate;
+  unsigned long burst = 0;
+  unsigned long max_keys = DEFAULT_RATELIMIT_MAX_KEYS;
+  char *p;
+  int n;
+
+  enum
+  {
+    RL_KEY,
+    RL_BURST,
+    RL_MAX
+  };
+
+  static struct kwtab optab[] = {
+    { "-key",   RL_KEY },
+    { "-burst", RL_BURST },
+    { "-max",   RL_MAX },
+    { NULL }
+  };
+
+  range.beg = last_token_locus_range ()->beg;
+
+  for (;;)
+    {
+      unsigned long *np;
+
+      if ((tok = gettkn_expect_mask (T_BIT (T_NUMBER) | T_BIT (T_LITERAL)))
+	  == NULL)
+	goto err;
+
+      if (tok->type == T_NUMBER || tok->str[0] != '-')
+	break;
+
+      if (kw_to_tok (optab, tok->str, 0, &n))
+	{
+	  conf_error ("unexpected token: %s", tok->str);
+	  goto err;
+	}
+
+      if (n == RL_KEY)
+	{
+	  if ((tok = gettkn_expect (T_STRING)) == NULL)
+	    goto err;
+	  free (key);
+	  key = xstrdup (tok->str);
+	  continue;
+	}
+
+      np = n == RL_BURST ? &burst : &max_keys;
+      if ((tok = gettkn_expect (T_NUMBER)) == NULL)
+	goto err;
+      errno = 0;
+      *np = strtoul (tok->str, &p, 10);
+      if (errno || *p || *np == 0 || *np > UINT_MAX)
+	{
+	  conf_error ("%s", "bad number");
+	  goto err;
+	}
+    }
+
+  if ((rate = parse_rate (tok->str)) < 0)
+    {
+      conf_error ("%s", "bad rate specification");
+      goto err;
+    }
+
+  /* By default, allow bursts of one second worth of requests. */
+  if (burst == 0 && (burst = rate) < rate)
+    burst++;
+
+  range.end = last_token_locus_range ()->end;
+  cond = service_cond_append (call_data, COND_RATE_LIMIT);
+  p = format_locus_str (&range);
+  cond->rl.limit = rate_limit_new (p, key, rate, burst, max_keys);
+  free (p);
+  cond->rl.key = key ? expand_compile (key) : NULL;
+  free (key);
+  return CFGPARSER_OK;
+
+ err:
+  free (key);
+  return CFGPARSER_FAIL;
+}
+
 static int
 parse_redirect_backend (void *call_data, void *section_data)
 {
@@ -1684,6 +1984,7 @@ parse_redirect_backend (void *call_data, void *section_data)
   if ((be->v.redirect.has_uri = matches[3].rm_eo - matches[3].rm_so) == 1)
     /* the path is a single '/', so remove it */
     be->v.redirect.url[matches[3].rm_so] = '\0';
+  be->v.redirect.prog = expand_compile (be->v.redirect.url);
 
   balancer_add_backend (balancer_list_get_normal (bml), be);
 
@@ -1736,6 +2037,8 @@ parse_error_backend (void *call_data, void *section_data)
   be->locus_str = format_locus_str (&range);
   be->v.error.status = status;
   be->v.error.text = text;
+  if (text)
+    be->v.error.reply = error_page_render (status, text);
 
   balancer_add_backend (balancer_list_get_normal (bml), be);
 
@@ -1778,95 +2081,270 @@ static struct kwtab sess_type_tab[] = {
   { NULL }
 };
 
-char const *
-sess_type_to_str (int type)
-{
-  if (type == SESS_NONE)
-    return "NONE";
-  return kw_to_str (sess_type_tab, type);
+char const *
+sess_type_to_str (int type)
+{
+  if (type == SESS_NONE)
+    return "NONE";
+  return kw_to_str (sess_type_tab, type);
+}
+
+static int
+session_type_parser (void *call_data, void *section_data)
+{
+  SERVICE *svc = call_data;
+  struct token *tok;
+  int n;
+
+  if ((tok = gettkn_expect (T_IDENT)) == NULL)
+    return CFGPARSER_FAIL;
+
+  if (kw_to_tok (sess_type_tab, tok->str, 1, &n))
+    {
+      conf_error ("%s", "Unknown Session type");
+      return CFGPARSER_FAIL;
+    }
+  svc->sess_type = n;
+
+  return CFGPARSER_OK;
+}
+
+static CFGPARSER_TABLE session_parsetab[] = {
+  {
+    .name = "End",
+    .parser = cfg_parse_end
+  },
+  {
+    .name = "Type",
+    .parser = session_type_parser
+  },
+  {
+    .name = "TTL",
+    .parser = cfg_assign_timeout,
+    .off = offsetof (SERVICE, sess_ttl)
+  },
+  {
+    .name = "ID",
+    .parser = cfg_assign_string,
+    .off = offsetof (SERVICE, sess_id)
+  },
+  { NULL }
+};
+
+static int
+parse_session (void *call_data, void *section_data)
+{
+  SERVICE *svc = call_data;
+  struct locus_range range;
+
+  if (parser_loop (session_parsetab, svc, section_data, &range))
+    return CFGPARSER_FAIL;
+
+  if (svc->sess_type == SESS_NONE)
+    {
+      conf_error_at_locus_range (&range, "Session type not defined");
+      return CFGPARSER_FAIL;
+    }
+
+  if (svc->sess_ttl == 0)
+    {
+      conf_error_at_locus_range (&range, "Session TTL not defined");
+      return CFGPARSER_FAIL;
+    }
+
+  switch (svc->sess_type)
+    {
+    case SESS_COOKIE:
+    case SESS_URL:
+    case SESS_HEADER:
+      if (svc->sess_id == NULL)
+	{
+	  conf_error ("%s", "Session ID not defined");
+	  return CFGPARSER_FAIL;
+	}
+      break;
+
+    default:
+      break;
+    }
+
+  return CFGPARSER_OK;
+}
+
+static CFGPARSER_TABLE cache_parsetab[] = {
+  {
+    .name = "End",
+    .parser = cfg_parse_end
+  },
+  {
+    .name = "Size",
+    .parser = assign_CONTENT_LENGTH,
+    .off = offsetof (struct cache_conf, size)
+  },
+  {
+    .name = "MaxObjectSize",
+    .parser = assign_CONTENT_LENGTH,
+    .off = offsetof (struct cache_conf, max_object_size)
+  },
+  {
+    .name = "DefaultTTL",
+    .parser = cfg_assign_timeout,
+    .off = offsetof (struct cache_conf, default_ttl)
+  },
+  {
+    .name = "LockTimeout",
+    .parser = cfg_assign_timeout,
+    .off = offsetof (struct cache_conf, lock_timeout)
+  },
+  { NULL }
+};
+
+static int
+parse_cache (void *call_data, void *section_data)
+{
+  SERVICE *svc = call_data;
+  struct cache_conf conf;
+  struct locus_range range;
+
+  if (svc->cache)
+    {
+      conf_error ("%s", "Cache already defined");
+      return CFGPARSER_FAIL;
+    }
+
+  conf.size = DEFAULT_CACHE_SIZE;
+  conf.max_object_size = DEFAULT_CACHE_MAX_OBJECT_SIZE;
+  conf.default_ttl = 0;
+  conf.lock_timeout = DEFAULT_CACHE_LOCK_TIMEOUT;
+
+  if (parser_loop (cache_parsetab, &conf, section_data, &range))
+    return CFGPARSER_FAIL;
+
+  if (conf.size <= 0)
+    {
+      conf_error_at_locus_range (&range, "%s", "Cache size must be positive");
+      return CFGPARSER_FAIL;
+    }
+
+  svc->cache = http_cache_new (&conf);
+  svc->cache_be = xbackend_create (BE_CACHE, 0, &range);
+  svc->cache_be->service = svc;
+
+  return CFGPARSER_OK;
 }
 
+#ifdef ENABLE_COMPRESSION
 static int
-session_type_parser (void *call_data, void *section_data)
+compression_parse_encoding (void *call_data, void *section_data)
 {
-  SERVICE *svc = call_data;
+  struct compress_conf *conf = call_data;
   struct token *tok;
-  int n;
+  int enc, i, level, maxlevel;
+  char *p;
 
-  if ((tok = gettkn_expect (T_IDENT)) == NULL)
+  if ((tok = gettkn_expect_mask (T_BIT (T_IDENT) | T_BIT (T_STRING))) == NULL)
     return CFGPARSER_FAIL;
+  if ((enc = compress_coding_lookup (tok->str)) == -1)
+    {
+      conf_error ("%s", "unsupported content coding");
+      return CFGPARSER_FAIL;
+    }
+  for (i = 0; i < conf->encc; i++)
+    if (conf->encv[i] == enc)
+      {
+	conf_error ("%s", "content coding already defined");
+	return CFGPARSER_FAIL;
+      }
+  conf->encv[conf->encc++] = enc;
 
-  if (kw_to_tok (sess_type_tab, tok->str, 1, &n))
+  if ((tok = gettkn_any ()) == NULL)
+    return CFGPARSER_FAIL;
+  if (tok->type == '\n')
+    return CFGPARSER_OK_NONL;
+  if (tok->type != T_NUMBER)
     {
-      conf_error ("%s", "Unknown Session type");
+      conf_error ("%s", "compression level or newline expected");
       return CFGPARSER_FAIL;
     }
-  svc->sess_type = n;
+  maxlevel = enc == COMPRESS_GZIP ? 9 : 11;
+  level = strtol (tok->str, &p, 10);
+  if (*p || level < (enc == COMPRESS_GZIP ? 1 : 0) || level > maxlevel)
+    {
+      conf_error ("%s", "compression level out of range");
+      return CFGPARSER_FAIL;
+    }
+  conf->level[enc] = level;
+  return CFGPARSER_OK;
+}
+
+static int
+compression_parse_content_type (void *call_data, void *section_data)
+{
+  struct compress_conf *conf = call_data;
+  struct token *tok;
 
+  if ((tok = gettkn_expect (T_STRING)) == NULL)
+    return CFGPARSER_FAIL;
+  if (conf->ntypes == conf->maxtypes)
+    conf->types = x2nrealloc (conf->types, &conf->maxtypes,
+			      sizeof (conf->types[0]));
+  conf->types[conf->ntypes++] = xstrdup (tok->str);
   return CFGPARSER_OK;
 }
 
-static CFGPARSER_TABLE session_parsetab[] = {
+static CFGPARSER_TABLE compression_parsetab[] = {
   {
     .name = "End",
     .parser = cfg_parse_end
   },
   {
-    .name = "Type",
-    .parser = session_type_parser
+    .name = "Encoding",
+    .parser = compression_parse_encoding
   },
   {
-    .name = "TTL",
-    .parser = cfg_assign_timeout,
-    .off = offsetof (SERVICE, sess_ttl)
+    .name = "MinSize",
+    .parser = assign_CONTENT_LENGTH,
+    .off = offsetof (struct compress_conf, min_size)
   },
   {
-    .name = "ID",
-    .parser = cfg_assign_string,
-    .off = offsetof (SERVICE, sess_id)
+    .name = "ContentType",
+    .parser = compression_parse_content_type
   },
   { NULL }
 };
 
 static int
-parse_session (void *call_data, void *section_data)
+parse_compression (void *call_data, void *section_data)
 {
   SERVICE *svc = call_data;
+  struct compress_conf conf;
   struct locus_range range;
 
-  if (parser_loop (session_parsetab, svc, section_data, &range))
-    return CFGPARSER_FAIL;
-
-  if (svc->sess_type == SESS_NONE)
-    {
-      conf_error_at_locus_range (&range, "Session type not defined");
-      return CFGPARSER_FAIL;
-    }
-
-  if (svc->sess_ttl == 0)
+  if (svc->compress)
     {
-      conf_error_at_locus_range (&range, "Session TTL not defined");
+      conf_error ("%s", "Compression already defined");
       return CFGPARSER_FAIL;
     }
 
-  switch (svc->sess_type)
-    {
-    case SESS_COOKIE:
-    case SESS_URL:
-    case SESS_HEADER:
-      if (svc->sess_id == NULL)
-	{
-	  conf_error ("%s", "Session ID not defined");
-	  return CFGPARSER_FAIL;
-	}
-      break;
+  memset (&conf, 0, sizeof (conf));
+  conf.level[COMPRESS_GZIP] = DEFAULT_GZIP_LEVEL;
+  conf.level[COMPRESS_BROTLI] = DEFAULT_BROTLI_LEVEL;
+  conf.min_size = DEFAULT_COMPRESS_MIN_SIZE;
 
-    default:
-      break;
-    }
+  if (parser_loop (compression_parsetab, &conf, section_data, &range))
+    return CFGPARSER_FAIL;
 
+  svc->compress = http_compress_new (&conf);
   return CFGPARSER_OK;
 }
+#else
+static int
+parse_compression (void *call_data, void *section_data)
+{
+  conf_error ("%s", "pound compiled without support for compression");
+  return CFGPARSER_FAIL;
+}
+#endif
 
 static int
 assign_dfl_ignore_case (void *call_data, void *section_data)
@@ -1965,6 +2443,10 @@ static CFGPARSER_TABLE match_conditions[] = {
     .name = "ClientCert",
     .parser = parse_cond_client_cert
   },
+  {
+    .name = "RateLimit",
+    .parser = parse_cond_rate_limit
+  },
   { NULL }
 };
 
@@ -2007,9 +2489,13 @@ parse_cond (int op, SERVICE_COND *cond, void *section_data)
 {
   SERVICE_COND *subcond = service_cond_append (cond, COND_BOOL);
   struct locus_range range;
+  int rc;
 
   subcond->bool.op = op;
-  return parser_loop (logcon_parsetab, subcond, section_data, &range);
+  rc = parser_loop (logcon_parsetab, subcond, section_data, &range);
+  if (rc == CFGPARSER_OK && op == BOOL_OR)
+    cond_fuse_literals (subcond);
+  return rc;
 }
 
 static int parse_else (void *call_data, void *section_data);
@@ -2140,6 +2626,7 @@ parse_rewrite_op (REWRITE_OP_HEAD *head, enum rewrite_type type)
     return CFGPARSER_FAIL;
 
   op->v.str = xstrdup (tok->str);
+  op->prog = expand_compile (op->v.str);
   return CFGPARSER_OK;
 }
 
@@ -2191,6 +2678,7 @@ parse_set_query_param (void *call_data, void *section_data)
   if ((tok = gettkn_expect (T_STRING)) == NULL)
     return CFGPARSER_FAIL;
   op->v.qp.value = xstrdup (tok->str);
+  op->prog = expand_compile (op->v.qp.value);
 
   return CFGPARSER_OK;
 
@@ -2434,6 +2922,10 @@ parse_balancer (void *call_data, void *section_data)
     *t = BALANCER_ALGO_RANDOM;
   else if (strcasecmp (tok->str, "iwrr") == 0)
     *t = BALANCER_ALGO_IWRR;
+  else if (strcasecmp (tok->str, "leastconn") == 0)
+    *t = BALANCER_ALGO_LEASTCONN;
+  else if (strcasecmp (tok->str, "ewma") == 0)
+    *t = BALANCER_ALGO_EWMA;
   else
     {
       conf_error ("unsupported balancing strategy: %s", tok->str);
@@ -2591,6 +3083,14 @@ static CFGPARSER_TABLE service_parsetab[] = {
     .name = "Session",
     .parser = parse_session
   },
+  {
+    .name = "Cache",
+    .parser = parse_cache
+  },
+  {
+    .name = "Compression",
+    .parser = parse_compression
+  },
   {
     .name = "Balancer",
     .parser = parse_balancer,
@@ -2649,7 +3149,6 @@ new_service (BALANCER_ALGO algo)
   svc->balancer_algo = algo;
 
   DLIST_INIT (&svc->be_rem_head);
-  pthread_cond_init (&svc->be_rem_cond, NULL);
 
   return svc;
 }
@@ -3044,6 +3543,11 @@ static CFGPARSER_TABLE http_common[] = {
     .name = "SocketFrom",
     .parser = listener_parse_socket_from
   },
+  {
+    .name = "Acceptors",
+    .parser = cfg_assign_unsigned,
+    .off = offsetof (LISTENER, acceptors)
+  },
   {
     .name = "xHTTP",
     .parser = listener_parse_xhttp,
@@ -3280,6 +3784,9 @@ listener_alloc (POUND_DEFAULTS *dfl)
   lst->verb = 0;
   lst->header_options = dfl->header_options;
   lst->clnt_check = -1;
+  lst->sess_cache_size = -1;
+  lst->sess_timeout = -1;
+  lst->http2_max_streams = DEFAULT_HTTP2_MAX_STREAMS;
   SLIST_INIT (&lst->rewrite[REWRITE_REQUEST]);
   SLIST_INIT (&lst->rewrite[REWRITE_RESPONSE]);
   SLIST_INIT (&lst->services);
@@ -3477,34 +3984,67 @@ get_subjectaltnames (X509 *x509, POUND_CTX *pc, size_t san_max)
     pc->subjectAltNames = result;
 }
 
-static int
-load_cert (char const *filename, LISTENER *lst)
+/*
+ * Loading certificates and keys is the most expensive part of the
+ * configuration processing.  To speed up the startup, it is deferred
+ * until the whole file has been parsed: load_cert only creates the SSL
+ * context and queues a job, which is then run along with the other
+ * queued jobs in a pool of threads (see cert_jobs_run).
+ */
+struct cert_job
 {
-  POUND_CTX *pc;
+  POUND_CTX *pc;              /* Context to load the certificate to. */
+  char *filename;             /* Certificate file name. */
+  struct locus_range locus;   /* Location of the Cert statement. */
+  struct stringbuf err;       /* Diagnostics, one message per line. */
+};
 
-  XZALLOC (pc);
+static struct cert_job *cert_jobs;
+static size_t cert_job_count, cert_job_max;
 
-  if ((pc->ctx = SSL_CTX_new (SSLv23_server_method ())) == NULL)
-    {
-      conf_openssl_error (NULL, "SSL_CTX_new");
-      return CFGPARSER_FAIL;
-    }
+/*
+ * Same as openssl_error_at_locus_range, but collects messages in SB.
+ * This is used in worker threads, where conf_error cannot be used.
+ */
+static void
+openssl_error_format (struct stringbuf *sb, char const *filename,
+		      char const *msg)
+{
+  unsigned long n = ERR_get_error ();
+
+  if (filename)
+    stringbuf_printf (sb, "%s: %s: %s\n", filename, msg,
+		      ERR_error_string (n, NULL));
+  else
+    stringbuf_printf (sb, "%s: %s\n", msg, ERR_error_string (n, NULL));
+  while ((n = ERR_get_error ()) != 0)
+    stringbuf_printf (sb, "%s\n", ERR_error_string (n, NULL));
+}
+
+/* Worker part of load_cert: runs in a startup thread. */
+static void
+cert_job_run (void *data)
+{
+  struct cert_job *job = data;
+  POUND_CTX *pc = job->pc;
+  char const *filename = job->filename;
 
   if (SSL_CTX_use_certificate_chain_file (pc->ctx, filename) != 1)
     {
-      conf_openssl_error (filename, "SSL_CTX_use_certificate_chain_file");
-      return CFGPARSER_FAIL;
+      openssl_error_format (&job->err, filename,
+			    "SSL_CTX_use_certificate_chain_file");
+      return;
     }
   if (SSL_CTX_use_PrivateKey_file (pc->ctx, filename, SSL_FILETYPE_PEM) != 1)
     {
-      conf_openssl_error (filename, "SSL_CTX_use_PrivateKey_file");
-      return CFGPARSER_FAIL;
+      openssl_error_format (&job->err, filename, "SSL_CTX_use_PrivateKey_file");
+      return;
     }
 
   if (SSL_CTX_check_private_key (pc->ctx) != 1)
     {
-      conf_openssl_error (filename, "SSL_CTX_check_private_key");
-      return CFGPARSER_FAIL;
+      openssl_error_format (&job->err, filename, "SSL_CTX_check_private_key");
+      return;
     }
 
 #ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
@@ -3518,9 +4058,10 @@ load_cert (char const *filename, LISTENER *lst)
 
     if ((fcert = fopen (filename, "r")) == NULL)
       {
-	conf_error ("%s: could not open certificate file: %s", filename,
-		    strerror (errno));
-	return CFGPARSER_FAIL;
+	stringbuf_printf (&job->err,
+			  "%s: could not open certificate file: %s\n",
+			  filename, strerror (errno));
+	return;
       }
 
     x509 = PEM_read_X509 (fcert, NULL, NULL, NULL);
@@ -3528,8 +4069,9 @@ load_cert (char const *filename, LISTENER *lst)
 
     if (!x509)
       {
-	conf_error ("%s: could not get certificate subject", filename);
-	return CFGPARSER_FAIL;
+	stringbuf_printf (&job->err, "%s: could not get certificate subject\n",
+			  filename);
+	return;
       }
 
     pc->subjectAltNameCount = 0;
@@ -3564,17 +4106,40 @@ load_cert (char const *filename, LISTENER *lst)
     X509_free (x509);
 
     if (pc->server_name == NULL)
-      {
-	conf_error ("%s: no CN in certificate subject name", filename);
-	return CFGPARSER_FAIL;
-      }
+      stringbuf_printf (&job->err, "%s: no CN in certificate subject name\n",
+			filename);
   }
-#else
+#endif
+}
+
+static int
+load_cert (char const *filename, LISTENER *lst)
+{
+  POUND_CTX *pc;
+  struct cert_job *job;
+
+  XZALLOC (pc);
+
+  if ((pc->ctx = SSL_CTX_new (SSLv23_server_method ())) == NULL)
+    {
+      conf_openssl_error (NULL, "SSL_CTX_new");
+      return CFGPARSER_FAIL;
+    }
+
+#ifndef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
   if (res->ctx)
     conf_error ("%s: multiple certificates not supported", filename);
 #endif
   SLIST_PUSH (&lst->ctx_head, pc, next);
 
+  if (cert_job_count == cert_job_max)
+    cert_jobs = x2nrealloc (cert_jobs, &cert_job_max, sizeof (cert_jobs[0]));
+  job = &cert_jobs[cert_job_count++];
+  job->pc = pc;
+  job->filename = xstrdup (filename);
+  job->locus = *last_token_locus_range ();
+  xstringbuf_init (&job->err);
+
   return CFGPARSER_OK;
 }
 
@@ -3666,8 +4231,140 @@ verify_OK (int pre_ok, X509_STORE_CTX *ctx)
 }
 
 #ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
+/*
+ * Index of certificate names used for SNI lookups.  Names without
+ * wildcard characters are kept in the "exact" hash, keyed by the name
+ * itself.  Names of the form "*.SUFFIX", where SUFFIX contains no
+ * wildcards, are kept in the "wildcard" hash, keyed by ".SUFFIX".  The
+ * rest of the patterns is kept in an array and matched using fnmatch.
+ *
+ * Each entry keeps the ordinal number (rank) of the certificate it
+ * comes from, so that the lookup returns the first matching
+ * certificate, as if all names were tried in turn.
+ */
+typedef struct sni_name
+{
+  char const *name;             /* Name, suffix, or pattern. */
+  POUND_CTX *pc;                /* Certificate context. */
+  unsigned rank;                /* Ordinal number of the certificate. */
+} SNI_NAME;
+
+#define HT_TYPE SNI_NAME
+#define HT_NO_DELETE
+#define HT_NO_FOREACH
+#include "ht.h"
+
+struct sni_index
+{
+  SNI_NAME_HASH *exact;         /* Exact names. */
+  SNI_NAME_HASH *wildcard;      /* Wildcard suffixes. */
+  SNI_NAME *patterns;           /* Other patterns, in rank order. */
+  size_t npatterns;
+  size_t maxpatterns;
+};
+
+#define SNI_WILDCARD_CHARS "*?[\\"
+
+static void
+sni_index_add (struct sni_index *idx, char const *name, POUND_CTX *pc,
+	       unsigned rank)
+{
+  SNI_NAME key, *ent;
+  SNI_NAME_HASH *tab;
+
+  if (name[strcspn (name, SNI_WILDCARD_CHARS)] == 0)
+    {
+      tab = idx->exact;
+      key.name = name;
+    }
+  else if (name[0] == '*' && name[1] == '.'
+	   && name[1 + strcspn (name + 1, SNI_WILDCARD_CHARS)] == 0)
+    {
+      tab = idx->wildcard;
+      key.name = name + 1;
+    }
+  else
+    {
+      if (idx->npatterns == idx->maxpatterns)
+	idx->patterns = x2nrealloc (idx->patterns, &idx->maxpatterns,
+				    sizeof (idx->patterns[0]));
+      ent = &idx->patterns[idx->npatterns++];
+      ent->name = name;
+      ent->pc = pc;
+      ent->rank = rank;
+      return;
+    }
+
+  /* If the name is already in the table, the earlier certificate wins. */
+  if (SNI_NAME_RETRIEVE (tab, &key))
+    return;
+  XZALLOC (ent);
+  ent->name = key.name;
+  ent->pc = pc;
+  ent->rank = rank;
+  SNI_NAME_INSERT (tab, ent);
+}
+
+static struct sni_index *
+sni_index_build (POUND_CTX_HEAD *ctx_head)
+{
+  struct sni_index *idx;
+  POUND_CTX *pc;
+  unsigned rank = 0;
+  size_t i;
+
+  XZALLOC (idx);
+  idx->exact = SNI_NAME_HASH_NEW ();
+  idx->wildcard = SNI_NAME_HASH_NEW ();
+  SLIST_FOREACH (pc, ctx_head, next)
+    {
+      sni_index_add (idx, pc->server_name, pc, rank);
+      for (i = 0; i < pc->subjectAltNameCount; i++)
+	sni_index_add (idx, pc->subjectAltNames[i], pc, rank);
+      rank++;
+    }
+  return idx;
+}
+
+/*
+ * Find the certificate for SERVER_NAME.  Return NULL if not found.
+ */
+static POUND_CTX *
+sni_index_lookup (struct sni_index *idx, char const *server_name)
+{
+  SNI_NAME key, *ent, *best;
+  char const *p;
+  size_t i;
+
+  key.name = server_name;
+  best = SNI_NAME_RETRIEVE (idx->exact, &key);
+
+  /* "*.SUFFIX" matches any name ending in ".SUFFIX". */
+  for (p = strchr (server_name, '.'); p; p = strchr (p + 1, '.'))
+    {
+      key.name = p;
+      if ((ent = SNI_NAME_RETRIEVE (idx->wildcard, &key)) != NULL
+	  && (best == NULL || ent->rank < best->rank))
+	best = ent;
+    }
+
+  for (i = 0; i < idx->npatterns; i++)
+    {
+      ent = &idx->patterns[i];
+      if (best && ent->rank >= best->rank)
+	break;
+      if (fnmatch (ent->name, server_name, 0) == 0)
+	{
+	  best = ent;
+	  break;
+	}
+    }
+
+  return best ? best->pc : NULL;
+}
+
 static int
-SNI_server_name (SSL *ssl, int *dummy, POUND_CTX_HEAD *ctx_head)
+SNI_server_name (SSL *ssl, int *dummy, LISTENER *lst)
 {
   const char *server_name;
   POUND_CTX *pc;
@@ -3677,33 +4374,12 @@ SNI_server_name (SSL *ssl, int *dummy, POUND_CTX_HEAD *ctx_head)
 
   /* logmsg(LOG_DEBUG, "Received SSL SNI Header for servername %s", servername); */
 
-  SSL_set_SSL_CTX (ssl, NULL);
-  SLIST_FOREACH (pc, ctx_head, next)
+  if ((pc = sni_index_lookup (lst->sni_index, server_name)) == NULL)
     {
-      if (fnmatch (pc->server_name, server_name, 0) == 0)
-	{
-	  /* logmsg(LOG_DEBUG, "Found cert for %s", servername); */
-	  SSL_set_SSL_CTX (ssl, pc->ctx);
-	  return SSL_TLSEXT_ERR_OK;
-	}
-      else if (pc->subjectAltNameCount > 0 && pc->subjectAltNames != NULL)
-	{
-	  int i;
-
-	  for (i = 0; i < pc->subjectAltNameCount; i++)
-	    {
-	      if (fnmatch ((char *) pc->subjectAltNames[i], server_name, 0) ==
-		  0)
-		{
-		  SSL_set_SSL_CTX (ssl, pc->ctx);
-		  return SSL_TLSEXT_ERR_OK;
-		}
-	    }
-	}
+      /* logmsg(LOG_DEBUG, "No match for %s, default used", server_name); */
+      pc = SLIST_FIRST (&lst->ctx_head);
     }
-
-  /* logmsg(LOG_DEBUG, "No match for %s, default used", server_name); */
-  SSL_set_SSL_CTX (ssl, SLIST_FIRST (ctx_head)->ctx);
+  SSL_set_SSL_CTX (ssl, pc->ctx);
   return SSL_TLSEXT_ERR_OK;
 }
 #endif
@@ -3933,17 +4609,93 @@ https_parse_crlist (void *call_data, void *section_data)
 	  return CFGPARSER_FAIL;
 	}
 
-      X509_STORE_set_flags (store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+      X509_STORE_set_flags (store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+    }
+
+  return CFGPARSER_OK;
+}
+
+static int
+https_parse_nohttps11 (void *call_data, void *section_data)
+{
+  LISTENER *lst = call_data;
+  return cfg_assign_int_range (&lst->noHTTPS11, 0, 2);
+}
+
+static int
+https_parse_http2 (void *call_data, void *section_data)
+{
+  LISTENER *lst = call_data;
+
+  if (cfg_assign_bool (&lst->http2, NULL) != CFGPARSER_OK)
+    return CFGPARSER_FAIL;
+#ifndef ENABLE_HTTP2
+  if (lst->http2)
+    {
+      conf_error ("%s", "pound compiled without support for HTTP/2");
+      return CFGPARSER_FAIL;
+    }
+#endif
+  return CFGPARSER_OK;
+}
+
+static int
+https_parse_http2_max_streams (void *call_data, void *section_data)
+{
+  LISTENER *lst = call_data;
+
+  if (cfg_assign_unsigned (&lst->http2_max_streams, NULL) != CFGPARSER_OK)
+    return CFGPARSER_FAIL;
+  if (lst->http2_max_streams == 0)
+    {
+      conf_error ("%s", "value must be positive");
+      return CFGPARSER_FAIL;
+    }
+  return CFGPARSER_OK;
+}
+
+static int
+https_parse_session_cache (void *call_data, void *section_data)
+{
+  LISTENER *lst = call_data;
+  unsigned n;
+
+  if (cfg_assign_unsigned (&n, NULL) != CFGPARSER_OK)
+    return CFGPARSER_FAIL;
+  lst->sess_cache_size = n;
+  return CFGPARSER_OK;
+}
+
+static int
+https_parse_session_timeout (void *call_data, void *section_data)
+{
+  LISTENER *lst = call_data;
+  unsigned n;
+
+  if (cfg_assign_timeout (&n, NULL) != CFGPARSER_OK)
+    return CFGPARSER_FAIL;
+  if (n == 0)
+    {
+      conf_error ("%s", "session timeout must be positive");
+      return CFGPARSER_FAIL;
     }
-
+  lst->sess_timeout = n;
   return CFGPARSER_OK;
 }
 
 static int
-https_parse_nohttps11 (void *call_data, void *section_data)
+https_parse_ticket_key_file (void *call_data, void *section_data)
 {
   LISTENER *lst = call_data;
-  return cfg_assign_int_range (&lst->noHTTPS11, 0, 2);
+  struct token *tok;
+  char *filename;
+
+  if ((tok = gettkn_expect (T_STRING)) == NULL)
+    return CFGPARSER_FAIL;
+  if ((filename = filename_resolve (tok->str)) == NULL)
+    return CFGPARSER_FAIL;
+  ticket_keys_add_file (lst, filename);
+  return CFGPARSER_OK;
 }
 
 static CFGPARSER_TABLE https_parsetab[] = {
@@ -4003,6 +4755,26 @@ static CFGPARSER_TABLE https_parsetab[] = {
     .name = "NoHTTPS11",
     .parser = https_parse_nohttps11
   },
+  {
+    .name = "SSLSessionCache",
+    .parser = https_parse_session_cache
+  },
+  {
+    .name = "SSLSessionTimeout",
+    .parser = https_parse_session_timeout
+  },
+  {
+    .name = "SSLTicketKeyFile",
+    .parser = https_parse_ticket_key_file
+  },
+  {
+    .name = "HTTP2",
+    .parser = https_parse_http2
+  },
+  {
+    .name = "HTTP2MaxStreams",
+    .parser = https_parse_http2_max_streams
+  },
 
   { NULL }
 };
@@ -4117,9 +4889,13 @@ parse_listen_https (void *call_data, void *section_data)
 #ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
   if (!SLIST_EMPTY (&lst->ctx_head))
     {
+      /*
+       * The SNI index is built by listener_sni_index_init after the
+       * certificates have been loaded.
+       */
       SSL_CTX *ctx = SLIST_FIRST (&lst->ctx_head)->ctx;
       if (!SSL_CTX_set_tlsext_servername_callback (ctx, SNI_server_name)
-	  || !SSL_CTX_set_tlsext_servername_arg (ctx, &lst->ctx_head))
+	  || !SSL_CTX_set_tlsext_servername_arg (ctx, lst))
 	{
 	  conf_openssl_error (NULL, "can't set SNI callback");
 	  return CFGPARSER_FAIL;
@@ -4127,19 +4903,59 @@ parse_listen_https (void *call_data, void *section_data)
     }
 #endif
 
+  if (ticket_keys_load (lst))
+    {
+      conf_error_at_locus_range (&range, "can't load ticket keys");
+      return CFGPARSER_FAIL;
+    }
+
   xstringbuf_init (&sb);
+  if (lst->ticket_keys)
+    {
+      /*
+       * Tickets issued by another pound instance or before restart
+       * can be resumed only if the session ID context is the same.
+       * Unnamed listeners are told apart by their address.
+       */
+      if (lst->name)
+	stringbuf_printf (&sb, "Pound-%s", lst->name);
+      else
+	{
+	  char abuf[MAX_ADDR_BUFSIZE];
+	  stringbuf_printf (&sb, "Pound-%s",
+			    addr2str (abuf, sizeof (abuf), &lst->addr, 0));
+	}
+      if (stringbuf_len (&sb) > SSL_MAX_SID_CTX_LENGTH)
+	sb.len = SSL_MAX_SID_CTX_LENGTH;
+    }
   SLIST_FOREACH (pc, &lst->ctx_head, next)
     {
       SSL_CTX_set_app_data (pc->ctx, lst);
       SSL_CTX_set_mode (pc->ctx, SSL_MODE_AUTO_RETRY);
       SSL_CTX_set_options (pc->ctx, lst->ssl_op_enable);
       SSL_CTX_clear_options (pc->ctx, lst->ssl_op_disable);
-      stringbuf_reset (&sb);
-      stringbuf_printf (&sb, "%d-Pound-%ld", getpid (), random ());
+      if (!lst->ticket_keys)
+	{
+	  stringbuf_reset (&sb);
+	  stringbuf_printf (&sb, "%d-Pound-%ld", getpid (), random ());
+	}
       SSL_CTX_set_session_id_context (pc->ctx, (unsigned char *) sb.base,
 				      sb.len);
+      if (lst->sess_cache_size == 0)
+	SSL_CTX_set_session_cache_mode (pc->ctx, SSL_SESS_CACHE_OFF);
+      else if (lst->sess_cache_size > 0)
+	SSL_CTX_sess_set_cache_size (pc->ctx, lst->sess_cache_size);
+      if (lst->sess_timeout > 0)
+	SSL_CTX_set_timeout (pc->ctx, lst->sess_timeout);
+      if (ticket_keys_setup (lst, pc->ctx))
+	{
+	  conf_openssl_error (NULL, "can't set ticket key callback");
+	  return CFGPARSER_FAIL;
+	}
       POUND_SSL_CTX_init (pc->ctx);
       SSL_CTX_set_info_callback (pc->ctx, SSLINFO_callback);
+      if (lst->http2)
+	http2_ctx_init (pc->ctx);
     }
   stringbuf_free (&sb);
 
@@ -4161,6 +4977,30 @@ parse_threads_compat (void *call_data, void *section_data)
   return CFGPARSER_OK;
 }
 
+static int
+parse_http2_max_sessions (void *call_data, void *section_data)
+{
+  if (cfg_assign_unsigned (&http2_max_sessions, section_data) != CFGPARSER_OK)
+    return CFGPARSER_FAIL;
+  if (http2_max_sessions == 0)
+    {
+      conf_error ("%s", "value must be positive");
+      return CFGPARSER_FAIL;
+    }
+  return CFGPARSER_OK;
+}
+
+static int
+parse_event_threads (void *call_data, void *section_data)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  return cfg_assign_unsigned (&event_thread_count, section_data);
+#else
+  conf_error ("%s", "event loop is not supported on this platform");
+  return CFGPARSER_FAIL;
+#endif
+}
+
 static int
 parse_control_socket (void *call_data, void *section_data)
 {
@@ -4485,6 +5325,121 @@ parse_resolver (void *call_data, void *section_data)
   return rc;
 }
 
+static int
+assign_access_log_overflow (void *call_data, void *section_data)
+{
+  static struct kwtab kwtab[] = {
+    { "drop",  ACCESS_LOG_DROP },
+    { "block", ACCESS_LOG_BLOCK },
+    { NULL }
+  };
+  return cfg_assign_int_enum (call_data, gettkn_expect (T_IDENT), kwtab,
+			      "overflow policy");
+}
+
+static CFGPARSER_TABLE access_log_parsetab[] = {
+  {
+    .name = "End",
+    .parser = cfg_parse_end
+  },
+  {
+    .name = "Target",
+    .parser = cfg_assign_string,
+    .off = offsetof (struct access_log_config, target)
+  },
+  {
+    .name = "BufferSize",
+    .parser = cfg_assign_unsigned,
+    .off = offsetof (struct access_log_config, bufsize)
+  },
+  {
+    .name = "Overflow",
+    .parser = assign_access_log_overflow,
+    .off = offsetof (struct access_log_config, overflow)
+  },
+  {
+    .name = "FlushInterval",
+    .parser = cfg_assign_unsigned,
+    .off = offsetof (struct access_log_config, flush_interval)
+  },
+  { NULL }
+};
+
+static int
+parse_access_log (void *call_data, void *section_data)
+{
+  struct access_log_config *cfg = call_data;
+  struct locus_range range;
+  static struct
+  {
+    char const *prefix;
+    int type;
+  } schemes[] = {
+    { "udp://", ACCESS_LOG_UDP },
+    { "tcp://", ACCESS_LOG_TCP },
+    { "file://", ACCESS_LOG_FILE },
+    { NULL }
+  };
+  int i;
+  unsigned n;
+
+  if (parser_loop (access_log_parsetab, cfg, section_data, &range))
+    return CFGPARSER_FAIL;
+
+  if (!cfg->target)
+    {
+      conf_error_at_locus_range (&range, "%s", "Target statement missing");
+      return CFGPARSER_FAIL;
+    }
+
+  if (strcmp (cfg->target, "-") == 0)
+    cfg->type = ACCESS_LOG_STDOUT;
+  else
+    {
+      cfg->type = ACCESS_LOG_FILE;
+      cfg->name = cfg->target;
+      for (i = 0; schemes[i].prefix; i++)
+	{
+	  size_t len = strlen (schemes[i].prefix);
+	  if (strncmp (cfg->target, schemes[i].prefix, len) == 0)
+	    {
+	      cfg->type = schemes[i].type;
+	      cfg->name = cfg->target + len;
+	      break;
+	    }
+	}
+      if (*cfg->name == 0)
+	{
+	  conf_error_at_locus_range (&range, "%s", "empty access log target");
+	  return CFGPARSER_FAIL;
+	}
+    }
+
+  if (cfg->bufsize < 4096)
+    cfg->bufsize = 4096;
+  /* Round buffer size up to the nearest power of 2. */
+  for (n = 4096; n < cfg->bufsize; n <<= 1)
+    {
+      if (n > UINT_MAX / 2)
+	{
+	  conf_error_at_locus_range (&range, "%s", "buffer size too big");
+	  return CFGPARSER_FAIL;
+	}
+    }
+  cfg->bufsize = n;
+
+  if (cfg->flush_interval == 0)
+    cfg->flush_interval = 1;
+
+  return CFGPARSER_OK;
+}
+
+/*
+ * Number of threads to use for loading certificates and resolving
+ * backend host names at startup.  0 means number of online CPUs.
+ */
+static unsigned startup_thread_count;
+
 static CFGPARSER_TABLE top_level_parsetab[] = {
   {
     .name = "IncludeDir",
@@ -4534,6 +5489,19 @@ static CFGPARSER_TABLE top_level_parsetab[] = {
     .parser = cfg_assign_timeout,
     .data = &worker_idle_timeout
   },
+  {
+    .name = "EventThreads",
+    .parser = parse_event_threads
+  },
+  {
+    .name = "HTTP2MaxSessions",
+    .parser = parse_http2_max_sessions
+  },
+  {
+    .name = "StartupThreads",
+    .parser = cfg_assign_unsigned,
+    .data = &startup_thread_count
+  },
   {
     .name = "Grace",
     .parser = cfg_assign_timeout,
@@ -4558,6 +5526,11 @@ static CFGPARSER_TABLE top_level_parsetab[] = {
     .parser = cfg_assign_string,
     .data = &syslog_tag
   },
+  {
+    .name = "AccessLog",
+    .parser = parse_access_log,
+    .data = &access_log_config
+  },
   {
     .name = "Alive",
     .parser = cfg_assign_timeout,
@@ -4783,6 +5756,226 @@ backend_matrix_to_regular (struct be_matrix *mtx, struct addrinfo *addr,
   reg->ws_to = mtx->ws_to;
   reg->ctx = mtx->ctx;
   reg->servername = mtx->servername;
+  reg->pool.max_idle = mtx->pool_size;
+  reg->pool.idle_to = mtx->pool_to;
+  reg->health.conf = mtx->health_check;
+  reg->health.last_ok = -1;
+}
+
+/*
+ * Startup thread pool.
+ */
+
+struct parallel_closure
+{
+  char *base;                /* Array of jobs. */
+  size_t nmemb;              /* Number of elements in it. */
+  size_t size;               /* Size of each element. */
+  void (*func) (void *);     /* Job function. */
+  size_t next;               /* Index of the next job to run. */
+};
+
+static void *
+parallel_worker (void *data)
+{
+  struct parallel_closure *clos = data;
+  size_t i;
+
+  while ((i = __atomic_fetch_add (&clos->next, 1, __ATOMIC_RELAXED))
+	 < clos->nmemb)
+    clos->func (clos->base + i * clos->size);
+  return NULL;
+}
+
+/*
+ * Call FUNC for each of NMEMB elements of SIZE bytes in array BASE.
+ * The calls are distributed among at most startup_thread_count threads,
+ * the calling one included.  Return when all of them have finished.
+ */
+static void
+parallel_run (void *base, size_t nmemb, size_t size, void (*func) (void *))
+{
+  struct parallel_closure clos = {
+    .base = base,
+    .nmemb = nmemb,
+    .size = size,
+    .func = func
+  };
+  size_t nthr, i;
+  pthread_t *tid;
+
+  if ((nthr = startup_thread_count) == 0)
+    {
+      long n = sysconf (_SC_NPROCESSORS_ONLN);
+      nthr = n > 0 ? n : 1;
+    }
+  if (nthr > nmemb)
+    nthr = nmemb;
+  if (nthr == 0)
+    return;
+
+  tid = xcalloc (nthr - 1, sizeof (tid[0]));
+  for (i = 0; i < nthr - 1; i++)
+    {
+      int rc;
+      if ((rc = pthread_create (&tid[i], NULL, parallel_worker, &clos)) != 0)
+	{
+	  /* Not critical: remaining jobs are run by the threads created. */
+	  logmsg (LOG_WARNING, "can't create startup thread: %s",
+		  strerror (rc));
+	  break;
+	}
+    }
+  parallel_worker (&clos);
+  while (i > 0)
+    pthread_join (tid[--i], NULL);
+  free (tid);
+}
+
+/*
+ * Host name cache.  Before finalizing services, the host names of all
+ * backends that are to be resolved immediately are resolved in parallel
+ * (see host_cache_fill).  Backend_resolve then takes results from the
+ * cache.
+ */
+struct host_job
+{
+  char *hostname;            /* Host name to resolve. */
+  int family;                /* Address family. */
+  int rc;                    /* Return from get_host. */
+  struct addrinfo addr;      /* Resulting address, if rc == 0. */
+};
+
+static struct host_job *host_cache;
+static size_t host_cache_count, host_cache_max;
+
+static int
+host_job_cmp (void const *a, void const *b)
+{
+  struct host_job const *ja = a, *jb = b;
+  int rc = strcmp (ja->hostname, jb->hostname);
+  return rc ? rc : ja->family - jb->family;
+}
+
+static void
+host_job_run (void *data)
+{
+  struct host_job *job = data;
+  job->rc = get_host (job->hostname, &job->addr, job->family);
+}
+
+static void
+host_cache_add (struct be_matrix *mtx)
+{
+  struct host_job *job;
+
+  if (mtx->hostname == NULL
+      || mtx->hostname[0] == '/'
+      || mtx->resolve_mode != bres_immediate
+      || str_is_ip (mtx->hostname))
+    return;
+  if (host_cache_count == host_cache_max)
+    host_cache = x2nrealloc (host_cache, &host_cache_max,
+			     sizeof (host_cache[0]));
+  job = &host_cache[host_cache_count++];
+  job->hostname = xstrdup (mtx->hostname);
+  job->family = mtx->family;
+}
+
+static int
+host_cache_collect (SERVICE *svc, void *data)
+{
+  NAMED_BACKEND_TABLE *tab = data;
+  BALANCER *bal;
+  BACKEND *be;
+
+  DLIST_FOREACH (bal, &svc->balancers, link)
+    {
+      DLIST_FOREACH (be, &bal->backends, link)
+	{
+	  if (be->be_type == BE_MATRIX)
+	    host_cache_add (&be->v.mtx);
+	  else if (be->be_type == BE_BACKEND_REF)
+	    {
+	      NAMED_BACKEND *nb = named_backend_retrieve (tab, be->v.be_name);
+	      if (nb)
+		host_cache_add (&nb->bemtx);
+	    }
+	}
+    }
+  return 0;
+}
+
+/*
+ * Resolve in parallel host names of all backends declared in the
+ * configuration.  Return the number of names resolved.
+ */
+static size_t
+host_cache_fill (NAMED_BACKEND_TABLE *tab)
+{
+  size_t i, j;
+
+  /* Without DNS, get_host does numeric conversion only. */
+  if (!feature_is_set (FEATURE_DNS))
+    return 0;
+
+  foreach_service (host_cache_collect, tab);
+  if (host_cache_count == 0)
+    return 0;
+
+  /* Remove duplicates. */
+  qsort (host_cache, host_cache_count, sizeof (host_cache[0]), host_job_cmp);
+  for (i = j = 1; i < host_cache_count; i++)
+    if (host_job_cmp (&host_cache[j-1], &host_cache[i]))
+      host_cache[j++] = host_cache[i];
+    else
+      free (host_cache[i].hostname);
+  host_cache_count = j;
+
+  parallel_run (host_cache, host_cache_count, sizeof (host_cache[0]),
+		host_job_run);
+  return host_cache_count;
+}
+
+static void
+host_cache_free (void)
+{
+  size_t i;
+
+  for (i = 0; i < host_cache_count; i++)
+    {
+      free (host_cache[i].hostname);
+      if (host_cache[i].rc == 0)
+	free (host_cache[i].addr.ai_addr);
+    }
+  free (host_cache);
+  host_cache = NULL;
+  host_cache_count = host_cache_max = 0;
+}
+
+/*
+ * Same as get_host, but consult the host cache first.
+ */
+static int
+resolve_host (char const *name, struct addrinfo *res, int family)
+{
+  struct host_job key, *job;
+
+  key.hostname = (char *) name;
+  key.family = family;
+  job = host_cache_count
+	  ? bsearch (&key, host_cache, host_cache_count,
+		     sizeof (host_cache[0]), host_job_cmp)
+	  : NULL;
+  if (job == NULL)
+    return get_host (name, res, family);
+  if (job->rc == 0)
+    {
+      *res = job->addr;
+      res->ai_addr = xmalloc (job->addr.ai_addrlen);
+      memcpy (res->ai_addr, job->addr.ai_addr, job->addr.ai_addrlen);
+    }
+  return job->rc;
 }
 
 static int
@@ -4792,7 +5985,7 @@ backend_resolve (BACKEND *be)
   struct be_regular reg;
   char *hostname = be->v.mtx.hostname;
 
-  if (get_host (hostname, &addr, be->v.mtx.family))
+  if (resolve_host (hostname, &addr, be->v.mtx.family))
     {
       /* if we can't resolve it, assume this is a UNIX domain socket */
       struct sockaddr_un *sun;
@@ -4819,6 +6012,7 @@ backend_resolve (BACKEND *be)
   backend_matrix_to_regular (&be->v.mtx, &addr, &reg);
   free (hostname);
   be->v.reg = reg;
+  backend_pool_init (&be->v.reg.pool);
   be->be_type = BE_REGULAR;
   be->refcount = 1;
   return 0;
@@ -4901,6 +6095,7 @@ backend_finalize (BACKEND *be, NAMED_BACKEND_TABLE *tab)
 	{
 	  if (backend_resolve (be))
 	    return -1;
+	  backend_health_check_start (be);
 	}
       else
 	{
@@ -5016,7 +6211,7 @@ service_finalize (SERVICE *svc, void *data)
 				 svc->locus_str);
     }
 
-  service_lb_init (svc);
+  service_lb_update (svc);
 
   return 0;
 }
@@ -5128,10 +6323,71 @@ listener_pass_file_fixup (LISTENER *lstn, void *data)
   return pass_file_fixup (&lstn->rewrite[REWRITE_REQUEST]);
 }
 
+static int
+listener_sni_index_init (LISTENER *lst, void *data)
+{
+#ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
+  if (!SLIST_EMPTY (&lst->ctx_head))
+    lst->sni_index = sni_index_build (&lst->ctx_head);
+#endif
+  return 0;
+}
+
+/*
+ * Run queued certificate loading jobs.  Report errors, if any, and
+ * return the number of failed jobs.
+ */
+static int
+cert_jobs_run (void)
+{
+  size_t i;
+  int err = 0;
+
+  parallel_run (cert_jobs, cert_job_count, sizeof (cert_jobs[0]),
+		cert_job_run);
+
+  for (i = 0; i < cert_job_count; i++)
+    {
+      struct cert_job *job = &cert_jobs[i];
+
+      if (stringbuf_len (&job->err))
+	{
+	  char *p, *q;
+
+	  for (p = stringbuf_finish (&job->err); *p; p = q)
+	    {
+	      q = strchr (p, '\n');
+	      *q++ = 0;
+	      conf_error_at_locus_range (&job->locus, "%s", p);
+	    }
+	  err++;
+	}
+      stringbuf_free (&job->err);
+      free (job->filename);
+    }
+  free (cert_jobs);
+  cert_jobs = NULL;
+  cert_job_count = cert_job_max = 0;
+  return err;
+}
+
+/* Return milliseconds elapsed since *TS and update it to current time. */
+static double
+phase_time (struct timespec *ts)
+{
+  struct timespec now, diff;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  diff = timespec_sub (&now, ts);
+  *ts = now;
+  return diff.tv_sec * 1e3 + diff.tv_nsec / 1e6;
+}
+
 int
 parse_config_file (char const *file, int nosyslog)
 {
   int res = -1;
+  struct timespec ts;
   POUND_DEFAULTS pound_defaults = {
     .log_level = 1,
     .facility = LOG_DAEMON,
@@ -5152,11 +6408,22 @@ parse_config_file (char const *file, int nosyslog)
   if (cfgparser_open (file, NULL))
     return -1;
 
+  clock_gettime (CLOCK_MONOTONIC, &ts);
   res = parser_loop (top_level_parsetab, &pound_defaults, &pound_defaults, NULL);
   if (res == 0)
     {
+      size_t ncerts, nhosts;
+      double t_parse, t_certs, t_hosts;
+
       if (cur_input)
 	return -1;
+      t_parse = phase_time (&ts);
+
+      ncerts = cert_job_count;
+      if (cert_jobs_run ())
+	return -1;
+      foreach_listener (listener_sni_index_init, NULL);
+      t_certs = phase_time (&ts);
 
       if (forbid_ssl_usage (&services,
 			    "use of SSL features in top-level sections"
@@ -5165,9 +6432,13 @@ parse_config_file (char const *file, int nosyslog)
 #ifdef ENABLE_DYNAMIC_BACKENDS
       resolver_set_config (&pound_defaults.resolver);
 #endif
-      if (foreach_service (service_finalize,
-			   &pound_defaults.named_backend_table))
+      nhosts = host_cache_fill (&pound_defaults.named_backend_table);
+      res = foreach_service (service_finalize,
+			     &pound_defaults.named_backend_table);
+      host_cache_free ();
+      if (res)
 	return -1;
+      t_hosts = phase_time (&ts);
       if (worker_min_count > worker_max_count)
 	abend ("WorkerMinCount is greater than WorkerMaxCount");
       if (!nosyslog)
@@ -5176,6 +6447,14 @@ parse_config_file (char const *file, int nosyslog)
       if (foreach_listener (listener_pass_file_fixup, NULL)
 	  || foreach_service (service_pass_file_fixup, NULL))
 	return -1;
+
+      service_index_build ();
+      foreach_listener (listener_static_responses_init, NULL);
+
+      logmsg (LOG_DEBUG, "startup times: parsing %.3f ms;"
+	      " certificates (%zu) %.3f ms; backends (%zu host names) %.3f ms;"
+	      " other %.3f ms",
+	      t_parse, ncerts, t_certs, nhosts, t_hosts, phase_time (&ts));
     }
   named_backend_table_free (&pound_defaults.named_backend_table);
   cfgparser_finish (root_jail || daemonize);
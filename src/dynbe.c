@@ -74,7 +74,6 @@ static void service_matrix_srv_update_backends (SERVICE *svc, BACKEND *mtx,
 						struct dns_response *resp);
 static void job_resolver (enum job_ctl ctl, void *arg,
 			  const struct timespec *ts);
-static void start_backend_removal (SERVICE *svc);
 
 static JOB_ID
 job_enqueue_resolver (struct timespec *ts, BACKEND *be)
@@ -83,27 +82,29 @@ job_enqueue_resolver (struct timespec *ts, BACKEND *be)
   return job_enqueue (ts, job_resolver, be);
 }
 
-static int
-backend_matrix_addr_update (BACKEND *be)
+/*
+ * Common part of the lookup callbacks.  Apply response RESP with status
+ * RC to the matrix backend BE using the UPDATE function.
+ */
+static void
+backend_matrix_apply (BACKEND *be, int rc, struct dns_response *resp,
+		      enum dns_resp_type type,
+		      void (*update) (SERVICE *, BACKEND *,
+				      struct dns_response *))
 {
-  int rc = 0;
-  struct dns_response *resp;
   struct timespec ts;
 
-  switch (dns_addr_lookup (be->v.mtx.hostname, be->v.mtx.family, &resp))
+  switch (rc)
     {
     case dns_not_found:
-      resp = dns_not_found_response_alloc (dns_resp_addr, be);
+      resp = dns_not_found_response_alloc (type, be);
       if (!resp)
-	{
-	  rc = 1;
-	  break;
-	}
+	break;
       /* fall through */
     case dns_success:
       if (be->v.mtx.override_ttl)
 	response_override_ttl (resp, be->v.mtx.override_ttl);
-      service_matrix_addr_update_backends (be->service, be, resp);
+      update (be->service, be, resp);
       dns_response_free (resp);
       break;
 
@@ -114,67 +115,52 @@ backend_matrix_addr_update (BACKEND *be)
 
     case dns_failure:
       //FIXME
-      rc = 1;
+      break;
     }
-  return rc;
 }
 
-static int
-backend_matrix_srv_update (BACKEND *be)
+static void
+backend_matrix_addr_cb (int rc, struct dns_response *resp, void *data)
 {
-  int rc = 0;
-  struct dns_response *resp;
-  struct timespec ts;
-
-  switch (dns_srv_lookup (be->v.mtx.hostname, &resp))
-    {
-    case dns_not_found:
-      resp = dns_not_found_response_alloc (dns_resp_srv, be);
-      if (!resp)
-	{
-	  rc = 1;
-	  break;
-	}
-      /* fall through */
-    case dns_success:
-      if (be->v.mtx.override_ttl)
-	response_override_ttl (resp, be->v.mtx.override_ttl);
-      service_matrix_srv_update_backends (be->service, be, resp);
-      dns_response_free (resp);
-      break;
-
-    case dns_temp_failure:
-      get_negative_expire_time (&ts, be);
-      job_enqueue_resolver (&ts, be);
-      break;
+  BACKEND *be = data;
+  backend_matrix_apply (be, rc, resp, dns_resp_addr,
+			service_matrix_addr_update_backends);
+  backend_unref (be);
+}
 
-    case dns_failure:
-      //FIXME
-      rc = 1;
-    }
-  return rc;
+static void
+backend_matrix_srv_cb (int rc, struct dns_response *resp, void *data)
+{
+  BACKEND *be = data;
+  backend_matrix_apply (be, rc, resp, dns_resp_srv,
+			service_matrix_srv_update_backends);
+  backend_unref (be);
 }
 
-static int
+/*
+ * Start updating the matrix backend BE.  The lookup is asynchronous:
+ * the backends are updated when the answer arrives.  The matrix is
+ * referenced until then.
+ */
+static void
 backend_matrix_update (BACKEND *be)
 {
-  int rc = -1;
-
+  backend_ref (be);
   switch (be->v.mtx.resolve_mode)
     {
     case bres_first:
     case bres_all:
-      rc = backend_matrix_addr_update (be);
+      dns_addr_lookup_async (be->v.mtx.hostname, be->v.mtx.family,
+			     backend_matrix_addr_cb, be);
       break;
 
     case bres_srv:
-      rc = backend_matrix_srv_update (be);
+      dns_srv_lookup_async (be->v.mtx.hostname, backend_matrix_srv_cb, be);
       break;
 
     default:
       abort ();
     }
-  return rc;
 }
 
 static void
@@ -372,16 +358,15 @@ backend_sweep (BACKEND *be, void *data)
 	  abort ();
 	}
 
-      /* If a load balancer stored this backend as current, reset it. */
-      service_lb_reset (svc, be);
+      /* Remove backend from the hash table. */
+      backend_table_delete (tab, be);
 
       /*
-       * Remove backend from the hash table and decrement its refcount.
+       * Add it to the list of backends to be removed.  The reference
+       * held by the table is dropped after the next update of the
+       * backend selection snapshot, when no thread can select it any
+       * more (see service_lb_update).
        */
-      backend_table_delete (tab, be);
-      be->refcount--;
-
-      /* Add it to the list of backends to be removed. */
       DLIST_INSERT_TAIL (&svc->be_rem_head, be, link);
 
       be->mark = 0;
@@ -459,6 +444,7 @@ service_matrix_addr_update_backends (SERVICE *svc,
 		  break;
 		}
 	      backend_matrix_to_regular (&mtx->v.mtx, &ai, &be->v.reg);
+	      backend_pool_init (&be->v.reg.pool);
 	      be->service = mtx->service;
 	      be->locus_str = mtx->locus_str;
 	      be->disabled = mtx->disabled;
@@ -468,15 +454,14 @@ service_matrix_addr_update_backends (SERVICE *svc,
 		 table. */
 	      balancer_add_backend (balancer, be);
 	      backend_table_insert (mtx->v.mtx.betab, be);
+	      backend_health_check_start (be);
 	    }
 	}
 
       /* Remove all unreferenced backends. */
       backend_table_foreach (mtx->v.mtx.betab, backend_sweep, mtx->v.mtx.betab);
       balancer_recompute_pri_unlocked (balancer, NULL, NULL);
-
-      if (!DLIST_EMPTY (&svc->be_rem_head))
-	start_backend_removal (svc);
+      service_lb_update (svc);
 
       /* Reschedule next update. */
       ts.tv_sec = resp->expires;
@@ -641,6 +626,7 @@ service_matrix_srv_update_backends (SERVICE *svc, BACKEND *mtx,
 		      be->v.mtx.ctx = mtx->v.mtx.ctx;
 		      be->v.mtx.servername = mtx->v.mtx.servername;
 		      be->v.mtx.override_ttl = mtx->v.mtx.override_ttl;
+		      be->v.mtx.health_check = mtx->v.mtx.health_check;
 		      be->v.mtx.betab = backend_table_new ();
 		      if (!be->v.mtx.betab)
 			{
@@ -699,6 +685,7 @@ backend_matrix_init (BACKEND *be)
 void
 backend_matrix_disable (BACKEND *be, int disable_mode)
 {
+  pthread_mutex_lock (&be->service->mut);
   if (disable_mode == BE_ENABLE)
     {
       if (be->disabled)
@@ -721,13 +708,7 @@ backend_matrix_disable (BACKEND *be, int disable_mode)
       be->disabled = 1;
       service_recompute_pri_unlocked (be->service, NULL, NULL);
     }
-}
-
-static void
-backend_remover_cleanup (void *ptr)
-{
-  SERVICE *svc = ptr;
-  pthread_mutex_unlock (&svc->mut);
+  pthread_mutex_unlock (&be->service->mut);
 }
 
 static void
@@ -736,6 +717,9 @@ backend_release (BACKEND *be)
   switch (be->be_type)
     {
     case BE_REGULAR:
+      backend_pool_free (&be->v.reg.pool);
+      if (be->v.reg.tls_session)
+	SSL_SESSION_free (be->v.reg.tls_session);
       free (be->v.reg.addr.ai_addr);
       break;
 
@@ -751,45 +735,6 @@ backend_release (BACKEND *be)
   free (be);
 }
 
-static void *
-thr_backend_remover (void *arg)
-{
-  SERVICE *svc = arg;
-  pthread_mutex_lock (&svc->mut);
-  pthread_cleanup_push (backend_remover_cleanup, svc);
-  for (;;)
-    {
-      BACKEND *be, *tmp;
-
-      DLIST_FOREACH_SAFE (be, tmp, &svc->be_rem_head, link)
-	{
-	  int refcount;
-	  pthread_mutex_lock (&be->mut);
-	  refcount = be->refcount;
-	  pthread_mutex_unlock (&be->mut);
-	  if (refcount == 0)
-	    {
-	      DLIST_REMOVE (&svc->be_rem_head, be, link);
-	      backend_release (be);
-	    }
-	}
-
-      if (DLIST_EMPTY (&svc->be_rem_head))
-	break;
-
-      pthread_cond_wait (&svc->be_rem_cond, &svc->mut);
-    }
-  pthread_cleanup_pop (1);
-  return NULL;
-}
-
-static void
-start_backend_removal (SERVICE *svc)
-{
-  pthread_t tid;
-  pthread_create (&tid, &thread_attr_detached, thr_backend_remover, svc);
-}
-
 void
 backend_ref (BACKEND *be)
 {
@@ -801,16 +746,21 @@ backend_ref (BACKEND *be)
     }
 }
 
+/*
+ * Decrease the reference count of BE.  Free it when it drops to 0.
+ */
 void
 backend_unref (BACKEND *be)
 {
   if (be)
     {
+      unsigned long refcount;
+
       pthread_mutex_lock (&be->mut);
       assert (be->refcount > 0);
-      be->refcount--;
-      if (be->refcount == 0)
-	pthread_cond_signal (&be->service->be_rem_cond);
+      refcount = --be->refcount;
       pthread_mutex_unlock (&be->mut);
+      if (refcount == 0)
+	backend_release (be);
     }
 }
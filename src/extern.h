@@ -29,6 +29,8 @@ extern char *user,		/* user to run as */
 extern unsigned worker_min_count; /* min. number of worker threads */
 extern unsigned worker_max_count; /* max. number of worker threads */
 extern unsigned worker_idle_timeout;
+extern unsigned http2_max_sessions; /* max. number of HTTP/2 sessions */
+extern unsigned event_thread_count; /* number of event loop threads */
 
 extern unsigned grace;		/* grace period before shutdown */
 
@@ -40,6 +42,7 @@ extern int log_facility;	/* log facility to use */
 extern int print_log;           /* print log messages to stdout/stderr during
 				   startup */
 extern int enable_backend_stats;
+extern struct access_log_config access_log_config;
 
 extern GENPAT HEADER,	/* Allowed header */
   CONN_UPGRD,			/* upgrade in connection header */
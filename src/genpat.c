@@ -307,7 +307,7 @@ struct genpat_defn exact_genpat_defn =
     .gp_nsub = substr_num_submatch,
     .gp_free = substr_free
   };
-
+
 /*
  * Substring match (-contain).
  * Implements Boyer–Moore string search algorithm.
@@ -528,3 +528,458 @@ struct genpat_defn contain_genpat_defn =
     .gp_nsub = substr_num_submatch,
     .gp_free = strstr_free
   };
+
+/*
+ * Pattern sets.
+ *
+ * A pattern set combines any number of literal patterns (exact, prefix,
+ * suffix and substring ones) with the same case sensitivity into a single
+ * Aho-Corasick automaton.  A single pass over the subject string finds
+ * all patterns that match it.
+ */
+
+struct patset_member
+{
+  int type;             /* Pattern type: GENPAT_EXACT, GENPAT_PREFIX, etc. */
+  char *pattern;        /* Pattern string, as supplied. */
+  size_t len;           /* Length of the pattern. */
+  size_t group;         /* Group number (see genpat_set_compile). */
+  size_t next;          /* Next member ending in the same state (1-based). */
+};
+
+struct patset_edge
+{
+  unsigned char ch;     /* Input character. */
+  size_t state;         /* Target state. */
+  size_t next;          /* Next edge leaving the same state (1-based). */
+};
+
+struct patset_state
+{
+  size_t edges;         /* First outgoing edge (1-based). */
+  size_t fail;          /* Failure link. */
+  size_t out;           /* First member ending in this state (1-based). */
+  size_t dict;          /* Nearest state on the failure chain having
+			   members, 0 if none. */
+};
+
+struct patset
+{
+  int ci;                        /* Case-insensitivity flag. */
+  size_t memc;                   /* Number of members. */
+  struct patset_member *memv;    /* Members. */
+  size_t groupc;                 /* Number of groups. */
+  size_t empty;                  /* Members with empty pattern (1-based). */
+  int anchored;                  /* True if all members are anchored at
+				    the start of the subject. */
+  size_t maxlen;                 /* Max. length of an anchored pattern. */
+
+  size_t root[UCHAR_MAX + 1];    /* Transitions from the root state. */
+  struct patset_state *statev;   /* States; 0 is the root. */
+  size_t statec;
+  size_t statemax;
+  struct patset_edge *edgev;     /* Edges. */
+  size_t edgec;
+  size_t edgemax;
+};
+
+#define PSC(ps,c) ((ps)->ci ? casemap[(unsigned char)c] : (unsigned char) c)
+
+static size_t
+patset_goto (struct patset *ps, size_t state, unsigned char c)
+{
+  size_t e;
+
+  if (state == 0)
+    return ps->root[c];
+  for (e = ps->statev[state].edges; e; e = ps->edgev[e-1].next)
+    if (ps->edgev[e-1].ch == c)
+      return ps->edgev[e-1].state;
+  return 0;
+}
+
+static size_t
+patset_new_state (struct patset *ps)
+{
+  if (ps->statec == ps->statemax)
+    ps->statev = x2nrealloc (ps->statev, &ps->statemax,
+			     sizeof (ps->statev[0]));
+  memset (&ps->statev[ps->statec], 0, sizeof (ps->statev[0]));
+  return ps->statec++;
+}
+
+static size_t
+patset_add_edge (struct patset *ps, size_t state, unsigned char c)
+{
+  size_t n = patset_new_state (ps);
+
+  if (state == 0)
+    ps->root[c] = n;
+  else
+    {
+      if (ps->edgec == ps->edgemax)
+	ps->edgev = x2nrealloc (ps->edgev, &ps->edgemax,
+				sizeof (ps->edgev[0]));
+      ps->edgev[ps->edgec].ch = c;
+      ps->edgev[ps->edgec].state = n;
+      ps->edgev[ps->edgec].next = ps->statev[state].edges;
+      ps->statev[state].edges = ++ps->edgec;
+    }
+  return n;
+}
+
+static void
+patset_insert (struct patset *ps, size_t i)
+{
+  struct patset_member *mp = &ps->memv[i];
+  size_t state = 0, j;
+
+  if (mp->len == 0)
+    {
+      mp->next = ps->empty;
+      ps->empty = i + 1;
+      return;
+    }
+
+  for (j = 0; j < mp->len; j++)
+    {
+      unsigned char c = PSC (ps, mp->pattern[j]);
+      size_t next = patset_goto (ps, state, c);
+      if (next == 0)
+	next = patset_add_edge (ps, state, c);
+      state = next;
+    }
+  mp->next = ps->statev[state].out;
+  ps->statev[state].out = i + 1;
+}
+
+/* Compute failure and dictionary links in breadth-first order. */
+static void
+patset_link (struct patset *ps)
+{
+  size_t *queue = xcalloc (ps->statec, sizeof (queue[0]));
+  size_t head = 0, tail = 0;
+  int c;
+
+  for (c = 0; c <= UCHAR_MAX; c++)
+    if (ps->root[c])
+      queue[tail++] = ps->root[c];
+
+  while (head < tail)
+    {
+      size_t r = queue[head++];
+
+      for (c = 0; c <= UCHAR_MAX; c++)
+	{
+	  size_t u, f, t;
+
+	  if ((u = patset_goto (ps, r, c)) == 0)
+	    continue;
+	  queue[tail++] = u;
+
+	  f = ps->statev[r].fail;
+	  while ((t = patset_goto (ps, f, c)) == 0 && f != 0)
+	    f = ps->statev[f].fail;
+	  ps->statev[u].fail = t;
+	  ps->statev[u].dict = ps->statev[t].out ? t : ps->statev[t].dict;
+	}
+    }
+  free (queue);
+}
+
+static int
+patset_member_match (struct patset_member *mp, size_t end, size_t slen)
+{
+  switch (mp->type)
+    {
+    case GENPAT_EXACT:
+      return end == mp->len && end == slen;
+
+    case GENPAT_PREFIX:
+      return end == mp->len;
+
+    case GENPAT_SUFFIX:
+      return end == slen;
+
+    default:
+      return 1;
+    }
+}
+
+/*
+ * Scan the subject string SUBJ, calling FN for each member of the set
+ * that matches it, with its index (in the order the patterns were given
+ * to genpat_set_compile) as the first argument.  FN can be called more
+ * than once for a substring pattern that occurs several times.  If FN
+ * returns non-zero, the scan stops.
+ *
+ * Return 0 if the scan has been stopped by FN, 1 otherwise.
+ */
+static int
+patset_scan (struct patset *ps, char const *subj,
+	     int (*fn) (size_t, void *), void *data)
+{
+  size_t slen = strlen (subj);
+  size_t i, m, state = 0;
+
+  for (m = ps->empty; m; m = ps->memv[m-1].next)
+    if (patset_member_match (&ps->memv[m-1], 0, slen) && fn (m - 1, data))
+      return 0;
+
+  for (i = 0; i < slen; i++)
+    {
+      unsigned char c;
+      size_t t, o;
+
+      if (ps->anchored && i >= ps->maxlen)
+	break;
+
+      c = PSC (ps, subj[i]);
+      while ((t = patset_goto (ps, state, c)) == 0 && state != 0)
+	state = ps->statev[state].fail;
+      state = t;
+
+      for (o = ps->statev[state].out ? state : ps->statev[state].dict; o;
+	   o = ps->statev[o].dict)
+	{
+	  for (m = ps->statev[o].out; m; m = ps->memv[m-1].next)
+	    {
+	      struct patset_member *mp = &ps->memv[m-1];
+	      if (patset_member_match (mp, i + 1, slen) && fn (m - 1, data))
+		return 0;
+	    }
+	}
+    }
+  return 1;
+}
+
+static int
+patset_any (size_t n, void *data)
+{
+  return 1;
+}
+
+static int
+patset_exec (void *gp_data, const char *subj, size_t n, POUND_REGMATCH *prm)
+{
+  return patset_scan (gp_data, subj, patset_any, NULL);
+}
+
+static void
+patset_free (void *gp_data)
+{
+  struct patset *ps = gp_data;
+  size_t i;
+
+  for (i = 0; i < ps->memc; i++)
+    free (ps->memv[i].pattern);
+  free (ps->memv);
+  free (ps->statev);
+  free (ps->edgev);
+  free (ps);
+}
+
+static struct genpat_defn patset_genpat_defn =
+  {
+    .gp_error = substr_error,
+    .gp_exec = patset_exec,
+    .gp_nsub = substr_num_submatch,
+    .gp_free = patset_free
+  };
+
+/*
+ * Compile N literal PATTERNS of given TYPES (GENPAT_EXACT, GENPAT_PREFIX,
+ * GENPAT_SUFFIX or GENPAT_CONTAIN) into a single pattern set.  The set
+ * matches a subject if any of its members does.  Only the GENPAT_ICASE
+ * bit of PFLAGS is meaningful.
+ *
+ * GROUPS, if not NULL, assigns each pattern a group number.  Groups must
+ * be numbered consecutively from 0, in non-decreasing order.  If GROUPS
+ * is NULL, each pattern forms a group of its own.
+ */
+int
+genpat_set_compile (GENPAT *retval, size_t n, int const *types,
+		    char const *const *patterns, size_t const *groups,
+		    int pflags)
+{
+  GENPAT gp;
+  struct patset *ps;
+  size_t i;
+
+  XZALLOC (ps);
+  ps->ci = pflags & GENPAT_ICASE;
+  ps->memc = n;
+  ps->memv = xcalloc (n, sizeof (ps->memv[0]));
+  ps->anchored = 1;
+  patset_new_state (ps);
+
+  for (i = 0; i < n; i++)
+    {
+      struct patset_member *mp = &ps->memv[i];
+
+      assert (types[i] == GENPAT_EXACT || types[i] == GENPAT_PREFIX
+	      || types[i] == GENPAT_SUFFIX || types[i] == GENPAT_CONTAIN);
+      mp->type = types[i];
+      mp->pattern = xstrdup (patterns[i]);
+      mp->len = strlen (mp->pattern);
+      mp->group = groups ? groups[i] : i;
+      if (mp->group >= ps->groupc)
+	ps->groupc = mp->group + 1;
+      if (mp->type == GENPAT_EXACT || mp->type == GENPAT_PREFIX)
+	{
+	  if (mp->len > ps->maxlen)
+	    ps->maxlen = mp->len;
+	}
+      else
+	ps->anchored = 0;
+      patset_insert (ps, i);
+    }
+  patset_link (ps);
+
+  XZALLOC (gp);
+  gp->vtab = &patset_genpat_defn;
+  gp->data = ps;
+  *retval = gp;
+  return 0;
+}
+
+/*
+ * Match SUBJ against the pattern set P, calling FN for each pattern that
+ * matches, as described in the comment to patset_scan.  Return 0 if FN
+ * stopped the scan, 1 otherwise, and -1 if P is not a pattern set.
+ */
+int
+genpat_set_scan (GENPAT p, char const *subj,
+		 int (*fn) (size_t, void *), void *data)
+{
+  GENPAT_ASSERT (p);
+  if (p->vtab != &patset_genpat_defn)
+    return -1;
+  return patset_scan (p->data, subj, fn, data);
+}
+
+struct patset_min_group
+{
+  struct patset *ps;
+  size_t group;
+};
+
+static int
+patset_min_group (size_t i, void *data)
+{
+  struct patset_min_group *mg = data;
+  size_t group = mg->ps->memv[i].group;
+
+  if (group < mg->group)
+    mg->group = group;
+  return group == 0;
+}
+
+/*
+ * Match SUBJ against the pattern set P.  On match, store in *GROUP the
+ * lowest group number of the matching members and return 0.  Return 1
+ * if SUBJ doesn't match, and -1 if P is not a pattern set.
+ */
+int
+genpat_set_match_group (GENPAT p, char const *subj, size_t *group)
+{
+  struct patset_min_group mg;
+
+  GENPAT_ASSERT (p);
+  if (p->vtab != &patset_genpat_defn)
+    return -1;
+  mg.ps = p->data;
+  mg.group = mg.ps->groupc;
+  patset_scan (mg.ps, subj, patset_min_group, &mg);
+  if (mg.group == mg.ps->groupc)
+    return 1;
+  *group = mg.group;
+  return 0;
+}
+
+/*
+ * Return the number of groups in the pattern set P, or 0 if P is not a
+ * pattern set.
+ */
+size_t
+genpat_set_groups (GENPAT p)
+{
+  GENPAT_ASSERT (p);
+  if (p->vtab != &patset_genpat_defn)
+    return 0;
+  return ((struct patset *)p->data)->groupc;
+}
+
+/*
+ * Return the group number of the Ith member of the pattern set P.
+ * If P is not a pattern set, return 0.
+ */
+size_t
+genpat_set_member_group (GENPAT p, size_t i)
+{
+  GENPAT_ASSERT (p);
+  if (p->vtab != &patset_genpat_defn)
+    return 0;
+  return ((struct patset *)p->data)->memv[i].group;
+}
+
+/*
+ * Return the number of literal patterns in P: 1 for an exact, prefix,
+ * suffix or substring pattern, number of members for a pattern set, and
+ * 0 for regular expressions.
+ */
+size_t
+genpat_literal_count (GENPAT p)
+{
+  GENPAT_ASSERT (p);
+  if (p->vtab == &patset_genpat_defn)
+    return ((struct patset *)p->data)->memc;
+  if (p->vtab == &exact_genpat_defn
+      || p->vtab == &prefix_genpat_defn
+      || p->vtab == &suffix_genpat_defn
+      || p->vtab == &contain_genpat_defn)
+    return 1;
+  return 0;
+}
+
+/*
+ * Return the type, string and case-insensitivity flag of the Ith literal
+ * pattern in P (see genpat_literal_count).  For case-insensitive substring
+ * patterns, the returned string is in upper case.
+ *
+ * Return 0 on success and -1 if there's no such pattern.
+ */
+int
+genpat_literal (GENPAT p, size_t i, int *type, char const **str, int *ci)
+{
+  GENPAT_ASSERT (p);
+  if (i >= genpat_literal_count (p))
+    return -1;
+  if (p->vtab == &patset_genpat_defn)
+    {
+      struct patset *ps = p->data;
+      *type = ps->memv[i].type;
+      *str = ps->memv[i].pattern;
+      *ci = ps->ci;
+    }
+  else if (p->vtab == &contain_genpat_defn)
+    {
+      struct strstr_pattern *sp = p->data;
+      *type = GENPAT_CONTAIN;
+      *str = (char const *) sp->pattern;
+      *ci = sp->ci;
+    }
+  else
+    {
+      struct substr_pattern *sp = p->data;
+      if (p->vtab == &exact_genpat_defn)
+	*type = GENPAT_EXACT;
+      else if (p->vtab == &prefix_genpat_defn)
+	*type = GENPAT_PREFIX;
+      else
+	*type = GENPAT_SUFFIX;
+      *str = sp->pattern;
+      *ci = sp->ci;
+    }
+  return 0;
+}
@@ -0,0 +1,590 @@
+/*
+ * Active health checks for pound.
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each regular backend with a HealthCheck statement has a periodic job
+ * that hands it over to the prober thread every health check interval.
+ * The prober thread runs all submitted probes concurrently, using
+ * non-blocking sockets and a single poll loop.  A probe connects to
+ * the backend (performing TLS handshake for HTTPS backends), sends an
+ * HTTP request and reads the status line of the response.  The probe
+ * succeeds if the status falls within the configured range.
+ *
+ * A live backend is marked dead after "fall" consecutive failed probes;
+ * a dead one is returned to service after "rise" consecutive successes.
+ */
+#include "pound.h"
+#include "extern.h"
+
+/* Probe states. */
+enum
+  {
+    PROBE_CONNECT,      /* Connection in progress. */
+    PROBE_HANDSHAKE,    /* TLS handshake in progress. */
+    PROBE_SEND,         /* Sending request. */
+    PROBE_RECV          /* Reading response status line. */
+  };
+
+typedef struct probe
+{
+  BACKEND *be;                  /* Backend being probed. */
+  int fd;                       /* Socket. */
+  SSL *ssl;                     /* TLS connection, for HTTPS backends. */
+  int state;                    /* Probe state. */
+  short events;                 /* Poll events to wait for. */
+  struct timespec start;        /* Time the probe was started. */
+  struct timespec deadline;     /* Time when it times out. */
+  struct stringbuf req;         /* Request text. */
+  size_t reqoff;                /* Number of request bytes sent so far. */
+  char buf[256];                /* Response buffer. */
+  size_t buflen;                /* Number of bytes in buf. */
+  DLIST_ENTRY (probe) link;
+} PROBE;
+
+typedef DLIST_HEAD (,probe) PROBE_HEAD;
+
+/* Probes submitted by the health check jobs. */
+static PROBE_HEAD probe_queue = DLIST_HEAD_INITIALIZER (probe_queue);
+static pthread_mutex_t probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t prober_once = PTHREAD_ONCE_INIT;
+static int prober_wakeup_fd[2] = { -1, -1 };
+
+/* Probes in progress.  Accessed only by the prober thread. */
+static PROBE_HEAD probe_active = DLIST_HEAD_INITIALIZER (probe_active);
+static size_t probe_active_count;
+
+static void health_check_job (enum job_ctl ctl, void *data,
+			      const struct timespec *ts);
+
+/*
+ * Return true if the backend BE is still in use, i.e. is referenced by
+ * anything besides the health check job.
+ */
+static inline int
+backend_in_use (BACKEND *be)
+{
+#ifdef ENABLE_DYNAMIC_BACKENDS
+  return be->refcount > 1;
+#else
+  return 1;
+#endif
+}
+
+static void
+health_check_schedule (BACKEND *be, unsigned interval)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  ts.tv_sec += interval;
+  job_enqueue (&ts, health_check_job, be);
+}
+
+/*
+ * Start periodic health checks of the backend BE, if it has them
+ * configured.
+ */
+void
+backend_health_check_start (BACKEND *be)
+{
+  if (be->be_type == BE_REGULAR && be->v.reg.health.conf)
+    {
+      backend_ref (be);
+      health_check_schedule (be, 0);
+    }
+}
+
+static uint64_t
+timespec_diff_ns (struct timespec const *a, struct timespec const *b)
+{
+  return (uint64_t) (a->tv_sec - b->tv_sec) * 1000000000
+    + a->tv_nsec - b->tv_nsec;
+}
+
+static void
+probe_free (PROBE *p)
+{
+  if (p->ssl)
+    SSL_free (p->ssl);
+  if (p->fd != -1)
+    close (p->fd);
+  stringbuf_free (&p->req);
+  free (p);
+}
+
+/*
+ * Finish the probe P.  OK is true if it succeeded.  STATUS is the HTTP
+ * status returned by the backend, or 0 if none.  On failure, FMT and
+ * the rest of arguments describe the reason.
+ */
+static void
+probe_finish (PROBE *p, int ok, int status, char const *fmt, ...)
+  ATTR_PRINTFLIKE(4,5);
+
+static void
+probe_finish (PROBE *p, int ok, int status, char const *fmt, ...)
+{
+  BACKEND *be = p->be;
+  struct be_health *hp = &be->v.reg.health;
+  struct timespec now;
+  int kill = 0, resurrect = 0;
+  char errbuf[sizeof (hp->last_error)];
+
+  clock_gettime (CLOCK_REALTIME, &now);
+  if (ok)
+    errbuf[0] = 0;
+  else
+    {
+      va_list ap;
+      va_start (ap, fmt);
+      vsnprintf (errbuf, sizeof (errbuf), fmt, ap);
+      va_end (ap);
+    }
+
+  pthread_mutex_lock (&be->mut);
+  hp->checks++;
+  hp->last_ok = ok;
+  hp->last_status = status;
+  hp->last_latency = timespec_diff_ns (&now, &p->start);
+  hp->last_time = now;
+  strcpy (hp->last_error, errbuf);
+  if (ok)
+    {
+      hp->fall_count = 0;
+      if (!be->v.reg.alive && ++hp->rise_count >= hp->conf->rise)
+	{
+	  hp->rise_count = 0;
+	  resurrect = 1;
+	}
+    }
+  else
+    {
+      hp->failures++;
+      hp->rise_count = 0;
+      if (be->v.reg.alive && ++hp->fall_count >= hp->conf->fall)
+	{
+	  hp->fall_count = 0;
+	  kill = 1;
+	}
+    }
+  pthread_mutex_unlock (&be->mut);
+
+  if (kill)
+    {
+      char buf[MAXBUF];
+      str_be (buf, sizeof (buf), be);
+      logmsg (LOG_NOTICE, "Backend %s failed %u health checks: %s",
+	      buf, hp->conf->fall, errbuf);
+      kill_be (be->service, be, BE_KILL);
+    }
+  else if (resurrect)
+    backend_resurrect (be);
+
+  DLIST_REMOVE (&probe_active, p, link);
+  probe_active_count--;
+  health_check_schedule (be, hp->conf->interval);
+  probe_free (p);
+}
+
+/*
+ * Handle result RC of an SSL I/O function.  Return 0 if the operation
+ * should be retried, after updating the wait events.  Finish the probe
+ * and return -1 on error.
+ */
+static int
+probe_ssl_retry (PROBE *p, int rc, char const *what)
+{
+  switch (SSL_get_error (p->ssl, rc))
+    {
+    case SSL_ERROR_WANT_READ:
+      p->events = POLLIN;
+      return 0;
+
+    case SSL_ERROR_WANT_WRITE:
+      p->events = POLLOUT;
+      return 0;
+
+    default:
+      probe_finish (p, 0, 0, "%s failed", what);
+      return -1;
+    }
+}
+
+static void
+probe_handshake (PROBE *p)
+{
+  int rc = SSL_do_handshake (p->ssl);
+  if (rc == 1)
+    {
+      p->state = PROBE_SEND;
+      p->events = POLLOUT;
+    }
+  else
+    probe_ssl_retry (p, rc, "TLS handshake");
+}
+
+/* Connection established.  Proceed to TLS handshake or sending request. */
+static void
+probe_connected (PROBE *p)
+{
+  BACKEND *be = p->be;
+
+  if (be->v.reg.ctx)
+    {
+      if ((p->ssl = backend_ssl_new (be)) == NULL)
+	{
+	  probe_finish (p, 0, 0, "%s", "can't create TLS connection");
+	  return;
+	}
+      SSL_set_fd (p->ssl, p->fd);
+      SSL_set_connect_state (p->ssl);
+      p->state = PROBE_HANDSHAKE;
+      probe_handshake (p);
+    }
+  else
+    {
+      p->state = PROBE_SEND;
+      p->events = POLLOUT;
+    }
+}
+
+static void
+probe_send (PROBE *p)
+{
+  char const *ptr = stringbuf_value (&p->req) + p->reqoff;
+  size_t len = stringbuf_len (&p->req) - p->reqoff;
+  ssize_t n;
+
+  if (p->ssl)
+    {
+      int rc = SSL_write (p->ssl, ptr, len);
+      if (rc <= 0)
+	{
+	  probe_ssl_retry (p, rc, "SSL_write");
+	  return;
+	}
+      n = rc;
+    }
+  else if ((n = write (p->fd, ptr, len)) == -1)
+    {
+      if (errno != EAGAIN && errno != EINTR)
+	probe_finish (p, 0, 0, "write: %s", strerror (errno));
+      return;
+    }
+
+  p->reqoff += n;
+  if (p->reqoff == stringbuf_len (&p->req))
+    {
+      p->state = PROBE_RECV;
+      p->events = POLLIN;
+    }
+}
+
+/* Parse HTTP status line in the probe buffer. */
+static void
+probe_parse_status (PROBE *p)
+{
+  struct health_check *hc = p->be->v.reg.health.conf;
+  char *q;
+  long status;
+
+  p->buf[p->buflen] = 0;
+  if (strncmp (p->buf, "HTTP/1.", 7) != 0
+      || !isdigit (p->buf[7]) || p->buf[8] != ' ')
+    {
+      probe_finish (p, 0, 0, "%s", "malformed response");
+      return;
+    }
+  status = strtol (p->buf + 9, &q, 10);
+  if (q != p->buf + 12 || !(*q == ' ' || *q == '\r' || *q == '\n'))
+    probe_finish (p, 0, 0, "%s", "malformed response");
+  else if (status < hc->status_min || status > hc->status_max)
+    probe_finish (p, 0, status, "unexpected status %ld", status);
+  else
+    probe_finish (p, 1, status, NULL);
+}
+
+static void
+probe_recv (PROBE *p)
+{
+  size_t size = sizeof (p->buf) - 1 - p->buflen;
+  ssize_t n;
+
+  if (p->ssl)
+    {
+      int rc = SSL_read (p->ssl, p->buf + p->buflen, size);
+      if (rc <= 0)
+	{
+	  if (SSL_get_error (p->ssl, rc) == SSL_ERROR_ZERO_RETURN)
+	    n = 0;
+	  else
+	    {
+	      probe_ssl_retry (p, rc, "SSL_read");
+	      return;
+	    }
+	}
+      else
+	n = rc;
+    }
+  else if ((n = read (p->fd, p->buf + p->buflen, size)) == -1)
+    {
+      if (errno != EAGAIN && errno != EINTR)
+	probe_finish (p, 0, 0, "read: %s", strerror (errno));
+      return;
+    }
+
+  if (n == 0)
+    {
+      if (p->buflen == 0)
+	probe_finish (p, 0, 0, "%s", "connection closed");
+      else
+	probe_parse_status (p);
+      return;
+    }
+
+  p->buflen += n;
+  if (memchr (p->buf, '\n', p->buflen) || p->buflen == sizeof (p->buf) - 1)
+    probe_parse_status (p);
+}
+
+/* Advance the probe P after poll reported events REVENTS on it. */
+static void
+probe_step (PROBE *p, short revents)
+{
+  int err;
+  socklen_t len;
+
+  switch (p->state)
+    {
+    case PROBE_CONNECT:
+      len = sizeof (err);
+      if (getsockopt (p->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+	err = errno;
+      if (err)
+	probe_finish (p, 0, 0, "connect: %s", strerror (err));
+      else
+	probe_connected (p);
+      break;
+
+    case PROBE_HANDSHAKE:
+      probe_handshake (p);
+      break;
+
+    case PROBE_SEND:
+      probe_send (p);
+      break;
+
+    case PROBE_RECV:
+      probe_recv (p);
+      break;
+    }
+}
+
+/* Start the submitted probe P. */
+static void
+probe_start (PROBE *p)
+{
+  BACKEND *be = p->be;
+  struct health_check *hc = be->v.reg.health.conf;
+  char const *host;
+  char buf[MAXBUF];
+
+  clock_gettime (CLOCK_REALTIME, &p->start);
+  p->deadline = p->start;
+  p->deadline.tv_sec += hc->timeout;
+  DLIST_INSERT_TAIL (&probe_active, p, link);
+  probe_active_count++;
+
+  if (hc->host)
+    host = hc->host;
+  else if (be->v.reg.servername)
+    host = be->v.reg.servername;
+  else if (be->v.reg.addr.ai_family == AF_UNIX)
+    host = "localhost";
+  else
+    host = addr2str (buf, sizeof (buf), &be->v.reg.addr, 0);
+  stringbuf_printf (&p->req,
+		    "GET %s HTTP/1.1\r\n"
+		    "Host: %s\r\n"
+		    "User-Agent: pound/" PACKAGE_VERSION " (health check)\r\n"
+		    "Connection: close\r\n"
+		    "\r\n",
+		    hc->url, host);
+
+  if ((p->fd = socket (be->v.reg.addr.ai_family, SOCK_STREAM, 0)) == -1)
+    {
+      probe_finish (p, 0, 0, "socket: %s", strerror (errno));
+      return;
+    }
+  if (fcntl (p->fd, F_SETFL, fcntl (p->fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+      probe_finish (p, 0, 0, "fcntl: %s", strerror (errno));
+      return;
+    }
+  if (connect (p->fd, be->v.reg.addr.ai_addr, be->v.reg.addr.ai_addrlen) == 0)
+    probe_connected (p);
+  else if (errno == EINPROGRESS)
+    {
+      p->state = PROBE_CONNECT;
+      p->events = POLLOUT;
+    }
+  else
+    probe_finish (p, 0, 0, "connect: %s", strerror (errno));
+}
+
+static void
+prober_wakeup_drain (void)
+{
+  char buf[64];
+  while (read (prober_wakeup_fd[0], buf, sizeof (buf)) > 0)
+    ;
+}
+
+static void *
+thr_prober (void *arg)
+{
+  struct pollfd *fds = NULL;
+  PROBE **probes = NULL;
+  size_t fdmax = 0;
+
+  for (;;)
+    {
+      PROBE_HEAD head;
+      PROBE *p, *tmp;
+      struct timespec now;
+      int timeout = -1;
+      size_t i, n;
+
+      /* Start submitted probes. */
+      pthread_mutex_lock (&probe_mutex);
+      head = probe_queue;
+      DLIST_INIT (&probe_queue);
+      pthread_mutex_unlock (&probe_mutex);
+
+      while ((p = DLIST_FIRST (&head)) != NULL)
+	{
+	  DLIST_SHIFT (&head, link);
+	  probe_start (p);
+	}
+
+      /* Expire timed out probes and compute poll timeout. */
+      clock_gettime (CLOCK_REALTIME, &now);
+      DLIST_FOREACH_SAFE (p, tmp, &probe_active, link)
+	{
+	  if (timespec_cmp (&p->deadline, &now) <= 0)
+	    probe_finish (p, 0, 0, "%s", "timed out");
+	  else
+	    {
+	      int ms = timespec_diff_ns (&p->deadline, &now) / 1000000 + 1;
+	      if (timeout == -1 || ms < timeout)
+		timeout = ms;
+	    }
+	}
+
+      /* Wait for events. */
+      while (fdmax < probe_active_count + 1)
+	{
+	  fds = x2nrealloc (fds, &fdmax, sizeof (fds[0]));
+	  probes = xrealloc (probes, fdmax * sizeof (probes[0]));
+	}
+      fds[0].fd = prober_wakeup_fd[0];
+      fds[0].events = POLLIN;
+      n = 1;
+      DLIST_FOREACH (p, &probe_active, link)
+	{
+	  fds[n].fd = p->fd;
+	  fds[n].events = p->events;
+	  probes[n] = p;
+	  n++;
+	}
+
+      if (poll (fds, n, timeout) == -1)
+	{
+	  if (errno != EINTR)
+	    logmsg (LOG_ERR, "health check: poll: %s", strerror (errno));
+	  continue;
+	}
+
+      if (fds[0].revents & POLLIN)
+	prober_wakeup_drain ();
+
+      for (i = 1; i < n; i++)
+	if (fds[i].revents)
+	  probe_step (probes[i], fds[i].revents);
+    }
+  return NULL;
+}
+
+static void
+prober_init (void)
+{
+  pthread_t tid;
+  int rc;
+
+  if (pipe (prober_wakeup_fd))
+    {
+      logmsg (LOG_ERR, "can't create health check pipe: %s",
+	      strerror (errno));
+      exit (1);
+    }
+  fcntl (prober_wakeup_fd[0], F_SETFL, O_NONBLOCK);
+  fcntl (prober_wakeup_fd[1], F_SETFL, O_NONBLOCK);
+
+  if ((rc = pthread_create (&tid, &thread_attr_detached, thr_prober,
+			    NULL)) != 0)
+    {
+      logmsg (LOG_ERR, "can't create health check thread: %s",
+	      strerror (rc));
+      exit (1);
+    }
+}
+
+/* Submit backend BE to the prober thread. */
+static void
+probe_submit (BACKEND *be)
+{
+  PROBE *p;
+  static char c;
+
+  pthread_once (&prober_once, prober_init);
+
+  XZALLOC (p);
+  p->be = be;
+  p->fd = -1;
+  xstringbuf_init (&p->req);
+  pthread_mutex_lock (&probe_mutex);
+  DLIST_INSERT_TAIL (&probe_queue, p, link);
+  pthread_mutex_unlock (&probe_mutex);
+  if (write (prober_wakeup_fd[1], &c, 1) == -1 && errno != EAGAIN)
+    logmsg (LOG_ERR, "health check wakeup: %s", strerror (errno));
+}
+
+/*
+ * Periodic job: probe the backend passed as argument.  The reference
+ * to the backend is held until the backend is removed.
+ */
+static void
+health_check_job (enum job_ctl ctl, void *data, const struct timespec *ts)
+{
+  BACKEND *be = data;
+
+  if (ctl == job_ctl_run && backend_in_use (be))
+    probe_submit (be);
+  else
+    backend_unref (be);
+}
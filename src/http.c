@@ -134,6 +134,12 @@ static HTTP_STATUS http_status[] = {
     "The length of the requested URL exceeds the capacity limit for"
     " this server."
   },
+  [HTTP_STATUS_TOO_MANY_REQUESTS] = {
+    429,
+    "Too Many Requests",
+    "You have sent too many requests in a given amount of time."
+    " Please try again later."
+  },
   [HTTP_STATUS_INTERNAL_SERVER_ERROR] = {
     500,
     "Internal Server Error",
@@ -188,6 +194,122 @@ pound_to_http_status (int err)
   return http_status[err].code;
 }
 
+/*
+ * Pre-rendered responses.
+ */
+
+/*
+ * Render the response with the given CODE, reason phrase TEXT, HEADERS
+ * (may be NULL), content TYPE (may be NULL) and CONTENT, for both HTTP
+ * versions.  The result is the same as the output of bio_http_reply_start
+ * (bio_http_reply_start_list, if TYPE is NULL) followed by CONTENT.
+ */
+static struct static_response *
+static_response_render (int code, char const *text, char const *headers,
+			char const *type, char const *content)
+{
+  struct static_response *resp;
+  size_t len = strlen (content);
+  int proto;
+
+  XZALLOC (resp);
+  for (proto = 0; proto < 2; proto++)
+    {
+      struct stringbuf sb;
+
+      xstringbuf_init (&sb);
+      stringbuf_printf (&sb, "HTTP/1.%d %d %s\r\n", proto, code, text);
+      if (type)
+	stringbuf_printf (&sb, "Content-Type: %s\r\n", type);
+      if (proto == 1)
+	stringbuf_printf (&sb,
+			  "Content-Length: %"PRICLEN"\r\n"
+			  "Connection: close\r\n", (CONTENT_LENGTH) len);
+      if (headers)
+	stringbuf_add_string (&sb, headers);
+      stringbuf_add (&sb, "\r\n", 2);
+      stringbuf_add (&sb, content, len);
+      resp->len[proto] = stringbuf_len (&sb);
+      resp->text[proto] = stringbuf_finish (&sb);
+    }
+  return resp;
+}
+
+/*
+ * Send pre-rendered response RESP to BIO in a single write.  PROTO is
+ * the HTTP minor version.  Return 0 on success, -1 on error.
+ */
+static int
+static_response_send (BIO *bio, struct static_response const *resp,
+		      int proto)
+{
+  proto = proto ? 1 : 0;
+  if (BIO_write (bio, resp->text[proto], resp->len[proto])
+      != resp->len[proto])
+    return -1;
+  BIO_flush (bio);
+  return 0;
+}
+
+/*
+ * Render error reply for HTTP_STATUS_* code ERR, as sent by bio_err_reply.
+ */
+static struct static_response *
+error_reply_render (int err, char const *content)
+{
+  struct static_response *resp;
+  struct stringbuf sb;
+
+  xstringbuf_init (&sb);
+  if (!content)
+    {
+      stringbuf_printf (&sb, default_error_page,
+			http_status[err].code,
+			http_status[err].reason,
+			http_status[err].reason,
+			http_status[err].text);
+      content = stringbuf_finish (&sb);
+    }
+  resp = static_response_render (http_status[err].code,
+				 http_status[err].reason,
+				 err_headers, "text/html", content);
+  stringbuf_free (&sb);
+  return resp;
+}
+
+/*
+ * Render response of an Error backend with HTTP_STATUS_* code ERR and
+ * content TEXT, as sent by error_response.
+ */
+struct static_response *
+error_page_render (int err, char const *text)
+{
+  return static_response_render (http_status[err].code,
+				 http_status[err].reason,
+				 err_headers, NULL, text);
+}
+
+/*
+ * Render error replies for the listener LSTN.  This is called once,
+ * after the configuration has been parsed, so that error responses
+ * don't have to be formatted anew for each request.
+ */
+int
+listener_static_responses_init (LISTENER *lstn, void *data)
+{
+  int err;
+
+  for (err = 0; err < HTTP_STATUS_MAX; err++)
+    {
+      lstn->err_reply[err] = error_reply_render (err, lstn->http_err[err]);
+      lstn->err_page[err] = error_page_render (err,
+					       lstn->http_err[err]
+					         ? lstn->http_err[err]
+					         : http_status[err].text);
+    }
+  return 0;
+}
+
 /*
  * Write to BIO an error HTTP 1.PROTO response.  ERR is one of
  * HTTP_STATUS_* constants.  TXT supplies the error page content.
@@ -226,13 +348,18 @@ bio_err_reply (BIO *bio, int proto, int err, char const *content)
  * constants.  Status code and reason phrase will be taken from the
  * http_status array.  If custom error page is defined in the listener,
  * it will be used, otherwise the default error page for the ERR code
- * will be generated
+ * will be generated.  Normally, the response pre-rendered for the
+ * listener is sent.
  */
 static void
 http_err_reply (POUND_HTTP *phttp, int err)
 {
-  bio_err_reply (phttp->cl, phttp->request.version, err,
-		 phttp->lstn->http_err[err]);
+  if (phttp->lstn->err_reply[err])
+    static_response_send (phttp->cl, phttp->lstn->err_reply[err],
+			  phttp->request.version);
+  else
+    bio_err_reply (phttp->cl, phttp->request.version, err,
+		   phttp->lstn->http_err[err]);
   phttp->conn_closed = 1;
 }
 
@@ -329,6 +456,55 @@ submatch_exec (GENPAT re, char const *subject, struct submatch *sm)
   return res;
 }
 
+/*
+ * Record the result of matching the pattern set RE, fused from N
+ * conditions of a Match OR block (see cond_fuse_literals in config.c),
+ * in the submatch queue SMQ.  GROUP is the number of the first matching
+ * condition, and SUBJECT is the matched string, or NULL if none matched.
+ *
+ * One queue entry is pushed for each condition that would have been
+ * evaluated without the fusion, so that back-references $N(M) refer to
+ * the same entries.  Return 1 on match, 0 otherwise.
+ */
+static int
+submatch_queue_push_set (struct submatch_queue *smq, size_t n, size_t group,
+			 char const *subject)
+{
+  struct submatch *sm;
+
+  if (subject == NULL)
+    group = n - 1;
+  /* Entries that would be overwritten anyway need not be reset. */
+  if (group > SMQ_SIZE)
+    {
+      smq->cur = (smq->cur + group - SMQ_SIZE) % SMQ_SIZE;
+      group = SMQ_SIZE;
+    }
+  while (group-- > 0)
+    submatch_queue_push (smq);
+  sm = submatch_queue_push (smq);
+  if (subject == NULL)
+    return 0;
+  return (sm->subject = strdup (subject)) != NULL;
+}
+
+/*
+ * Push a new entry to the submatch queue SMQ and match SUBJECT against
+ * RE, storing the result in it.
+ */
+static int
+submatch_queue_exec (struct submatch_queue *smq, GENPAT re,
+		     char const *subject)
+{
+  size_t n = genpat_set_groups (re), group;
+
+  if (n <= 1)
+    return submatch_exec (re, subject, submatch_queue_push (smq));
+  if (genpat_set_match_group (re, subject, &group))
+    subject = NULL;
+  return submatch_queue_push_set (smq, n, group, subject);
+}
+
 static int http_request_get_query_param (struct http_request *,
 					 char const *, size_t,
 					 struct query_param **);
@@ -536,80 +712,190 @@ find_accessor (char const *input, size_t len, char **ret_arg, size_t *ret_arglen
 }
 
 /*
- * Expand backreferences and request accessors in STR, using the submatch
- * queue SMQ and HTTP request REQ.  If the latter is NULL, request accessors
- * are not handled.  Place the result in string buffer SB.  The string
- * WHAT gives the identifier for use in diagnostic messages.
+ * Expansion programs.
  *
- * On success, returns number of expansions made.  If invalid references or
- * accessors are encountered, returns -1.  The failed references are copied
- * to the output buffer verbatim and error message is logged for each of
- * them.
+ * Strings that can contain backreferences and request accessors are
+ * compiled at configuration time into a sequence of instructions, which
+ * is then executed for each request.
+ */
+enum expand_opcode
+  {
+    EXPAND_LITERAL,     /* Copy literal text. */
+    EXPAND_SUBMATCH,    /* Insert a submatch. */
+    EXPAND_ACCESSOR,    /* Insert result of request accessor. */
+    EXPAND_ERROR        /* Malformed reference. */
+  };
+
+enum expand_error
+  {
+    EXPAND_ERR_UNCLOSED_ACCESSOR,
+    EXPAND_ERR_MISSING_PAREN,
+    EXPAND_ERR_MISSING_BRACE,
+    EXPAND_ERR_NO_GROUP,
+    EXPAND_ERR_UNESCAPED
+  };
+
+struct expand_instr
+{
+  enum expand_opcode opcode;
+  size_t off;           /* For EXPAND_LITERAL: offset of the text in the
+			   literal pool.  Otherwise, offset of the
+			   reference in the source string. */
+  size_t len;           /* Length of the above. */
+  union
+  {
+    struct
+    {
+      int refno;        /* Submatch queue index. */
+      long groupno;     /* Group number. */
+    } ref;              /* EXPAND_SUBMATCH */
+    struct
+    {
+      accessor_func func;
+      char const *arg;  /* Argument (points into the source string). */
+      size_t arglen;    /* Length of the argument. */
+    } acc;              /* EXPAND_ACCESSOR */
+    struct
+    {
+      enum expand_error code;
+      int arg;          /* Position or length for the diagnostics. */
+    } err;              /* EXPAND_ERROR */
+  } v;
+};
+
+struct expand_prog
+{
+  char *src;                   /* Source string. */
+  char *text;                  /* Literal pool. */
+  size_t ninstr;               /* Number of instructions. */
+  struct expand_instr *instr;  /* Instructions. */
+};
+
+struct expand_compiler
+{
+  EXPAND_PROG *prog;           /* Program being compiled. */
+  size_t nalloc;               /* Number of allocated instruction slots. */
+  struct stringbuf text;       /* Literal pool. */
+};
+
+static struct expand_instr *
+expand_instr_new (struct expand_compiler *cmp, enum expand_opcode opcode,
+		  size_t off, size_t len)
+{
+  EXPAND_PROG *prog = cmp->prog;
+  struct expand_instr *ip;
+
+  if (prog->ninstr == cmp->nalloc)
+    prog->instr = x2nrealloc (prog->instr, &cmp->nalloc,
+			      sizeof (prog->instr[0]));
+  ip = &prog->instr[prog->ninstr++];
+  memset (ip, 0, sizeof (*ip));
+  ip->opcode = opcode;
+  ip->off = off;
+  ip->len = len;
+  return ip;
+}
+
+static void
+expand_add_literal (struct expand_compiler *cmp, char const *str, size_t len)
+{
+  EXPAND_PROG *prog = cmp->prog;
+  struct expand_instr *ip;
+
+  if (len == 0)
+    return;
+  if (prog->ninstr > 0
+      && prog->instr[prog->ninstr - 1].opcode == EXPAND_LITERAL)
+    /* Merge with the previous literal. */
+    ip = &prog->instr[prog->ninstr - 1];
+  else
+    ip = expand_instr_new (cmp, EXPAND_LITERAL, stringbuf_len (&cmp->text), 0);
+  stringbuf_add (&cmp->text, str, len);
+  ip->len += len;
+}
+
+static void
+expand_add_error (struct expand_compiler *cmp, enum expand_error code,
+		  char const *str, size_t len, int arg)
+{
+  struct expand_instr *ip = expand_instr_new (cmp, EXPAND_ERROR,
+					      str - cmp->prog->src, len);
+  ip->v.err.code = code;
+  ip->v.err.arg = arg;
+}
+
+/*
+ * Compile string STR, which can contain backreferences and request
+ * accessors, into an expansion program.
  *
- * Eventual memory allocation failures are handled by SB.  The caller is
- * supposed to check its error status.
+ * Malformed references don't cause compilation errors.  They are compiled
+ * into EXPAND_ERROR instructions which, when executed, copy the reference
+ * verbatim to the output and report it, the way it has always been done.
  */
-static int
-expand_string_to_buffer (struct stringbuf *sb, char const *str,
-			 POUND_HTTP *phttp,
-			 struct http_request *req, char *what)
+EXPAND_PROG *
+expand_compile (char const *str)
 {
+  struct expand_compiler cmp;
+  char const *start;
   char *p;
-  char const *start = str; /* Save the string for error reporting. */
-  int result = 0; /* Number of expansions made. */
 
+  XZALLOC (cmp.prog);
+  cmp.prog->src = xstrdup (str);
+  cmp.nalloc = 0;
+  xstringbuf_init (&cmp.text);
+
+  str = start = cmp.prog->src;
   while (*str)
     {
       int brace;
       size_t len = strcspn (str, "$%");
-      stringbuf_add (sb, str, len);
+      expand_add_literal (&cmp, str, len);
       str += len;
       if (*str == 0)
 	break;
-      else if ((str[0] == '$' && (str[1] == '$' || str[1] == '%')) ||
-	       str[1] == 0)
+      else if (str[1] == 0)
+	{
+	  expand_add_literal (&cmp, str, 1);
+	  break;
+	}
+      else if (str[0] == '$' && (str[1] == '$' || str[1] == '%'))
 	{
-	  stringbuf_add_char (sb, str[0]);
+	  expand_add_literal (&cmp, str + 1, 1);
 	  str += 2;
 	}
       else if (str[0] == '%' && isxdigit (str[1]) && isxdigit (str[2]))
 	{
-	  stringbuf_add (sb, str, 3);
+	  expand_add_literal (&cmp, str, 3);
 	  str += 3;
 	}
-      else if (req && str[0] == '%' && str[1] == '[')
+      else if (str[0] == '%' && str[1] == '[')
 	{
 	  char *q;
-	  size_t len;
 	  accessor_func acc;
 	  char *arg;
 	  size_t arglen;
-	  char const *val;
 
 	  q = strchr (str + 2, ']');
 	  if (q == NULL)
 	    {
-	      logmsg (LOG_WARNING, "%s \"%s\": unclosed %%[ at offset %d",
-		      what, start, (int)(str - start));
-	      stringbuf_add (sb, str, 2);
+	      expand_add_error (&cmp, EXPAND_ERR_UNCLOSED_ACCESSOR, str, 2,
+				str - start);
 	      str += 2;
-	      result = -1;
 	      continue;
 	    }
 
 	  len = q - str;
 
 	  if ((acc = find_accessor (str + 2, len - 2, &arg, &arglen)) == NULL)
+	    expand_add_literal (&cmp, str, len + 1);
+	  else
 	    {
-	      stringbuf_add (sb, str, len + 1);
-	    }
-	  else if (acc (&phttp->request, arg, arglen, &val, &len) == 0 && val)
-	    {
-	      stringbuf_add (sb, val, len);
-	      if (result >= 0)
-		result++;
+	      struct expand_instr *ip =
+		expand_instr_new (&cmp, EXPAND_ACCESSOR, str - start, len + 1);
+	      ip->v.acc.func = acc;
+	      ip->v.acc.arg = arg;
+	      ip->v.acc.arglen = arglen;
 	    }
-
 	  str = q + 1;
 	}
       else if ((brace = (str[1] == '{')) || isdigit (str[1]))
@@ -619,7 +905,7 @@ expand_string_to_buffer (struct stringbuf *sb, char const *str,
 	  groupno = strtoul (str + 1 + brace, &p, 10);
 	  if (errno)
 	    {
-	      stringbuf_add (sb, str, 2);
+	      expand_add_literal (&cmp, str, 2);
 	      str += 2;
 	    }
 	  else
@@ -629,7 +915,7 @@ expand_string_to_buffer (struct stringbuf *sb, char const *str,
 	       * mean $N(1).
 	       */
 	      int refno = str[0] == '$' ? 0 : 1;
-	      struct submatch *sm;
+	      struct expand_instr *ip;
 
 	      if (str[0] == '$' && *p == '(')
 		{
@@ -638,25 +924,16 @@ expand_string_to_buffer (struct stringbuf *sb, char const *str,
 		  n = strtoul (p + 1, &p, 10);
 		  if (errno || *p != ')')
 		    {
-		      int len = str - start + 1;
-		      logmsg (LOG_WARNING,
-			      "%s \"%s\": missing closing parenthesis in"
-			      " reference started in position %d ",
-			      what, start, len);
-		      stringbuf_add (sb, str, p - str);
+		      expand_add_error (&cmp, EXPAND_ERR_MISSING_PAREN,
+					str, p - str, str - start + 1);
 		      str = p;
-		      result = -1;
 		      continue;
 		    }
 		  if (n < 0 || n >= SMQ_SIZE)
 		    {
-		      int len = p - str + 1;
-		      logmsg (LOG_WARNING,
-			      "%s \"%s\" refers to non-existing group %*.*s",
-			      what, start, len, len, str);
-		      stringbuf_add (sb, str, p - str);
+		      expand_add_error (&cmp, EXPAND_ERR_NO_GROUP,
+					str, p - str, p - str + 1);
 		      str = p;
-		      result = -1;
 		      continue;
 		    }
 		  refno = n;
@@ -667,80 +944,225 @@ expand_string_to_buffer (struct stringbuf *sb, char const *str,
 		{
 		  if (*p != '}')
 		    {
-		      int n = str - start + 1;
-		      logmsg (LOG_WARNING,
-			      "%s \"%s\": missing closing brace in reference"
-			      " started in position %d", what, start, n);
-		      stringbuf_add (sb, str, p - str);
+		      expand_add_error (&cmp, EXPAND_ERR_MISSING_BRACE,
+					str, p - str, str - start + 1);
 		      str = p;
-		      result = -1;
 		      continue;
 		    }
 		  p++;
 		}
 
-	      sm = submatch_queue_get (&phttp->smq, refno);
-
-	      if (sm->subject && groupno <= sm->matchn)
-		{
-		  stringbuf_add (sb, sm->subject + sm->matchv[groupno].rm_so,
-				 sm->matchv[groupno].rm_eo - sm->matchv[groupno].rm_so);
-		  if (result >= 0)
-		    result++;
-		}
-	      else
-		{
-		  int n = p - str;
-		  stringbuf_add (sb, str, n);
-		  logmsg (LOG_WARNING,
-			  "%s \"%s\" refers to non-existing group %*.*s",
-			  what, start, n, n, str);
-		  result = -1;
-		}
+	      ip = expand_instr_new (&cmp, EXPAND_SUBMATCH, str - start,
+				     p - str);
+	      ip->v.ref.refno = refno;
+	      ip->v.ref.groupno = groupno;
 	      str = p;
 	    }
 	}
       else
 	{
-	  int n = str - start + 1;
-	  logmsg (LOG_WARNING,
-		  "%s \"%s\": unescaped %% character in position %d",
-		  what, start, n);
-	  stringbuf_add_char (sb, *str);
+	  expand_add_error (&cmp, EXPAND_ERR_UNESCAPED, str, 1,
+			    str - start + 1);
 	  str++;
+	}
+    }
+
+  cmp.prog->text = stringbuf_finish (&cmp.text);
+  return cmp.prog;
+}
+
+/*
+ * Report malformed or unresolved reference IP from PROG.  WHAT identifies
+ * the string.
+ */
+static void
+expand_report (EXPAND_PROG const *prog, struct expand_instr const *ip,
+	       char const *what)
+{
+  char const *src = prog->src;
+  int n;
+
+  if (ip->opcode == EXPAND_SUBMATCH)
+    {
+      n = ip->len;
+      logmsg (LOG_WARNING, "%s \"%s\" refers to non-existing group %*.*s",
+	      what, src, n, n, src + ip->off);
+      return;
+    }
+
+  n = ip->v.err.arg;
+  switch (ip->v.err.code)
+    {
+    case EXPAND_ERR_UNCLOSED_ACCESSOR:
+      logmsg (LOG_WARNING, "%s \"%s\": unclosed %%[ at offset %d",
+	      what, src, n);
+      break;
+
+    case EXPAND_ERR_MISSING_PAREN:
+      logmsg (LOG_WARNING,
+	      "%s \"%s\": missing closing parenthesis in"
+	      " reference started in position %d ",
+	      what, src, n);
+      break;
+
+    case EXPAND_ERR_MISSING_BRACE:
+      logmsg (LOG_WARNING,
+	      "%s \"%s\": missing closing brace in reference"
+	      " started in position %d", what, src, n);
+      break;
+
+    case EXPAND_ERR_NO_GROUP:
+      logmsg (LOG_WARNING,
+	      "%s \"%s\" refers to non-existing group %*.*s",
+	      what, src, n, n, src + ip->off);
+      break;
+
+    case EXPAND_ERR_UNESCAPED:
+      logmsg (LOG_WARNING,
+	      "%s \"%s\": unescaped %% character in position %d",
+	      what, src, n);
+      break;
+    }
+}
+
+/*
+ * Run the expansion program PROG, using the submatch queue and request
+ * of PHTTP.  Place the result in string buffer SB.  The string WHAT gives
+ * the identifier for use in diagnostic messages.
+ *
+ * On success, returns number of expansions made.  If invalid references or
+ * accessors are encountered, returns -1.  The failed references are copied
+ * to the output buffer verbatim and error message is logged for each of
+ * them.
+ *
+ * Eventual memory allocation failures are handled by SB.  The caller is
+ * supposed to check its error status.
+ */
+static int
+expand_prog_run (struct stringbuf *sb, EXPAND_PROG const *prog,
+		 POUND_HTTP *phttp, char const *what)
+{
+  int result = 0; /* Number of expansions made. */
+  size_t i;
+
+  for (i = 0; i < prog->ninstr; i++)
+    {
+      struct expand_instr const *ip = &prog->instr[i];
+      struct submatch *sm;
+      char const *val;
+      size_t len;
+
+      switch (ip->opcode)
+	{
+	case EXPAND_LITERAL:
+	  stringbuf_add (sb, prog->text + ip->off, ip->len);
+	  break;
+
+	case EXPAND_ACCESSOR:
+	  val = NULL;
+	  if (ip->v.acc.func (&phttp->request, ip->v.acc.arg, ip->v.acc.arglen,
+			      &val, &len) == 0 && val)
+	    {
+	      stringbuf_add (sb, val, len);
+	      if (result >= 0)
+		result++;
+	    }
+	  break;
+
+	case EXPAND_SUBMATCH:
+	  sm = submatch_queue_get (&phttp->smq, ip->v.ref.refno);
+	  if (sm->subject && ip->v.ref.groupno <= sm->matchn)
+	    {
+	      POUND_REGMATCH *m = &sm->matchv[ip->v.ref.groupno];
+	      stringbuf_add (sb, sm->subject + m->rm_so, m->rm_eo - m->rm_so);
+	      if (result >= 0)
+		result++;
+	    }
+	  else
+	    {
+	      stringbuf_add (sb, prog->src + ip->off, ip->len);
+	      expand_report (prog, ip, what);
+	      result = -1;
+	    }
+	  break;
+
+	case EXPAND_ERROR:
+	  stringbuf_add (sb, prog->src + ip->off, ip->len);
+	  expand_report (prog, ip, what);
 	  result = -1;
+	  break;
 	}
     }
   return result;
 }
 
-char *
-expand_string (char const *str, POUND_HTTP *phttp, struct http_request *req,
-	       char *what)
+/*
+ * Per-thread buffer for the results of expansion.  The returned pointer
+ * stays valid until the next expansion in the same thread.
+ */
+static pthread_key_t expand_buffer_key;
+static pthread_once_t expand_buffer_key_once = PTHREAD_ONCE_INIT;
+
+static void
+expand_buffer_free (void *ptr)
 {
-  struct stringbuf sb;
-  char *p = NULL;
+  struct stringbuf *sb = ptr;
+  stringbuf_free (sb);
+  free (sb);
+}
 
-  stringbuf_init_log (&sb);
-  if (expand_string_to_buffer (&sb, str, phttp, req, what) == -1
-      || (p = stringbuf_finish (&sb)) == NULL)
-    stringbuf_free (&sb);
-  return p;
+static void
+expand_buffer_key_create (void)
+{
+  pthread_key_create (&expand_buffer_key, expand_buffer_free);
+}
+
+static struct stringbuf *
+expand_buffer_get (void)
+{
+  struct stringbuf *sb;
+
+  pthread_once (&expand_buffer_key_once, expand_buffer_key_create);
+  if ((sb = pthread_getspecific (expand_buffer_key)) == NULL)
+    {
+      if ((sb = malloc (sizeof (*sb))) == NULL)
+	{
+	  lognomem ();
+	  return NULL;
+	}
+      stringbuf_init_log (sb);
+      pthread_setspecific (expand_buffer_key, sb);
+    }
+  else
+    {
+      stringbuf_reset (sb);
+      sb->err = 0;
+    }
+  return sb;
 }
 
 static char *
-expand_url (char const *url, POUND_HTTP *phttp, int has_uri)
+expand_string (EXPAND_PROG const *prog, POUND_HTTP *phttp, char const *what)
 {
-  struct stringbuf sb;
-  char *p;
+  struct stringbuf *sb;
 
-  stringbuf_init_log (&sb);
+  if ((sb = expand_buffer_get ()) == NULL
+      || expand_prog_run (sb, prog, phttp, what) == -1)
+    return NULL;
+  return stringbuf_finish (sb);
+}
+
+static char *
+expand_url (EXPAND_PROG const *prog, POUND_HTTP *phttp, int has_uri)
+{
+  struct stringbuf *sb;
+
+  if ((sb = expand_buffer_get ()) == NULL)
+    return NULL;
 
-  switch (expand_string_to_buffer (&sb, url, phttp, &phttp->request,
-				   "Redirect expression"))
+  switch (expand_prog_run (sb, prog, phttp, "Redirect expression"))
     {
     case -1:
-      stringbuf_free (&sb);
       return NULL;
 
     case 0:
@@ -752,11 +1174,9 @@ expand_url (char const *url, POUND_HTTP *phttp, int has_uri)
 
   /* For compatibility with previous versions */
   if (!has_uri)
-    stringbuf_add_string (&sb, phttp->request.url);
+    stringbuf_add_string (sb, phttp->request.url);
 
-  if ((p = stringbuf_finish (&sb)) == NULL)
-    stringbuf_free (&sb);
-  return p;
+  return stringbuf_finish (sb);
 }
 
 static int rewrite_apply (REWRITE_RULE_HEAD *rewrite_rules,
@@ -772,6 +1192,12 @@ control_response (POUND_HTTP *phttp)
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
   return control_response_basic (phttp);
 }
+static char const redirect_page[] =
+  "<html><head><title>Redirect</title></head>"
+  "<body><h1>Redirect</h1>"
+  "<p>You should go to <a href=\"%s\">%s</a></p>"
+  "</body></html>";
+
 /*
  * Reply with a redirect
  */
@@ -780,9 +1206,10 @@ redirect_response (POUND_HTTP *phttp)
 {
   struct be_redirect const *redirect = &phttp->backend->v.redirect;
   int code = redirect->status;
-  char const *code_msg, *cont, *hdr;
+  char const *code_msg;
   char *xurl, *url;
-  struct stringbuf sb_url, sb_cont, sb_loc;
+  size_t urllen;
+  struct stringbuf sb_url, sb;
   int i;
 
   /*
@@ -824,7 +1251,7 @@ redirect_response (POUND_HTTP *phttp)
 		     phttp))
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
-  xurl = expand_url (redirect->url, phttp, redirect->has_uri);
+  xurl = expand_url (redirect->prog, phttp, redirect->has_uri);
   if (!xurl)
     {
       return HTTP_STATUS_INTERNAL_SERVER_ERROR;
@@ -850,7 +1277,6 @@ redirect_response (POUND_HTTP *phttp)
 	stringbuf_printf (&sb_url, "%%%02x", xurl[i]);
     }
   url = stringbuf_finish (&sb_url);
-  free (xurl);
 
   if (!url)
     {
@@ -858,38 +1284,37 @@ redirect_response (POUND_HTTP *phttp)
       return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
 
-  stringbuf_init_log (&sb_cont);
-  stringbuf_printf (&sb_cont,
-		    "<html><head><title>Redirect</title></head>"
-		    "<body><h1>Redirect</h1>"
-		    "<p>You should go to <a href=\"%s\">%s</a></p>"
-		    "</body></html>",
-		    url, url);
-
-  if ((cont = stringbuf_finish (&sb_cont)) == NULL)
-    {
-      stringbuf_free (&sb_url);
-      stringbuf_free (&sb_cont);
-      return HTTP_STATUS_INTERNAL_SERVER_ERROR;
-    }
-
-  stringbuf_init_log (&sb_loc);
-  stringbuf_printf (&sb_loc, "Location: %s\r\n", url);
-
-  if ((hdr = stringbuf_finish (&sb_loc)) == NULL)
+  /*
+   * Compose the entire response in a single buffer, so that it is sent
+   * in one write.
+   */
+  urllen = strlen (url);
+  stringbuf_init_log (&sb);
+  stringbuf_printf (&sb,
+		    "HTTP/1.%d %d %s\r\n"
+		    "Content-Type: text/html\r\n",
+		    phttp->request.version, code, code_msg);
+  if (phttp->request.version == 1)
+    stringbuf_printf (&sb,
+		      "Content-Length: %"PRICLEN"\r\n"
+		      "Connection: close\r\n",
+		      (CONTENT_LENGTH) (sizeof (redirect_page)
+					- sizeof ("%s%s") + 2 * urllen));
+  stringbuf_printf (&sb, "Location: %s\r\n\r\n", url);
+  stringbuf_printf (&sb, redirect_page, url, url);
+
+  if (stringbuf_err (&sb))
     {
       stringbuf_free (&sb_url);
-      stringbuf_free (&sb_cont);
-      stringbuf_free (&sb_loc);
+      stringbuf_free (&sb);
       return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
 
-  bio_http_reply (phttp->cl, phttp->request.version, code, code_msg, hdr,
-		  "text/html", cont);
+  BIO_write (phttp->cl, stringbuf_value (&sb), stringbuf_len (&sb));
+  BIO_flush (phttp->cl);
 
   stringbuf_free (&sb_url);
-  stringbuf_free (&sb_cont);
-  stringbuf_free (&sb_loc);
+  stringbuf_free (&sb);
 
   phttp->response_code = code;
 
@@ -938,8 +1363,8 @@ copy_status_string (int rc)
  * Read and write some binary data
  */
 static int
-copy_bin (BIO *cl, BIO *be, CONTENT_LENGTH cont, CONTENT_LENGTH *res_bytes,
-	  int no_write)
+copy_bin_buffered (BIO *cl, BIO *be, CONTENT_LENGTH cont,
+		   CONTENT_LENGTH *res_bytes, int no_write)
 {
   char buf[MAXBUF];
   int res;
@@ -974,7 +1399,515 @@ copy_bin (BIO *cl, BIO *be, CONTENT_LENGTH cont, CONTENT_LENGTH *res_bytes,
   return COPY_OK;
 }
 
-static int
+static int err_to = -1;
+
+typedef struct
+{
+  int timeout;
+  RENEG_STATE *reneg_state;
+} BIO_ARG;
+
+#ifdef HAVE_SPLICE
+/*
+ * Zero-copy transfer between plain sockets.
+ *
+ * If both ends of the transfer are plain (non-TLS) sockets, the data are
+ * moved between them by splice(2) through a pipe, without copying them
+ * to the user space.  Each thread keeps its pipe for reuse.
+ */
+
+/* Don't use splice for transfers shorter than this. */
+#define SPLICE_MIN_LENGTH (4*MAXBUF)
+
+/* Max. number of bytes to move by a single call to splice. */
+#define SPLICE_CHUNK 65536
+
+struct splice_pipe
+{
+  int fd[2];
+};
+
+static pthread_key_t splice_pipe_key;
+static pthread_once_t splice_pipe_key_once = PTHREAD_ONCE_INIT;
+
+static void
+splice_pipe_free (void *ptr)
+{
+  struct splice_pipe *sp = ptr;
+  close (sp->fd[0]);
+  close (sp->fd[1]);
+  free (sp);
+}
+
+static void
+splice_pipe_key_create (void)
+{
+  pthread_key_create (&splice_pipe_key, splice_pipe_free);
+}
+
+static struct splice_pipe *
+splice_pipe_get (void)
+{
+  struct splice_pipe *sp;
+
+  pthread_once (&splice_pipe_key_once, splice_pipe_key_create);
+  if ((sp = pthread_getspecific (splice_pipe_key)) == NULL)
+    {
+      if ((sp = malloc (sizeof (*sp))) == NULL)
+	{
+	  lognomem ();
+	  return NULL;
+	}
+      if (pipe2 (sp->fd, O_CLOEXEC))
+	{
+	  logmsg (LOG_WARNING, "(%"PRItid") pipe: %s", POUND_TID (),
+		  strerror (errno));
+	  free (sp);
+	  return NULL;
+	}
+      pthread_setspecific (splice_pipe_key, sp);
+    }
+  return sp;
+}
+
+/*
+ * Close the pipe of the current thread.  This is done after a failed
+ * transfer, when the pipe may contain stale data.
+ */
+static void
+splice_pipe_discard (void)
+{
+  struct splice_pipe *sp = pthread_getspecific (splice_pipe_key);
+  if (sp)
+    {
+      pthread_setspecific (splice_pipe_key, NULL);
+      splice_pipe_free (sp);
+    }
+}
+
+/*
+ * If BIO is a buffered plain socket, return the underlying socket BIO.
+ * Otherwise, return NULL.
+ */
+static BIO *
+bio_plain_socket (BIO *bio)
+{
+  BIO *next;
+
+  if (BIO_method_type (bio) != BIO_TYPE_BUFFER
+      || (next = BIO_next (bio)) == NULL
+      || BIO_method_type (next) != BIO_TYPE_SOCKET
+      || BIO_next (next) != NULL)
+    return NULL;
+  return next;
+}
+
+/*
+ * Wait until the socket FD of the socket BIO is ready for I/O, observing
+ * the timeout set for that BIO.
+ */
+static int
+splice_wait (BIO *bio, int fd, int events)
+{
+  BIO_ARG *arg = (BIO_ARG *) BIO_get_callback_arg (bio);
+  struct pollfd p;
+  int to = -1;
+
+  if (arg)
+    {
+      if (arg->timeout < 0)
+	{
+	  errno = ETIMEDOUT;
+	  return -1;
+	}
+      if (arg->timeout > 0)
+	to = arg->timeout * 1000;
+    }
+
+  for (;;)
+    {
+      memset (&p, 0, sizeof (p));
+      p.fd = fd;
+      p.events = events;
+      switch (poll (&p, 1, to))
+	{
+	case 1:
+	  return 0;
+
+	case 0:
+	  if (arg)
+	    arg->timeout = err_to;
+	  errno = ETIMEDOUT;
+	  return -1;
+
+	default:
+	  if (errno != EINTR)
+	    return -1;
+	}
+    }
+}
+
+/*
+ * Move N bytes from the pipe SP to the socket FD of the socket BIO SOCK.
+ * MORE is true if more data will follow.  Return 0 on success and -1 on
+ * error.
+ */
+static int
+splice_drain (struct splice_pipe *sp, BIO *sock, int fd, ssize_t n, int more,
+	      CONTENT_LENGTH *res_bytes)
+{
+  ssize_t nw;
+
+  while (n > 0)
+    {
+      if (splice_wait (sock, fd, POLLOUT))
+	return -1;
+      nw = splice (sp->fd[0], NULL, fd, NULL, n,
+		   SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+		   | (more ? SPLICE_F_MORE : 0));
+      if (nw < 0)
+	{
+	  if (errno == EINTR || errno == EAGAIN)
+	    continue;
+	  return -1;
+	}
+      n -= nw;
+      if (res_bytes)
+	*res_bytes += nw;
+    }
+  return 0;
+}
+
+/*
+ * Copy CONT bytes from CL to BE using splice.  Return -1 if it is not
+ * possible, and one of COPY_* constants otherwise.
+ */
+static int
+copy_bin_splice (BIO *cl, BIO *be, CONTENT_LENGTH cont,
+		 CONTENT_LENGTH *res_bytes)
+{
+  BIO *cl_sock, *be_sock;
+  struct splice_pipe *sp;
+  int in_fd, out_fd;
+  CONTENT_LENGTH n;
+  int rc = COPY_OK;
+
+  if ((cl_sock = bio_plain_socket (cl)) == NULL
+      || (be_sock = bio_plain_socket (be)) == NULL
+      || (sp = splice_pipe_get ()) == NULL)
+    return -1;
+
+  /*
+   * Pass the data already read into the CL buffer and flush the BE
+   * buffer before writing directly to its socket.
+   */
+  if ((n = BIO_pending (cl)) > 0)
+    {
+      if (n > cont)
+	n = cont;
+      if ((rc = copy_bin_buffered (cl, be, n, res_bytes, 0)) != COPY_OK)
+	return rc;
+      cont -= n;
+    }
+  else if (BIO_flush (be) != 1)
+    return COPY_WRITE_ERR;
+
+  BIO_get_fd (cl_sock, &in_fd);
+  BIO_get_fd (be_sock, &out_fd);
+
+  while (cont > 0)
+    {
+      ssize_t nr;
+
+      if (splice_wait (cl_sock, in_fd, POLLIN))
+	{
+	  rc = COPY_READ_ERR;
+	  break;
+	}
+      nr = splice (in_fd, NULL, sp->fd[1], NULL,
+		   cont > SPLICE_CHUNK ? SPLICE_CHUNK : cont,
+		   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (nr == 0)
+	{
+	  rc = COPY_EOF;
+	  break;
+	}
+      else if (nr < 0)
+	{
+	  if (errno == EINTR || errno == EAGAIN)
+	    continue;
+	  rc = COPY_READ_ERR;
+	  break;
+	}
+      cont -= nr;
+
+      if (splice_drain (sp, be_sock, out_fd, nr, cont > 0, res_bytes))
+	{
+	  rc = COPY_WRITE_ERR;
+	  break;
+	}
+    }
+
+  if (rc != COPY_OK)
+    splice_pipe_discard ();
+  return rc;
+}
+#endif
+
+static int
+copy_bin (BIO *cl, BIO *be, CONTENT_LENGTH cont, CONTENT_LENGTH *res_bytes,
+	  int no_write)
+{
+#ifdef HAVE_SPLICE
+  if (!no_write && cont >= SPLICE_MIN_LENGTH)
+    {
+      int rc = copy_bin_splice (cl, be, cont, res_bytes);
+      if (rc != -1)
+	return rc;
+    }
+#endif
+  return copy_bin_buffered (cl, be, cont, res_bytes, no_write);
+}
+
+/*
+ * Pass the data already read into the buffer of IN to OUT.  WHAT names
+ * the data for diagnostics.  Return 0 on success and -1 on error.
+ */
+static int
+copy_pending (BIO *in, BIO *out, CONTENT_LENGTH *res_bytes, char const *what)
+{
+  int n;
+
+  while ((n = BIO_pending (in)) > 0)
+    {
+      switch (copy_bin_buffered (in, out, n, res_bytes, 0))
+	{
+	case COPY_OK:
+	  break;
+
+	case COPY_WRITE_ERR:
+	  if (errno)
+	    logmsg (LOG_NOTICE, "(%"PRItid") error writing %s pending: %s",
+		    POUND_TID (), what, strerror (errno));
+	  return -1;
+
+	default:
+	  logmsg (LOG_NOTICE, "(%"PRItid") error reading %s pending: %s",
+		  POUND_TID (), what, strerror (errno));
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+/*
+ * Relaying of upgraded (WebSocket) connections.  The data are passed in
+ * both directions until either side closes its connection, or no data
+ * arrive within the WebSocket timeout of the backend.
+ */
+
+/* Size of the relay buffer: the maximum size of a TLS record. */
+#define WS_BUFSIZE 16384
+
+#ifdef HAVE_SPLICE
+/*
+ * Relay between plain sockets using splice.  Return -1 if it is not
+ * possible, and one of COPY_* constants otherwise.
+ */
+static int
+ws_relay_splice (POUND_HTTP *phttp)
+{
+  BIO *sock[2];
+  int fd[2];
+  struct pollfd p[2];
+  struct splice_pipe *sp;
+  int rc = COPY_OK;
+  int eof = 0;
+  int i;
+
+  if ((sock[0] = bio_plain_socket (phttp->cl)) == NULL
+      || (sock[1] = bio_plain_socket (phttp->be)) == NULL
+      || (sp = splice_pipe_get ()) == NULL)
+    return -1;
+
+  memset (p, 0, sizeof (p));
+  for (i = 0; i < 2; i++)
+    {
+      BIO_get_fd (sock[i], &fd[i]);
+      p[i].fd = fd[i];
+      p[i].events = POLLIN | POLLPRI;
+    }
+
+  while (!eof && poll (p, 2, phttp->backend->v.reg.ws_to * 1000) > 0)
+    {
+      for (i = 0; i < 2; i++)
+	{
+	  ssize_t nr;
+
+	  if (!p[i].revents)
+	    continue;
+	  p[i].revents = 0;
+	  /*
+	   * The pipe is always drained before the next read, so data
+	   * flowing in both directions can share it.
+	   */
+	  nr = splice (fd[i], NULL, sp->fd[1], NULL, SPLICE_CHUNK,
+		       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	  if (nr < 0 && (errno == EINTR || errno == EAGAIN))
+	    continue;
+	  if (nr <= 0)
+	    {
+	      eof = 1;
+	      break;
+	    }
+	  if (splice_drain (sp, sock[!i], fd[!i], nr, 0,
+			    i == 1 ? &phttp->res_bytes : NULL))
+	    {
+	      if (errno)
+		logmsg (LOG_NOTICE,
+			"(%"PRItid") error copying ws %s body: %s",
+			POUND_TID (), i == 0 ? "request" : "response",
+			strerror (errno));
+	      rc = COPY_WRITE_ERR;
+	      eof = 1;
+	      break;
+	    }
+	}
+    }
+
+  if (rc != COPY_OK)
+    splice_pipe_discard ();
+  return rc;
+}
+#endif
+
+static int
+ws_relay_buffered (POUND_HTTP *phttp)
+{
+  char buf[WS_BUFSIZE];
+  BIO *cl_unbuf;
+  BIO *be_unbuf;
+  struct pollfd p[2];
+  int res;
+
+  /*
+   * find the socket BIO in the chain
+   */
+  if ((cl_unbuf = BIO_find_type (phttp->cl,
+				 SLIST_EMPTY (&phttp->lstn->ctx_head)
+				   ? BIO_TYPE_SOCKET : BIO_TYPE_SSL)) == NULL
+      || (be_unbuf = BIO_find_type (phttp->be,
+				    backend_is_https (phttp->backend)
+				      ? BIO_TYPE_SSL
+				      : BIO_TYPE_SOCKET)) == NULL)
+    {
+      logmsg (LOG_WARNING,
+	      "(%"PRItid") error getting unbuffered BIO: %s",
+	      POUND_TID (), strerror (errno));
+      return -1;
+    }
+
+  memset (p, 0, sizeof (p));
+  BIO_get_fd (phttp->cl, &p[0].fd);
+  p[0].events = POLLIN | POLLPRI;
+  BIO_get_fd (phttp->be, &p[1].fd);
+  p[1].events = POLLIN | POLLPRI;
+
+  for (;;)
+    {
+      /*
+       * A TLS record may be larger than the buffer: pass whatever
+       * remains in the TLS layer before polling.
+       */
+      if (copy_pending (phttp->cl, phttp->be, NULL, "ws request")
+	  || copy_pending (phttp->be, phttp->cl, &phttp->res_bytes,
+			   "ws response"))
+	return -1;
+
+      if (poll (p, 2, phttp->backend->v.reg.ws_to * 1000) <= 0)
+	break;
+
+      if (p[0].revents)
+	{
+	  if ((res = BIO_read (cl_unbuf, buf, sizeof (buf))) <= 0)
+	    break;
+	  if (BIO_write (phttp->be, buf, res) != res)
+	    {
+	      if (errno)
+		logmsg (LOG_NOTICE,
+			"(%"PRItid") error copying ws request body: %s",
+			POUND_TID (), strerror (errno));
+	      return -1;
+	    }
+	  BIO_flush (phttp->be);
+	  p[0].revents = 0;
+	}
+      if (p[1].revents)
+	{
+	  if ((res = BIO_read (be_unbuf, buf, sizeof (buf))) <= 0)
+	    break;
+	  if (BIO_write (phttp->cl, buf, res) != res)
+	    {
+	      if (errno)
+		logmsg (LOG_NOTICE,
+			"(%"PRItid") error copying ws response body: %s",
+			POUND_TID (), strerror (errno));
+	      return -1;
+	    }
+	  phttp->res_bytes += res;
+	  BIO_flush (phttp->cl);
+	  p[1].revents = 0;
+	}
+    }
+  return 0;
+}
+
+/*
+ * Relay an upgraded connection.  Return 0 when it is finished and -1 on
+ * error.
+ */
+static int
+ws_relay (POUND_HTTP *phttp)
+{
+  /*
+   * First pass whatever is already in the input buffers.
+   */
+  if (copy_pending (phttp->cl, phttp->be, NULL, "ws request")
+      || copy_pending (phttp->be, phttp->cl, &phttp->res_bytes, "ws response"))
+    return -1;
+  BIO_flush (phttp->be);
+  BIO_flush (phttp->cl);
+
+#ifdef HAVE_SPLICE
+  switch (ws_relay_splice (phttp))
+    {
+    case -1:
+      break;
+
+    case COPY_OK:
+      return 0;
+
+    default:
+      return -1;
+    }
+#endif
+  return ws_relay_buffered (phttp);
+}
+
+/* Expansion program for "$1": the file name requested from ACME backend. */
+static struct expand_instr acme_path_instr[] = {
+  { .opcode = EXPAND_SUBMATCH, .off = 0, .len = 2,
+    .v.ref = { .refno = 0, .groupno = 1 } }
+};
+
+static EXPAND_PROG acme_path_prog = {
+  .src = "$1",
+  .text = "",
+  .ninstr = 1,
+  .instr = acme_path_instr
+};
+
+static int
 acme_response (POUND_HTTP *phttp)
 {
   int fd;
@@ -989,7 +1922,8 @@ acme_response (POUND_HTTP *phttp)
 		     phttp))
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
-  file_name = expand_url ("$1", phttp, 1);
+  if ((file_name = expand_url (&acme_path_prog, phttp, 1)) == NULL)
+    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
   if ((fd = openat (phttp->backend->v.acme.wd, file_name, O_RDONLY)) == -1)
     {
@@ -1044,7 +1978,6 @@ acme_response (POUND_HTTP *phttp)
       BIO_free (bin);
       BIO_flush (phttp->cl);
     }
-  free (file_name);
   return rc;
 }
 
@@ -1091,11 +2024,27 @@ error_response (POUND_HTTP *phttp)
 			: phttp->lstn->http_err[err]
 			    ? phttp->lstn->http_err[err]
 			    : http_status[err].text;
+  struct static_response *reply = phttp->backend->v.error.text
+				    ? phttp->backend->v.error.reply
+				    : phttp->lstn->err_page[err];
   size_t len = strlen (text);
   struct http_request req;
   BIO *bin;
   int rc;
 
+  if (reply
+      && SLIST_EMPTY (&phttp->svc->rewrite[REWRITE_RESPONSE])
+      && SLIST_EMPTY (&phttp->lstn->rewrite[REWRITE_RESPONSE]))
+    {
+      /* No response modifications: use the pre-rendered reply. */
+      if (static_response_send (phttp->cl, reply, phttp->request.version))
+	logmsg (LOG_NOTICE, "(%"PRItid") %s while sending response %d",
+		POUND_TID (), copy_status_string (COPY_WRITE_ERR),
+		http_status[err].code);
+      phttp->response_code = http_status[err].code;
+      return 0;
+    }
+
   http_request_init (&req);
   if (parse_header_text (&req.headers, err_headers))
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
@@ -1143,17 +2092,20 @@ error_response (POUND_HTTP *phttp)
 static void
 drain_eol (BIO *in)
 {
-  char c;
-  do
+  char buf[128];
+  int n;
+
+  for (;;)
     {
-      if (BIO_read (in, &c, 1) <= 0)
+      if ((n = BIO_gets (in, buf, sizeof (buf))) <= 0)
 	{
 	  if (BIO_should_retry (in))
 	    continue;
 	  break;
 	}
+      if (buf[n - 1] == '\n')
+	break;
     }
-  while (c != '\n');
 }
 
 /*
@@ -1161,79 +2113,98 @@ drain_eol (BIO *in)
  * stream if buffer too small.
  * The result buffer is 0-terminated.
  * Return 0 on success.
+ *
+ * The line is obtained using BIO_gets, which, for buffered BIOs, scans
+ * the BIO input buffer for the newline and copies the line in bulk.
+ * Any bytes past the newline remain in the buffer, available for
+ * subsequent BIO_read calls.  Each line is then checked for control
+ * characters.  Lines are terminated either by CRLF or by LF alone.  CR
+ * not followed by LF, as well as any other control character except
+ * horizontal tab, causes COPY_BAD_DATA.  A line that doesn't fit into
+ * BUFSIZE-1 bytes, terminator included, causes COPY_TOO_LONG.  In both
+ * cases the rest of the input line is skipped.
  */
 static int
 get_line (BIO *in, char *const buf, int bufsize)
 {
-  char tmp;
-  int i, seen_cr;
+  int len = 0;  /* Number of bytes collected so far. */
+  int seen_cr = 0;
 
-  memset (buf, 0, bufsize);
-  for (i = 0, seen_cr = 0; i < bufsize - 1; i++)
-    switch (BIO_read (in, &tmp, 1))
-      {
-      case -2:
-	/*
-	 * BIO_gets not implemented
-	 */
-	return COPY_READ_ERR;
-      case 0:
-	if (BIO_should_retry (in))
-	  continue;
-	return i == 0 ? COPY_EOF : COPY_OK;
-      case -1:
-	return COPY_READ_ERR;
-      default:
-	if (seen_cr)
-	  {
-	    if (tmp != '\n')
-	      {
-		/*
-		 * we have CR not followed by NL
-		 */
-		drain_eol (in);
-		return COPY_BAD_DATA;
-	      }
-	    else
-	      {
-		buf[i - 1] = '\0';
-		return 0;
-	      }
-	  }
+  for (;;)
+    {
+      int i, n;
 
-	if (!iscntrl (tmp) || tmp == '\t')
-	  {
-	    buf[i] = tmp;
-	    continue;
-	  }
+      if ((n = BIO_gets (in, buf + len, bufsize - len)) <= 0)
+	{
+	  if (n == 0)
+	    {
+	      if (BIO_should_retry (in))
+		continue;
+	      /* End of input. */
+	      if (len == 0)
+		return COPY_EOF;
+	      /* Drop dangling CR, if any. */
+	      buf[len - seen_cr] = 0;
+	      return COPY_OK;
+	    }
+	  /* -2 means BIO_gets not implemented */
+	  return COPY_READ_ERR;
+	}
 
-	if (tmp == '\r')
-	  {
-	    seen_cr = 1;
-	    continue;
-	  }
+      for (i = len, len += n; i < len; i++)
+	{
+	  unsigned char c = buf[i];
 
-	if (tmp == '\n')
-	  {
-	    /*
-	     * line ends in NL only (no CR)
-	     */
-	    buf[i] = 0;
-	    return 0;
-	  }
+	  if (seen_cr)
+	    {
+	      if (c != '\n')
+		{
+		  /*
+		   * we have CR not followed by NL
+		   */
+		  if (buf[len - 1] != '\n')
+		    drain_eol (in);
+		  return COPY_BAD_DATA;
+		}
+	      /* line ends in CRLF */
+	      buf[i - 1] = 0;
+	      return COPY_OK;
+	    }
+	  else if (c == '\n')
+	    {
+	      /*
+	       * line ends in NL only (no CR)
+	       */
+	      buf[i] = 0;
+	      return COPY_OK;
+	    }
+	  else if (c == '\r')
+	    seen_cr = 1;
+	  else if (iscntrl (c) && c != '\t')
+	    {
+	      /*
+	       * all other control characters cause an error
+	       */
+	      if (buf[len - 1] != '\n')
+		drain_eol (in);
+	      return COPY_BAD_DATA;
+	    }
+	}
 
-	/*
-	 * all other control characters cause an error
-	 */
-	drain_eol (in);
-	return COPY_BAD_DATA;
-      }
+      if (len == bufsize - 1)
+	{
+	  /*
+	   * line too long
+	   */
+	  drain_eol (in);
+	  return COPY_TOO_LONG;
+	}
 
-  /*
-   * line too long
-   */
-  drain_eol (in);
-  return COPY_TOO_LONG;
+      /*
+       * Partial line: either EOF was hit or the underlying BIO
+       * returned less data than requested.  Try to read more.
+       */
+    }
 }
 
 /*
@@ -1346,10 +2317,12 @@ get_content_length (char const *arg, int mode)
 
 /*
  * Copy chunked
+ * If DATA_ONLY is true, only chunk data are written, without chunk
+ * framing and trailers.
  */
 static int
 copy_chunks (BIO *cl, BIO *be, CONTENT_LENGTH *res_bytes, int no_write,
-	     CONTENT_LENGTH max_size)
+	     int data_only, CONTENT_LENGTH max_size)
 {
   char buf[MAXBUF];
   CONTENT_LENGTH cont, tot_size;
@@ -1376,7 +2349,7 @@ copy_chunks (BIO *cl, BIO *be, CONTENT_LENGTH *res_bytes, int no_write,
 		  POUND_TID (), buf, strerror (errno));
 	  return HTTP_STATUS_BAD_REQUEST;
 	}
-      if (!no_write)
+      if (!no_write && !data_only)
 	if (BIO_printf (be, "%s\r\n", buf) <= 0)
 	  {
 	    logmsg (LOG_NOTICE, "(%"PRItid") error write chunked: %s",
@@ -1441,7 +2414,7 @@ copy_chunks (BIO *cl, BIO *be, CONTENT_LENGTH *res_bytes, int no_write,
 		  POUND_TID (), buf);
 	  return HTTP_STATUS_BAD_REQUEST;
 	}    
-      if (!no_write)
+      if (!no_write && !data_only)
 	if (BIO_printf (be, "%s\r\n", buf) <= 0)
 	  {
 	    logmsg (LOG_NOTICE, "(%"PRItid") error after chunk write: %s",
@@ -1464,7 +2437,7 @@ copy_chunks (BIO *cl, BIO *be, CONTENT_LENGTH *res_bytes, int no_write,
 	    : HTTP_STATUS_BAD_REQUEST;
 	}
 
-      if (!no_write)
+      if (!no_write && !data_only)
 	if (BIO_printf (be, "%s\r\n", buf) <= 0)
 	  {
 	    logmsg (LOG_NOTICE, "(%"PRItid") error post-chunk write: %s",
@@ -1484,14 +2457,6 @@ copy_chunks (BIO *cl, BIO *be, CONTENT_LENGTH *res_bytes, int no_write,
   return HTTP_STATUS_OK;
 }
 
-static int err_to = -1;
-
-typedef struct
-{
-  int timeout;
-  RENEG_STATE *reneg_state;
-} BIO_ARG;
-
 /*
  * Time-out for client read/gets
  * the SSL manual says not to do it, but it works well enough anyway...
@@ -1912,6 +2877,8 @@ qualify_header (struct http_header *hdr)
       hdr->name_end = matches[1].rm_eo;
       hdr->val_start = matches[2].rm_so;
       hdr->val_end = matches[2].rm_eo;
+      hdr->hash = strhash_ci (http_header_name_ptr (hdr),
+			      http_header_name_len (hdr));
       for (i = 0; hd_types[i].len > 0; i++)
 	if ((matches[1].rm_eo - matches[1].rm_so) == hd_types[i].len
 	    && strncasecmp (hdr->header + matches[1].rm_so, hd_types[i].header,
@@ -1922,23 +2889,82 @@ qualify_header (struct http_header *hdr)
       return hdr->code = HEADER_OTHER;
     }
   else
-    return hdr->code = HEADER_ILLEGAL;
+    {
+      hdr->hash = 0;
+      return hdr->code = HEADER_ILLEGAL;
+    }
 }
 
-static struct http_header *
-http_header_alloc (char *text)
+/*
+ * Memory for request data.  While a worker is processing a connection,
+ * headers and request strings are allocated from the connection arena
+ * (see do_http).  Each object remembers the arena it was allocated
+ * from (NULL meaning the heap), so that it can be released properly
+ * no matter in what context that happens.
+ */
+static void *
+http_mem_alloc (struct arena *arena, size_t n)
 {
-  struct http_header *hdr;
+  void *p = arena ? arena_alloc (arena, n) : malloc (n);
+  if (p == NULL)
+    lognomem ();
+  return p;
+}
 
-  if ((hdr = calloc (1, sizeof (*hdr))) == NULL)
+static char *
+http_mem_strndup (struct arena *arena, char const *s, size_t n)
+{
+  char *p;
+
+  if ((p = http_mem_alloc (arena, n + 1)) != NULL)
     {
-      lognomem ();
-      return NULL;
+      memcpy (p, s, n);
+      p[n] = 0;
     }
-  if ((hdr->header = strdup (text)) == NULL)
+  return p;
+}
+
+static inline char *
+http_mem_strdup (struct arena *arena, char const *s)
+{
+  return http_mem_strndup (arena, s, strlen (s));
+}
+
+static inline void
+http_mem_free (struct arena *arena, void *p)
+{
+  if (!arena)
+    free (p);
+}
+
+/*
+ * Move the string STR, obtained from malloc, to ARENA.
+ */
+static char *
+http_mem_adopt (struct arena *arena, char *str)
+{
+  char *p;
+
+  if (!arena || !str)
+    return str;
+  p = http_mem_strdup (arena, str);
+  free (str);
+  return p;
+}
+
+static struct http_header *
+http_header_alloc (char *text)
+{
+  struct arena *arena = arena_current ();
+  struct http_header *hdr;
+
+  if ((hdr = http_mem_alloc (arena, sizeof (*hdr))) == NULL)
+    return NULL;
+  memset (hdr, 0, sizeof (*hdr));
+  hdr->arena = arena;
+  if ((hdr->header = http_mem_strdup (arena, text)) == NULL)
     {
-      lognomem ();
-      free (hdr);
+      http_mem_free (arena, hdr);
       return NULL;
     }
 
@@ -1950,11 +2976,15 @@ http_header_alloc (char *text)
 static void
 http_header_free (struct http_header *hdr)
 {
-  free (hdr->header);
-  free (hdr->value);
-  free (hdr);
+  http_mem_free (hdr->arena, hdr->header);
+  http_mem_free (hdr->arena, hdr->value);
+  http_mem_free (hdr->arena, hdr);
 }
 
+/*
+ * Change the text of header HDR to TEXT.  Header name must remain the
+ * same, because HDR can be linked to an indexed header list.
+ */
 static int
 http_header_change (struct http_header *hdr, char const *text, int alloc)
 {
@@ -1962,17 +2992,14 @@ http_header_change (struct http_header *hdr, char const *text, int alloc)
 
   if (alloc)
     {
-      if ((ctext = strdup (text)) == NULL)
-	{
-	  lognomem ();
-	  return -1;
-	}
+      if ((ctext = http_mem_strdup (hdr->arena, text)) == NULL)
+	return -1;
     }
-  else
-    ctext = (char*)text;
-  free (hdr->header);
+  else if ((ctext = http_mem_adopt (hdr->arena, (char*)text)) == NULL)
+    return -1;
+  http_mem_free (hdr->arena, hdr->header);
   hdr->header = ctext;
-  free (hdr->value);
+  http_mem_free (hdr->arena, hdr->value);
   hdr->value = NULL;
   qualify_header (hdr);
   return 0;
@@ -2005,21 +3032,77 @@ http_header_get_value (struct http_header *hdr)
   if (!hdr->value)
     {
       size_t n = hdr->val_end - hdr->val_start + 1;
-      if ((hdr->value = malloc (n)) == NULL)
-	{
-	  lognomem ();
-	  return NULL;
-	}
+      if ((hdr->value = http_mem_alloc (hdr->arena, n)) == NULL)
+	return NULL;
       http_header_copy_value (hdr, hdr->value, n);
     }
   return hdr->value;
 }
 
+static inline struct http_header **
+http_header_list_bucket (HTTP_HEADER_LIST *head, unsigned long hash)
+{
+  return &head->name_index[hash & (HEADER_INDEX_SIZE - 1)];
+}
+
+/* Append header HDR to the list HEAD and index it. */
+static void
+http_header_list_link (HTTP_HEADER_LIST *head, struct http_header *hdr)
+{
+  struct http_header **pp;
+
+  DLIST_INSERT_TAIL (&head->list, hdr, link);
+  hdr->index_next = NULL;
+  for (pp = http_header_list_bucket (head, hdr->hash); *pp;
+       pp = &(*pp)->index_next)
+    ;
+  *pp = hdr;
+  if (hdr->code > HEADER_OTHER && head->code_index[hdr->code] == NULL)
+    head->code_index[hdr->code] = hdr;
+}
+
+/* Remove header HDR from the list HEAD and from its index. */
+static void
+http_header_list_unlink (HTTP_HEADER_LIST *head, struct http_header *hdr)
+{
+  struct http_header **pp;
+
+  for (pp = http_header_list_bucket (head, hdr->hash); *pp;
+       pp = &(*pp)->index_next)
+    {
+      if (*pp == hdr)
+	{
+	  *pp = hdr->index_next;
+	  break;
+	}
+    }
+  if (hdr->code > HEADER_OTHER && head->code_index[hdr->code] == hdr)
+    {
+      struct http_header *p = hdr;
+      while ((p = DLIST_NEXT (p, link)) != NULL && p->code != hdr->code)
+	;
+      head->code_index[hdr->code] = p;
+    }
+  DLIST_REMOVE (&head->list, hdr, link);
+}
+
+static inline int
+http_header_name_eq (struct http_header *hdr, unsigned long hash,
+		     char const *name, size_t len)
+{
+  return hdr->hash == hash
+	 && http_header_name_len (hdr) == len
+	 && strncasecmp (http_header_name_ptr (hdr), name, len) == 0;
+}
+
 static struct http_header *
 http_header_list_locate (HTTP_HEADER_LIST *head, int code)
 {
   struct http_header *hdr;
-  DLIST_FOREACH (hdr, head, link)
+
+  if (code > HEADER_OTHER && code < HEADER_CODES)
+    return head->code_index[code];
+  DLIST_FOREACH (hdr, &head->list, link)
     {
       if (hdr->code == code)
 	return hdr;
@@ -2032,12 +3115,15 @@ http_header_list_locate_name (HTTP_HEADER_LIST *head, char const *name,
 			      size_t len)
 {
   struct http_header *hdr;
+  unsigned long hash;
+
   if (len == 0)
     len = strcspn (name, ":");
-  DLIST_FOREACH (hdr, head, link)
+  hash = strhash_ci (name, len);
+  for (hdr = *http_header_list_bucket (head, hash); hdr;
+       hdr = hdr->index_next)
     {
-      if (http_header_name_len (hdr) == len &&
-	  strncasecmp (http_header_name_ptr (hdr), name, len) == 0)
+      if (http_header_name_eq (hdr, hash, name, len))
 	return hdr;
     }
   return NULL;
@@ -2049,10 +3135,11 @@ http_header_list_next (struct http_header *hdr)
 {
   size_t len = http_header_name_len (hdr);
   char const *name = http_header_name_ptr (hdr);
-  while ((hdr = DLIST_NEXT (hdr, link)) != NULL)
+  unsigned long hash = hdr->hash;
+
+  while ((hdr = hdr->index_next) != NULL)
     {
-      if (http_header_name_len (hdr) == len &&
-	  strncasecmp (http_header_name_ptr (hdr), name, len) == 0)
+      if (http_header_name_eq (hdr, hash, name, len))
 	return hdr;
     }
   return NULL;
@@ -2114,7 +3201,7 @@ http_header_list_append (HTTP_HEADER_LIST *head, char *text, int replace)
       return 1;
     }
   else
-    DLIST_INSERT_TAIL (head, hdr, link);
+    http_header_list_link (head, hdr);
   return 0;
 }
 
@@ -2123,7 +3210,7 @@ http_header_list_append_list (HTTP_HEADER_LIST *head, HTTP_HEADER_LIST *add,
 			      int replace)
 {
   struct http_header *hdr;
-  DLIST_FOREACH (hdr, add, link)
+  DLIST_FOREACH (hdr, &add->list, link)
     {
       if (http_header_list_append (head, hdr->header, replace))
 	return -1;
@@ -2134,18 +3221,20 @@ http_header_list_append_list (HTTP_HEADER_LIST *head, HTTP_HEADER_LIST *add,
 static void
 http_header_list_free (HTTP_HEADER_LIST *head)
 {
-  while (!DLIST_EMPTY (head))
+  while (!DLIST_EMPTY (&head->list))
     {
-      struct http_header *hdr = DLIST_FIRST (head);
-      DLIST_REMOVE_HEAD (head, link);
+      struct http_header *hdr = DLIST_FIRST (&head->list);
+      DLIST_REMOVE_HEAD (&head->list, link);
       http_header_free (hdr);
     }
+  memset (head->code_index, 0, sizeof (head->code_index));
+  memset (head->name_index, 0, sizeof (head->name_index));
 }
 
 static void
 http_header_list_remove (HTTP_HEADER_LIST *head, struct http_header *hdr)
 {
-  DLIST_REMOVE (head, hdr, link);
+  http_header_list_unlink (head, hdr);
   http_header_free (hdr);
 }
 
@@ -2154,7 +3243,7 @@ http_header_list_filter (HTTP_HEADER_LIST *head, MATCHER *m)
 {
   struct http_header *hdr, *tmp;
 
-  DLIST_FOREACH_SAFE (hdr, tmp, head, link)
+  DLIST_FOREACH_SAFE (hdr, tmp, &head->list, link)
     {
       if (genpat_match (m->pat, hdr->header, 0, NULL) == 0)
 	{
@@ -2186,26 +3275,19 @@ http_request_split (struct http_request *req)
 	    }
 	}
 
-      free (req->path);
-      if ((req->path = malloc (path_len + 1)) == NULL)
-	{
-	  lognomem ();
-	  return -1;
-	}
-      memcpy (req->path, req->url, path_len);
-      req->path[path_len] = 0;
+      http_mem_free (req->arena, req->path);
+      if ((req->path = http_mem_strndup (req->arena, req->url,
+					 path_len)) == NULL)
+	return -1;
 
-      free (req->query);
+      http_mem_free (req->arena, req->query);
       http_request_free_query (req);
       if (query_len > 0)
 	{
-	  if ((req->query = malloc (query_len + 1)) == NULL)
-	    {
-	      lognomem ();
-	      return -1;
-	    }
-	  memcpy (req->query, req->url + query_start, query_len);
-	  req->query[query_len] = 0;
+	  if ((req->query = http_mem_strndup (req->arena,
+					      req->url + query_start,
+					      query_len)) == NULL)
+	    return -1;
 	}
       else
 	req->query = NULL;
@@ -2235,9 +3317,11 @@ http_request_rebuild_line (struct http_request *req)
       stringbuf_free (&sb);
       return -1;
     }
+  if ((str = http_mem_adopt (req->arena, str)) == NULL)
+    return -1;
 
   if (req->orig_request_line)
-    free (req->request);
+    http_mem_free (req->arena, req->request);
   else
     req->orig_request_line = req->request;
   req->request = str;
@@ -2263,7 +3347,9 @@ http_request_rebuild_url (struct http_request *req)
       stringbuf_free (&sb);
       return -1;
     }
-  free (req->url);
+  if ((str = http_mem_adopt (req->arena, str)) == NULL)
+    return -1;
+  http_mem_free (req->arena, req->url);
   req->url = str;
 
   return http_request_rebuild_line (req);
@@ -2296,7 +3382,9 @@ http_request_rebuild_query (struct http_request *req)
       stringbuf_free (&sb);
       return -1;
     }
-  free (req->query);
+  if ((p = http_mem_adopt (req->arena, p)) == NULL)
+    return -1;
+  http_mem_free (req->arena, req->query);
   req->query = p;
 
   return http_request_rebuild_url (req);
@@ -2330,12 +3418,9 @@ http_request_set_url (struct http_request *req, char const *url)
 {
   char *p;
 
-  if ((p = strdup (url)) == NULL)
-    {
-      lognomem ();
-      return -1;
-    }
-  free (req->url);
+  if ((p = http_mem_strdup (req->arena, url)) == NULL)
+    return -1;
+  http_mem_free (req->arena, req->url);
   req->url = p;
   req->split = 1;
   return http_request_rebuild_line (req);
@@ -2361,12 +3446,9 @@ http_request_set_path (struct http_request *req, char const *path)
 
   if (http_request_get_path (req, &s))
     return -1;
-  if ((val = strdup (path)) == NULL)
-    {
-      lognomem ();
-      return -1;
-    }
-  free (req->path);
+  if ((val = http_mem_strdup (req->arena, path)) == NULL)
+    return -1;
+  http_mem_free (req->arena, req->path);
   req->path = val;
 
   return http_request_rebuild_url (req);
@@ -2382,11 +3464,11 @@ http_request_get_query (struct http_request *req, char const **retval)
 }
 
 static void
-query_param_free (struct query_param *qp)
+query_param_free (struct arena *arena, struct query_param *qp)
 {
-  free (qp->name);
-  free (qp->value);
-  free (qp);
+  http_mem_free (arena, qp->name);
+  http_mem_free (arena, qp->value);
+  http_mem_free (arena, qp);
 }
 
 static void
@@ -2396,7 +3478,7 @@ http_request_free_query (struct http_request *req)
     {
       struct query_param *qp = DLIST_FIRST (&req->query_head);
       DLIST_SHIFT (&req->query_head, link);
-      query_param_free (qp);
+      query_param_free (req->arena, qp);
     }
 }
 
@@ -2426,29 +3508,19 @@ http_request_parse_query (struct http_request *req)
 	  else
 	    {
 	      nl = q - query;
-	      if ((val = malloc (pl - nl)) == NULL)
-		{
-		  lognomem ();
-		  return -1;
-		}
-	      memcpy (val, query + nl + 1, pl - nl - 1);
-	      val[pl - nl - 1] = 0;
+	      if ((val = http_mem_strndup (req->arena, query + nl + 1,
+					   pl - nl - 1)) == NULL)
+		return -1;
 	    }
 
-	  if ((qp = malloc (sizeof (*qp))) == NULL)
-	    {
-	      lognomem ();
-	      return -1;
-	    }
+	  if ((qp = http_mem_alloc (req->arena, sizeof (*qp))) == NULL)
+	    return -1;
 
-	  if ((qp->name = malloc (nl + 1)) == NULL)
+	  if ((qp->name = http_mem_strndup (req->arena, query, nl)) == NULL)
 	    {
-	      lognomem ();
-	      free (qp);
+	      http_mem_free (req->arena, qp);
 	      return -1;
 	    }
-	  memcpy (qp->name, query, nl);
-	  qp->name[nl] = 0;
 	  qp->value = val;
 
 	  DLIST_PUSH (&req->query_head, qp, link);
@@ -2502,12 +3574,9 @@ http_request_set_query (struct http_request *req, char const *rawquery)
 
   if (http_request_split (req))
       return -1;
-  if ((p = strdup (rawquery)) == NULL)
-    {
-      lognomem ();
-      return -1;
-    }
-  free (req->query);
+  if ((p = http_mem_strdup (req->arena, rawquery)) == NULL)
+    return -1;
+  http_mem_free (req->arena, req->query);
   req->query = p;
   http_request_free_query (req);
   return http_request_rebuild_url (req);
@@ -2530,20 +3599,13 @@ http_request_set_query_param (struct http_request *req, char const *name,
       /* not found */
       if (raw_value == NULL)
 	return RETRIEVE_OK;
-      if ((value = strdup (raw_value)) == NULL)
-	{
-	  lognomem ();
-	  return RETRIEVE_ERROR;
-	}
-      if ((qp = malloc (sizeof (*qp))) == NULL)
-	{
-	  lognomem ();
-	  return RETRIEVE_ERROR;
-	}
-      if ((qp->name = strdup (name)) == NULL)
+      if ((value = http_mem_strdup (req->arena, raw_value)) == NULL)
+	return RETRIEVE_ERROR;
+      if ((qp = http_mem_alloc (req->arena, sizeof (*qp))) == NULL)
+	return RETRIEVE_ERROR;
+      if ((qp->name = http_mem_strdup (req->arena, name)) == NULL)
 	{
-	  lognomem ();
-	  free (qp);
+	  http_mem_free (req->arena, qp);
 	  return RETRIEVE_ERROR;
 	}
       qp->value = value;
@@ -2554,16 +3616,13 @@ http_request_set_query_param (struct http_request *req, char const *name,
       if (raw_value == 0)
 	{
 	  DLIST_REMOVE (&req->query_head, qp, link);
-	  query_param_free (qp);
+	  query_param_free (req->arena, qp);
 	}
       else
 	{
-	  if ((value = strdup (raw_value)) == NULL)
-	    {
-	      lognomem ();
-	      return -1;
-	    }
-	  free (qp->value);
+	  if ((value = http_mem_strdup (req->arena, raw_value)) == NULL)
+	    return -1;
+	  http_mem_free (req->arena, qp->value);
 	  qp->value = value;
 	}
       break;
@@ -2590,13 +3649,13 @@ http_request_host (struct http_request *req)
 void
 http_request_free (struct http_request *req)
 {
-  free (req->request);
+  http_mem_free (req->arena, req->request);
   http_header_list_free (&req->headers);
-  free (req->url);
-  free (req->path);
-  free (req->query);
+  http_mem_free (req->arena, req->url);
+  http_mem_free (req->arena, req->path);
+  http_mem_free (req->arena, req->query);
   http_request_free_query (req);
-  free (req->orig_request_line);
+  http_mem_free (req->arena, req->orig_request_line);
   http_request_init (req);
 }
 
@@ -2685,6 +3744,7 @@ http_request_read (BIO *in, const LISTENER *lstn, struct http_request *req)
     }
 
   http_request_init (req);
+  req->arena = arena_current ();
 
   /*
    * HTTP/1.1 allows leading CRLF
@@ -2712,9 +3772,8 @@ http_request_read (BIO *in, const LISTENER *lstn, struct http_request *req)
       return HTTP_STATUS_BAD_REQUEST;
     }
 
-  if ((req->request = strdup (buf)) == NULL)
+  if ((req->request = http_mem_strdup (req->arena, buf)) == NULL)
     {
-      lognomem ();
       compose_header_hash_free (chash);
       return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
@@ -2790,7 +3849,7 @@ http_request_read (BIO *in, const LISTENER *lstn, struct http_request *req)
 		  COMPOSE_HEADER_INSERT (chash, comp);
 		}
 	    }
-	  DLIST_INSERT_TAIL (&req->headers, hdr, link);
+	  http_header_list_link (&req->headers, hdr);
 	}
     }
 
@@ -2971,13 +4030,8 @@ parse_http_request (struct http_request *req, int group)
   if (status == HTTP_STATUS_OK)
     {
       req->method = md->meth;
-      if ((req->url = malloc (len + 1)) == NULL)
-	{
-	  lognomem ();
-	  return HTTP_STATUS_INTERNAL_SERVER_ERROR;
-	}
-      memcpy (req->url, url, len);
-      req->url[len] = 0;
+      if ((req->url = http_mem_strndup (req->arena, url, len)) == NULL)
+	return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
       req->version = http_ver - '0';
       req->split = 1;
@@ -2992,7 +4046,7 @@ match_headers (HTTP_HEADER_LIST *headers, GENPAT re,
 {
   struct http_header *hdr;
 
-  DLIST_FOREACH (hdr, headers, link)
+  DLIST_FOREACH (hdr, &headers->list, link)
     {
       if (hdr->header && submatch_exec (re, hdr->header, sm))
 	return 1;
@@ -3000,6 +4054,39 @@ match_headers (HTTP_HEADER_LIST *headers, GENPAT re,
   return 0;
 }
 
+/*
+ * Match HEADERS against RE, storing the result in a new entry of the
+ * submatch queue SMQ.  For pattern sets, find the header matching the
+ * lowest group, as the fused conditions would have been tried one by
+ * one against all headers.
+ */
+static int
+submatch_queue_match_headers (struct submatch_queue *smq,
+			      HTTP_HEADER_LIST *headers, GENPAT re)
+{
+  size_t n = genpat_set_groups (re), group, best;
+  struct http_header *hdr;
+  char const *subject = NULL;
+
+  if (n <= 1)
+    return match_headers (headers, re, submatch_queue_push (smq));
+
+  best = n;
+  DLIST_FOREACH (hdr, &headers->list, link)
+    {
+      if (hdr->header
+	  && genpat_set_match_group (re, hdr->header, &group) == 0
+	  && group < best)
+	{
+	  best = group;
+	  subject = hdr->header;
+	  if (group == 0)
+	    break;
+	}
+    }
+  return submatch_queue_push_set (smq, n, best, subject);
+}
+
 /*
  * Match request (or response) REQ obtained from PHTTP against condition COND.
  * Return value:
@@ -3030,21 +4117,21 @@ match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
       if (http_request_get_url (req, &str) == -1)
 	res = -1;
       else
-	res = submatch_exec (cond->re, str, submatch_queue_push (&phttp->smq));
+	res = submatch_queue_exec (&phttp->smq, cond->re, str);
       break;
 
     case COND_PATH:
       if (http_request_get_path (req, &str) == -1)
 	res = -1;
       else
-	res = submatch_exec (cond->re, str, submatch_queue_push (&phttp->smq));
+	res = submatch_queue_exec (&phttp->smq, cond->re, str);
       break;
 
     case COND_QUERY:
       if (http_request_get_query (req, &str) == -1)
 	res = -1;
       else
-	res = submatch_exec (cond->re, str, submatch_queue_push (&phttp->smq));
+	res = submatch_queue_exec (&phttp->smq, cond->re, str);
       break;
 
     case COND_QUERY_PARAM:
@@ -3069,8 +4156,8 @@ match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
       break;
 
     case COND_HDR:
-      res = match_headers (&req->headers, cond->re,
-			   submatch_queue_push (&phttp->smq));
+      res = submatch_queue_match_headers (&phttp->smq, &req->headers,
+					  cond->re);
       break;
 
     case COND_HOST:
@@ -3128,14 +4215,10 @@ match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
       {
 	char *subj;
 
-	subj = expand_string (cond->sm.string->value, phttp, req,
-			      "string_match");
+	subj = expand_string (cond->sm.prog, phttp, "string_match");
 	if (subj)
-	  {
-	    res = submatch_exec (cond->sm.re, subj,
-				 submatch_queue_push (&phttp->smq));
-	    free (subj);
-	  }
+	  res = submatch_exec (cond->sm.re, subj,
+			       submatch_queue_push (&phttp->smq));
 	else
 	  res = -1;
       }
@@ -3166,7 +4249,29 @@ match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
     case COND_CLIENT_CERT:
       res = (phttp->x509 != NULL &&
 	     X509_cmp (phttp->x509, cond->x509) == 0 &&
-	     SSL_get_verify_result (phttp->ssl) == X509_V_OK);
+	     (phttp->tls
+		? phttp->tls->verify_result
+		: SSL_get_verify_result (phttp->ssl)) == X509_V_OK);
+      break;
+
+    case COND_RATE_LIMIT:
+      {
+	char caddr[MAX_ADDR_BUFSIZE];
+	char const *key;
+
+	if (cond->rl.key)
+	  key = expand_string (cond->rl.key, phttp, "rate_limit");
+	else
+	  key = addr2str (caddr, sizeof (caddr), &phttp->from_host, 1);
+	if (key == NULL)
+	  res = -1;
+	else if (*key == 0)
+	  /* Requests with empty key are not limited. */
+	  res = 0;
+	else
+	  res = rate_limit_check (cond->rl.limit, key);
+      }
+      break;
     }
 
   return res;
@@ -3188,7 +4293,7 @@ static int
 http_headers_send (BIO *be, HTTP_HEADER_LIST *head, int safe)
 {
   struct http_header *hdr;
-  DLIST_FOREACH (hdr, head, link)
+  DLIST_FOREACH (hdr, &head->list, link)
     {
       if (safe &&
 	  (hdr->code == HEADER_CONTENT_LENGTH ||
@@ -3233,7 +4338,7 @@ add_forwarded_headers (POUND_HTTP *phttp)
 
   stringbuf_reset (&sb);
   stringbuf_printf (&sb, "X-Forwarded-Proto: %s",
-		    phttp->ssl == NULL ? "http" : "https");
+		    pound_http_is_tls (phttp) ? "https" : "http");
   if ((str = stringbuf_finish (&sb)) == NULL
       || http_header_list_append (&phttp->request.headers, str, H_REPLACE))
     {
@@ -3293,24 +4398,66 @@ set_header_from_bio (BIO *bio, struct http_request *req,
   return 0;
 }
 
+/*
+ * Obtain TLS parameters of the connection SSL.
+ */
+void
+tls_info_init (struct tls_info *tls, SSL *ssl)
+{
+  const SSL_CIPHER *cipher;
+
+  tls->verify_result = SSL_get_verify_result (ssl);
+  tls->version = SSL_get_version (ssl);
+  tls->cipher = NULL;
+  if ((cipher = SSL_get_current_cipher (ssl)) != NULL)
+    {
+      char buf[MAXBUF];
+
+      SSL_CIPHER_description (cipher, buf, sizeof (buf));
+      strip_eol (buf);
+      tls->cipher = xstrdup (buf);
+    }
+}
+
+void
+tls_info_free (struct tls_info *tls)
+{
+  free (tls->cipher);
+  tls->cipher = NULL;
+}
+
 static int
 add_ssl_headers (POUND_HTTP *phttp)
 {
   int res = 0;
-  const SSL_CIPHER *cipher;
   struct stringbuf sb;
   char *str;
   char buf[MAXBUF];
+  char const *version = NULL, *descr = NULL;
   BIO *bio = NULL;
 
+  if (phttp->tls)
+    {
+      version = phttp->tls->version;
+      descr = phttp->tls->cipher;
+    }
+  else
+    {
+      const SSL_CIPHER *cipher;
+
+      if ((cipher = SSL_get_current_cipher (phttp->ssl)) != NULL)
+	{
+	  SSL_CIPHER_description (cipher, buf, sizeof (buf));
+	  strip_eol (buf);
+	  version = SSL_get_version (phttp->ssl);
+	  descr = buf;
+	}
+    }
+
   stringbuf_init_log (&sb);
-  if ((cipher = SSL_get_current_cipher (phttp->ssl)) != NULL)
+  if (descr)
     {
-      SSL_CIPHER_description (cipher, buf, sizeof (buf));
-      strip_eol (buf);
-      stringbuf_printf (&sb, "X-SSL-cipher: %s/%s",
-			SSL_get_version (phttp->ssl),
-			buf);
+      stringbuf_printf (&sb, "X-SSL-cipher: %s/%s", version, descr);
       if ((str = stringbuf_finish (&sb)) == NULL
 	  || http_header_list_append (&phttp->request.headers, str, H_REPLACE))
 	{
@@ -3428,33 +4575,23 @@ rewrite_op_apply (REWRITE_OP_HEAD *head, struct http_request *request,
 	  break;
 
 	case REWRITE_HDR_SET:
-	  if ((s = expand_string (op->v.str, phttp, request, "Header")) != NULL)
-	    {
-	      res = http_header_list_append (&request->headers, s, H_REPLACE);
-	      free (s);
-	    }
+	  if ((s = expand_string (op->prog, phttp, "Header")) != NULL)
+	    res = http_header_list_append (&request->headers, s, H_REPLACE);
 	  else
 	    res = -1;
 	  break;
 
 	case REWRITE_QUERY_PARAM_SET:
-	  if ((s = expand_string (op->v.qp.value, phttp, request,
-				  "query parameter")) != NULL)
-	    {
-	      res = http_request_set_query_param (request, op->v.qp.name, s);
-	      free (s);
-	    }
+	  if ((s = expand_string (op->prog, phttp, "query parameter")) != NULL)
+	    res = http_request_set_query_param (request, op->v.qp.name, s);
 	  else
 	    res = -1;
 	  break;
 
 	default:
-	  if ((s = expand_string (op->v.str, phttp, request,
+	  if ((s = expand_string (op->prog, phttp,
 				  rwtab[op->type].name)) != NULL)
-	    {
-	      res = rwtab[op->type].setter (request, s);
-	      free (s);
-	    }
+	    res = rwtab[op->type].setter (request, s);
 	  else
 	    res = -1;
 	  break;
@@ -3541,31 +4678,247 @@ force_http_10 (POUND_HTTP *phttp)
   switch (phttp->lstn->noHTTPS11)
     {
     case 1:
-      return (phttp->ssl != NULL);
+      return pound_http_is_tls (phttp);
+
+    case 2:
+      {
+	char const *agent = http_request_header_value (&phttp->request,
+						       HEADER_USER_AGENT);
+	return (pound_http_is_tls (phttp) && agent != NULL &&
+		strstr (agent, "MSIE") != NULL);
+      }
+
+    default:
+      break;
+    }
+  return 0;
+}
+
+static void
+close_backend (POUND_HTTP *phttp)
+{
+  if (phttp->be)
+    {
+      BIO_reset (phttp->be);
+      BIO_free_all (phttp->be);
+      phttp->be = NULL;
+    }
+}
+
+/*
+ * Pools of idle backend connections.
+ *
+ * When a response from a regular backend has been processed and the
+ * backend connection can be kept alive, it is placed into the pool of
+ * that backend (provided that its ConnPool setting is not 0), instead of
+ * being closed.  Subsequent requests to the same backend, whatever client
+ * they come from, take their connection from the pool.  Connections are
+ * kept in most-recently-used order, so that the least recently used one
+ * is at the tail.  It is closed when its idle time-out expires, or when
+ * the pool gets full.
+ */
+void
+backend_pool_init (struct be_pool *pool)
+{
+  pthread_mutex_init (&pool->mut, NULL);
+  DLIST_INIT (&pool->head);
+  pool->count = 0;
+  pool->armed = 0;
+  pool->hits = pool->misses = 0;
+}
+
+static void
+be_conn_free (struct be_conn *conn)
+{
+  BIO_reset (conn->bio);
+  BIO_free_all (conn->bio);
+  free (conn);
+}
+
+void
+backend_pool_free (struct be_pool *pool)
+{
+  struct be_conn *conn;
+
+  while ((conn = DLIST_FIRST (&pool->head)) != NULL)
+    {
+      DLIST_REMOVE (&pool->head, conn, link);
+      be_conn_free (conn);
+    }
+  pool->count = 0;
+  pthread_mutex_destroy (&pool->mut);
+}
+
+/*
+ * Return the callback argument of the socket BIO underlying the
+ * backend BIO chain BE.
+ */
+static BIO_ARG *
+backend_bio_arg (BIO *be)
+{
+  BIO *bio = BIO_next (be);
+
+  if (bio && BIO_method_type (bio) == BIO_TYPE_SSL)
+    {
+      SSL *ssl = NULL;
+
+      BIO_get_ssl (bio, &ssl);
+      bio = ssl ? SSL_get_rbio (ssl) : NULL;
+    }
+  return bio ? (BIO_ARG *) BIO_get_callback_arg (bio) : NULL;
+}
+
+/*
+ * Periodic job: close expired connections in the pool of the backend
+ * passed as DATA.  Rearms itself for the expiration time of the least
+ * recently used connection, if any.  When cancelled, closes all
+ * connections.
+ */
+static void
+backend_pool_expire (enum job_ctl ctl, void *data, const struct timespec *now)
+{
+  BACKEND *be = data;
+  struct be_pool *pool = &be->v.reg.pool;
+  struct be_conn *conn;
+
+  pthread_mutex_lock (&pool->mut);
+  while ((conn = DLIST_LAST (&pool->head)) != NULL &&
+	 (ctl != job_ctl_run || timespec_cmp (&conn->expire, now) <= 0))
+    {
+      DLIST_REMOVE (&pool->head, conn, link);
+      pool->count--;
+      be_conn_free (conn);
+    }
+  if (conn)
+    job_enqueue (&conn->expire, backend_pool_expire, be);
+  else
+    pool->armed = 0;
+  pthread_mutex_unlock (&pool->mut);
+  if (!conn)
+    backend_unref (be);
+}
+
+/*
+ * Get an idle connection to the backend BE from its pool.  Connections
+ * that expired or were closed by the backend are discarded.  On success,
+ * return the connection BIO chain, with its renegotiation state pointer
+ * set to STATE.  Return NULL if no usable connection is available.
+ */
+static BIO *
+backend_pool_get (BACKEND *be, RENEG_STATE *state)
+{
+  struct be_pool *pool = &be->v.reg.pool;
+  struct be_conn *conn;
+  struct timespec now;
+  BIO *bio = NULL;
+  BIO_ARG *arg;
+
+  if (pool->max_idle == 0)
+    return NULL;
+
+  clock_gettime (CLOCK_REALTIME, &now);
+  for (;;)
+    {
+      pthread_mutex_lock (&pool->mut);
+      if ((conn = DLIST_FIRST (&pool->head)) != NULL)
+	{
+	  DLIST_REMOVE (&pool->head, conn, link);
+	  pool->count--;
+	}
+      pthread_mutex_unlock (&pool->mut);
+      if (conn == NULL)
+	break;
+      /*
+       * An idle connection is readable only if the backend has closed it
+       * (or sent some garbage), so don't use it.  The connection is no
+       * longer in the pool, so this is checked without locking it.
+       */
+      if (timespec_cmp (&conn->expire, &now) > 0 && !is_readable (conn->bio, 0))
+	{
+	  bio = conn->bio;
+	  free (conn);
+	  break;
+	}
+      be_conn_free (conn);
+    }
+  __atomic_add_fetch (bio ? &pool->hits : &pool->misses, 1, __ATOMIC_RELAXED);
+
+  if (bio && (arg = backend_bio_arg (bio)) != NULL)
+    arg->reneg_state = state;
+
+  return bio;
+}
+
+/*
+ * Place the backend connection of PHTTP into the pool of its backend.
+ * Return 0 on success.  Otherwise, if the connection can't be reused
+ * or the backend has no pool, return -1 and leave phttp->be untouched.
+ */
+int
+backend_pool_release (POUND_HTTP *phttp)
+{
+  BACKEND *be = phttp->backend;
+  struct be_pool *pool;
+  struct be_conn *conn, *victim = NULL;
+  BIO_ARG *arg;
+
+  if (phttp->be == NULL || !phttp->be_keepalive || be == NULL
+      || be->be_type != BE_REGULAR)
+    return -1;
+  pool = &be->v.reg.pool;
+  if (pool->max_idle == 0 || BIO_pending (phttp->be) > 0)
+    return -1;
+  if ((arg = backend_bio_arg (phttp->be)) != NULL)
+    {
+      /* Don't reuse connection that timed out. */
+      if (arg->timeout < 0)
+	return -1;
+      arg->reneg_state = NULL;
+    }
 
-    case 2:
-      {
-	char const *agent = http_request_header_value (&phttp->request,
-						       HEADER_USER_AGENT);
-	return (phttp->ssl != NULL && agent != NULL &&
-		strstr (agent, "MSIE") != NULL);
-      }
+  if ((conn = malloc (sizeof (*conn))) == NULL)
+    {
+      lognomem ();
+      return -1;
+    }
+  conn->bio = phttp->be;
+  clock_gettime (CLOCK_REALTIME, &conn->expire);
+  conn->expire.tv_sec += pool->idle_to;
 
-    default:
-      break;
+  pthread_mutex_lock (&pool->mut);
+  if (pool->count == pool->max_idle)
+    {
+      victim = DLIST_LAST (&pool->head);
+      DLIST_REMOVE (&pool->head, victim, link);
+      pool->count--;
+    }
+  DLIST_INSERT_HEAD (&pool->head, conn, link);
+  pool->count++;
+  if (!pool->armed)
+    {
+      pool->armed = 1;
+      backend_ref (be);
+      job_enqueue (&conn->expire, backend_pool_expire, be);
     }
+  pthread_mutex_unlock (&pool->mut);
+
+  if (victim)
+    be_conn_free (victim);
+
+  phttp->be = NULL;
+  phttp->be_keepalive = 0;
   return 0;
 }
 
+/*
+ * Release the backend connection: return it to the pool, if possible,
+ * or close it otherwise.
+ */
 static void
-close_backend (POUND_HTTP *phttp)
+release_backend (POUND_HTTP *phttp)
 {
-  if (phttp->be)
-    {
-      BIO_reset (phttp->be);
-      BIO_free_all (phttp->be);
-      phttp->be = NULL;
-    }
+  if (backend_pool_release (phttp))
+    close_backend (phttp);
 }
 
 /*
@@ -3652,6 +5005,490 @@ http_response_validate (struct http_request *req)
   return 0;
 }
 
+/*
+ * Response cache support.
+ */
+
+/* Cache-Control directives relevant for caching. */
+struct cache_control
+{
+  int no_store;
+  int no_cache;
+  int private;
+  long max_age;           /* -1 if not given */
+  long s_maxage;          /* -1 if not given */
+};
+
+/* Parse Cache-Control headers from the list HEAD into CC. */
+static void
+cache_control_parse (HTTP_HEADER_LIST *head, struct cache_control *cc)
+{
+  struct http_header *hdr;
+
+  cc->no_store = cc->no_cache = cc->private = 0;
+  cc->max_age = cc->s_maxage = -1;
+  for (hdr = http_header_list_locate_name (head, "Cache-Control", 0);
+       hdr;
+       hdr = http_header_list_next (hdr))
+    {
+      char const *p = http_header_get_value (hdr);
+      char const *val;
+      size_t len;
+
+      if (p == NULL)
+	continue;
+      for (;;)
+	{
+	  p += strspn (p, " \t,");
+	  if (*p == 0)
+	    break;
+	  len = strcspn (p, " \t,=");
+	  if (p[len] == '=')
+	    val = p + len + 1;
+	  else
+	    val = NULL;
+
+	  if (len == 8 && strncasecmp (p, "no-store", len) == 0)
+	    cc->no_store = 1;
+	  else if (len == 8 && strncasecmp (p, "no-cache", len) == 0)
+	    cc->no_cache = 1;
+	  else if (len == 7 && strncasecmp (p, "private", len) == 0)
+	    cc->private = 1;
+	  else if (len == 7 && strncasecmp (p, "max-age", len) == 0 && val)
+	    cc->max_age = isdigit (*val) ? strtol (val, NULL, 10) : 0;
+	  else if (len == 8 && strncasecmp (p, "s-maxage", len) == 0 && val)
+	    cc->s_maxage = isdigit (*val) ? strtol (val, NULL, 10) : 0;
+
+	  p += len;
+	  if (val)
+	    {
+	      p = val;
+	      if (*p == '"')
+		{
+		  if ((p = strchr (p + 1, '"')) == NULL)
+		    break;
+		  p++;
+		}
+	    }
+	  p += strcspn (p, ",");
+	}
+    }
+}
+
+/* Parse HTTP date (RFC 9110, 5.6.7) from STR into *T. */
+static int
+http_date_parse (char const *str, time_t *t)
+{
+  struct tm tm;
+  char *p;
+
+  memset (&tm, 0, sizeof (tm));
+  if ((p = strptime (str, "%a, %d %b %Y %H:%M:%S GMT", &tm)) == NULL || *p)
+    return -1;
+  *t = timegm (&tm);
+  return 0;
+}
+
+/* Return the value of the header NAME from the list HEAD, or NULL. */
+static char *
+http_header_list_value (HTTP_HEADER_LIST *head, char const *name)
+{
+  struct http_header *hdr = http_header_list_locate_name (head, name, 0);
+  return hdr ? http_header_get_value (hdr) : NULL;
+}
+
+/*
+ * Return true if the request can be served from the cache.  HAS_BODY
+ * is true if it has a body.
+ */
+static int
+cache_request_eligible (POUND_HTTP *phttp, int has_body)
+{
+  HTTP_HEADER_LIST *head = &phttp->request.headers;
+  struct cache_control cc;
+  char *val;
+
+  if ((phttp->request.method != METH_GET
+       && phttp->request.method != METH_HEAD)
+      || has_body
+      || (phttp->ws_state & WSS_REQ_HEADER_UPGRADE_WEBSOCKET)
+      || http_header_list_locate (head, HEADER_AUTHORIZATION)
+      || http_header_list_locate_name (head, "Range", 0))
+    return 0;
+
+  cache_control_parse (head, &cc);
+  if (cc.no_store || cc.no_cache)
+    return 0;
+  if ((val = http_header_list_value (head, "Pragma")) != NULL
+      && cs_locate_token (val, "no-cache", 1, NULL))
+    return 0;
+  return 1;
+}
+
+/*
+ * Return the content coding to compress the response to the current
+ * request with, or -1 if the client doesn't accept any of the codings
+ * configured for the service.
+ */
+static int
+compress_request_coding (POUND_HTTP *phttp)
+{
+  char *val;
+
+  if (phttp->svc->compress == NULL
+      || phttp->request.version != 1
+      || (val = http_header_list_value (&phttp->request.headers,
+					"Accept-Encoding")) == NULL)
+    return -1;
+  return compress_negotiate (phttp->svc->compress, val);
+}
+
+/*
+ * Look up the response to the current request in the cache of its
+ * service.  Return CACHE_HIT if it is found.  The entry to serve the
+ * response from is then stored in phttp->cache_entry.  If CACHE_MISS is
+ * returned, phttp->cache_entry is the pending entry to be filled from
+ * the backend response.
+ */
+static int
+service_cache_lookup (POUND_HTTP *phttp, int has_body)
+{
+  struct http_cache *cache = phttp->svc->cache;
+  char const *host;
+  struct stringbuf sb;
+  char *key;
+  int rc, enc;
+
+  if (!cache_request_eligible (phttp, has_body))
+    {
+      http_cache_bypass (cache);
+      return CACHE_BYPASS;
+    }
+
+  stringbuf_init_log (&sb);
+  stringbuf_add_string (&sb, pound_http_is_tls (phttp) ? "https://" : "http://");
+  if ((host = http_request_host (&phttp->request)) != NULL)
+    for (; *host; host++)
+      stringbuf_add_char (&sb, tolower (*host));
+  stringbuf_add_string (&sb, phttp->request.url);
+  /* Compressed responses are cached separately for each coding. */
+  if ((enc = compress_request_coding (phttp)) != -1)
+    {
+      stringbuf_add_char (&sb, '\n');
+      stringbuf_add_string (&sb, compress_coding_name (enc));
+    }
+  if ((key = stringbuf_finish (&sb)) == NULL)
+    {
+      stringbuf_free (&sb);
+      return CACHE_BYPASS;
+    }
+
+  rc = cache_lookup (cache, key, phttp->request.method == METH_GET,
+		     phttp->request.version == 1, &phttp->cache_entry);
+  stringbuf_free (&sb);
+  return rc;
+}
+
+/*
+ * Decide whether the backend response can be stored in the cache.
+ * Return its lifetime in seconds, or 0 if it can't be cached.  Store
+ * the value of its Age header in *RET_AGE.
+ */
+static time_t
+response_cache_ttl (POUND_HTTP *phttp, unsigned *ret_age)
+{
+  HTTP_HEADER_LIST *head = &phttp->response.headers;
+  struct cache_control cc;
+  time_t ttl, date, expires;
+  long age = 0;
+  char *val;
+
+  switch (phttp->response_code)
+    {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 308:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+      break;
+
+    default:
+      return 0;
+    }
+
+  /*
+   * Vary added by compression is accounted for by the cache key.
+   */
+  if (http_header_list_locate_name (head, "Set-Cookie", 0)
+      || (!phttp->compress_vary
+	  && http_header_list_locate_name (head, "Vary", 0)))
+    return 0;
+
+  cache_control_parse (head, &cc);
+  if (cc.no_store || cc.no_cache || cc.private)
+    return 0;
+
+  if (cc.s_maxage >= 0)
+    ttl = cc.s_maxage;
+  else if (cc.max_age >= 0)
+    ttl = cc.max_age;
+  else if ((val = http_header_list_value (head, "Expires")) != NULL)
+    {
+      if (http_date_parse (val, &expires))
+	return 0;
+      if ((val = http_header_list_value (head, "Date")) == NULL
+	  || http_date_parse (val, &date))
+	date = time (NULL);
+      ttl = expires - date;
+    }
+  else
+    ttl = http_cache_conf (phttp->svc->cache)->default_ttl;
+
+  if ((val = http_header_list_value (head, "Age")) != NULL && isdigit (*val))
+    age = strtol (val, NULL, 10);
+  if (ttl <= age)
+    return 0;
+  *ret_age = age;
+  return ttl - age;
+}
+
+/*
+ * Format the status line and headers of the response for storing in the
+ * cache.  Hop-by-hop headers are omitted, as well as Age, which is added
+ * when serving the response.
+ */
+static char *
+cache_response_head (struct http_request *resp, struct stringbuf *sb)
+{
+  struct http_header *hdr;
+  char const *s;
+
+  if (http_request_get_request_line (resp, &s))
+    return NULL;
+  stringbuf_printf (sb, "%s\r\n", s);
+  DLIST_FOREACH (hdr, &resp->headers.list, link)
+    {
+      if (hdr->code == HEADER_CONNECTION
+	  || (http_header_name_len (hdr) == 10
+	      && strncasecmp (http_header_name_ptr (hdr), "Keep-Alive", 10) == 0)
+	  || (http_header_name_len (hdr) == 3
+	      && strncasecmp (http_header_name_ptr (hdr), "Age", 3) == 0))
+	continue;
+      stringbuf_printf (sb, "%s\r\n", hdr->header);
+    }
+  return stringbuf_finish (sb);
+}
+
+/*
+ * Start storing the backend response in the cache entry
+ * phttp->cache_entry.  This is called after sending the response
+ * headers.  CHUNKED is true if the response body is chunked,
+ * CONTENT_LENGTH is its length, if known.  Return the BIO to send the
+ * response body to.  If the response can't be cached, abandon the entry
+ * and return the client BIO.
+ */
+static BIO *
+cache_fill_start (POUND_HTTP *phttp, int chunked,
+		  CONTENT_LENGTH content_length)
+{
+  struct cache_conf const *conf = http_cache_conf (phttp->svc->cache);
+  time_t ttl;
+  unsigned age;
+  struct stringbuf sb;
+  char *head;
+  BIO *bio = NULL;
+
+  if ((phttp->no_cont || chunked
+       || (content_length >= 0 && content_length <= conf->max_object_size))
+      && (ttl = response_cache_ttl (phttp, &age)) > 0)
+    {
+      stringbuf_init_log (&sb);
+      if ((head = cache_response_head (&phttp->response, &sb)) != NULL)
+	bio = cache_entry_fill_begin (phttp->cache_entry, phttp->cl,
+				      head, strlen (head),
+				      phttp->response_code, ttl, age,
+				      chunked);
+      else
+	cache_entry_fill_end (phttp->cache_entry, NULL, 0);
+      stringbuf_free (&sb);
+    }
+  else
+    cache_entry_fill_end (phttp->cache_entry, NULL, 0);
+
+  if (bio)
+    {
+      phttp->cache_bio = bio;
+      return bio;
+    }
+  phttp->cache_entry = NULL;
+  return phttp->cl;
+}
+
+/*
+ * Finish storing the backend response.  OK is true if it has been
+ * received successfully.
+ */
+static void
+cache_fill_finish (POUND_HTTP *phttp, int ok)
+{
+  if (phttp->cache_entry)
+    {
+      cache_entry_fill_end (phttp->cache_entry, phttp->cache_bio, ok);
+      phttp->cache_entry = NULL;
+      phttp->cache_bio = NULL;
+    }
+}
+
+/*
+ * Send the cached response.
+ */
+static int
+cache_response (POUND_HTTP *phttp)
+{
+  char caddr[MAX_ADDR_BUFSIZE];
+  char const *head, *p;
+  size_t len;
+  int code;
+
+  /* Status line, for logging. */
+  head = cache_entry_head (phttp->cache_entry, &len);
+  if ((p = memchr (head, '\r', len)) != NULL)
+    {
+      phttp->response.arena = arena_current ();
+      phttp->response.request = http_mem_strndup (phttp->response.arena,
+						  head, p - head);
+    }
+
+  code = cache_entry_send (phttp->cache_entry, phttp->cl,
+			   phttp->request.method == METH_HEAD,
+			   &phttp->res_bytes);
+  cache_entry_unref (phttp->cache_entry);
+  phttp->cache_entry = NULL;
+  if (code == -1)
+    {
+      if (errno)
+	logmsg (LOG_NOTICE, "(%"PRItid") error writing cached response to %s: %s",
+		POUND_TID (),
+		addr2str (caddr, sizeof (caddr), &phttp->from_host, 1),
+		strerror (errno));
+      return -1;
+    }
+  phttp->response_code = code;
+  return HTTP_STATUS_OK;
+}
+
+/*
+ * Return true if the response to the current request can be compressed.
+ * BE_11 is true if the backend uses HTTP/1.1, CHUNKED is true if the
+ * response body is chunked, CONTENT_LENGTH is its length, if known.
+ */
+static int
+compress_response_eligible (POUND_HTTP *phttp, int be_11, int chunked,
+			    CONTENT_LENGTH content_length)
+{
+  struct http_compress *comp = phttp->svc->compress;
+  HTTP_HEADER_LIST *head = &phttp->response.headers;
+  struct http_header *hdr;
+  char *val;
+
+  if (comp == NULL
+      || phttp->no_cont
+      || !be_11
+      || !(chunked
+	   || (content_length >= 0
+	       && content_length >= compress_min_size (comp)))
+      || phttp->response_code == 206
+      || http_header_list_locate_name (head, "Content-Range", 0)
+      || http_header_list_locate_name (head, "Content-Encoding", 0)
+      || (val = http_header_list_value (head, "Content-Type")) == NULL
+      || !compress_content_type_ok (comp, val))
+    return 0;
+
+  for (hdr = http_header_list_locate_name (head, "Cache-Control", 0);
+       hdr;
+       hdr = http_header_list_next (hdr))
+    {
+      if ((val = http_header_get_value (hdr)) != NULL
+	  && cs_locate_token (val, "no-transform", 1, NULL))
+	return 0;
+    }
+  return 1;
+}
+
+/*
+ * Prepare the backend response for compression.  Return the content
+ * coding to compress it with, or -1 if it should be passed as is.  The
+ * arguments are as in compress_response_eligible.  If the response is
+ * to be compressed, its headers are modified accordingly.
+ */
+static int
+compress_response_setup (POUND_HTTP *phttp, int be_11, int chunked,
+			 CONTENT_LENGTH content_length)
+{
+  HTTP_HEADER_LIST *head = &phttp->response.headers;
+  struct http_header *hdr;
+  struct stringbuf sb;
+  char *val;
+  int enc, rc;
+
+  phttp->compress_vary = 0;
+  if (!compress_response_eligible (phttp, be_11, chunked, content_length))
+    return -1;
+
+  /*
+   * The response depends on Accept-Encoding, whether it is compressed
+   * or not.
+   */
+  if ((hdr = http_header_list_locate_name (head, "Vary", 0)) == NULL)
+    phttp->compress_vary = 1;
+  else if ((val = http_header_get_value (hdr)) != NULL
+	   && (cs_locate_token (val, "Accept-Encoding", 1, NULL)
+	       || cs_locate_token (val, "*", 0, NULL)))
+    hdr = NULL;
+  if ((phttp->compress_vary || hdr)
+      && http_header_list_append (head, "Vary: Accept-Encoding", H_APPEND))
+    return -1;
+
+  if ((enc = compress_request_coding (phttp)) == -1)
+    return -1;
+
+  while ((hdr = http_header_list_locate (head, HEADER_CONTENT_LENGTH)) != NULL)
+    http_header_list_remove (head, hdr);
+  if (!chunked
+      && http_header_list_append (head, "Transfer-Encoding: chunked",
+				  H_REPLACE))
+    return -1;
+
+  stringbuf_init_log (&sb);
+  stringbuf_printf (&sb, "Content-Encoding: %s", compress_coding_name (enc));
+  if ((val = stringbuf_finish (&sb)) == NULL)
+    rc = -1;
+  else
+    rc = http_header_list_append (head, val, H_REPLACE);
+
+  /* The compressed representation is only weakly equivalent. */
+  if (rc == 0
+      && (hdr = http_header_list_locate_name (head, "ETag", 0)) != NULL
+      && (val = http_header_get_value (hdr)) != NULL
+      && *val == '"')
+    {
+      stringbuf_reset (&sb);
+      stringbuf_printf (&sb, "ETag: W/%s", val);
+      if ((val = stringbuf_finish (&sb)) == NULL)
+	rc = -1;
+      else
+	rc = http_header_change (hdr, val, 1);
+    }
+  stringbuf_free (&sb);
+  return rc ? -1 : enc;
+}
+
 /*
  * get the response
  */
@@ -3660,11 +5497,13 @@ backend_response (POUND_HTTP *phttp)
 {
   int skip = 0;
   int be_11 = 0;  /* Whether backend connection is using HTTP/1.1. */
+  int be_close = 0; /* Whether backend requested to close the connection. */
   CONTENT_LENGTH content_length;
   char caddr[MAX_ADDR_BUFSIZE];
   char buf[MAXBUF];
   struct http_header *hdr;
   char *val;
+  BIO *out;  /* BIO to send the response to. */
   int res;
 
   phttp->res_bytes = 0;
@@ -3728,7 +5567,7 @@ backend_response (POUND_HTTP *phttp)
 
       chunked = 0;
       content_length = NO_CONTENT_LENGTH;
-      DLIST_FOREACH (hdr, &phttp->response.headers, link)
+      DLIST_FOREACH (hdr, &phttp->response.headers.list, link)
 	{
 	  switch (hdr->code)
 	    {
@@ -3736,7 +5575,7 @@ backend_response (POUND_HTTP *phttp)
 	      if ((val = http_header_get_value (hdr)) == NULL)
 		return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 	      if (!strcasecmp ("close", val))
-		phttp->conn_closed = 1;
+		phttp->conn_closed = be_close = 1;
 	      /*
 	       * Connection: upgrade
 	       */
@@ -3788,7 +5627,7 @@ backend_response (POUND_HTTP *phttp)
 
 		      stringbuf_init_log (&sb);
 		      stringbuf_printf (&sb, "Location: %s://%s/%s",
-					(phttp->ssl == NULL ? "http" : "https"),
+					(pound_http_is_tls (phttp) ? "https" : "http"),
 					v_host,
 					path);
 		      if ((p = stringbuf_finish (&sb)) == NULL)
@@ -3818,7 +5657,7 @@ backend_response (POUND_HTTP *phttp)
 		      stringbuf_init_log (&sb);
 		      stringbuf_printf (&sb,
 					"Content-location: %s://%s/%s",
-					(phttp->ssl == NULL ? "http" : "https"),
+					(pound_http_is_tls (phttp) ? "https" : "http"),
 					v_host,
 					path);
 		      if ((p = stringbuf_finish (&sb)) == NULL)
@@ -3842,8 +5681,12 @@ backend_response (POUND_HTTP *phttp)
       /*
        * send the response
        */
+      out = phttp->cl;
       if (!skip)
 	{
+	  int enc = compress_response_setup (phttp, be_11, chunked,
+					     content_length);
+
 	  if (http_request_send (phttp->cl, &phttp->response))
 	    {
 	      if (errno)
@@ -3857,9 +5700,21 @@ backend_response (POUND_HTTP *phttp)
 	    }
 	  /* Final CRLF */
 	  BIO_puts (phttp->cl, "\r\n");
+
+	  if (phttp->cache_entry)
+	    out = cache_fill_start (phttp, (be_11 && chunked) || enc != -1,
+				    content_length);
+
+	  if (enc != -1)
+	    {
+	      if ((phttp->compress_bio = compress_bio_new (phttp->svc->compress,
+							   enc, out)) == NULL)
+		return -1;
+	      out = phttp->compress_bio;
+	    }
 	}
 
-      if (BIO_flush (phttp->cl) != 1)
+      if (BIO_flush (out) != 1)
 	{
 	  if (errno)
 	    {
@@ -3882,8 +5737,9 @@ backend_response (POUND_HTTP *phttp)
 	       * had Transfer-encoding: chunked so read/write all
 	       * the chunks (HTTP/1.1 only)
 	       */
-	      if (copy_chunks (phttp->be, phttp->cl, &phttp->res_bytes,
-			       skip, 0) != HTTP_STATUS_OK)
+	      if (copy_chunks (phttp->be, out, &phttp->res_bytes,
+			       skip, phttp->compress_bio != NULL, 0)
+		  != HTTP_STATUS_OK)
 		{
 		  /*
 		   * copy_chunks() has its own error messages
@@ -3897,7 +5753,7 @@ backend_response (POUND_HTTP *phttp)
 	       * may have had Content-length, so do raw reads/writes
 	       * for the length
 	       */
-	      int ec = copy_bin (phttp->be, phttp->cl, content_length,
+	      int ec = copy_bin (phttp->be, out, content_length,
 				 &phttp->res_bytes, skip);
 	      switch (ec)
 		{
@@ -3925,7 +5781,6 @@ backend_response (POUND_HTTP *phttp)
 	    {
 	      if (is_readable (phttp->be, phttp->backend->v.reg.to))
 		{
-		  char one;
 		  BIO *be_unbuf;
 
 		  /*
@@ -3937,26 +5792,10 @@ backend_response (POUND_HTTP *phttp)
 
 		  /*
 		   * first read whatever is already in the input buffer
-		   */
-		  while (BIO_pending (phttp->be))
-		    {
-		      if (BIO_read (phttp->be, &one, 1) != 1)
-			{
-			  logmsg (LOG_NOTICE,
-				  "(%"PRItid") error reading response pending: %s",
-				  POUND_TID (), strerror (errno));
-			  return -1;
-			}
-		      if (BIO_write (phttp->cl, &one, 1) != 1)
-			{
-			  if (errno)
-			    logmsg (LOG_NOTICE,
-				    "(%"PRItid") error writing response pending: %s",
-				    POUND_TID (), strerror (errno));
-			  return -1;
-			}
-		      phttp->res_bytes++;
-		    }
+		   */
+		  if (copy_pending (phttp->be, phttp->cl, &phttp->res_bytes,
+				    "response"))
+		    return -1;
 		  BIO_flush (phttp->cl);
 
 		  /*
@@ -3995,7 +5834,15 @@ backend_response (POUND_HTTP *phttp)
 		    }
 		}
 	    }
-	  if (BIO_flush (phttp->cl) != 1)
+	  if (phttp->compress_bio && compress_bio_finish (phttp->compress_bio))
+	    {
+	      logmsg (LOG_NOTICE, "(%"PRItid") error finishing compressed "
+		      "response to %s",
+		      POUND_TID (),
+		      addr2str (caddr, sizeof (caddr), &phttp->from_host, 1));
+	      return -1;
+	    }
+	  if (BIO_flush (out) != 1)
 	    {
 	      if (errno)
 		{
@@ -4012,156 +5859,32 @@ backend_response (POUND_HTTP *phttp)
 	  /*
 	   * special mode for Websockets - content until EOF
 	   */
-	  char one;
-	  BIO *cl_unbuf;
-	  BIO *be_unbuf;
-	  struct pollfd p[2];
 
 	  /* Force connection close on both sides when ws has finished */
 	  be_11 = 0;
 	  phttp->conn_closed = 1;
 
-	  memset (p, 0, sizeof (p));
-	  BIO_get_fd (phttp->cl, &p[0].fd);
-	  p[0].events = POLLIN | POLLPRI;
-	  BIO_get_fd (phttp->be, &p[1].fd);
-	  p[1].events = POLLIN | POLLPRI;
-
-	  while (BIO_pending (phttp->cl) || BIO_pending (phttp->be)
-		 || poll (p, 2, phttp->backend->v.reg.ws_to * 1000) > 0)
-	    {
-
-	      /*
-	       * first read whatever is already in the input buffer
-	       */
-	      while (BIO_pending (phttp->cl))
-		{
-		  if (BIO_read (phttp->cl, &one, 1) != 1)
-		    {
-		      logmsg (LOG_NOTICE,
-			      "(%"PRItid") error reading ws request pending: %s",
-			      POUND_TID (), strerror (errno));
-		      return -1;
-		    }
-		  if (BIO_write (phttp->be, &one, 1) != 1)
-		    {
-		      if (errno)
-			logmsg (LOG_NOTICE,
-				"(%"PRItid") error writing ws request pending: %s",
-				POUND_TID (), strerror (errno));
-		      return -1;
-		    }
-		}
-	      BIO_flush (phttp->be);
-
-	      while (BIO_pending (phttp->be))
-		{
-		  if (BIO_read (phttp->be, &one, 1) != 1)
-		    {
-		      logmsg (LOG_NOTICE,
-			      "(%"PRItid") error reading ws response pending: %s",
-			      POUND_TID (), strerror (errno));
-		      return -1;
-		    }
-		  if (BIO_write (phttp->cl, &one, 1) != 1)
-		    {
-		      if (errno)
-			logmsg (LOG_NOTICE,
-				"(%"PRItid") error writing ws response pending: %s",
-				POUND_TID (), strerror (errno));
-		      return -1;
-		    }
-		  phttp->res_bytes++;
-		}
-	      BIO_flush (phttp->cl);
-
-	      /*
-	       * find the socket BIO in the chain
-	       */
-	      if ((cl_unbuf =
-		   BIO_find_type (phttp->cl,
-				  SLIST_EMPTY (&phttp->lstn->ctx_head)
-				  ? BIO_TYPE_SOCKET : BIO_TYPE_SSL)) == NULL)
-		{
-		  logmsg (LOG_WARNING,
-			  "(%"PRItid") error getting unbuffered BIO: %s",
-			  POUND_TID (), strerror (errno));
-		  return -1;
-		}
-	      if ((be_unbuf = BIO_find_type (phttp->be,
-					     backend_is_https (phttp->backend)
-					       ? BIO_TYPE_SSL
-					       : BIO_TYPE_SOCKET)) == NULL)
-		{
-		  logmsg (LOG_WARNING,
-			  "(%"PRItid") error getting unbuffered BIO: %s",
-			  POUND_TID (), strerror (errno));
-		  return -1;
-		}
-
-	      /*
-	       * copy till EOF
-	       */
-	      if (p[0].revents)
-		{
-		  res = BIO_read (cl_unbuf, buf, sizeof (buf));
-		  if (res <= 0)
-		    {
-		      break;
-		    }
-		  if (BIO_write (phttp->be, buf, res) != res)
-		    {
-		      if (errno)
-			logmsg (LOG_NOTICE,
-				"(%"PRItid") error copying ws request body: %s",
-				POUND_TID (), strerror (errno));
-		      return -1;
-		    }
-		  else
-		    {
-		      BIO_flush (phttp->be);
-		    }
-		  p[0].revents = 0;
-		}
-	      if (p[1].revents)
-		{
-		  res = BIO_read (be_unbuf, buf, sizeof (buf));
-		  if (res <= 0)
-		    {
-		      break;
-		    }
-		  if (BIO_write (phttp->cl, buf, res) != res)
-		    {
-		      if (errno)
-			logmsg (LOG_NOTICE,
-				"(%"PRItid") error copying ws response body: %s",
-				POUND_TID (), strerror (errno));
-		      return -1;
-		    }
-		  else
-		    {
-		      phttp->res_bytes += res;
-		      BIO_flush (phttp->cl);
-		    }
-		  p[1].revents = 0;
-		}
-	    }
+	  if (ws_relay (phttp))
+	    return -1;
 	}
     }
   while (skip);
 
   if (!be_11)
     close_backend (phttp);
+  else
+    phttp->be_keepalive = !be_close;
 
   return HTTP_STATUS_OK;
 }
 
 /*
- * Pass the request to the backend.  Return 0 on success and pound
- * http error number otherwise.
+ * Prepare the request for passing it to the selected backend: add
+ * canned headers and apply request rewriting.  Return 0 on success and
+ * pound http error number otherwise.
  */
 static int
-send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
+backend_request_prepare (POUND_HTTP *phttp)
 {
   struct http_header *hdr;
   char const *val;
@@ -4216,7 +5939,8 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
 	lognomem ();
     }
 
-  if (phttp->ssl != NULL && (phttp->lstn->header_options & HDROPT_SSL_HEADERS))
+  if (pound_http_is_tls (phttp)
+      && (phttp->lstn->header_options & HDROPT_SSL_HEADERS))
     {
       if (add_ssl_headers (phttp))
 	lognomem ();
@@ -4247,6 +5971,19 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
       || rewrite_apply (&phttp->svc->rewrite[REWRITE_REQUEST], &phttp->request,
 			phttp))
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  return 0;
+}
+
+/*
+ * Pass the request to the backend.  Set *BODY_SENT to 1 if copying of
+ * the request body from the client has been started.  Return 0 on success
+ * and pound http error number otherwise.
+ */
+static int
+send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length,
+		 int *body_sent)
+{
+  *body_sent = 0;
 
   /*
    * Send the request and its headers
@@ -4264,6 +6001,9 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
    */
   BIO_puts (phttp->be, "\r\n");
 
+  if (chunked || content_length > 0)
+    *body_sent = 1;
+
   if (chunked)
     {
       /*
@@ -4271,7 +6011,7 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
        * (HTTP/1.1 only)
        */
       int rc = copy_chunks (phttp->cl, phttp->be, NULL,
-			    phttp->backend->be_type != BE_REGULAR,
+			    phttp->backend->be_type != BE_REGULAR, 0,
 			    phttp->lstn->max_req_size);
       if (rc != HTTP_STATUS_OK)
 	{
@@ -4318,6 +6058,61 @@ send_to_backend (POUND_HTTP *phttp, int chunked, CONTENT_LENGTH content_length)
   return 0;
 }
 
+static int backend_connect (POUND_HTTP *phttp, BACKEND *backend);
+
+/*
+ * Send the request to the backend and process its response.  If the
+ * backend connection has been used before, it might have been closed by
+ * the backend meanwhile.  In that case, if sending the request fails or
+ * the connection is closed before the first byte of the response arrives,
+ * retry once over a fresh connection, provided that the request body (if
+ * any) hasn't been consumed yet.
+ */
+static int
+backend_exchange (POUND_HTTP *phttp, int chunked,
+		  CONTENT_LENGTH content_length)
+{
+  int res;
+  int body_sent;
+  int reused = phttp->be_reused;
+  BIO_ARG *arg;
+  char caddr[MAX_ADDR_BUFSIZE];
+
+  if ((res = send_to_backend (phttp, chunked, content_length,
+			      &body_sent)) == 0)
+    {
+      BIO *bio = BIO_next (phttp->be);
+      uint64_t nread = BIO_number_read (bio);
+
+      res = backend_response (phttp);
+      if (res == HTTP_STATUS_OK || BIO_number_read (bio) != nread)
+	return res;
+    }
+
+  if (!reused || body_sent || res == -1)
+    return res;
+  /* Don't retry if the backend is merely slow to respond. */
+  if ((arg = backend_bio_arg (phttp->be)) != NULL && arg->timeout < 0)
+    return res;
+
+  logmsg (LOG_NOTICE, "(%"PRItid") reused connection to %s failed; retrying",
+	  POUND_TID (), str_be (caddr, sizeof (caddr), phttp->backend));
+  close_backend (phttp);
+  if ((res = backend_connect (phttp, phttp->backend)) != 0)
+    {
+      if (res == -1)
+	{
+	  kill_be (phttp->svc, phttp->backend, BE_KILL);
+	  res = HTTP_STATUS_SERVICE_UNAVAILABLE;
+	}
+      return res;
+    }
+  if ((res = send_to_backend (phttp, chunked, content_length,
+			      &body_sent)) == 0)
+    res = backend_response (phttp);
+  return res;
+}
+
 static int
 open_backend (POUND_HTTP *phttp, BACKEND *backend, int sock)
 {
@@ -4348,13 +6143,11 @@ open_backend (POUND_HTTP *phttp, BACKEND *backend, int sock)
     {
       SSL *be_ssl;
 
-      if ((be_ssl = SSL_new (backend->v.reg.ctx)) == NULL)
+      if ((be_ssl = backend_ssl_new (backend)) == NULL)
 	{
 	  logmsg (LOG_WARNING, "(%"PRItid") be SSL_new: failed", POUND_TID ());
 	  return HTTP_STATUS_SERVICE_UNAVAILABLE;
 	}
-      if (backend->v.reg.servername)
-	SSL_set_tlsext_host_name (be_ssl, backend->v.reg.servername);
       SSL_set_bio (be_ssl, phttp->be, phttp->be);
       if ((bb = BIO_new (BIO_f_ssl ())) == NULL)
 	{
@@ -4390,12 +6183,76 @@ open_backend (POUND_HTTP *phttp, BACKEND *backend, int sock)
   return 0;
 }
 
+/*
+ * Open a new connection to the regular backend BACKEND.  On success,
+ * set phttp->be and return 0.  Return -1 if the backend could not be
+ * connected to, and HTTP status code on other errors.
+ */
+static int
+backend_connect (POUND_HTTP *phttp, BACKEND *backend)
+{
+  int sock, sock_proto, res;
+  char caddr[MAX_ADDR_BUFSIZE];
+
+  switch (backend->v.reg.addr.ai_family)
+    {
+    case AF_INET:
+      sock_proto = PF_INET;
+      break;
+
+    case AF_INET6:
+      sock_proto = PF_INET6;
+      break;
+
+    case AF_UNIX:
+      sock_proto = PF_UNIX;
+      break;
+
+    default:
+      log_error (phttp, HTTP_STATUS_SERVICE_UNAVAILABLE, 0,
+		 "backend: unknown family %d",
+		 backend->v.reg.addr.ai_family);
+      return HTTP_STATUS_SERVICE_UNAVAILABLE;
+    }
+
+  if ((sock = socket (sock_proto, SOCK_STREAM, 0)) < 0)
+    {
+      log_error (phttp, HTTP_STATUS_SERVICE_UNAVAILABLE, errno,
+		 "backend %s: socket create",
+		 str_be (caddr, sizeof (caddr), backend));
+      return HTTP_STATUS_SERVICE_UNAVAILABLE;
+    }
+
+  if (connect_nb (sock, &backend->v.reg.addr, backend->v.reg.conn_to) == 0)
+    {
+      /*
+       * Connected successfully.  Open the backend connection.
+       */
+      if (sock_proto == PF_INET || sock_proto == PF_INET6)
+	socket_setup (sock);
+      if ((res = open_backend (phttp, backend, sock)) != 0)
+	{
+	  close_backend (phttp);
+	  return res;
+	}
+      phttp->be_reused = 0;
+      return 0;
+    }
+
+  logmsg (LOG_WARNING, "(%"PRItid") backend %s connect: %s",
+	  POUND_TID (),
+	  str_be (caddr, sizeof (caddr), backend),
+	  strerror (errno));
+  shutdown (sock, 2);
+  close (sock);
+  return -1;
+}
+
 static int
 select_backend (POUND_HTTP *phttp)
 {
   BACKEND *backend;
-  int sock;
-  char caddr[MAX_ADDR_BUFSIZE];
+  int res;
 
   if ((backend = get_backend (phttp)) != NULL)
     {
@@ -4405,10 +6262,11 @@ select_backend (POUND_HTTP *phttp)
 	    {
 	      /* Same backend as before: nothing to do */
 	      backend_unref (backend);
+	      phttp->be_reused = 1;
 	      return 0;
 	    }
 	  else
-	    close_backend (phttp);
+	    release_backend (phttp);
 	}
 
       do
@@ -4416,68 +6274,33 @@ select_backend (POUND_HTTP *phttp)
 	  if (backend->be_type == BE_REGULAR)
 	    {
 	      /*
-	       * Try to open connection to this backend.
+	       * Reuse an idle connection from the pool, if possible.
 	       */
-	      int sock_proto;
-
-	      switch (backend->v.reg.addr.ai_family)
-		{
-		case AF_INET:
-		  sock_proto = PF_INET;
-		  break;
-
-		case AF_INET6:
-		  sock_proto = PF_INET6;
-		  break;
-
-		case AF_UNIX:
-		  sock_proto = PF_UNIX;
-		  break;
-
-		default:
-		  backend_unref (backend);
-		  log_error (phttp, HTTP_STATUS_SERVICE_UNAVAILABLE, 0,
-			     "backend: unknown family %d",
-			     backend->v.reg.addr.ai_family);
-		  return HTTP_STATUS_SERVICE_UNAVAILABLE;
-		}
-
-	      if ((sock = socket (sock_proto, SOCK_STREAM, 0)) < 0)
+	      if ((phttp->be = backend_pool_get (backend,
+						 &phttp->reneg_state)) != NULL)
 		{
-		  backend_unref (backend);
-		  log_error (phttp, HTTP_STATUS_SERVICE_UNAVAILABLE, errno,
-			     "backend %s: socket create",
-			     str_be (caddr, sizeof (caddr), backend));
-		  return HTTP_STATUS_SERVICE_UNAVAILABLE;
+		  backend_unref (phttp->backend);
+		  phttp->backend = backend;
+		  phttp->be_reused = 1;
+		  return 0;
 		}
 
-	      if (connect_nb (sock, &backend->v.reg.addr,
-			      backend->v.reg.conn_to) == 0)
+	      /*
+	       * Otherwise, try to open connection to this backend.
+	       */
+	      if ((res = backend_connect (phttp, backend)) == 0)
 		{
-		  int res;
-
-		  /*
-		   * Connected successfully.  Open the backend connection.
-		   */
-		  if (sock_proto == PF_INET || sock_proto == PF_INET6)
-		    socket_setup (sock);
-		  if ((res = open_backend (phttp, backend, sock)) != 0)
-		    {
-		      close_backend (phttp);
-		      return res;
-		    }
 		  /* New backend selected. */
 		  backend_unref (phttp->backend);
 		  phttp->backend = backend;
 		  return 0;
 		}
+	      else if (res != -1)
+		{
+		  backend_unref (backend);
+		  return res;
+		}
 
-	      logmsg (LOG_WARNING, "(%"PRItid") backend %s connect: %s",
-		      POUND_TID (),
-		      str_be (caddr, sizeof (caddr), backend),
-		      strerror (errno));
-	      shutdown (sock, 2);
-	      close (sock);
 	      /*
 	       * The following will close all sessions associated with
 	       * this backend, and mark the backend itself as dead, so
@@ -4507,22 +6330,6 @@ select_backend (POUND_HTTP *phttp)
   return HTTP_STATUS_SERVICE_UNAVAILABLE;
 }
 
-static void
-backend_update_stats (BACKEND *be, struct timespec const *start,
-		      struct timespec const *end)
-{
-  struct timespec diff;
-  double t;
-
-  pthread_mutex_lock (&be->mut);
-  diff = timespec_sub (end, start);
-  t = (double) diff.tv_sec * 1e9 + diff.tv_nsec;
-  be->avgtime = (be->numreq * be->avgtime + t) / (be->numreq + 1);
-  be->avgsqtime = (be->numreq * be->avgsqtime + t*t) / (be->numreq + 1);
-  be->numreq++;
-  pthread_mutex_unlock (&be->mut);
-}
-
 enum transfer_encoding
   {
     TRANSFER_ENCODING_NONE,
@@ -4531,21 +6338,14 @@ enum transfer_encoding
   };
 
 /*
- * handle an HTTP request
+ * Set up the client connection: perform TLS handshake, if necessary,
+ * and create the buffered BIO chain.  Return 0 on success, -1 on error.
  */
-void
-do_http (POUND_HTTP *phttp)
+static int
+client_connection_setup (POUND_HTTP *phttp)
 {
-  int cl_11;  /* Whether client connection is using HTTP/1.1 */
-  int res;  /* General-purpose result variable */
-  /* FIXME: this belongs to struct http_request, perhaps. */
-  int transfer_encoding = TRANSFER_ENCODING_NONE;
   BIO *bb;
   char caddr[MAX_ADDR_BUFSIZE];
-  CONTENT_LENGTH content_length;
-  struct http_header *hdr, *hdrtemp;
-  char *val;
-  struct timespec be_start;
 
   if (phttp->lstn->allow_client_reneg)
     phttp->reneg_state = RENEG_ALLOW;
@@ -4559,16 +6359,23 @@ do_http (POUND_HTTP *phttp)
       logmsg (LOG_ERR, "(%"PRItid") BIO_new_socket failed", POUND_TID ());
       shutdown (phttp->sock, 2);
       close (phttp->sock);
-      return;
+      return -1;
     }
   set_callback (phttp->cl, phttp->lstn->to, &phttp->reneg_state);
 
-  if (!SLIST_EMPTY (&phttp->lstn->ctx_head))
+  if (phttp->h2)
+    {
+      /*
+       * HTTP/2 stream: TLS is handled by the session thread, which has
+       * also supplied the client certificate.
+       */
+    }
+  else if (!SLIST_EMPTY (&phttp->lstn->ctx_head))
     {
       if ((phttp->ssl = SSL_new (SLIST_FIRST (&phttp->lstn->ctx_head)->ctx)) == NULL)
 	{
 	  logmsg (LOG_ERR, "(%"PRItid") SSL_new: failed", POUND_TID ());
-	  return;
+	  return -1;
 	}
       SSL_set_app_data (phttp->ssl, &phttp->reneg_state);
       SSL_set_bio (phttp->ssl, phttp->cl, phttp->cl);
@@ -4576,7 +6383,7 @@ do_http (POUND_HTTP *phttp)
 	{
 	  logmsg (LOG_ERR, "(%"PRItid") BIO_new(Bio_f_ssl()) failed",
 		  POUND_TID ());
-	  return;
+	  return -1;
 	}
       BIO_set_ssl (bb, phttp->ssl, BIO_CLOSE);
       BIO_set_ssl_mode (bb, 0);
@@ -4585,7 +6392,7 @@ do_http (POUND_HTTP *phttp)
 	{
 	  logmsg (LOG_ERR, "(%"PRItid") handshake failed: %s",
 		  POUND_TID (), ERR_error_string (ERR_get_error (), NULL));
-	  return;
+	  return -1;
 	}
       else
 	{
@@ -4595,7 +6402,7 @@ do_http (POUND_HTTP *phttp)
 	    {
 	      logmsg (LOG_NOTICE, "bad certificate from %s",
 		      addr2str (caddr, sizeof (caddr), &phttp->from_host, 1));
-	      return;
+	      return -1;
 	    }
 	}
     }
@@ -4609,17 +6416,55 @@ do_http (POUND_HTTP *phttp)
   if ((bb = BIO_new (BIO_f_buffer ())) == NULL)
     {
       logmsg (LOG_ERR, "(%"PRItid") BIO_new(buffer) failed", POUND_TID ());
-      return;
+      return -1;
     }
   BIO_set_close (phttp->cl, BIO_CLOSE);
   BIO_set_buffer_size (phttp->cl, MAXBUF);
   phttp->cl = BIO_push (bb, phttp->cl);
 
-  cl_11 = 0;
+  return 0;
+}
+
+/*
+ * handle an HTTP request
+ */
+int
+do_http (POUND_HTTP *phttp)
+{
+  int cl_11;  /* Whether client connection is using HTTP/1.1 */
+  int res;  /* General-purpose result variable */
+  /* FIXME: this belongs to struct http_request, perhaps. */
+  int transfer_encoding = TRANSFER_ENCODING_NONE;
+  char caddr[MAX_ADDR_BUFSIZE];
+  CONTENT_LENGTH content_length;
+  struct http_header *hdr, *hdrtemp;
+  char *val;
+  struct timespec be_start;
+
+  if (phttp->keepalive)
+    /* Resuming idle keep-alive connection. */
+    cl_11 = 1;
+  else
+    {
+      if (client_connection_setup (phttp))
+	return HTTP_CONN_DONE;
+      if (phttp->h2 == NULL && http2_negotiated (phttp->ssl))
+	{
+	  BIO_ARG *arg = (BIO_ARG *)
+	    BIO_get_callback_arg (SSL_get_rbio (phttp->ssl));
+	  /* The session does its own polling. */
+	  if (arg)
+	    arg->timeout = 0;
+	  return pound_http_session_start (phttp);
+	}
+      cl_11 = 0;
+    }
+
   for (;;)
     {
       http_request_free (&phttp->request);
       http_request_free (&phttp->response);
+      arena_reset (&phttp->arena);
 
       phttp->ws_state = WSS_INIT;
       phttp->conn_closed = 0;
@@ -4635,7 +6480,7 @@ do_http (POUND_HTTP *phttp)
 			  strerror (errno));
 		}
 	    }
-	  return;
+	  return HTTP_CONN_DONE;
 	}
 
       clock_gettime (CLOCK_REALTIME, &phttp->start_req);
@@ -4647,7 +6492,7 @@ do_http (POUND_HTTP *phttp)
 	{
 	  log_error (phttp, res, 0, "error parsing request");
 	  http_err_reply (phttp, res);
-	  return;
+	  return HTTP_CONN_DONE;
 	}
       cl_11 = phttp->request.version;
 
@@ -4661,7 +6506,7 @@ do_http (POUND_HTTP *phttp)
 	  log_error (phttp, HTTP_STATUS_NOT_IMPLEMENTED, 0,
 		     "bad URL \"%s\"", phttp->request.url);
 	  http_err_reply (phttp, HTTP_STATUS_NOT_IMPLEMENTED);
-	  return;
+	  return HTTP_CONN_DONE;
 	}
 
       /*
@@ -4669,7 +6514,7 @@ do_http (POUND_HTTP *phttp)
        */
       transfer_encoding = TRANSFER_ENCODING_NONE;
       content_length = NO_CONTENT_LENGTH;
-      DLIST_FOREACH_SAFE (hdr, hdrtemp, &phttp->request.headers, link)
+      DLIST_FOREACH_SAFE (hdr, hdrtemp, &phttp->request.headers.list, link)
 	{
 	  switch (hdr->code)
 	    {
@@ -4700,7 +6545,7 @@ do_http (POUND_HTTP *phttp)
 		  log_error (phttp, HTTP_STATUS_BAD_REQUEST, 0,
 			     "multiple Transfer-Encoding headers");
 		  http_err_reply (phttp, HTTP_STATUS_BAD_REQUEST);
-		  return;
+		  return HTTP_CONN_DONE;
 		}
 	      else
 		{
@@ -4717,7 +6562,7 @@ do_http (POUND_HTTP *phttp)
 			  log_error (phttp, HTTP_STATUS_BAD_REQUEST, 0,
 				     "multiple Transfer-Encoding headers");
 			  http_err_reply (phttp, HTTP_STATUS_BAD_REQUEST);
-			  return;
+			  return HTTP_CONN_DONE;
 			}
 		      transfer_encoding = TRANSFER_ENCODING_CHUNKED;
 		    }
@@ -4734,14 +6579,14 @@ do_http (POUND_HTTP *phttp)
 		  log_error (phttp, HTTP_STATUS_BAD_REQUEST, 0,
 			     "multiple Content-Length headers");
 		  http_err_reply (phttp, HTTP_STATUS_BAD_REQUEST);
-		  return;
+		  return HTTP_CONN_DONE;
 		}
 	      else if ((content_length = get_content_length (val, CL_HEADER)) == NO_CONTENT_LENGTH)
 		{
 		  log_error (phttp, HTTP_STATUS_BAD_REQUEST, 0,
 			     "bad Content-Length value");
 		  http_err_reply (phttp, HTTP_STATUS_BAD_REQUEST);
-		  return;
+		  return HTTP_CONN_DONE;
 		}
 
 	      if (content_length == NO_CONTENT_LENGTH)
@@ -4790,14 +6635,14 @@ do_http (POUND_HTTP *phttp)
 	      log_error (phttp, HTTP_STATUS_NOT_IMPLEMENTED, 0,
 			 "unknown Transfer-Encoding");
 	      http_err_reply (phttp, HTTP_STATUS_NOT_IMPLEMENTED);
-	      return;
+	      return HTTP_CONN_DONE;
 	    }
 	  else if (content_length != NO_CONTENT_LENGTH)
 	    {
 	      log_error (phttp, HTTP_STATUS_BAD_REQUEST, 0,
 			 "both Transfer-Encoding and Content-Length given");
 	      http_err_reply (phttp, HTTP_STATUS_BAD_REQUEST);
-	      return;
+	      return HTTP_CONN_DONE;
 	    }
 	}
 
@@ -4815,7 +6660,7 @@ do_http (POUND_HTTP *phttp)
 			     "URI too long: %zu bytes",
 			     urlen);
 		  http_err_reply (phttp, HTTP_STATUS_URI_TOO_LONG);
-		  return;
+		  return HTTP_CONN_DONE;
 		}
 	    }
 	  else
@@ -4836,7 +6681,7 @@ do_http (POUND_HTTP *phttp)
 		     "request too large: %"PRICLEN" bytes",
 		     content_length);
 	  http_err_reply (phttp, HTTP_STATUS_PAYLOAD_TOO_LARGE);
-	  return;
+	  return HTTP_CONN_DONE;
 	}
 
       if (phttp->be != NULL)
@@ -4860,13 +6705,26 @@ do_http (POUND_HTTP *phttp)
 	  log_error (phttp, HTTP_STATUS_SERVICE_UNAVAILABLE, 0,
 		     "no suitable service found");
 	  http_err_reply (phttp, HTTP_STATUS_SERVICE_UNAVAILABLE);
-	  return;
+	  return HTTP_CONN_DONE;
 	}
 
-      if ((res = select_backend (phttp)) != 0)
+      if (phttp->svc->cache
+	  && service_cache_lookup (phttp,
+				   transfer_encoding != TRANSFER_ENCODING_NONE
+				   || content_length > 0) == CACHE_HIT)
+	{
+	  /* Serve the response from the cache. */
+	  if (phttp->be != NULL)
+	    release_backend (phttp);
+	  backend_unref (phttp->backend);
+	  phttp->backend = phttp->svc->cache_be;
+	  backend_ref (phttp->backend);
+	}
+      else if ((res = select_backend (phttp)) != 0)
 	{
+	  cache_fill_finish (phttp, 0);
 	  http_err_reply (phttp, res);
-	  return;
+	  return HTTP_CONN_DONE;
 	}
 
       /*
@@ -4879,6 +6737,7 @@ do_http (POUND_HTTP *phttp)
 	phttp->conn_closed = 1;
 
       phttp->res_bytes = 0;
+      phttp->be_keepalive = 0;
       http_request_free (&phttp->response);
 
       save_forwarded_header (phttp);
@@ -4906,14 +6765,23 @@ do_http (POUND_HTTP *phttp)
 	  res = metrics_response (phttp);
 	  break;
 
+	case BE_CACHE:
+	  res = cache_response (phttp);
+	  break;
+
 	case BE_REGULAR:
-	  /* Send the request. */
-	  res = send_to_backend (phttp,
-				 cl_11 && (transfer_encoding == TRANSFER_ENCODING_CHUNKED),
-				 content_length);
-	  if (res == 0)
-	    /* Process the response. */
-	    res = backend_response (phttp);
+	  backend_request_begin (phttp->backend);
+	  /* Send the request and process the response. */
+	  if ((res = backend_request_prepare (phttp)) == 0)
+	    res = backend_exchange (phttp,
+				    cl_11 && (transfer_encoding == TRANSFER_ENCODING_CHUNKED),
+				    content_length);
+	  if (phttp->compress_bio)
+	    {
+	      compress_bio_free (phttp->compress_bio);
+	      phttp->compress_bio = NULL;
+	    }
+	  cache_fill_finish (phttp, res == HTTP_STATUS_OK);
 	  break;
 
 	case BE_MATRIX:
@@ -4921,8 +6789,15 @@ do_http (POUND_HTTP *phttp)
 	  /* shouldn't happen */
 	  abort ();
 	}
+      /*
+       * Abandon the pending cache entry, if the response didn't come
+       * from a regular backend.
+       */
+      cache_fill_finish (phttp, 0);
 
       clock_gettime (CLOCK_REALTIME, &phttp->end_req);
+      if (phttp->backend->be_type == BE_REGULAR)
+	backend_request_end (phttp->backend, &be_start, &phttp->end_req);
       if (enable_backend_stats)
 	backend_update_stats (phttp->backend, &be_start, &phttp->end_req);
 
@@ -4942,16 +6817,36 @@ do_http (POUND_HTTP *phttp)
        *  - client is not HTTP/1.1
        *      or
        *  - we had a "Connection: closed" header
+       *      or
+       *  - this is an HTTP/2 stream
        */
-      if (!cl_11 || phttp->conn_closed)
-	break;
+      if (!cl_11 || phttp->conn_closed || phttp->h2)
+	{
+	  http_request_free (&phttp->request);
+	  http_request_free (&phttp->response);
+	  arena_reset (&phttp->arena);
+	  break;
+	}
+
+      /*
+       * If the client hasn't sent anything yet, pass the connection to
+       * the event loop, instead of waiting for the next request.
+       */
+      if (event_thread_count > 0 && BIO_pending (phttp->cl) == 0)
+	{
+	  http_request_free (&phttp->request);
+	  http_request_free (&phttp->response);
+	  arena_reset (&phttp->arena);
+	  backend_pool_release (phttp);
+	  return HTTP_CONN_IDLE;
+	}
     }
 
-  return;
+  return HTTP_CONN_DONE;
 
  err:
   http_err_reply (phttp, HTTP_STATUS_INTERNAL_SERVER_ERROR);
-  return;
+  return HTTP_CONN_DONE;
 }
 
 void *
@@ -4961,12 +6856,51 @@ thr_http (void *dummy)
 
   while ((phttp = pound_http_dequeue ()) != NULL)
     {
-      do_http (phttp);
-      clear_error (phttp->ssl);
-      pound_http_destroy (phttp);
+      int rc;
+
+      arena_set_current (&phttp->arena);
+      rc = do_http (phttp);
+      arena_set_current (NULL);
+      /* A detached connection may have already been freed. */
+      if (rc != HTTP_CONN_DETACHED)
+	{
+	  clear_error (phttp->ssl);
+	  if (rc != HTTP_CONN_IDLE || pound_http_park (phttp))
+	    pound_http_destroy (phttp);
+	}
       active_threads_decr ();
     }
   logmsg (LOG_NOTICE, "(%"PRItid") thread terminating on idle timeout",
 	  POUND_TID ());
   return NULL;
 }
+
+#ifdef POUND_BENCH
+/*
+ * Entry points for the micro-benchmarks (see bench/microbench.c).
+ */
+
+/*
+ * Read the request from IN and parse it, the same way as it is done for
+ * requests received by the listener LSTN.
+ */
+int
+bench_http_request_parse (BIO *in, const LISTENER *lstn,
+			  struct http_request *req)
+{
+  int res;
+
+  if ((res = http_request_read (in, lstn, req)) == HTTP_STATUS_OK)
+    res = parse_http_request (req, lstn->verb);
+  return res;
+}
+
+/*
+ * Expand the compiled string PROG in the context of PHTTP.
+ */
+char *
+bench_expand_string (EXPAND_PROG const *prog, POUND_HTTP *phttp)
+{
+  return expand_string (prog, phttp, "benchmark");
+}
+#endif
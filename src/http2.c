@@ -0,0 +1,1273 @@
+/* HTTP/2 support for pound
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * HTTP/2 is negotiated via ALPN on HTTPS listeners.  The thread that
+ * accepted the connection runs an nghttp2 session on it.  Each request
+ * stream is converted into an HTTP/1.1 request and passed over a socket
+ * pair to a worker thread, which handles it as a connection carrying a
+ * single request: service selection, rewriting, backends and logging
+ * work unchanged.  The HTTP/1.1 response produced by the worker is
+ * converted back to HEADERS and DATA frames.
+ */
+#include "pound.h"
+#include <nghttp2/nghttp2.h>
+
+/* Amount of data buffered per stream, in each direction. */
+#define H2_STREAM_BUFSIZE 65536
+/* Size of I/O chunks. */
+#define H2_IOSIZE 16384
+/* Max. size of the response head. */
+#define H2_MAX_HEAD (8 * MAXBUF)
+
+/* Simple FIFO buffer. */
+struct h2_buf
+{
+  struct stringbuf sb;
+  size_t off;              /* Offset of the first unconsumed byte. */
+};
+
+static void
+h2_buf_init (struct h2_buf *b)
+{
+  stringbuf_init_log (&b->sb);
+  b->off = 0;
+}
+
+static inline char *
+h2_buf_data (struct h2_buf *b)
+{
+  return b->sb.base + b->off;
+}
+
+static inline size_t
+h2_buf_len (struct h2_buf *b)
+{
+  return b->sb.len - b->off;
+}
+
+static void
+h2_buf_drain (struct h2_buf *b, size_t n)
+{
+  b->off += n;
+  if (b->off == b->sb.len)
+    {
+      b->off = 0;
+      stringbuf_reset (&b->sb);
+    }
+}
+
+static void
+h2_buf_compact (struct h2_buf *b)
+{
+  if (b->off > 0)
+    {
+      memmove (b->sb.base, b->sb.base + b->off, b->sb.len - b->off);
+      b->sb.len -= b->off;
+      b->off = 0;
+    }
+}
+
+static int
+h2_buf_add (struct h2_buf *b, void const *data, size_t len)
+{
+  h2_buf_compact (b);
+  return stringbuf_add (&b->sb, data, len);
+}
+
+/*
+ * Reserve N bytes at the end of the buffer B and return pointer to them.
+ * Call h2_buf_commit to account for the bytes actually stored.
+ */
+static char *
+h2_buf_reserve (struct h2_buf *b, size_t n)
+{
+  size_t len;
+
+  h2_buf_compact (b);
+  len = b->sb.len;
+  if (stringbuf_set (&b->sb, 0, n) == NULL)
+    return NULL;
+  b->sb.len = len;
+  return b->sb.base + len;
+}
+
+static inline void
+h2_buf_commit (struct h2_buf *b, size_t n)
+{
+  b->sb.len += n;
+}
+
+static inline void
+h2_buf_free (struct h2_buf *b)
+{
+  stringbuf_free (&b->sb);
+}
+
+enum h2_req_state
+  {
+    REQ_HEADERS,           /* Receiving request headers. */
+    REQ_BODY,              /* Receiving request body. */
+    REQ_DONE               /* Request received completely. */
+  };
+
+enum h2_resp_state
+  {
+    RESP_HEAD,             /* Reading response head. */
+    RESP_BODY,             /* Reading response body, up to EOF. */
+    RESP_CHUNK_SIZE,       /* Reading chunk size line. */
+    RESP_CHUNK_DATA,       /* Reading chunk data. */
+    RESP_CHUNK_CRLF,       /* Reading CRLF after the chunk data. */
+    RESP_TRAILER,          /* Skipping trailer. */
+    RESP_DONE              /* Response read completely. */
+  };
+
+struct http2_session;
+
+struct http2_stream
+{
+  int32_t id;                   /* Stream ID. */
+  int fd;                       /* Our end of the socket pair, or -1. */
+  int pidx;                     /* Index in the pollfd array, or -1. */
+  struct http2_session *sess;   /* Session this stream belongs to. */
+
+  /* Request */
+  enum h2_req_state req_state;
+  char *method;                 /* :method */
+  char *path;                   /* :path */
+  char *authority;              /* :authority */
+  int has_host;                 /* Host header is present. */
+  int has_length;               /* Content-Length header is present. */
+  int chunked;                  /* Body is passed chunk-encoded. */
+  int wr_closed;                /* Worker doesn't accept more data. */
+  struct stringbuf headers;     /* Regular request headers. */
+  struct stringbuf cookie;      /* Cookie values. */
+  struct h2_buf req;            /* Data to be sent to the worker. */
+  size_t unconsumed;            /* DATA bytes not yet given back to the
+				   flow control. */
+
+  /* Response */
+  enum h2_resp_state resp_state;
+  int submitted;                /* Final response has been submitted. */
+  int eof;                      /* Worker closed its end. */
+  int deferred;                 /* Data provider is deferred. */
+  CONTENT_LENGTH body_left;     /* Bytes left in the body, or
+				   NO_CONTENT_LENGTH if unknown. */
+  unsigned long chunk_left;     /* Bytes left in the current chunk. */
+  struct h2_buf resp;           /* Raw response data from the worker. */
+  struct h2_buf body;           /* Decoded body waiting to be sent. */
+
+  DLIST_ENTRY (http2_stream) link;
+};
+
+typedef DLIST_HEAD (,http2_stream) HTTP2_STREAM_HEAD;
+
+struct http2_session
+{
+  POUND_HTTP *phttp;            /* Client connection. */
+  nghttp2_session *ngh;
+  HTTP2_STREAM_HEAD streams;
+  size_t nstreams;
+  struct h2_buf out;            /* Data to be sent to the client. */
+
+  struct tls_info tls;          /* TLS parameters, for the streams. */
+
+  /*
+   * Number of worker threads processing streams of this session.  The
+   * session can't be freed until it drops to 0, because the workers
+   * reference its TLS parameters.
+   */
+  pthread_mutex_t mut;
+  pthread_cond_t cond;
+  unsigned refcount;
+};
+
+static const unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+/* Offset of http/1.1 in alpn_protos, used when h2 can't be offered. */
+#define ALPN_HTTP1_OFF 3
+
+static int
+alpn_select (SSL *ssl, const unsigned char **out, unsigned char *outlen,
+	     const unsigned char *in, unsigned int inlen, void *arg)
+{
+  size_t off = pound_http_session_available () ? 0 : ALPN_HTTP1_OFF;
+
+  if (SSL_select_next_proto ((unsigned char **) out, outlen,
+			     alpn_protos + off, sizeof (alpn_protos) - 1 - off,
+			     in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+/* Enable negotiation of HTTP/2 on CTX. */
+void
+http2_ctx_init (SSL_CTX *ctx)
+{
+  SSL_CTX_set_alpn_select_cb (ctx, alpn_select, NULL);
+}
+
+/* Return true if HTTP/2 has been negotiated on the connection SSL. */
+int
+http2_negotiated (SSL *ssl)
+{
+  const unsigned char *proto;
+  unsigned len;
+
+  if (ssl == NULL)
+    return 0;
+  SSL_get0_alpn_selected (ssl, &proto, &len);
+  return len == 2 && memcmp (proto, "h2", 2) == 0;
+}
+
+static void
+http2_session_ref (struct http2_session *sess)
+{
+  pthread_mutex_lock (&sess->mut);
+  sess->refcount++;
+  pthread_mutex_unlock (&sess->mut);
+}
+
+/*
+ * Called when the worker thread has finished processing a stream of
+ * the session SESS.
+ */
+void
+http2_stream_release (struct http2_session *sess)
+{
+  pthread_mutex_lock (&sess->mut);
+  if (--sess->refcount == 0)
+    pthread_cond_broadcast (&sess->cond);
+  pthread_mutex_unlock (&sess->mut);
+}
+
+static struct http2_stream *
+stream_new (struct http2_session *sess, int32_t id)
+{
+  struct http2_stream *st;
+
+  if ((st = calloc (1, sizeof (*st))) == NULL)
+    {
+      lognomem ();
+      return NULL;
+    }
+  st->id = id;
+  st->fd = -1;
+  st->pidx = -1;
+  st->sess = sess;
+  st->req_state = REQ_HEADERS;
+  st->resp_state = RESP_HEAD;
+  stringbuf_init_log (&st->headers);
+  stringbuf_init_log (&st->cookie);
+  h2_buf_init (&st->req);
+  h2_buf_init (&st->resp);
+  h2_buf_init (&st->body);
+  DLIST_PUSH (&sess->streams, st, link);
+  sess->nstreams++;
+  return st;
+}
+
+static void
+stream_close_fd (struct http2_stream *st)
+{
+  if (st->fd != -1)
+    {
+      close (st->fd);
+      st->fd = -1;
+    }
+}
+
+static void
+stream_free (struct http2_stream *st)
+{
+  struct http2_session *sess = st->sess;
+
+  stream_close_fd (st);
+  if (st->unconsumed)
+    nghttp2_session_consume_connection (sess->ngh, st->unconsumed);
+  free (st->method);
+  free (st->path);
+  free (st->authority);
+  stringbuf_free (&st->headers);
+  stringbuf_free (&st->cookie);
+  h2_buf_free (&st->req);
+  h2_buf_free (&st->resp);
+  h2_buf_free (&st->body);
+  DLIST_REMOVE (&sess->streams, st, link);
+  sess->nstreams--;
+  free (st);
+}
+
+/* Abort the stream ST, notifying the client. */
+static void
+stream_reset (struct http2_stream *st, uint32_t error_code)
+{
+  stream_close_fd (st);
+  nghttp2_submit_rst_stream (st->sess->ngh, NGHTTP2_FLAG_NONE, st->id,
+			     error_code);
+}
+
+/* Give the consumed request data back to the flow control. */
+static void
+stream_consume (struct http2_stream *st, size_t n)
+{
+  if (n > st->unconsumed)
+    n = st->unconsumed;
+  if (n > 0)
+    {
+      nghttp2_session_consume (st->sess->ngh, st->id, n);
+      st->unconsumed -= n;
+    }
+}
+
+/*
+ * Request processing.
+ */
+
+static char *
+h2_strndup (const uint8_t *s, size_t len)
+{
+  char *p;
+
+  if ((p = malloc (len + 1)) == NULL)
+    {
+      lognomem ();
+      return NULL;
+    }
+  memcpy (p, s, len);
+  p[len] = 0;
+  return p;
+}
+
+#define HDR_IS(name, namelen, str) \
+  ((namelen) == sizeof (str) - 1 && memcmp (name, str, namelen) == 0)
+
+static int
+on_begin_headers (nghttp2_session *session, const nghttp2_frame *frame,
+		  void *user_data)
+{
+  struct http2_session *sess = user_data;
+  struct http2_stream *st;
+
+  if (frame->hd.type != NGHTTP2_HEADERS
+      || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+    return 0;
+  if ((st = stream_new (sess, frame->hd.stream_id)) == NULL)
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  nghttp2_session_set_stream_user_data (session, frame->hd.stream_id, st);
+  return 0;
+}
+
+static int
+on_header (nghttp2_session *session, const nghttp2_frame *frame,
+	   const uint8_t *name, size_t namelen,
+	   const uint8_t *value, size_t valuelen,
+	   uint8_t flags, void *user_data)
+{
+  struct http2_stream *st;
+  char **pval = NULL;
+
+  if (frame->hd.type != NGHTTP2_HEADERS
+      || (st = nghttp2_session_get_stream_user_data (session,
+						     frame->hd.stream_id)) == NULL
+      || st->req_state != REQ_HEADERS)
+    /* Trailers are ignored. */
+    return 0;
+
+  if (namelen > 0 && name[0] == ':')
+    {
+      if (HDR_IS (name, namelen, ":method"))
+	pval = &st->method;
+      else if (HDR_IS (name, namelen, ":path"))
+	pval = &st->path;
+      else if (HDR_IS (name, namelen, ":authority"))
+	pval = &st->authority;
+      else
+	return 0;
+      free (*pval);
+      if ((*pval = h2_strndup (value, valuelen)) == NULL)
+	return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+      return 0;
+    }
+
+  /*
+   * Connection-specific headers are rejected by nghttp2, except for
+   * "te: trailers", which has no meaning in HTTP/1.1 request to pound.
+   */
+  if (HDR_IS (name, namelen, "te"))
+    return 0;
+
+  if (HDR_IS (name, namelen, "cookie"))
+    {
+      /* Multiple cookie headers are joined (RFC 9113, 8.2.3). */
+      if (stringbuf_len (&st->cookie) > 0)
+	stringbuf_add (&st->cookie, "; ", 2);
+      stringbuf_add (&st->cookie, (char const *) value, valuelen);
+      return stringbuf_err (&st->cookie)
+	       ? NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE : 0;
+    }
+
+  if (HDR_IS (name, namelen, "host"))
+    st->has_host = 1;
+  else if (HDR_IS (name, namelen, "content-length"))
+    st->has_length = 1;
+
+  stringbuf_add (&st->headers, (char const *) name, namelen);
+  stringbuf_add (&st->headers, ": ", 2);
+  stringbuf_add (&st->headers, (char const *) value, valuelen);
+  stringbuf_add (&st->headers, "\r\n", 2);
+  return stringbuf_err (&st->headers)
+	   ? NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE : 0;
+}
+
+/*
+ * Request headers have been received.  Compose the HTTP/1.1 request
+ * and pass it to a worker thread.
+ */
+static int
+stream_dispatch (struct http2_stream *st, int end_stream)
+{
+  struct http2_session *sess = st->sess;
+  struct stringbuf *sb = &st->req.sb;
+  int fd[2];
+
+  if (st->method == NULL || st->path == NULL)
+    return -1;
+
+  stringbuf_printf (sb, "%s %s HTTP/1.1\r\n", st->method, st->path);
+  if (!st->has_host && st->authority)
+    stringbuf_printf (sb, "Host: %s\r\n", st->authority);
+  stringbuf_add (sb, stringbuf_value (&st->headers),
+		 stringbuf_len (&st->headers));
+  if (stringbuf_len (&st->cookie) > 0)
+    {
+      stringbuf_add_string (sb, "Cookie: ");
+      stringbuf_add (sb, stringbuf_value (&st->cookie),
+		     stringbuf_len (&st->cookie));
+      stringbuf_add (sb, "\r\n", 2);
+    }
+  if (!end_stream && !st->has_length)
+    {
+      stringbuf_add_string (sb, "Transfer-Encoding: chunked\r\n");
+      st->chunked = 1;
+    }
+  stringbuf_add (sb, "\r\n", 2);
+  if (stringbuf_err (sb))
+    return -1;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fd))
+    {
+      logmsg (LOG_ERR, "(%"PRItid") socketpair: %s", POUND_TID (),
+	      strerror (errno));
+      return -1;
+    }
+  fcntl (fd[0], F_SETFL, fcntl (fd[0], F_GETFL) | O_NONBLOCK);
+  fcntl (fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl (fd[1], F_SETFD, FD_CLOEXEC);
+
+  http2_session_ref (sess);
+  if (pound_http_enqueue_stream (sess->phttp, fd[1], sess, &sess->tls))
+    {
+      http2_stream_release (sess);
+      close (fd[0]);
+      close (fd[1]);
+      return -1;
+    }
+  st->fd = fd[0];
+  st->req_state = end_stream ? REQ_DONE : REQ_BODY;
+  return 0;
+}
+
+/* The client has sent the whole request. */
+static void
+stream_request_end (struct http2_stream *st)
+{
+  if (st->req_state == REQ_BODY)
+    {
+      if (st->chunked && !st->wr_closed)
+	h2_buf_add (&st->req, "0\r\n\r\n", 5);
+      st->req_state = REQ_DONE;
+    }
+}
+
+static int
+on_frame_recv (nghttp2_session *session, const nghttp2_frame *frame,
+	       void *user_data)
+{
+  struct http2_stream *st;
+
+  if ((st = nghttp2_session_get_stream_user_data (session,
+						  frame->hd.stream_id)) == NULL)
+    return 0;
+
+  switch (frame->hd.type)
+    {
+    case NGHTTP2_HEADERS:
+      if (st->req_state == REQ_HEADERS)
+	{
+	  if ((frame->hd.flags & NGHTTP2_FLAG_END_HEADERS)
+	      && stream_dispatch (st, frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+	    {
+	      stream_reset (st, NGHTTP2_INTERNAL_ERROR);
+	      return 0;
+	    }
+	}
+      else if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)
+	stream_request_end (st);
+      break;
+
+    case NGHTTP2_DATA:
+      if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)
+	stream_request_end (st);
+      break;
+    }
+  return 0;
+}
+
+static int
+on_data_chunk_recv (nghttp2_session *session, uint8_t flags,
+		    int32_t stream_id, const uint8_t *data,
+		    size_t len, void *user_data)
+{
+  struct http2_stream *st;
+
+  if ((st = nghttp2_session_get_stream_user_data (session, stream_id)) == NULL)
+    {
+      nghttp2_session_consume (session, stream_id, len);
+      return 0;
+    }
+
+  st->unconsumed += len;
+  if (st->wr_closed)
+    stream_consume (st, len);
+  else if (st->chunked)
+    {
+      char buf[32];
+      int n = snprintf (buf, sizeof (buf), "%zx\r\n", len);
+      if (h2_buf_add (&st->req, buf, n)
+	  || h2_buf_add (&st->req, data, len)
+	  || h2_buf_add (&st->req, "\r\n", 2))
+	return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    }
+  else if (h2_buf_add (&st->req, data, len))
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  return 0;
+}
+
+static int
+on_frame_send (nghttp2_session *session, const nghttp2_frame *frame,
+	       void *user_data)
+{
+  struct http2_stream *st;
+
+  /*
+   * If the response is complete, but the client is still sending the
+   * request, tell it to stop (RFC 9113, 8.1).
+   */
+  if ((frame->hd.type == NGHTTP2_DATA || frame->hd.type == NGHTTP2_HEADERS)
+      && (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)
+      && (st = nghttp2_session_get_stream_user_data (session,
+						     frame->hd.stream_id)) != NULL
+      && st->req_state != REQ_DONE)
+    nghttp2_submit_rst_stream (session, NGHTTP2_FLAG_NONE, st->id,
+			       NGHTTP2_NO_ERROR);
+  return 0;
+}
+
+static int
+on_stream_close (nghttp2_session *session, int32_t stream_id,
+		 uint32_t error_code, void *user_data)
+{
+  struct http2_stream *st;
+
+  if ((st = nghttp2_session_get_stream_user_data (session, stream_id)) != NULL)
+    {
+      nghttp2_session_set_stream_user_data (session, stream_id, NULL);
+      stream_free (st);
+    }
+  return 0;
+}
+
+/*
+ * Response processing.
+ */
+
+static inline int
+stream_response_complete (struct http2_stream *st)
+{
+  return st->resp_state == RESP_DONE
+	 || (st->eof && st->resp_state == RESP_BODY
+	     && st->body_left == NO_CONTENT_LENGTH);
+}
+
+static ssize_t
+stream_data_read (nghttp2_session *session, int32_t stream_id,
+		  uint8_t *buf, size_t length, uint32_t *data_flags,
+		  nghttp2_data_source *source, void *user_data)
+{
+  struct http2_stream *st = source->ptr;
+  size_t n = h2_buf_len (&st->body);
+
+  if (n > length)
+    n = length;
+  memcpy (buf, h2_buf_data (&st->body), n);
+  h2_buf_drain (&st->body, n);
+  if (h2_buf_len (&st->body) == 0)
+    {
+      if (stream_response_complete (st))
+	*data_flags |= NGHTTP2_DATA_FLAG_EOF;
+      else if (n == 0)
+	{
+	  st->deferred = 1;
+	  return NGHTTP2_ERR_DEFERRED;
+	}
+    }
+  return n;
+}
+
+static int
+is_connection_header (char const *name, size_t len)
+{
+  static struct
+  {
+    char const *name;
+    size_t len;
+  } hdrtab[] = {
+#define S(s) { s, sizeof (s) - 1 }
+    S ("connection"),
+    S ("keep-alive"),
+    S ("proxy-connection"),
+    S ("transfer-encoding"),
+    S ("upgrade"),
+    { NULL }
+#undef S
+  };
+  int i;
+
+  for (i = 0; hdrtab[i].name; i++)
+    if (hdrtab[i].len == len && memcmp (hdrtab[i].name, name, len) == 0)
+      return 1;
+  return 0;
+}
+
+/* Return true if the Transfer-Encoding value VAL ends with "chunked". */
+static int
+is_chunked (char const *val, size_t len)
+{
+  while (len > 0 && (val[len-1] == ' ' || val[len-1] == '\t'))
+    len--;
+  return len >= 7 && strncasecmp (val + len - 7, "chunked", 7) == 0
+	 && (len == 7 || strchr (" \t,", val[len - 8]));
+}
+
+/*
+ * Parse the response head at the start of the raw response buffer and
+ * submit it to the client.  Return 1 if the head has been processed,
+ * 0 if more data are needed and -1 on error.
+ */
+static int
+stream_response_head (struct http2_stream *st)
+{
+  char *head = h2_buf_data (&st->resp);
+  size_t len = h2_buf_len (&st->resp);
+  char *end, *p, *q;
+  size_t hlen, count;
+  nghttp2_nv *nva;
+  CONTENT_LENGTH content_length = NO_CONTENT_LENGTH;
+  int code, chunked = 0;
+  int rc;
+
+  if ((end = memmem (head, len, "\r\n\r\n", 4)) == NULL)
+    return len > H2_MAX_HEAD ? -1 : 0;
+  hlen = end - head + 4;
+
+  /* Status line: HTTP/1.x NNN [reason] */
+  if (hlen < 12 || memcmp (head, "HTTP/1.", 7) != 0 || head[8] != ' '
+      || !(isdigit (head[9]) && isdigit (head[10]) && isdigit (head[11])))
+    return -1;
+  code = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+
+  /* Upper bound on the number of headers. */
+  count = 1;
+  for (p = head; p < end; p++)
+    if (*p == '\n')
+      count++;
+  if ((nva = calloc (count, sizeof (nva[0]))) == NULL)
+    {
+      lognomem ();
+      return -1;
+    }
+
+  nva[0].name = (uint8_t *) ":status";
+  nva[0].namelen = 7;
+  nva[0].value = (uint8_t *) head + 9;
+  nva[0].valuelen = 3;
+  count = 1;
+
+  p = memchr (head, '\n', hlen) + 1;
+  while (p < end + 2)
+    {
+      char *eol = memchr (p, '\n', end + 2 - p);
+      char *colon;
+      size_t i;
+
+      q = eol;
+      if (q > p && q[-1] == '\r')
+	q--;
+      if (*p == ' ' || *p == '\t'
+	  || (colon = memchr (p, ':', q - p)) == NULL || colon == p)
+	/* Skip obsolete line folding and malformed lines. */
+	goto next;
+
+      for (i = 0; p + i < colon; i++)
+	p[i] = tolower ((unsigned char) p[i]);
+      if (!is_connection_header (p, colon - p))
+	{
+	  char *val = colon + 1;
+
+	  while (val < q && (*val == ' ' || *val == '\t'))
+	    val++;
+	  while (q > val && (q[-1] == ' ' || q[-1] == '\t'))
+	    q--;
+	  nva[count].name = (uint8_t *) p;
+	  nva[count].namelen = colon - p;
+	  nva[count].value = (uint8_t *) val;
+	  nva[count].valuelen = q - val;
+	  count++;
+	  if (colon - p == 14 && !memcmp (p, "content-length", 14)
+	      && q > val && isdigit (*val))
+	    content_length = strtoll (val, NULL, 10);
+	}
+      else if (colon - p == 17 && !memcmp (p, "transfer-encoding", 17))
+	chunked = is_chunked (colon + 1, q - colon - 1);
+    next:
+      p = eol + 1;
+    }
+
+  if (code < 200)
+    {
+      if (code == 101)
+	rc = -1;
+      else
+	/* Informational response. */
+	rc = nghttp2_submit_headers (st->sess->ngh, NGHTTP2_FLAG_NONE,
+				     st->id, NULL, nva, count, NULL) ? -1 : 1;
+    }
+  else
+    {
+      nghttp2_data_provider prd;
+
+      prd.source.ptr = st;
+      prd.read_callback = stream_data_read;
+      if (nghttp2_submit_response (st->sess->ngh, st->id, nva, count, &prd))
+	rc = -1;
+      else
+	{
+	  st->submitted = 1;
+	  if (chunked)
+	    st->resp_state = RESP_CHUNK_SIZE;
+	  else
+	    {
+	      if (code == 204 || code == 304 || strcmp (st->method, "HEAD") == 0)
+		content_length = 0;
+	      st->body_left = content_length;
+	      st->resp_state = content_length == 0 ? RESP_DONE : RESP_BODY;
+	    }
+	  rc = 1;
+	}
+    }
+  free (nva);
+  h2_buf_drain (&st->resp, hlen);
+  return rc;
+}
+
+/*
+ * Move body data from the raw response buffer to the body buffer,
+ * decoding chunked transfer encoding.  Return -1 on error.
+ */
+static int
+stream_response_body (struct http2_stream *st)
+{
+  for (;;)
+    {
+      char *data = h2_buf_data (&st->resp);
+      size_t len = h2_buf_len (&st->resp);
+      char *p;
+
+      if (len == 0)
+	return 0;
+
+      switch (st->resp_state)
+	{
+	case RESP_BODY:
+	  if (st->body_left != NO_CONTENT_LENGTH && len > st->body_left)
+	    len = st->body_left;
+	  if (h2_buf_add (&st->body, data, len))
+	    return -1;
+	  h2_buf_drain (&st->resp, len);
+	  if (st->body_left != NO_CONTENT_LENGTH
+	      && (st->body_left -= len) == 0)
+	    st->resp_state = RESP_DONE;
+	  break;
+
+	case RESP_CHUNK_SIZE:
+	  if ((p = memmem (data, len, "\r\n", 2)) == NULL)
+	    return len > MAXBUF ? -1 : 0;
+	  if (!isxdigit (*data))
+	    return -1;
+	  errno = 0;
+	  st->chunk_left = strtoul (data, NULL, 16);
+	  if (errno)
+	    return -1;
+	  st->resp_state = st->chunk_left ? RESP_CHUNK_DATA : RESP_TRAILER;
+	  h2_buf_drain (&st->resp, p - data + 2);
+	  break;
+
+	case RESP_CHUNK_DATA:
+	  if (len > st->chunk_left)
+	    len = st->chunk_left;
+	  if (h2_buf_add (&st->body, data, len))
+	    return -1;
+	  h2_buf_drain (&st->resp, len);
+	  if ((st->chunk_left -= len) == 0)
+	    st->resp_state = RESP_CHUNK_CRLF;
+	  break;
+
+	case RESP_CHUNK_CRLF:
+	  if (len < 2)
+	    return 0;
+	  if (memcmp (data, "\r\n", 2))
+	    return -1;
+	  h2_buf_drain (&st->resp, 2);
+	  st->resp_state = RESP_CHUNK_SIZE;
+	  break;
+
+	case RESP_TRAILER:
+	  /* Trailers are not passed to the client. */
+	  st->resp_state = RESP_DONE;
+	  /* fall through */
+	case RESP_DONE:
+	  h2_buf_drain (&st->resp, len);
+	  return 0;
+
+	case RESP_HEAD:
+	  abort ();
+	}
+    }
+}
+
+/* Process data received from the worker. */
+static void
+stream_response (struct http2_stream *st)
+{
+  while (st->resp_state == RESP_HEAD)
+    {
+      int rc = stream_response_head (st);
+      if (rc == -1)
+	goto err;
+      if (rc == 0)
+	{
+	  if (st->eof)
+	    goto err;
+	  return;
+	}
+    }
+
+  if (stream_response_body (st))
+    goto err;
+  if (st->eof && !stream_response_complete (st))
+    goto err;
+
+  if (st->deferred
+      && (h2_buf_len (&st->body) > 0 || stream_response_complete (st)))
+    {
+      st->deferred = 0;
+      nghttp2_session_resume_data (st->sess->ngh, st->id);
+    }
+  return;
+
+ err:
+  stream_reset (st, NGHTTP2_INTERNAL_ERROR);
+  st->eof = 1;
+  st->resp_state = RESP_DONE;
+}
+
+/* Send pending request data to the worker. */
+static void
+stream_write (struct http2_stream *st)
+{
+  size_t len = h2_buf_len (&st->req);
+  ssize_t n;
+
+  if ((n = write (st->fd, h2_buf_data (&st->req), len)) == -1)
+    {
+      if (errno == EAGAIN || errno == EINTR)
+	return;
+      /* The worker won't read any more. */
+      st->wr_closed = 1;
+      n = len;
+    }
+  h2_buf_drain (&st->req, n);
+  stream_consume (st, n);
+  if (st->wr_closed)
+    stream_consume (st, st->unconsumed);
+}
+
+/* Read response data from the worker. */
+static void
+stream_read (struct http2_stream *st)
+{
+  char *p;
+  ssize_t n;
+
+  if ((p = h2_buf_reserve (&st->resp, H2_IOSIZE)) == NULL)
+    n = -1;
+  else if ((n = read (st->fd, p, H2_IOSIZE)) == -1
+	   && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  if (n <= 0)
+    {
+      st->eof = 1;
+      stream_close_fd (st);
+    }
+  else
+    h2_buf_commit (&st->resp, n);
+  stream_response (st);
+}
+
+/*
+ * Client connection I/O.
+ */
+
+static int
+session_flush (struct http2_session *sess)
+{
+  SSL *ssl = sess->phttp->ssl;
+
+  for (;;)
+    {
+      int rc;
+
+      while (h2_buf_len (&sess->out) < H2_IOSIZE)
+	{
+	  const uint8_t *data;
+	  ssize_t n = nghttp2_session_mem_send (sess->ngh, &data);
+	  if (n < 0)
+	    {
+	      logmsg (LOG_ERR, "(%"PRItid") nghttp2_session_mem_send: %s",
+		      POUND_TID (), nghttp2_strerror (n));
+	      return -1;
+	    }
+	  if (n == 0)
+	    break;
+	  if (h2_buf_add (&sess->out, data, n))
+	    return -1;
+	}
+
+      if (h2_buf_len (&sess->out) == 0)
+	return 0;
+
+      rc = SSL_write (ssl, h2_buf_data (&sess->out), h2_buf_len (&sess->out));
+      if (rc <= 0)
+	{
+	  switch (SSL_get_error (ssl, rc))
+	    {
+	    case SSL_ERROR_WANT_READ:
+	    case SSL_ERROR_WANT_WRITE:
+	      return 0;
+
+	    default:
+	      return -1;
+	    }
+	}
+      h2_buf_drain (&sess->out, rc);
+    }
+}
+
+static int
+session_read (struct http2_session *sess)
+{
+  SSL *ssl = sess->phttp->ssl;
+  uint8_t buf[H2_IOSIZE];
+
+  for (;;)
+    {
+      ssize_t n;
+      int rc = SSL_read (ssl, buf, sizeof (buf));
+
+      if (rc <= 0)
+	{
+	  switch (SSL_get_error (ssl, rc))
+	    {
+	    case SSL_ERROR_WANT_READ:
+	    case SSL_ERROR_WANT_WRITE:
+	      return 0;
+
+	    default:
+	      /* EOF or error. */
+	      return -1;
+	    }
+	}
+
+      if ((n = nghttp2_session_mem_recv (sess->ngh, buf, rc)) < 0)
+	{
+	  logmsg (LOG_NOTICE, "(%"PRItid") HTTP/2 error: %s",
+		  POUND_TID (), nghttp2_strerror (n));
+	  return -1;
+	}
+    }
+}
+
+static nghttp2_session_callbacks *callbacks;
+static pthread_once_t callbacks_once = PTHREAD_ONCE_INIT;
+
+static void
+callbacks_init (void)
+{
+  if (nghttp2_session_callbacks_new (&callbacks))
+    {
+      lognomem ();
+      return;
+    }
+  nghttp2_session_callbacks_set_on_begin_headers_callback (callbacks,
+							   on_begin_headers);
+  nghttp2_session_callbacks_set_on_header_callback (callbacks, on_header);
+  nghttp2_session_callbacks_set_on_frame_recv_callback (callbacks,
+							on_frame_recv);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback (callbacks,
+							     on_data_chunk_recv);
+  nghttp2_session_callbacks_set_on_frame_send_callback (callbacks,
+							on_frame_send);
+  nghttp2_session_callbacks_set_on_stream_close_callback (callbacks,
+							  on_stream_close);
+}
+
+static int
+session_init (struct http2_session *sess, POUND_HTTP *phttp)
+{
+  nghttp2_option *opt;
+  nghttp2_settings_entry settings[] = {
+    { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, phttp->lstn->http2_max_streams },
+    { NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, H2_STREAM_BUFSIZE },
+  };
+  int rc;
+
+  memset (sess, 0, sizeof (*sess));
+  sess->phttp = phttp;
+  tls_info_init (&sess->tls, phttp->ssl);
+  DLIST_INIT (&sess->streams);
+  h2_buf_init (&sess->out);
+  pthread_mutex_init (&sess->mut, NULL);
+  pthread_cond_init (&sess->cond, NULL);
+
+  pthread_once (&callbacks_once, callbacks_init);
+  if (callbacks == NULL)
+    return -1;
+
+  if (nghttp2_option_new (&opt))
+    {
+      lognomem ();
+      return -1;
+    }
+  /* Flow control follows the rate at which workers read request data. */
+  nghttp2_option_set_no_auto_window_update (opt, 1);
+  rc = nghttp2_session_server_new2 (&sess->ngh, callbacks, sess, opt);
+  nghttp2_option_del (opt);
+  if (rc)
+    {
+      logmsg (LOG_ERR, "(%"PRItid") nghttp2_session_server_new: %s",
+	      POUND_TID (), nghttp2_strerror (rc));
+      return -1;
+    }
+
+  if ((rc = nghttp2_submit_settings (sess->ngh, NGHTTP2_FLAG_NONE, settings,
+				     sizeof (settings) / sizeof (settings[0]))))
+    {
+      logmsg (LOG_ERR, "(%"PRItid") nghttp2_submit_settings: %s",
+	      POUND_TID (), nghttp2_strerror (rc));
+      return -1;
+    }
+  return 0;
+}
+
+static void
+session_free (struct http2_session *sess)
+{
+  struct http2_stream *st, *tmp;
+
+  /* Closing the socket pairs makes the workers finish. */
+  DLIST_FOREACH_SAFE (st, tmp, &sess->streams, link)
+    {
+      st->unconsumed = 0;
+      stream_free (st);
+    }
+
+  pthread_mutex_lock (&sess->mut);
+  while (sess->refcount > 0)
+    pthread_cond_wait (&sess->cond, &sess->mut);
+  pthread_mutex_unlock (&sess->mut);
+
+  pthread_mutex_destroy (&sess->mut);
+  pthread_cond_destroy (&sess->cond);
+  tls_info_free (&sess->tls);
+  nghttp2_session_del (sess->ngh);
+  h2_buf_free (&sess->out);
+}
+
+/*
+ * Refuse the HTTP/2 connection PHTTP: send GOAWAY without accepting
+ * any streams, so that the client can retry elsewhere.
+ */
+int
+http2_refuse (POUND_HTTP *phttp)
+{
+  struct http2_session sess;
+
+  if (session_init (&sess, phttp) == 0
+      && nghttp2_session_terminate_session (sess.ngh,
+					    NGHTTP2_REFUSED_STREAM) == 0)
+    {
+      while (nghttp2_session_want_write (sess.ngh)
+	     || h2_buf_len (&sess.out) > 0)
+	if (session_flush (&sess))
+	  break;
+    }
+  session_free (&sess);
+  return HTTP_CONN_DONE;
+}
+
+/*
+ * Serve the HTTP/2 connection PHTTP.
+ */
+int
+http2_serve (POUND_HTTP *phttp)
+{
+  struct http2_session sess;
+  struct pollfd *pfd = NULL;
+  size_t pfd_max = 0;
+  int timeout = phttp->lstn->to ? phttp->lstn->to * 1000 : -1;
+  int flags;
+
+  if (session_init (&sess, phttp))
+    {
+      session_free (&sess);
+      return HTTP_CONN_DONE;
+    }
+
+  flags = fcntl (phttp->sock, F_GETFL);
+  fcntl (phttp->sock, F_SETFL, flags | O_NONBLOCK);
+  SSL_set_mode (phttp->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE
+		| SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+  for (;;)
+    {
+      struct http2_stream *st, *tmp;
+      size_t n;
+      int rc;
+
+      if (session_flush (&sess))
+	break;
+
+      if (!nghttp2_session_want_read (sess.ngh)
+	  && !nghttp2_session_want_write (sess.ngh)
+	  && h2_buf_len (&sess.out) == 0)
+	break;
+
+      if (pfd_max < sess.nstreams + 1)
+	{
+	  struct pollfd *p;
+	  size_t nmax = sess.nstreams + 1;
+
+	  if ((p = realloc (pfd, nmax * sizeof (pfd[0]))) == NULL)
+	    {
+	      lognomem ();
+	      break;
+	    }
+	  pfd = p;
+	  pfd_max = nmax;
+	}
+
+      pfd[0].fd = phttp->sock;
+      pfd[0].events = 0;
+      if (nghttp2_session_want_read (sess.ngh))
+	pfd[0].events |= POLLIN;
+      if (h2_buf_len (&sess.out) > 0)
+	pfd[0].events |= POLLOUT;
+      n = 1;
+
+      DLIST_FOREACH (st, &sess.streams, link)
+	{
+	  st->pidx = -1;
+	  if (st->fd == -1)
+	    continue;
+	  pfd[n].fd = st->fd;
+	  pfd[n].events = 0;
+	  if (h2_buf_len (&st->req) > 0)
+	    pfd[n].events |= POLLOUT;
+	  if (h2_buf_len (&st->body) < H2_STREAM_BUFSIZE)
+	    pfd[n].events |= POLLIN;
+	  if (pfd[n].events)
+	    st->pidx = n++;
+	}
+
+      rc = poll (pfd, n, timeout);
+      if (rc == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  logmsg (LOG_ERR, "(%"PRItid") poll: %s", POUND_TID (),
+		  strerror (errno));
+	  break;
+	}
+
+      if (rc == 0)
+	{
+	  if (sess.nstreams == 0)
+	    /* Idle timeout: send GOAWAY and finish. */
+	    nghttp2_session_terminate_session (sess.ngh, NGHTTP2_NO_ERROR);
+	  continue;
+	}
+
+      DLIST_FOREACH_SAFE (st, tmp, &sess.streams, link)
+	{
+	  if (st->pidx == -1)
+	    continue;
+	  if (pfd[st->pidx].revents & POLLOUT)
+	    stream_write (st);
+	  if (pfd[st->pidx].revents & (POLLIN | POLLHUP | POLLERR))
+	    stream_read (st);
+	}
+
+      if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+	{
+	  if (session_read (&sess))
+	    break;
+	}
+
+      /* Try to send request data received just now. */
+      DLIST_FOREACH (st, &sess.streams, link)
+	{
+	  if (st->fd != -1 && h2_buf_len (&st->req) > 0)
+	    stream_write (st);
+	}
+    }
+
+  free (pfd);
+  session_free (&sess);
+  fcntl (phttp->sock, F_SETFL, flags);
+  return HTTP_CONN_DONE;
+}
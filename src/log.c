@@ -343,7 +343,7 @@ static void
 i_protocol (struct stringbuf *sb, struct http_log_instr *instr,
 	    POUND_HTTP *phttp)
 {
-  print_str (sb, phttp->ssl == NULL ? "http" : "https");
+  print_str (sb, pound_http_is_tls (phttp) ? "https" : "http");
 }
 
 static void
@@ -651,6 +651,7 @@ be_service_name (BACKEND *be)
   switch (be->be_type)
     {
     case BE_REGULAR:
+    case BE_CACHE:
       if (be->service->name)
        return be->service->name;
       break;
@@ -1048,6 +1049,10 @@ http_log (POUND_HTTP *phttp)
     {
       logmsg (LOG_ERR, "error formatting log message");
     }
+  else if (access_log_enabled ())
+    {
+      access_log_write (msg, strlen (msg));
+    }
   else
     {
       logmsg (LOG_INFO, "%s", msg);
@@ -16,252 +16,607 @@
  */
 #include "pound.h"
 #include "extern.h"
-#include "json.h"
 
 /*
- * Metric labels
+ * Metric labels.
+ *
+ * Labels are kept in a stack: iterators push the label identifying
+ * each object before calling the generator and pop it afterwards.
+ * Generators may push additional labels for the duration of a sample.
  */
+#define METRIC_LABELS_MAX 8
+
 struct metric_label
 {
-  char *name;
-  char *value;
-  DLIST_ENTRY (metric_label) next;
+  char const *name;
+  char const *value;
+  char buf[24];		/* Storage for numeric values. */
 };
 
-typedef DLIST_HEAD (,metric_label) METRIC_LABELS;
+typedef struct metric_labels
+{
+  size_t count;
+  struct metric_label label[METRIC_LABELS_MAX];
+} METRIC_LABELS;
+
+/* Push label NAME=VALUE to the stack. */
+static void
+metric_labels_push (METRIC_LABELS *labels, char const *name,
+		    char const *value)
+{
+  struct metric_label *label;
+
+  if (labels->count == METRIC_LABELS_MAX)
+    {
+      logmsg (LOG_ERR, "INTERNAL ERROR at %s:%d: metric label stack overflow; please report", __FILE__, __LINE__);
+      abort ();
+    }
+  label = &labels->label[labels->count++];
+  label->name = name;
+  label->value = value;
+}
+
+/* Push label NAME with the numeric value N. */
+static void
+metric_labels_push_index (METRIC_LABELS *labels, char const *name, size_t n)
+{
+  struct metric_label *label;
+
+  metric_labels_push (labels, name, NULL);
+  label = &labels->label[labels->count - 1];
+  snprintf (label->buf, sizeof label->buf, "%zu", n);
+  label->value = label->buf;
+}
+
+/* Remove last label from the stack. */
+static void
+metric_labels_pop (METRIC_LABELS *labels)
+{
+  labels->count--;
+}
+
+/*
+ * Exposition.
+ *
+ * Metrics are formatted directly from the runtime objects into the
+ * output buffer, which is sent to the client each time it grows beyond
+ * EXPOSITION_CHUNK_SIZE bytes.  HTTP/1.1 clients receive the reply in
+ * chunked transfer encoding.  For HTTP/1.0 clients the reply ends when
+ * the connection is closed.
+ */
+#define EXPOSITION_CHUNK_SIZE 16384
+
+struct metric_family;
+
+typedef struct exposition
+{
+  BIO *bio;                 /* Client connection. */
+  int chunked;              /* Use chunked transfer encoding. */
+  struct stringbuf sb;      /* Output buffer. */
+  CONTENT_LENGTH bytes;     /* Number of content bytes sent so far. */
+  int err;                  /* Error indicator. */
+  struct metric_family const *family; /* Family being output. */
+  int header_done;          /* Family header has been output. */
+} EXPOSITION;
 
-#define metric_labels_empty DLIST_EMPTY
+/*
+ * Mertric families.
+ */
+struct metric_family
+{
+  char const *name;
+  char const *type;
+  char const *unit;
+  char const *help;
+  void (*genfn) (EXPOSITION *, METRIC_LABELS *, void *);
+};
 
 /*
- * Add label NAME=VALUE to the label list HEAD.
+ * Send the accumulated output to the client.
+ * Return 0 on success.  On error, log the failure and return -1.
  */
 static int
-metric_labels_add (METRIC_LABELS *head, char const *name, char const *value)
+exposition_flush (EXPOSITION *exp)
 {
-  struct metric_label *label;
-  size_t nlen = strlen (name);
+  size_t len;
 
-  if ((label = malloc (sizeof (*label) + nlen + strlen (value) + 2)) == NULL)
+  if (exp->err)
+    return -1;
+  if (stringbuf_err (&exp->sb))
     {
-      lognomem ();
+      exp->err = 1;
       return -1;
     }
-  label->name = (char*) (label + 1);
-  strcpy (label->name, name);
-  label->value = label->name + nlen + 1;
-  strcpy (label->value, value);
-
-  DLIST_PUSH (head, label, next);
+  if ((len = stringbuf_len (&exp->sb)) == 0)
+    return 0;
 
+  if ((exp->chunked && BIO_printf (exp->bio, "%zx\r\n", len) <= 0)
+      || BIO_write (exp->bio, stringbuf_value (&exp->sb), len) != len
+      || (exp->chunked && BIO_puts (exp->bio, "\r\n") <= 0))
+    {
+      logmsg (LOG_NOTICE, "(%"PRItid") error writing metrics: %s",
+	      POUND_TID (), strerror (errno));
+      exp->err = 1;
+      return -1;
+    }
+  exp->bytes += len;
+  stringbuf_reset (&exp->sb);
   return 0;
 }
 
-/* Remove last label from the list. */
+/* Flush the output if it has grown large enough. */
 static void
-metric_labels_pop (METRIC_LABELS *head)
+exposition_flush_maybe (EXPOSITION *exp)
 {
-  struct metric_label *label = DLIST_LAST (head);
-  DLIST_REMOVE (head, label, next);
-  free (label);
+  if (stringbuf_len (&exp->sb) >= EXPOSITION_CHUNK_SIZE)
+    exposition_flush (exp);
 }
 
-/* Copy labels from SRC to DST.  Notice: does not initialize or reset DST. */
-static int
-metric_labels_copy (METRIC_LABELS *dst, METRIC_LABELS const *src)
+/* Output label value, escaping it as required by Openmetrics. */
+static void
+label_value_format (struct stringbuf *sb, char const *value)
 {
-  if (src)
+  for (; *value; value++)
     {
-      struct metric_label *label;
-      DLIST_FOREACH (label, src, next)
+      switch (*value)
 	{
-	  if (metric_labels_add (dst, label->name, label->value))
-	    return -1;
+	case '\\':
+	  stringbuf_add_string (sb, "\\\\");
+	  break;
+
+	case '"':
+	  stringbuf_add_string (sb, "\\\"");
+	  break;
+
+	case '\n':
+	  stringbuf_add_string (sb, "\\n");
+	  break;
+
+	default:
+	  stringbuf_add_char (sb, *value);
 	}
     }
-  return 0;
 }
 
-/* Free the label list. */
+/*
+ * Output a sample of the current family.  SUFFIX (may be NULL) is
+ * appended to the family name.  The descriptive header of the family
+ * is output before its first sample, so that families without samples
+ * don't appear in the exposition.
+ */
 static void
-metric_labels_free (METRIC_LABELS *head)
+exposition_sample (EXPOSITION *exp, char const *suffix,
+		   METRIC_LABELS *labels, double number)
 {
-  while (!DLIST_EMPTY (head))
+  struct metric_family const *family = exp->family;
+  struct stringbuf *sb = &exp->sb;
+
+  if (exp->err)
+    return;
+
+  if (!exp->header_done)
     {
-      struct metric_label *p = DLIST_FIRST (head);
-      DLIST_SHIFT (head, next);
-      free (p);
+      stringbuf_printf (sb, "# TYPE %s %s\n", family->name, family->type);
+      if (family->unit)
+	stringbuf_printf (sb, "# UNIT %s %s\n", family->name, family->unit);
+      stringbuf_printf (sb, "# HELP %s %s\n", family->name, family->help);
+      exp->header_done = 1;
     }
+
+  stringbuf_add_string (sb, family->name);
+  if (suffix)
+    stringbuf_add_string (sb, suffix);
+  if (labels->count > 0)
+    {
+      size_t i;
+
+      stringbuf_add_char (sb, '{');
+      for (i = 0; i < labels->count; i++)
+	{
+	  if (i > 0)
+	    stringbuf_add_char (sb, ',');
+	  stringbuf_add_string (sb, labels->label[i].name);
+	  stringbuf_add_string (sb, "=\"");
+	  label_value_format (sb, labels->label[i].value);
+	  stringbuf_add_char (sb, '"');
+	}
+      stringbuf_add_char (sb, '}');
+    }
+  stringbuf_printf (sb, " %.0f\n", number);
 }
-
+
+/* Output a sample with an additional label NAME=VALUE. */
+static void
+exposition_sample_label (EXPOSITION *exp, METRIC_LABELS *labels,
+			 char const *name, char const *value, double number)
+{
+  metric_labels_push (labels, name, value);
+  exposition_sample (exp, NULL, labels, number);
+  metric_labels_pop (labels);
+}
+
 /*
- * Metric samples.
+ * Metric generators.  Each generator outputs samples of its family
+ * for a single runtime object.  Service and backend generators are
+ * called with the service mutex locked.
  */
-struct metric_sample
+static void
+gen_workers (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
 {
-  METRIC_LABELS labels;
-  double number;
-  SLIST_ENTRY (metric_sample) next;
-};
+  unsigned count, active;
 
-typedef SLIST_HEAD (,metric_sample) METRIC_SAMPLES;
+  workers_count (&count, &active);
+  exposition_sample_label (exp, labels, "type", "active", active);
+  exposition_sample_label (exp, labels, "type", "count", count);
+  exposition_sample_label (exp, labels, "type", "max", worker_max_count);
+  exposition_sample_label (exp, labels, "type", "min", worker_min_count);
+}
 
-/*
- * Allocate a new metric sample and append it to the samples list.
- * On success, return the new sample.
- * On error, log the failure and return NULL.
- */
-static struct metric_sample *
-metric_samples_add (METRIC_SAMPLES *samples)
+static void
+gen_access_log_dropped (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  if (access_log_config.target)
+    exposition_sample (exp, "_total", labels, access_log_dropped ());
+}
+
+static void
+gen_arena_high_water (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
 {
-  struct metric_sample *sp;
+  exposition_sample (exp, NULL, labels, arena_high_water ());
+}
 
-  if ((sp = malloc (sizeof (*sp))) != NULL)
+static void
+gen_arena_extra_chunks (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  exposition_sample (exp, "_total", labels, arena_extra_chunks ());
+}
+
+static void
+gen_listener_enabled (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  LISTENER *lstn = data;
+  exposition_sample (exp, NULL, labels, !lstn->disabled);
+}
+
+static void
+gen_listener_info (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  LISTENER *lstn = data;
+  char buf[MAX_ADDR_BUFSIZE];
+
+  addr2str (buf, sizeof (buf), &lstn->addr, 0);
+  metric_labels_push (labels, "name", lstn->name ? lstn->name : "");
+  metric_labels_push (labels, "address", buf);
+  metric_labels_push (labels, "protocol",
+		      SLIST_EMPTY (&lstn->ctx_head) ? "http" : "https");
+  exposition_sample (exp, NULL, labels, 1);
+  metric_labels_pop (labels);
+  metric_labels_pop (labels);
+  metric_labels_pop (labels);
+}
+
+static void
+gen_service_info (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  SERVICE *svc = data;
+  exposition_sample_label (exp, labels, "name", svc->name ? svc->name : "", 1);
+}
+
+static void
+gen_service_enabled (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  SERVICE *svc = data;
+  exposition_sample (exp, NULL, labels, !svc->disabled);
+}
+
+static void
+gen_backends_count (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  SERVICE *svc = data;
+  BALANCER *balancer;
+  BACKEND *be;
+  size_t n = 0;
+  size_t n_alive = 0;
+  size_t n_enabled = 0;
+  size_t n_active = 0;
+
+  DLIST_FOREACH (balancer, &svc->balancers, link)
     {
-      DLIST_INIT (&sp->labels);
-      sp->number = 0;
-      SLIST_PUSH (samples, sp, next);
+      DLIST_FOREACH (be, &balancer->backends, link)
+	{
+	  n++;
+	  if (!be->disabled)
+	    n_enabled++;
+	  if (backend_is_alive (be))
+	    {
+	      n_alive++;
+	      if (!be->disabled)
+		n_active++;
+	    }
+	}
     }
-  else
-    lognomem ();
-  return sp;
+
+  exposition_sample_label (exp, labels, "state", "total", n);
+  exposition_sample_label (exp, labels, "state", "enabled", n_enabled);
+  exposition_sample_label (exp, labels, "state", "alive", n_alive);
+  exposition_sample_label (exp, labels, "state", "active", n_active);
 }
 
-/* Free all samples in the list. */
 static void
-metric_samples_free (METRIC_SAMPLES *samples)
-{
-  while (!SLIST_EMPTY (samples))
+gen_cache_requests (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  SERVICE *svc = data;
+  struct http_cache_stats st;
+  static char const *result_str[] = {
+    [CACHE_HIT] = "hit",
+    [CACHE_COALESCED] = "coalesced",
+    [CACHE_MISS] = "miss",
+    [CACHE_BYPASS] = "bypass"
+  };
+  int i;
+
+  if (!svc->cache)
+    return;
+  http_cache_stats (svc->cache, &st);
+  for (i = 0; i < CACHE_STAT_MAX; i++)
     {
-      struct metric_sample *s = SLIST_FIRST (samples);
-      SLIST_SHIFT (samples, next);
-      metric_labels_free (&s->labels);
-      free (s);
+      metric_labels_push (labels, "result", result_str[i]);
+      exposition_sample (exp, "_total", labels, st.requests[i]);
+      metric_labels_pop (labels);
     }
 }
-
-/*
- * Metrics.
- */
-struct metric
+
+static void
+gen_cache_entries (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
 {
-  struct metric_family const *family;
-  METRIC_SAMPLES samples;
-  SLIST_ENTRY (metric) next;
-};
+  SERVICE *svc = data;
+  struct http_cache_stats st;
 
-/* Exposition is a list of metrics. */
-typedef SLIST_HEAD (,metric) EXPOSITION;
+  if (!svc->cache)
+    return;
+  http_cache_stats (svc->cache, &st);
+  exposition_sample (exp, NULL, labels, st.entries);
+}
 
-#define EXPOSITION_INIT(exp) SLIST_INIT(exp)
+static void
+gen_cache_size (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  SERVICE *svc = data;
+  struct http_cache_stats st;
 
-/*
- * Allocate a new metric sample and append it to the sample list in
- * the metric.  Set sample labels to PFX.
- * Return the new sample or NULL on allocation error.  In the latter
- * case the partially initialized object might be left attached to
- * the metric.  Thus, it will be freed when the caller disposes of
- * the metric.
- */
-static struct metric_sample *
-metric_add_sample (struct metric *metric, METRIC_LABELS *pfx)
+  if (!svc->cache)
+    return;
+  http_cache_stats (svc->cache, &st);
+  exposition_sample (exp, NULL, labels, st.size);
+}
+
+static void
+gen_cache_evictions (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
 {
-  struct metric_sample *samp = metric_samples_add (&metric->samples);
-  if (samp)
+  SERVICE *svc = data;
+  struct http_cache_stats st;
+
+  if (!svc->cache)
+    return;
+  http_cache_stats (svc->cache, &st);
+  exposition_sample (exp, "_total", labels, st.evictions);
+}
+
+enum
+  {
+    COMPRESS_STAT_RESPONSES,
+    COMPRESS_STAT_BYTES_IN,
+    COMPRESS_STAT_BYTES_OUT
+  };
+
+static void
+gen_compression_stat (EXPOSITION *exp, METRIC_LABELS *labels, SERVICE *svc,
+		      int what)
+{
+  struct http_compress_stats st;
+  int i;
+
+  if (!svc->compress)
+    return;
+  http_compress_stats (svc->compress, &st);
+  for (i = 0; i < COMPRESS_MAX; i++)
     {
-      if (metric_labels_copy (&samp->labels, pfx))
-	return NULL;
+      metric_labels_push (labels, "encoding", compress_coding_name (i));
+      exposition_sample (exp, "_total", labels,
+			 what == COMPRESS_STAT_RESPONSES
+			   ? st.responses[i]
+			   : what == COMPRESS_STAT_BYTES_IN
+			       ? st.bytes_in[i] : st.bytes_out[i]);
+      metric_labels_pop (labels);
     }
-  return samp;
 }
 
-/* Free the metric and everything associated with it. */
 static void
-metric_free (struct metric *metric)
+gen_compressed_responses (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  gen_compression_stat (exp, labels, data, COMPRESS_STAT_RESPONSES);
+}
+
+static void
+gen_compression_input (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
 {
-  metric_samples_free (&metric->samples);
+  gen_compression_stat (exp, labels, data, COMPRESS_STAT_BYTES_IN);
+}
+
+static void
+gen_compression_output (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  gen_compression_stat (exp, labels, data, COMPRESS_STAT_BYTES_OUT);
+}
+
+static void
+gen_backend_state (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  BACKEND *be = data;
+  exposition_sample_label (exp, labels, "state", "alive",
+			   backend_is_alive (be));
+  exposition_sample_label (exp, labels, "state", "enabled", !be->disabled);
 }
 
 /*
- * Find in the exposition a metric with the given family.  If not there,
- * allocate one and add to the exposition.
- * Return the metric.
- * On error, log the failure and return NULL.
+ * Read request statistics of BE into ST.  Return 0 on success and -1
+ * if statistics is not available for this backend.
  */
-static struct metric *
-exposition_metric_find (EXPOSITION *exp, struct metric_family const *family)
+static int
+backend_stats_get (BACKEND *be, struct be_stats *st)
 {
-  struct metric *mp;
+  if (!enable_backend_stats || be->be_type == BE_MATRIX)
+    return -1;
+  backend_stats_read (be, st);
+  return 0;
+}
 
-  SLIST_FOREACH (mp, exp, next)
-    {
-      if (mp->family == family)
-	return mp;
-    }
+static void
+gen_backend_requests (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  struct be_stats st;
 
-  if ((mp = malloc (sizeof (*mp))) != NULL)
-    {
-      mp->family = family;
-      SLIST_INIT (&mp->samples);
-      SLIST_PUSH (exp, mp, next);
-    }
-  else
-    lognomem ();
-  return mp;
+  if (backend_stats_get (data, &st) == 0)
+    exposition_sample (exp, NULL, labels, st.count);
+}
+
+static void
+gen_backend_request_time_avg (EXPOSITION *exp, METRIC_LABELS *labels,
+			      void *data)
+{
+  struct be_stats st;
+
+  if (backend_stats_get (data, &st) == 0 && st.count > 0)
+    exposition_sample (exp, NULL, labels, (double) st.sum / st.count);
 }
 
-/* Free the exposition. */
 static void
-exposition_free (EXPOSITION *exp)
+gen_backend_request_stddev (EXPOSITION *exp, METRIC_LABELS *labels,
+			    void *data)
 {
-  while (!SLIST_EMPTY (exp))
+  struct be_stats st;
+
+  if (backend_stats_get (data, &st) == 0 && st.count > 0)
+    exposition_sample (exp, NULL, labels, be_stats_stddev (&st));
+}
+
+static void
+gen_backend_request_time (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  struct be_stats st;
+  char buf[80];
+  uint64_t total = 0;
+  int i;
+
+  if (backend_stats_get (data, &st) || st.count == 0)
+    return;
+
+  for (i = 0; i <= BE_STATS_BUCKETS; i++)
     {
-      struct metric *mp = SLIST_FIRST (exp);
-      SLIST_SHIFT (exp, next);
-      metric_free (mp);
-      free (mp);
+      total += st.hist[i];
+      if (i < BE_STATS_BUCKETS)
+	snprintf (buf, sizeof buf, "%"PRIu64, be_stats_bucket_bound[i]);
+      else
+	strcpy (buf, "+Inf");
+      metric_labels_push (labels, "le", buf);
+      exposition_sample (exp, "_bucket", labels, total);
+      metric_labels_pop (labels);
     }
+  exposition_sample (exp, "_count", labels, total);
+  exposition_sample (exp, "_sum", labels, st.sum);
+}
+
+static void
+gen_backend_pool (EXPOSITION *exp, METRIC_LABELS *labels, void *data)
+{
+  BACKEND *be = data;
+  struct be_pool *pool;
+  unsigned count;
+  unsigned long hits, misses;
+
+  if (be->be_type != BE_REGULAR || be->v.reg.pool.max_idle == 0)
+    return;
+
+  pool = &be->v.reg.pool;
+  pthread_mutex_lock (&pool->mut);
+  count = pool->count;
+  hits = pool->hits;
+  misses = pool->misses;
+  pthread_mutex_unlock (&pool->mut);
+
+  exposition_sample_label (exp, labels, "type", "idle", count);
+  exposition_sample_label (exp, labels, "type", "hits", hits);
+  exposition_sample_label (exp, labels, "type", "misses", misses);
 }
-
+
 /*
- * Mertric families.
+ * Copy health check state of BE to HP.  Return 0 on success and -1 if
+ * the backend has no health checks or hasn't been probed yet.
  */
-struct metric_family
+static int
+backend_health_get (BACKEND *be, struct be_health *hp)
 {
-  char const *name;
-  char const *type;
-  char const *unit;
-  char const *help;
-  int (*setfn) (EXPOSITION *, struct metric *, METRIC_LABELS *, struct json_value *);
-};
+  if (be->be_type != BE_REGULAR || be->v.reg.health.conf == NULL)
+    return -1;
+  pthread_mutex_lock (&be->mut);
+  *hp = be->v.reg.health;
+  pthread_mutex_unlock (&be->mut);
+  return hp->last_ok == -1 ? -1 : 0;
+}
+
+static void
+gen_backend_health_check_up (EXPOSITION *exp, METRIC_LABELS *labels,
+			     void *data)
+{
+  struct be_health h;
+
+  if (backend_health_get (data, &h) == 0)
+    exposition_sample (exp, NULL, labels, h.last_ok);
+}
 
-static int gen_listener_enabled (EXPOSITION *exp, struct metric *metric,
-				 METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_listener_info (EXPOSITION *exp, struct metric *metric,
-			      METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backends_count (EXPOSITION *exp, struct metric *metric,
-			       METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_service_info (EXPOSITION *exp, struct metric *metric,
-			     METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_service_enabled (EXPOSITION *exp, struct metric *metric,
-				METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backend_state (EXPOSITION *exp, struct metric *metric,
-			      METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backend_requests (EXPOSITION *exp, struct metric *metric,
-				 METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backend_request_time_avg (EXPOSITION *exp, struct metric *metric,
-				 METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_backend_request_stddev (EXPOSITION *exp, struct metric *metric,
-				 METRIC_LABELS *pfx, struct json_value *obj);
-static int gen_workers (EXPOSITION *exp, struct metric *metric,
-			METRIC_LABELS *pfx, struct json_value *obj);
+static void
+gen_backend_health_check_status (EXPOSITION *exp, METRIC_LABELS *labels,
+				 void *data)
+{
+  struct be_health h;
+
+  if (backend_health_get (data, &h) == 0)
+    exposition_sample (exp, NULL, labels, h.last_status);
+}
+
+static void
+gen_backend_health_check_latency (EXPOSITION *exp, METRIC_LABELS *labels,
+				  void *data)
+{
+  struct be_health h;
+
+  if (backend_health_get (data, &h) == 0)
+    exposition_sample (exp, NULL, labels, h.last_latency);
+}
+
+static void
+gen_backend_health_checks (EXPOSITION *exp, METRIC_LABELS *labels,
+			   void *data)
+{
+  struct be_health h;
+
+  if (backend_health_get (data, &h) == 0)
+    {
+      metric_labels_push (labels, "result", "failure");
+      exposition_sample (exp, "_total", labels, h.failures);
+      metric_labels_pop (labels);
+      metric_labels_push (labels, "result", "success");
+      exposition_sample (exp, "_total", labels, h.checks - h.failures);
+      metric_labels_pop (labels);
+    }
+}
 
 static struct metric_family listener_metric_families[] = {
   { "pound_listener_enabled",
     "stateset",
     NULL,
     "State of a listener: enabled/disabled.",
-    gen_listener_enabled,
-  },
+    gen_listener_enabled },
   { "pound_listener_info",
     "info",
     NULL,
@@ -285,8 +640,42 @@ static struct metric_family service_metric_families[] = {
     "gauge",
     NULL,
     "Number of backends per service: total, alive, enabled, and active (both alive and enabled).",
-    gen_backends_count,
-  },
+    gen_backends_count },
+  { "pound_cache_requests",
+    "counter",
+    NULL,
+    "Number of requests handled by the service cache, by result: hit, coalesced, miss, or bypass.",
+    gen_cache_requests },
+  { "pound_cache_entries",
+    "gauge",
+    NULL,
+    "Number of responses stored in the service cache.",
+    gen_cache_entries },
+  { "pound_cache_size_bytes",
+    "gauge",
+    "bytes",
+    "Amount of memory used by the service cache.",
+    gen_cache_size },
+  { "pound_cache_evictions",
+    "counter",
+    NULL,
+    "Number of responses evicted from the service cache to free up space.",
+    gen_cache_evictions },
+  { "pound_compressed_responses",
+    "counter",
+    NULL,
+    "Number of responses compressed by the service, by content coding.",
+    gen_compressed_responses },
+  { "pound_compression_input_bytes",
+    "counter",
+    "bytes",
+    "Amount of response data passed to the compressor.",
+    gen_compression_input },
+  { "pound_compression_output_bytes",
+    "counter",
+    "bytes",
+    "Amount of compressed response data produced.",
+    gen_compression_output },
   { NULL }
 };
 
@@ -311,598 +700,253 @@ static struct metric_family backend_metric_families[] = {
     "nanoseconds",
     "Standard deviation of the average time per request.",
     gen_backend_request_stddev },
+  { "pound_backend_request_time_nanoseconds",
+    "histogram",
+    "nanoseconds",
+    "Distribution of time per request spent in backend.",
+    gen_backend_request_time },
+  { "pound_backend_pool",
+    "gauge",
+    NULL,
+    "Backend connection pool: number of idle connections, pool hits and misses.",
+    gen_backend_pool },
+  { "pound_backend_health_check_up",
+    "gauge",
+    NULL,
+    "Result of the last health check: 1 if it succeeded, 0 otherwise.",
+    gen_backend_health_check_up },
+  { "pound_backend_health_check_status",
+    "gauge",
+    NULL,
+    "HTTP status returned by the last health check, 0 if none.",
+    gen_backend_health_check_status },
+  { "pound_backend_health_check_latency_nanoseconds",
+    "gauge",
+    "nanoseconds",
+    "Duration of the last health check.",
+    gen_backend_health_check_latency },
+  { "pound_backend_health_checks",
+    "counter",
+    NULL,
+    "Number of health checks performed, by result.",
+    gen_backend_health_checks },
   { NULL }
 };
 
-static struct metric_family workers_metric_families[] = {
+static struct metric_family global_metric_families[] = {
   { "pound_workers",
     "gauge",
     NULL,
     "Number of pound workers.",
     gen_workers },
-  { NULL }
-};
-
-
-/*
- * Metric family definitions describe how to iterate over the root
- * object and, if necessary, what family to descend into for each
- * object retrieved.
- */
-struct metric_family_defn
-{
-  struct metric_family const *family;
-  char const *attr;        /* JSON attribute that contains array of objects
-			      of this family. */
-  char const *index_label; /* Label to hold index of the current object. */
-  int descend_family;      /* After handling each retrieved object, descend
-			      into that family. */
-};
-
-/* The table below is indexed by these constants: */
-enum
-  {
-    METRIC_FAMILY_NONE = -1,
-    METRIC_FAMILY_LISTENER,
-    METRIC_FAMILY_SERVICE,
-    METRIC_FAMILY_BACKEND
-  };
-
-struct metric_family_defn metric_family_defn[] = {
-  { listener_metric_families,
-    "listeners",
-    "listener",
-    METRIC_FAMILY_SERVICE },
-  { service_metric_families,
-    "services",
-    "service",
-    METRIC_FAMILY_BACKEND },
-  { backend_metric_families,
-    "backends",
-    "backend",
-    METRIC_FAMILY_NONE },
+  { "pound_access_log_dropped",
+    "counter",
+    NULL,
+    "Number of access log records dropped.",
+    gen_access_log_dropped },
+  { "pound_request_arena_high_water_bytes",
+    "gauge",
+    "bytes",
+    "Maximum amount of memory allocated for a single request.",
+    gen_arena_high_water },
+  { "pound_request_arena_extra_chunks",
+    "counter",
+    NULL,
+    "Number of request arena chunks allocated beyond the base ones.",
+    gen_arena_extra_chunks },
   { NULL }
 };
 
 /*
- * Version of json_object_get with error and type checking.
- * Retrieves from the object OBJ the value of attribute ATTR.
- * If found, checks that it has the given TYPE, and if so,
- * stores it in the memory location pointed to by RETVAL and
- * returns 0.  On error (attribute not found, is of wrong type,
- * etc.) logs the failure and returns -1.
+ * Object iterators.  Each iterator calls the generator of FAMILY for
+ * every runtime object of the corresponding kind, with labels
+ * identifying the object pushed to LABELS.
  *
- * When checking types, json_number and json_integer are considered
- * to be the same type.
+ * Output is flushed only between services, so that service mutexes are
+ * never held while writing to the client.
  */
-static int
-json_object_get_type (struct json_value *obj, char const *attr, int type,
-		      struct json_value **retval)
+static void
+global_foreach (EXPOSITION *exp, METRIC_LABELS *labels,
+		 struct metric_family const *family)
 {
-  struct json_value *jv;
-
-  if (json_object_get (obj, attr, &jv))
-    {
-      if (errno == ENOENT)
-	logmsg (LOG_NOTICE, "attribute \"%s\" not found", attr);
-      else
-	logmsg (LOG_NOTICE, "attribute lookup error: %s", strerror (errno));
-      return -1;
-    }
-
-  switch (type)
-    {
-    case json_number:
-    case json_integer:
-      if (jv->type == json_number || jv->type == json_integer)
-	{
-	  *retval = jv;
-	  return 0;
-	}
-      break;
-
-    default:
-      if (jv->type == type)
-	{
-	  *retval = jv;
-	  return 0;
-	}
-    }
-  logmsg (LOG_NOTICE, "attribute \"%s\" type mismatch (expected %d, got %d)",
-	  attr, type, jv->type);
-  errno = EINVAL;
-  return -1;
+  family->genfn (exp, labels, NULL);
+  exposition_flush_maybe (exp);
 }
 
-static int
-json_object_get_name (struct json_value *obj, struct json_value **retval)
+static void
+listeners_foreach (EXPOSITION *exp, METRIC_LABELS *labels,
+		   struct metric_family const *family)
 {
-  struct json_value *jv;
-
-  if (json_object_get (obj, "name", &jv))
-    {
-      if (errno == ENOENT)
-	logmsg (LOG_NOTICE, "attribute \"%s\" not found", "name");
-      else
-	logmsg (LOG_NOTICE, "attribute lookup error: %s", strerror (errno));
-      return -1;
-    }
+  LISTENER *lstn;
+  size_t i = 0;
 
-  switch (jv->type)
+  SLIST_FOREACH (lstn, &listeners, next)
     {
-    case json_string:
-    case json_null:
-      *retval = jv;
-      break;
-
-    default:
-      logmsg (LOG_NOTICE, "attribute \"%s\" type mismatch (expected %d or %d, got %d)",
-	      "name", json_string, json_null, jv->type);
-      errno = EINVAL;
-      return -1;
+      if (exp->err)
+	break;
+      metric_labels_push_index (labels, "listener", i++);
+      family->genfn (exp, labels, lstn);
+      metric_labels_pop (labels);
+      exposition_flush_maybe (exp);
     }
-
-  return 0;
 }
 
+typedef void (*METRIC_SERVICE_FN) (EXPOSITION *, METRIC_LABELS *,
+				  struct metric_family const *, SERVICE *);
+
 /*
- * For each entry in the FAMILY array, apply its setfn function to the metric
- * of this family in the exposition.  EXP, PFX and VAL are passed to setfn.
- *
- * Return 0 on success.
- * On error, log the failure and return -1.
+ * Iterate over services in the list HEAD, calling FN for each of them
+ * with the service mutex locked.
  */
-int
-exposition_apply_family (EXPOSITION *exp,
-			 METRIC_LABELS *pfx,
-			 struct metric_family const *family,
-			 struct json_value *val)
+static void
+service_list_foreach (EXPOSITION *exp, METRIC_LABELS *labels,
+		      struct metric_family const *family,
+		      SERVICE_HEAD *head, METRIC_SERVICE_FN fn)
 {
-  int res = 0;
-  for (; family->name; family++)
-    {
-      static struct metric *metric;
+  SERVICE *svc;
+  size_t i = 0;
 
-      if ((metric = exposition_metric_find (exp, family)) == NULL)
-	{
-	  logmsg (LOG_ERR, "INTERNAL ERROR at %s:%d: metric family not found; please report", __FILE__, __LINE__);
-	  res = -1;
-	  break;
-	}
-
-      if ((res = family->setfn (exp, metric, pfx, val)) != 0)
+  SLIST_FOREACH (svc, head, next)
+    {
+      if (exp->err)
 	break;
+      metric_labels_push_index (labels, "service", i++);
+      pthread_mutex_lock (&svc->mut);
+      fn (exp, labels, family, svc);
+      pthread_mutex_unlock (&svc->mut);
+      metric_labels_pop (labels);
+      exposition_flush_maybe (exp);
     }
-  return res;
 }
 
 /*
- * Iterate over each value in OBJ using metric family definition at
- * index FN.
- *
- * Return 0 on success.
- * On error, log the failure and return -1.
+ * Apply FN to all services: first to the services of each listener,
+ * then to the global ones.
  */
-int
-exposition_iterate (EXPOSITION *exp, METRIC_LABELS const *pfx, int fn,
-		    struct json_value *obj)
+static void
+all_services_foreach (EXPOSITION *exp, METRIC_LABELS *labels,
+		      struct metric_family const *family,
+		      METRIC_SERVICE_FN fn)
 {
-  struct metric_family_defn const *defn = metric_family_defn + fn;
-  struct json_value *arr, *jv;
-  size_t i, n;
-  char nbuf[80];
-  METRIC_LABELS pfxcopy;
-  int res;
+  LISTENER *lstn;
+  size_t i = 0;
 
-  if (json_object_get (obj, defn->attr, &arr))
+  SLIST_FOREACH (lstn, &listeners, next)
     {
-      if (errno == ENOENT)
-	return 0;
-      else
-	{
-	  logmsg (LOG_NOTICE, "attribute lookup error: %s", strerror (errno));
-	  return -1;
-	}
+      metric_labels_push_index (labels, "listener", i++);
+      service_list_foreach (exp, labels, family, &lstn->services, fn);
+      metric_labels_pop (labels);
     }
-  if (arr->type != json_array)
-    {
-      logmsg (LOG_NOTICE, "attribute \"%s\" type mismatch (expected %d, got %d)",
-	      defn->attr, json_array, arr->type);
-      return -1;
-    }
-
-  DLIST_INIT (&pfxcopy);
-  metric_labels_copy (&pfxcopy, pfx);
-
-  res = 0;
-  n = json_array_length (arr);
-  for (i = 0; i < n; i++)
-    {
-      jv = arr->v.a->ov[i];
-      snprintf (nbuf, sizeof nbuf, "%zu", i);
-      if ((res = metric_labels_add (&pfxcopy, defn->index_label, nbuf)) != 0)
-	break;
-      if ((res = exposition_apply_family (exp, &pfxcopy, defn->family, jv)) != 0)
-	break;
-      if (defn->descend_family != METRIC_FAMILY_NONE)
-	{
-	  if ((res = exposition_iterate (exp, &pfxcopy, defn->descend_family, jv)) != 0)
-	    break;
-	}
-      metric_labels_pop (&pfxcopy);
-    }
-  metric_labels_free (&pfxcopy);
-  return res;
+  service_list_foreach (exp, labels, family, &services, fn);
 }
-
-static int
-gen_listener_enabled (EXPOSITION *exp, struct metric *metric,
-		      METRIC_LABELS *pfx, struct json_value *obj)
-{
-  struct json_value *jv;
-  struct metric_sample *samp;
 
-  if (json_object_get_type (obj, "enabled", json_bool, &jv))
-    return -1;
-
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  samp->number = jv->v.b;
-  return 0;
-}
-
-static int
-gen_listener_info (EXPOSITION *exp, struct metric *metric,
-		   METRIC_LABELS *pfx, struct json_value *obj)
-{
-  struct metric_sample *samp;
-  struct json_value *jv;
-
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-
-  if (json_object_get_name (obj, &jv))
-    return -1;
-  if (metric_labels_add (&samp->labels, "name",
-			 jv->type == json_string ? jv->v.s : ""))
-    return -1;
-
-  if (json_object_get_type (obj, "address", json_string, &jv))
-    return -1;
-  metric_labels_add (&samp->labels, "address", jv->v.s);
-  if (json_object_get_type (obj, "protocol", json_string, &jv))
-    return -1;
-  if (metric_labels_add (&samp->labels, "protocol", jv->v.s))
-    return -1;
-  samp->number = 1;
-  return 0;
-}
-
-static int
-gen_backends_count (EXPOSITION *exp, struct metric *metric,
-		    METRIC_LABELS *pfx, struct json_value *obj)
-{
-  struct metric_sample *samp;
-  struct json_value *arr, *jv;
-  size_t n_alive = 0;
-  size_t n_enabled = 0;
-  size_t n_active = 0;
-  size_t i, n;
-
-  if (json_object_get_type (obj, "backends", json_array, &arr))
-    return -1;
-
-  n = json_array_length (arr);
-  for (i = 0; i < n; i++)
-    {
-      int enabled = 0;
-
-      jv = arr->v.a->ov[i];
-
-      if (json_object_get_type (arr->v.a->ov[i], "enabled", json_bool, &jv) == 0 &&
-	  (enabled = jv->v.b) != 0)
-	n_enabled++;
-
-      if (json_object_get_type (arr->v.a->ov[i], "alive", json_bool, &jv) == 0 &&
-	  jv->v.b)
-	{
-	  n_alive++;
-	  if (enabled)
-	    n_active++;
-	}
-    }
-
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "total"))
-    return -1;
-  samp->number = n;
-
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "enabled"))
-    return -1;
-  samp->number = n_enabled;
-
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "alive"))
-    return -1;
-  samp->number = n_alive;
-
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "active"))
-    return -1;
-  samp->number = n_active;
-  return 0;
-}
-
-static int
-gen_service_info (EXPOSITION *exp, struct metric *metric,
-		  METRIC_LABELS *pfx, struct json_value *obj)
+static void
+service_gen (EXPOSITION *exp, METRIC_LABELS *labels,
+	     struct metric_family const *family, SERVICE *svc)
 {
-  struct metric_sample *samp;
-  struct json_value *jv;
-
-  if (json_object_get_name (obj, &jv))
-    return -1;
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "name",
-			 jv->type == json_string ? jv->v.s : ""))
-    return -1;
-  samp->number = 1;
-  return 0;
+  family->genfn (exp, labels, svc);
 }
 
-static int
-gen_service_enabled (EXPOSITION *exp, struct metric *metric,
-		     METRIC_LABELS *pfx, struct json_value *obj)
-{
-  struct metric_sample *samp;
-  struct json_value *jv;
-
-  if (json_object_get_type (obj, "enabled", json_bool, &jv))
-    return -1;
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  samp->number = jv->v.b;
-  return 0;
-}
-
-static int
-gen_backend_state (EXPOSITION *exp, struct metric *metric,
-		   METRIC_LABELS *pfx, struct json_value *obj)
+static void
+services_foreach (EXPOSITION *exp, METRIC_LABELS *labels,
+		  struct metric_family const *family)
 {
-  struct metric_sample *samp;
-  struct json_value *jv;
-
-  if (json_object_get_type (obj, "alive", json_bool, &jv))
-    return -1;
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "alive"))
-    return -1;
-  samp->number = jv->v.b;
-
-  if (json_object_get_type (obj, "enabled", json_bool, &jv))
-    return -1;
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  if (metric_labels_add (&samp->labels, "state", "enabled"))
-    return -1;
-  samp->number = jv->v.b;
-
-  return 0;
+  all_services_foreach (exp, labels, family, service_gen);
 }
 
-static int
-gen_backend_stats (EXPOSITION *exp, struct metric *metric,
-		   METRIC_LABELS *pfx, struct json_value *obj, char const *attr)
+static void
+service_backends_gen (EXPOSITION *exp, METRIC_LABELS *labels,
+		      struct metric_family const *family, SERVICE *svc)
 {
-  struct metric_sample *samp;
-  struct json_value *stats, *jv;
-
-  if (json_object_get (obj, "stats", &stats))
-    {
-      if (errno == ENOENT)
-	return 0;
-      else
-	{
-	  logmsg (LOG_NOTICE, "attribute lookup error: %s", strerror (errno));
-	  return -1;
-	}
-    }
-  if (stats->type != json_object)
-    {
-      logmsg (LOG_NOTICE, "attribute \"%s\" type mismatch (expected %d, got %d)",
-	      "stats", json_object, jv->type);
-      return -1;
-    }
+  BALANCER *balancer;
+  BACKEND *be;
+  size_t i = 0;
 
-  if (json_object_get (stats, attr, &jv))
+  DLIST_FOREACH (balancer, &svc->balancers, link)
     {
-      if (errno == ENOENT)
-	return 0;
-      else
+      DLIST_FOREACH (be, &balancer->backends, link)
 	{
-	  logmsg (LOG_NOTICE, "attribute lookup error: %s", strerror (errno));
-	  return -1;
+	  metric_labels_push_index (labels, "backend", i++);
+	  family->genfn (exp, labels, be);
+	  metric_labels_pop (labels);
 	}
     }
-  if (jv->type != json_number)
-    {
-      logmsg (LOG_NOTICE, "stats: attribute \"%s\" type mismatch (expected %d, got %d)",
-	      attr, json_number, jv->type);
-      return -1;
-    }
-
-  if ((samp = metric_add_sample (metric, pfx)) == NULL)
-    return -1;
-  samp->number = jv->v.n;
-
-  return 0;
-}
-
-static int
-gen_backend_requests (EXPOSITION *exp, struct metric *metric,
-		      METRIC_LABELS *pfx, struct json_value *obj)
-{
-  return gen_backend_stats (exp, metric, pfx, obj, "request_count");
 }
 
-static int
-gen_backend_request_time_avg (EXPOSITION *exp, struct metric *metric,
-			      METRIC_LABELS *pfx, struct json_value *obj)
-{
-  return gen_backend_stats (exp, metric, pfx, obj, "request_time_avg");
-}
-
-static int
-gen_backend_request_stddev (EXPOSITION *exp, struct metric *metric,
-			    METRIC_LABELS *pfx, struct json_value *obj)
+static void
+backends_foreach (EXPOSITION *exp, METRIC_LABELS *labels,
+		  struct metric_family const *family)
 {
-  return gen_backend_stats (exp, metric, pfx, obj, "request_time_stddev");
+  all_services_foreach (exp, labels, family, service_backends_gen);
 }
 
-static int
-gen_workers (EXPOSITION *exp, struct metric *metric,
-	     METRIC_LABELS *pfx, struct json_value *obj)
-{
-  char *attr[] = { "active", "count", "max", "min", NULL };
-  int i;
-
-  for (i = 0; attr[i]; i++)
-    {
-      struct json_value *val;
-      struct metric_sample *samp;
-
-      if (json_object_get_type (obj, attr[i], json_number, &val))
-	return -1;
-      if ((samp = metric_add_sample (metric, pfx)) == NULL)
-	return -1;
-      if (metric_labels_add (&samp->labels, "type", attr[i]))
-	return -1;
-      samp->number = val->v.n;
-    }
-  return 0;
-}
-
 /*
- * Initialize the exposition and fill it, using OBJ as input.
+ * Metric family definitions describe how to iterate over the runtime
+ * objects of each family.  Families are output in this order.
  */
-static int
-exposition_fill (EXPOSITION *exp, struct json_value *obj)
+struct metric_family_defn
 {
-  struct json_value *val;
-
-  EXPOSITION_INIT (exp);
-
-  if (json_object_get_type (obj, "workers", json_object, &val))
-    return -1;
-
-  if (exposition_apply_family (exp, NULL, workers_metric_families, val))
-    return -1;
-
-  if (exposition_iterate (exp, NULL, METRIC_FAMILY_LISTENER, obj))
-    return -1;
+  struct metric_family const *family;
+  void (*foreach) (EXPOSITION *, METRIC_LABELS *,
+		   struct metric_family const *);
+};
 
-  return exposition_iterate (exp, NULL, METRIC_FAMILY_SERVICE, obj);
-}
+static struct metric_family_defn metric_family_defn[] = {
+  { global_metric_families, global_foreach },
+  { listener_metric_families, listeners_foreach },
+  { service_metric_families, services_foreach },
+  { backend_metric_families, backends_foreach },
+  { NULL }
+};
 
-/*
- * Print the exposition in Openmetrics format into stringbuf.
- */
-static char *
-exposition_format (struct stringbuf *sb, EXPOSITION *exp)
+int
+metrics_response (POUND_HTTP *phttp)
 {
-  struct metric *metric;
-
-  SLIST_FOREACH (metric, exp, next)
-    {
-      if (!SLIST_EMPTY (&metric->samples))
-	{
-	  struct metric_sample *samp;
-	  struct metric_family const *family = metric->family;
-
-	  stringbuf_printf (sb, "# TYPE %s %s\n",
-			    family->name, family->type);
-	  if (family->unit)
-	    stringbuf_printf (sb, "# UNIT %s %s\n", family->name,
-			      family->unit);
-	  stringbuf_printf (sb, "# HELP %s %s\n", family->name, family->help);
+  EXPOSITION exp;
+  METRIC_LABELS labels;
+  struct metric_family_defn *defn;
+  struct metric_family const *family;
 
-	  SLIST_FOREACH (samp, &metric->samples, next)
-	    {
-	      stringbuf_add_string (sb, family->name);
-	      if (!metric_labels_empty (&samp->labels))
-		{
-		  struct metric_label *label;
-
-		  stringbuf_add_char (sb, '{');
-		  DLIST_FOREACH (label, &samp->labels, next)
-		    {
-		      stringbuf_add_string (sb, label->name);
-		      stringbuf_add_char (sb, '=');
-		      stringbuf_add_char (sb, '"');
-		      //FIXME: escape value
-		      stringbuf_add_string (sb, label->value);
-		      stringbuf_add_char (sb, '"');
-		      if (DLIST_NEXT (label, next))
-			stringbuf_add_char (sb, ',');
-		    }
-		  stringbuf_add_char (sb, '}');
-		}
-	      stringbuf_add_char (sb, ' ');
-	      stringbuf_printf (sb, "%.0f\n", samp->number);
-	    }
-	}
-    }
-  stringbuf_add_string (sb, "# EOF\n");
-  return stringbuf_finish (sb);
-}
+  exp.bio = phttp->cl;
+  exp.chunked = phttp->request.version == 1;
+  stringbuf_init_log (&exp.sb);
+  exp.bytes = 0;
+  exp.err = 0;
+  labels.count = 0;
 
-static int
-send_reply (POUND_HTTP *phttp, char const *content)
-{
   BIO_printf (phttp->cl,
 	      "HTTP/1.%d %d %s\r\n"
 	      "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
-	      "Content-Length: %"PRICLEN"\r\n"
-	      "\r\n"
-	      "%s",
+	      "%s"
+	      "\r\n",
 	      phttp->request.version,
-	      200, "OK", (CONTENT_LENGTH) strlen (content), content);
-  BIO_flush (phttp->cl);
-  return 0;
-}
+	      200, "OK",
+	      exp.chunked ? "Transfer-Encoding: chunked\r\n" : "");
+  phttp->response_code = 200;
+  if (!exp.chunked)
+    phttp->conn_closed = 1;
 
-int
-metrics_response (POUND_HTTP *phttp)
-{
-  struct json_value *obj;
-  EXPOSITION exp;
-  int res;
-
-  if ((obj = pound_serialize ()) == NULL)
-    return -1;
-
-  EXPOSITION_INIT (&exp);
-
-  if ((res = exposition_fill (&exp, obj)) == 0)
+  for (defn = metric_family_defn; defn->family && !exp.err; defn++)
     {
-      struct stringbuf sb;
-      char *content;
+      for (family = defn->family; family->name && !exp.err; family++)
+	{
+	  exp.family = family;
+	  exp.header_done = 0;
+	  defn->foreach (&exp, &labels, family);
+	}
+    }
 
-      stringbuf_init_log (&sb);
-      if ((content = exposition_format (&sb, &exp)) == NULL)
-	res = -1;
-      else
-	res = send_reply (phttp, content);
-      stringbuf_free (&sb);
+  stringbuf_add_string (&exp.sb, "# EOF\n");
+  if (exposition_flush (&exp) == 0 && exp.chunked
+      && BIO_puts (exp.bio, "0\r\n\r\n") <= 0)
+    {
+      logmsg (LOG_NOTICE, "(%"PRItid") error writing metrics: %s",
+	      POUND_TID (), strerror (errno));
+      exp.err = 1;
     }
-  exposition_free (&exp);
-  json_value_free (obj);
-  return res == 0 ? 0 : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  BIO_flush (exp.bio);
+  phttp->res_bytes = exp.bytes;
+  stringbuf_free (&exp.sb);
+
+  return exp.err ? -1 : 0;
 }
@@ -20,6 +20,9 @@
 #include "pound.h"
 #include "json.h"
 #include "extern.h"
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
 
 /* common variables */
 char *user;			/* user to run as */
@@ -213,10 +216,15 @@ static unsigned active_threads; /* Number of threads currently active,
 				   i.e processing requests. */
 
 static unsigned worker_count = 0;
+static unsigned queue_length;   /* Number of requests waiting in the queue. */
+static unsigned session_count;  /* Number of running HTTP/2 session threads. */
 
 unsigned worker_min_count = DEFAULT_WORKER_MIN;
 unsigned worker_max_count = DEFAULT_WORKER_MAX;
 unsigned worker_idle_timeout = DEFAULT_WORKER_IDLE_TIMEOUT;
+unsigned http2_max_sessions = DEFAULT_HTTP2_MAX_SESSIONS;
+
+static unsigned idle_count (void);
 
 struct json_value *
 workers_serialize (void)
@@ -237,6 +245,8 @@ workers_serialize (void)
 	    || json_object_set (obj, "active", json_new_number (active_threads));
 	  pthread_mutex_unlock (&arg_mut);
 	}
+      if (err == 0 && event_thread_count > 0)
+	err = json_object_set (obj, "idle", json_new_number (idle_count ()));
     }
   if (err)
     {
@@ -246,6 +256,19 @@ workers_serialize (void)
   return obj;
 }
 
+/*
+ * Store the current number of worker threads and the number of threads
+ * processing requests in COUNT and ACTIVE.
+ */
+void
+workers_count (unsigned *count, unsigned *active)
+{
+  pthread_mutex_lock (&arg_mut);
+  *count = worker_count;
+  *active = active_threads;
+  pthread_mutex_unlock (&arg_mut);
+}
+
 static void
 worker_start (void)
 {
@@ -257,25 +280,68 @@ worker_start (void)
   worker_count++;
 }
 
+static void
+thr_queue_push (POUND_HTTP *phttp)
+{
+  pthread_mutex_lock (&arg_mut);
+  SLIST_PUSH (&thr_head, phttp, next);
+  queue_length++;
+  /*
+   * Start a new worker unless there are enough idle ones to handle all
+   * queued requests.  Workers that have just been started and haven't
+   * yet dequeued anything count as idle.
+   */
+  if (worker_count < worker_max_count
+      && worker_count < active_threads + queue_length)
+    {
+      worker_start ();
+    }
+  pthread_cond_signal (&arg_cond);
+  pthread_mutex_unlock (&arg_mut);
+}
+
 /*
- * add a request to the queue
+ * Push N requests from the list HEAD to the queue at once.
  */
-int
-pound_http_enqueue (int sock, LISTENER *lstn, struct sockaddr *sa, socklen_t salen)
+static void
+thr_queue_push_list (POUND_HTTP_HEAD *head, unsigned n)
+{
+  unsigned i;
+
+  pthread_mutex_lock (&arg_mut);
+  SLIST_CONCAT (&thr_head, head, next);
+  queue_length += n;
+  /* Make sure there is an idle worker for each queued request. */
+  for (i = 0; i < n; i++)
+    {
+      if (worker_count < worker_max_count
+	  && worker_count < active_threads + queue_length)
+	worker_start ();
+    }
+  if (n > 1)
+    pthread_cond_broadcast (&arg_cond);
+  else
+    pthread_cond_signal (&arg_cond);
+  pthread_mutex_unlock (&arg_mut);
+}
+
+static POUND_HTTP *
+pound_http_alloc (int sock, LISTENER *lstn, struct sockaddr *sa,
+		  socklen_t salen)
 {
   POUND_HTTP *res;
 
   if ((res = calloc (1, sizeof (res[0]))) == NULL)
     {
       lognomem ();
-      return -1;
+      return NULL;
     }
 
   if ((res->from_host.ai_addr = malloc (salen)) == NULL)
     {
       lognomem ();
       free (res);
-      return -1;
+      return NULL;
     }
 
   res->sock = sock;
@@ -291,15 +357,47 @@ pound_http_enqueue (int sock, LISTENER *lstn, struct sockaddr *sa, socklen_t sal
    * Note: submatch_queue_init is not called, because res is already
    * filled with zeros.  Revise this if submatch_queue stuff changes.
    */
+  return res;
+}
 
-  pthread_mutex_lock (&arg_mut);
-  SLIST_PUSH (&thr_head, res, next);
-  if (worker_count < worker_max_count && worker_count == active_threads)
-    {
-      worker_start ();
-    }
-  pthread_cond_signal (&arg_cond);
-  pthread_mutex_unlock (&arg_mut);
+/*
+ * add a request to the queue
+ */
+int
+pound_http_enqueue (int sock, LISTENER *lstn, struct sockaddr *sa, socklen_t salen)
+{
+  POUND_HTTP *res;
+
+  if ((res = pound_http_alloc (sock, lstn, sa, salen)) == NULL)
+    return -1;
+  thr_queue_push (res);
+  return 0;
+}
+
+/*
+ * Add a request for an HTTP/2 stream to the queue.  The stream inherits
+ * the listener and client parameters of the connection PARENT.  SOCK is
+ * the worker end of the socket pair connecting it to the session H2.
+ */
+int
+pound_http_enqueue_stream (POUND_HTTP *parent, int sock,
+			   struct http2_session *h2,
+			   struct tls_info const *tls)
+{
+  POUND_HTTP *res;
+
+  if ((res = pound_http_alloc (sock, parent->lstn, parent->from_host.ai_addr,
+			       parent->from_host.ai_addrlen)) == NULL)
+    return -1;
+  /*
+   * The SSL object is used by the session thread only.  The stream gets
+   * the TLS parameters obtained from it in advance.
+   */
+  res->tls = tls;
+  if ((res->x509 = parent->x509) != NULL)
+    X509_up_ref (res->x509);
+  res->h2 = h2;
+  thr_queue_push (res);
   return 0;
 }
 
@@ -357,6 +455,7 @@ pound_http_dequeue (void)
   /* Dequeue the head element */
   res = SLIST_FIRST (&thr_head);
   SLIST_SHIFT (&thr_head, next);
+  queue_length--;
   if (!SLIST_EMPTY (&thr_head))
     /*
      * If there's still more in the queue, signal other threads, so they
@@ -380,22 +479,26 @@ pound_http_destroy (POUND_HTTP *arg)
   free (arg->from_host.ai_addr);
 
   free (arg->orig_forwarded_header);
+  /* Abandon the cache entry, if the response was not received in full. */
+  if (arg->cache_entry)
+    cache_entry_fill_end (arg->cache_entry, arg->cache_bio, 0);
   http_request_free (&arg->request);
   http_request_free (&arg->response);
+  arena_free (&arg->arena);
 
-  if (arg->ssl != NULL)
+  if (arg->ssl != NULL && arg->h2 == NULL)
     {
       SSL_set_shutdown (arg->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
       BIO_ssl_shutdown (arg->cl);
     }
 
-  backend_unref (arg->backend);
-  if (arg->be != NULL)
+  if (arg->be != NULL && backend_pool_release (arg) != 0)
     {
       BIO_flush (arg->be);
       BIO_reset (arg->be);
       BIO_free_all (arg->be);
     }
+  backend_unref (arg->backend);
 
   if (arg->cl != NULL)
     {
@@ -411,6 +514,8 @@ pound_http_destroy (POUND_HTTP *arg)
 
   submatch_queue_free (&arg->smq);
 
+  if (arg->h2)
+    http2_stream_release (arg->h2);
   free (arg);
 }
 
@@ -420,12 +525,10 @@ pound_http_destroy (POUND_HTTP *arg)
 int
 get_thr_qlen (void)
 {
-  int res = 0;
-  POUND_HTTP *tap;
+  int res;
 
   pthread_mutex_lock (&arg_mut);
-  SLIST_FOREACH (tap, &thr_head, next)
-    res++;
+  res = queue_length;
   pthread_mutex_unlock (&arg_mut);
   return res;
 }
@@ -435,9 +538,86 @@ active_threads_decr (void)
 {
   pthread_mutex_lock (&arg_mut);
   active_threads--;
-  if (active_threads == 0)
+  if (active_threads + session_count == 0)
+    pthread_cond_broadcast (&active_cond);
+  pthread_mutex_unlock (&arg_mut);
+}
+
+#ifdef ENABLE_HTTP2
+static void *
+thr_http2_session (void *arg)
+{
+  POUND_HTTP *phttp = arg;
+
+  arena_set_current (&phttp->arena);
+  http2_serve (phttp);
+  arena_set_current (NULL);
+  pound_http_destroy (phttp);
+
+  pthread_mutex_lock (&arg_mut);
+  session_count--;
+  if (active_threads + session_count == 0)
     pthread_cond_broadcast (&active_cond);
   pthread_mutex_unlock (&arg_mut);
+  return NULL;
+}
+#endif
+
+/*
+ * Serve the HTTP/2 session PHTTP in a thread of its own.  The session
+ * lasts as long as the client connection, and its streams are served by
+ * the workers.  Running it in a worker would make the two compete for
+ * the same pool, up to the point where all workers are busy running
+ * sessions and there are none left to serve their streams.  For the
+ * same reason, the session is refused if the thread can't be created.
+ *
+ * At most http2_max_sessions sessions run simultaneously.  Normally, h2
+ * is not offered to the client when this limit is reached (see
+ * alpn_select in http2.c), so the check below only catches connections
+ * that have been negotiated concurrently.
+ *
+ * Return HTTP_CONN_DETACHED if the thread has been started, and
+ * HTTP_CONN_DONE if the session has been refused.
+ */
+int
+pound_http_session_start (POUND_HTTP *phttp)
+{
+#ifdef ENABLE_HTTP2
+  pthread_t thr;
+  int rc;
+
+  pthread_mutex_lock (&arg_mut);
+  if (session_count >= http2_max_sessions)
+    {
+      pthread_mutex_unlock (&arg_mut);
+      logmsg (LOG_NOTICE, "(%"PRItid") too many HTTP/2 sessions, "
+	      "refusing connection", POUND_TID ());
+      return http2_refuse (phttp);
+    }
+  session_count++;
+  pthread_mutex_unlock (&arg_mut);
+  if ((rc = pthread_create (&thr, &thread_attr_worker, thr_http2_session,
+			    phttp)) == 0)
+    return HTTP_CONN_DETACHED;
+
+  logmsg (LOG_ERR, "can't create HTTP/2 session thread: %s", strerror (rc));
+  pthread_mutex_lock (&arg_mut);
+  session_count--;
+  pthread_cond_broadcast (&active_cond);
+  pthread_mutex_unlock (&arg_mut);
+#endif
+  return http2_refuse (phttp);
+}
+
+int
+pound_http_session_available (void)
+{
+  int rc;
+
+  pthread_mutex_lock (&arg_mut);
+  rc = session_count < http2_max_sessions;
+  pthread_mutex_unlock (&arg_mut);
+  return rc;
 }
 
 void
@@ -446,95 +626,453 @@ active_threads_wait (void)
   struct timespec ts;
 
   pthread_mutex_lock (&arg_mut);
-  if (active_threads > 0)
+  if (active_threads + session_count > 0)
     {
       logmsg (LOG_NOTICE, "waiting for %u active threads to terminate",
-	      active_threads);
+	      active_threads + session_count);
       clock_gettime (CLOCK_REALTIME, &ts);
       ts.tv_sec += grace;
-      while (active_threads > 0 &&
+      while (active_threads + session_count > 0 &&
 	     pthread_cond_timedwait (&active_cond, &arg_mut, &ts) == 0)
 	;
     }
   pthread_mutex_unlock (&arg_mut);
 }
 
+/*
+ * Event loop for idle keep-alive connections.
+ *
+ * Unless event_thread_count is 0, a worker that has finished serving a
+ * request on a keep-alive connection does not block waiting for the next
+ * one.  Instead, it parks the connection in one of the event loops and
+ * returns to the pool.  The event loop thread waits for the connection
+ * to become readable and puts it back to the work queue.  Connections
+ * that remain idle longer than the client timeout of their listener are
+ * closed.
+ */
+unsigned event_thread_count;
+
+#ifdef HAVE_SYS_EPOLL_H
+typedef DLIST_HEAD (,_pound_http) IDLE_HEAD;
+
+struct event_loop
+{
+  int fd;               /* epoll descriptor */
+  pthread_mutex_t mut;  /* Protects the fields below */
+  IDLE_HEAD head;       /* Idle connections, sorted by expiration time */
+  unsigned count;       /* Number of connections in head */
+};
+
+static struct event_loop *event_loops;
+
+/* Max. number of events to handle in one iteration */
+#define EVENT_LOOP_BATCH 64
+
+static unsigned
+idle_count (void)
+{
+  unsigned i, n = 0;
+
+  for (i = 0; i < event_thread_count; i++)
+    {
+      pthread_mutex_lock (&event_loops[i].mut);
+      n += event_loops[i].count;
+      pthread_mutex_unlock (&event_loops[i].mut);
+    }
+  return n;
+}
+
+/*
+ * Insert PHTTP into the idle list of EVL, keeping it sorted by expiration
+ * time.  Since most connections are parked with the same timeout,
+ * the list is scanned from its tail.
+ */
 static void
-listener_cleanup (void *ptr)
+idle_insert_unlocked (struct event_loop *evl, POUND_HTTP *phttp)
 {
-  LISTENER *lstn;
-  SLIST_FOREACH (lstn, &listeners, next)
-    close (lstn->sock);
+  POUND_HTTP *p;
+
+  DLIST_FOREACH_REVERSE (p, &evl->head, idle_link)
+    {
+      if (timespec_cmp (&p->idle_expire, &phttp->idle_expire) <= 0)
+	break;
+    }
+  if (p)
+    DLIST_INSERT_AFTER (&evl->head, p, phttp, idle_link);
+  else
+    DLIST_INSERT_HEAD (&evl->head, phttp, idle_link);
+  evl->count++;
+}
+
+static void
+idle_remove_unlocked (struct event_loop *evl, POUND_HTTP *phttp)
+{
+  DLIST_REMOVE (&evl->head, phttp, idle_link);
+  evl->count--;
+}
+
+/*
+ * Park idle keep-alive connection.  Return 0 on success.  On error,
+ * return -1; the caller is responsible for closing the connection.
+ */
+int
+pound_http_park (POUND_HTTP *phttp)
+{
+  struct event_loop *evl;
+  struct epoll_event ev;
+  int rc = 0;
+
+  if (event_thread_count == 0)
+    return -1;
+
+  evl = &event_loops[phttp->sock % event_thread_count];
+  phttp->keepalive = 1;
+  clock_gettime (CLOCK_REALTIME, &phttp->idle_expire);
+  phttp->idle_expire.tv_sec += phttp->lstn->to;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = phttp;
+
+  /*
+   * Keep the mutex locked until the descriptor is registered, so that
+   * the event loop won't see it before it is inserted to the list.
+   */
+  pthread_mutex_lock (&evl->mut);
+  idle_insert_unlocked (evl, phttp);
+  if (epoll_ctl (evl->fd, EPOLL_CTL_ADD, phttp->sock, &ev))
+    {
+      logmsg (LOG_WARNING, "(%"PRItid") epoll_ctl: %s", POUND_TID (),
+	      strerror (errno));
+      idle_remove_unlocked (evl, phttp);
+      rc = -1;
+    }
+  pthread_mutex_unlock (&evl->mut);
+  return rc;
+}
+
+static void *
+thr_event_loop (void *arg)
+{
+  struct event_loop *evl = arg;
+  struct epoll_event events[EVENT_LOOP_BATCH];
+
+  for (;;)
+    {
+      int i, n;
+      struct timespec now;
+      POUND_HTTP *phttp;
+      IDLE_HEAD expired;
+
+      /*
+       * Connection timeouts have a granularity of one second, so it
+       * suffices to wake up once a second to close expired ones.
+       */
+      n = epoll_wait (evl->fd, events, EVENT_LOOP_BATCH, 1000);
+      if (n < 0)
+	{
+	  if (errno != EINTR)
+	    logmsg (LOG_WARNING, "epoll_wait: %s", strerror (errno));
+	  continue;
+	}
+
+      DLIST_INIT (&expired);
+      clock_gettime (CLOCK_REALTIME, &now);
+
+      pthread_mutex_lock (&evl->mut);
+      for (i = 0; i < n; i++)
+	idle_remove_unlocked (evl, events[i].data.ptr);
+      while ((phttp = DLIST_FIRST (&evl->head)) != NULL
+	     && timespec_cmp (&phttp->idle_expire, &now) <= 0)
+	{
+	  idle_remove_unlocked (evl, phttp);
+	  DLIST_PUSH (&expired, phttp, idle_link);
+	}
+      pthread_mutex_unlock (&evl->mut);
+
+      for (i = 0; i < n; i++)
+	{
+	  phttp = events[i].data.ptr;
+	  epoll_ctl (evl->fd, EPOLL_CTL_DEL, phttp->sock, NULL);
+	  thr_queue_push (phttp);
+	}
+
+      while ((phttp = DLIST_FIRST (&expired)) != NULL)
+	{
+	  DLIST_SHIFT (&expired, idle_link);
+	  epoll_ctl (evl->fd, EPOLL_CTL_DEL, phttp->sock, NULL);
+	  pound_http_destroy (phttp);
+	}
+    }
+  return NULL;
+}
+
+static void
+event_loop_start (void)
+{
+  unsigned i;
+
+  if (event_thread_count == 0)
+    return;
+  event_loops = xcalloc (event_thread_count, sizeof (event_loops[0]));
+  for (i = 0; i < event_thread_count; i++)
+    {
+      pthread_t thr;
+      int rc;
+
+      if ((event_loops[i].fd = epoll_create1 (EPOLL_CLOEXEC)) == -1)
+	abend ("epoll_create1: %s", strerror (errno));
+      pthread_mutex_init (&event_loops[i].mut, NULL);
+      DLIST_INIT (&event_loops[i].head);
+      if ((rc = pthread_create (&thr, &thread_attr_detached, thr_event_loop,
+				&event_loops[i])) != 0)
+	abend ("can't create event loop thread: %s", strerror (rc));
+    }
+}
+#else
+static unsigned
+idle_count (void)
+{
+  return 0;
+}
+
+int
+pound_http_park (POUND_HTTP *phttp)
+{
+  return -1;
+}
+
+static void
+event_loop_start (void)
+{
+}
+#endif
+
+/* Maximum number of connections accepted before passing them to workers. */
+#define ACCEPT_BATCH_MAX 64
+
+static int
+accept_cloexec (int fd, struct sockaddr *sa, socklen_t *salen)
+{
+  int clnt;
+#ifdef HAVE_ACCEPT4
+  clnt = accept4 (fd, sa, salen, SOCK_CLOEXEC);
+#else
+  if ((clnt = accept (fd, sa, salen)) >= 0)
+    {
+      /* Some systems propagate O_NONBLOCK to the accepted socket. */
+      fcntl (clnt, F_SETFL, fcntl (clnt, F_GETFL) & ~O_NONBLOCK);
+      fcntl (clnt, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+  return clnt;
+}
+
+/*
+ * Accept all pending connections on the listening socket FD, which
+ * belongs to the listener LSTN, and pass them to the workers.  The
+ * socket must be in non-blocking mode.
+ */
+static void
+listener_accept (LISTENER *lstn, int fd)
+{
+  POUND_HTTP_HEAD head;
+  POUND_HTTP *phttp;
+  unsigned n = 0;
+
+  SLIST_INIT (&head);
+  for (;;)
+    {
+      struct sockaddr_storage clnt_addr;
+      socklen_t clnt_length;
+      int clnt;
+
+      memset (&clnt_addr, 0, sizeof (clnt_addr));
+      clnt_length = sizeof (clnt_addr);
+      if ((clnt = accept_cloexec (fd, (struct sockaddr *) &clnt_addr,
+				  &clnt_length)) < 0)
+	{
+	  if (errno == EINTR || errno == ECONNABORTED)
+	    continue;
+	  if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    logmsg (LOG_WARNING, "HTTP accept: %s", strerror (errno));
+	  break;
+	}
+
+      if (lstn->disabled)
+	{
+	  close (clnt);
+	  continue;
+	}
+
+      if ((phttp = pound_http_alloc (clnt, lstn,
+				     (struct sockaddr *) &clnt_addr,
+				     clnt_length)) == NULL)
+	{
+	  close (clnt);
+	  continue;
+	}
+
+      SLIST_PUSH (&head, phttp, next);
+      if (++n == ACCEPT_BATCH_MAX)
+	{
+	  thr_queue_push_list (&head, n);
+	  SLIST_INIT (&head);
+	  n = 0;
+	}
+    }
+
+  if (n > 0)
+    thr_queue_push_list (&head, n);
 }
 
+/*
+ * Dispatcher thread: accepts connections on all listeners that don't
+ * have dedicated acceptors.
+ */
 void *
 thr_dispatch (void *unused)
 {
-  int i;
+  int i, n;
   LISTENER *lstn;
   struct pollfd *polls;
+  LISTENER **lstv;
 
   /* alloc the poll structures */
   polls = xcalloc (n_listeners, sizeof (struct pollfd));
+  lstv = xcalloc (n_listeners, sizeof (lstv[0]));
 
-  i = 0;
+  n = 0;
   SLIST_FOREACH (lstn, &listeners, next)
-    polls[i++].fd = lstn->sock;
+    {
+      if (lstn->acceptors == 0)
+	{
+	  lstv[n] = lstn;
+	  polls[n++].fd = lstn->sock;
+	}
+    }
 
-  pthread_cleanup_push (listener_cleanup, NULL);
   for (;;)
     {
-      i = 0;
-      SLIST_FOREACH (lstn, &listeners, next)
+      for (i = 0; i < n; i++)
 	{
 	  polls[i].events = POLLIN | POLLPRI;
 	  polls[i].revents = 0;
-	  i++;
 	}
 
-      if (poll (polls, n_listeners, -1) < 0)
+      if (poll (polls, n, -1) < 0)
 	{
 	  logmsg (LOG_WARNING, "poll: %s", strerror (errno));
 	}
       else
 	{
-	  i = 0;
-	  SLIST_FOREACH (lstn, &listeners, next)
+	  for (i = 0; i < n; i++)
 	    {
 	      if (polls[i].revents & (POLLIN | POLLPRI))
-		{
-		  struct sockaddr_storage clnt_addr;
-		  socklen_t clnt_length;
-		  int clnt;
-
-		  memset (&clnt_addr, 0, sizeof (clnt_addr));
-		  clnt_length = sizeof (clnt_addr);
-		  if ((clnt = accept (lstn->sock,
-				      (struct sockaddr *) &clnt_addr,
-				      &clnt_length)) < 0)
-		    {
-		      logmsg (LOG_WARNING, "HTTP accept: %s",
-			      strerror (errno));
-		    }
-		  else
-		    {
-		      if (lstn->disabled)
-			{
-			  close (clnt);
-			  continue;
-			}
-
-		      if (pound_http_enqueue (clnt, lstn,
-					   (struct sockaddr *) &clnt_addr,
-					   clnt_length))
-			close (clnt);
-		    }
-		}
-	      i++;
+		listener_accept (lstv[i], polls[i].fd);
 	    }
 	}
     }
-  pthread_cleanup_pop (1);
+}
+
+struct acceptor
+{
+  LISTENER *lstn;
+  int fd;
+};
+
+/*
+ * Acceptor thread: accepts connections on a single listening socket.
+ */
+static void *
+thr_acceptor (void *arg)
+{
+  struct acceptor *acc = arg;
+  struct pollfd pfd;
+
+  pfd.fd = acc->fd;
+  for (;;)
+    {
+      pfd.events = POLLIN | POLLPRI;
+      pfd.revents = 0;
+      if (poll (&pfd, 1, -1) < 0)
+	logmsg (LOG_WARNING, "poll: %s", strerror (errno));
+      else if (pfd.revents & (POLLIN | POLLPRI))
+	listener_accept (acc->lstn, acc->fd);
+    }
+  return NULL;
+}
+
+/* Acceptor threads, including the dispatcher. */
+static pthread_t *acceptor_tid;
+static size_t acceptor_count;
+
+static void
+acceptor_thread_start (void *(*fn) (void *), void *arg)
+{
+  int rc;
+
+  acceptor_tid = xrealloc (acceptor_tid,
+			   (acceptor_count + 1) * sizeof (acceptor_tid[0]));
+  if ((rc = pthread_create (&acceptor_tid[acceptor_count], NULL, fn, arg)) != 0)
+    abend ("can't create acceptor thread: %s", strerror (rc));
+  acceptor_count++;
+}
+
+static void
+acceptors_start (void)
+{
+  LISTENER *lstn;
+  int dispatch = 0;
+
+  SLIST_FOREACH (lstn, &listeners, next)
+    {
+      unsigned i;
+
+      if (lstn->acceptors == 0)
+	{
+	  dispatch = 1;
+	  continue;
+	}
+      for (i = 0; i < lstn->acceptors; i++)
+	{
+	  struct acceptor *acc;
+
+	  XZALLOC (acc);
+	  acc->lstn = lstn;
+	  /*
+	   * If there's no separate socket for this acceptor, share the
+	   * main one.
+	   */
+	  acc->fd = (i > 0 && lstn->acceptor_sock) ? lstn->acceptor_sock[i-1]
+						    : lstn->sock;
+	  acceptor_thread_start (thr_acceptor, acc);
+	}
+    }
+  if (dispatch)
+    acceptor_thread_start (thr_dispatch, NULL);
+}
+
+static void
+acceptors_stop (void)
+{
+  size_t i;
+  LISTENER *lstn;
+
+  for (i = 0; i < acceptor_count; i++)
+    pthread_cancel (acceptor_tid[i]);
+  for (i = 0; i < acceptor_count; i++)
+    pthread_join (acceptor_tid[i], NULL);
+
+  SLIST_FOREACH (lstn, &listeners, next)
+    {
+      close (lstn->sock);
+      if (lstn->acceptor_sock)
+	{
+	  for (i = 1; i < lstn->acceptors; i++)
+	    close (lstn->acceptor_sock[i-1]);
+	}
+    }
 }
 
 struct file_location
@@ -696,7 +1234,6 @@ server (void)
   pthread_t thr;
   struct sigaction act;
   sigset_t sigs;
-  void *res;
 
   sigemptyset (&sigs);
 
@@ -717,6 +1254,9 @@ server (void)
   if (pthread_create (&thr, &thread_attr_detached, thr_timer, NULL))
     abend ("can't create timer thread: %s", strerror (errno));
 
+  if (access_log_config.target)
+    access_log_start ();
+
   /*
    * Create the worker threads
    */
@@ -733,16 +1273,17 @@ server (void)
       worker_count--;
     }
 
-  pthread_create (&thr, NULL, thr_dispatch, NULL);
+  event_loop_start ();
+
+  acceptors_start ();
 
   /* Wait for a signal to arrive */
   sigwait (&sigs, &i);
 
   logmsg (LOG_NOTICE, "shutting down...");
 
-  /* Stop main dispatcher thread */
-  pthread_cancel (thr);
-  pthread_join (thr, &res);
+  /* Stop acceptor threads */
+  acceptors_stop ();
 
   switch (i)
     {
@@ -757,6 +1298,7 @@ server (void)
     }
 
   cleanup ();
+  access_log_stop ();
 
   exit (0);
 }
@@ -1041,12 +1583,72 @@ listener_socket_from (LISTENER *lst)
   stringbuf_free (&sb);
 }
 
+/*
+ * Create a socket for the listener LST and bind it to the listener
+ * address.
+ */
+static int
+listener_socket (LISTENER *lst, int domain)
+{
+  int fd, opt;
+  char abuf[MAX_ADDR_BUFSIZE];
+
+  if ((fd = socket (domain, SOCK_STREAM, 0)) < 0)
+    abend ("%s: can't create HTTP socket %s: %s",
+	   lst->locus_str,
+	   addr2str (abuf, sizeof (abuf), &lst->addr, 0),
+	   strerror (errno));
+
+  opt = 1;
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof (opt));
+#ifdef SO_REUSEPORT
+  if (lst->acceptors > 1 && domain != PF_UNIX
+      && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof (opt)))
+    abend ("%s: can't set SO_REUSEPORT: %s",
+	   lst->locus_str, strerror (errno));
+#endif
+  if (bind (fd, lst->addr.ai_addr, lst->addr.ai_addrlen) < 0)
+    abend ("%s: can't bind HTTP socket to %s: %s",
+	   lst->locus_str,
+	   addr2str (abuf, sizeof (abuf), &lst->addr, 0),
+	   strerror (errno));
+  return fd;
+}
+
+static void
+listener_listen (LISTENER *lst, int fd)
+{
+  char abuf[MAX_ADDR_BUFSIZE];
+
+  if (listen (fd, 512))
+    abend ("%s: can't listen on %s: %s",
+	   lst->locus_str,
+	   addr2str (abuf, sizeof (abuf), &lst->addr, 0),
+	   strerror (errno));
+}
+
+/*
+ * Switch all sockets of the listener LST to non-blocking mode, so that
+ * pending connections can be accepted until the queue is drained.
+ */
+static void
+listener_set_nonblock (LISTENER *lst)
+{
+  unsigned i;
+
+  if (fcntl (lst->sock, F_SETFL, fcntl (lst->sock, F_GETFL) | O_NONBLOCK))
+    abend ("%s: can't set non-blocking mode: %s",
+	   lst->locus_str, strerror (errno));
+  if (lst->acceptor_sock)
+    for (i = 1; i < lst->acceptors; i++)
+      fcntl (lst->acceptor_sock[i-1], F_SETFL,
+	     fcntl (lst->acceptor_sock[i-1], F_GETFL) | O_NONBLOCK);
+}
+
 static void
 listener_init (LISTENER *lst, uid_t user_id, gid_t group_id)
 {
-  int opt;
   int domain;
-  char abuf[MAX_ADDR_BUFSIZE];
   mode_t oldmask;
 
   switch (lst->addr.ai_family)
@@ -1069,20 +1671,8 @@ listener_init (LISTENER *lst, uid_t user_id, gid_t group_id)
       abort ();
     }
 
-  if ((lst->sock = socket (domain, SOCK_STREAM, 0)) < 0)
-    abend ("%s: can't create HTTP socket %s: %s",
-	   lst->locus_str,
-	   addr2str (abuf, sizeof (abuf), &lst->addr, 0),
-	   strerror (errno));
+  lst->sock = listener_socket (lst, domain);
 
-  opt = 1;
-  setsockopt (lst->sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof (opt));
-  if (bind (lst->sock, lst->addr.ai_addr, lst->addr.ai_addrlen) < 0)
-    abend ("%s: can't bind HTTP socket to %s: %s",
-	   lst->locus_str,
-	   addr2str (abuf, sizeof (abuf), &lst->addr, 0),
-	   strerror (errno));
-  
   if (domain == PF_UNIX)
     {
       umask (oldmask);
@@ -1096,26 +1686,37 @@ listener_init (LISTENER *lst, uid_t user_id, gid_t group_id)
 	}
     }
 
-  if (listen (lst->sock, 512))
-    abend ("%s: can't listen on %s: %s",
-	   lst->locus_str,
-	   addr2str (abuf, sizeof (abuf), &lst->addr, 0),
-	   strerror (errno));
+  listener_listen (lst, lst->sock);
+
+#ifdef SO_REUSEPORT
+  if (lst->acceptors > 1 && domain != PF_UNIX)
+    {
+      unsigned i;
+
+      /* Open a separate socket for each additional acceptor. */
+      lst->acceptor_sock = xcalloc (lst->acceptors - 1,
+				    sizeof (lst->acceptor_sock[0]));
+      for (i = 1; i < lst->acceptors; i++)
+	{
+	  int fd = listener_socket (lst, domain);
+	  listener_listen (lst, fd);
+	  lst->acceptor_sock[i-1] = fd;
+	}
+    }
+#endif
 }
 
-int
-main (const int argc, char **argv)
+/*
+ * Initialize the libraries and global data used by pound.  This must
+ * be called before parsing the configuration.
+ */
+void
+pound_init (void)
 {
-  LISTENER *lstn;
-  uid_t user_id = -1;
-  gid_t group_id = -1;
 #ifndef SOL_TCP
   struct protoent *pe;
 #endif
 
-  umask (077);
-  srandom (getpid ());
-
   /* SSL stuff */
   SSL_load_error_strings ();
   SSL_library_init ();
@@ -1160,6 +1761,24 @@ main (const int argc, char **argv)
 
   
   json_memabrt = lognomem;
+}
+
+#ifdef POUND_BENCH
+/* The benchmark suite has its own main function. */
+# define main pound_main
+#endif
+
+int
+main (const int argc, char **argv)
+{
+  LISTENER *lstn;
+  uid_t user_id = -1;
+  gid_t group_id = -1;
+
+  umask (077);
+  srandom (getpid ());
+
+  pound_init ();
 
   /* read config */
   config_parse (argc, argv);
@@ -1198,9 +1817,13 @@ main (const int argc, char **argv)
 	listener_socket_from (lstn);
       else
 	listener_init (lstn, user_id, group_id);
+      listener_set_nonblock (lstn);
       n_listeners++;
     }
 
+  if (access_log_config.target)
+    access_log_open ();
+
   print_log = 0;
   if (daemonize)
     detach ();
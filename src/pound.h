@@ -121,6 +121,14 @@ int genpat_match (GENPAT, const char *, size_t, POUND_REGMATCH *);
 void genpat_free (GENPAT);
 char const *genpat_error (GENPAT, size_t *);
 size_t genpat_nsub (GENPAT);
+int genpat_set_compile (GENPAT *, size_t, int const *, char const *const *,
+			size_t const *, int);
+int genpat_set_scan (GENPAT, char const *, int (*) (size_t, void *), void *);
+int genpat_set_match_group (GENPAT, char const *, size_t *);
+size_t genpat_set_groups (GENPAT);
+size_t genpat_set_member_group (GENPAT, size_t);
+size_t genpat_literal_count (GENPAT);
+int genpat_literal (GENPAT, size_t, int *, char const **, int *);
 
 enum
   {
@@ -191,6 +199,59 @@ unsigned long strhash_ci (const char *c, size_t len);
 # define DEFAULT_ALIVE_TO 30
 #endif
 
+#ifndef DEFAULT_CONN_POOL_TO
+# define DEFAULT_CONN_POOL_TO 4
+#endif
+
+/* Health check defaults: interval and timeout in seconds, number of
+   consecutive successes and failures needed to change backend state. */
+#ifndef DEFAULT_HEALTH_CHECK_INTERVAL
+# define DEFAULT_HEALTH_CHECK_INTERVAL 5
+#endif
+#ifndef DEFAULT_HEALTH_CHECK_TIMEOUT
+# define DEFAULT_HEALTH_CHECK_TIMEOUT 2
+#endif
+#ifndef DEFAULT_HEALTH_CHECK_RISE
+# define DEFAULT_HEALTH_CHECK_RISE 2
+#endif
+#ifndef DEFAULT_HEALTH_CHECK_FALL
+# define DEFAULT_HEALTH_CHECK_FALL 3
+#endif
+
+/* Default size of per-thread access log buffer, in bytes. */
+#ifndef DEFAULT_ACCESS_LOG_BUFSIZE
+# define DEFAULT_ACCESS_LOG_BUFSIZE 65536
+#endif
+
+/* Default access log flush interval, in milliseconds. */
+#ifndef DEFAULT_ACCESS_LOG_FLUSH_INTERVAL
+# define DEFAULT_ACCESS_LOG_FLUSH_INTERVAL 100
+#endif
+
+/* Number of independently locked shards in a session table. */
+#ifndef SESSION_SHARDS
+# define SESSION_SHARDS 16
+#endif
+
+/* Default max. number of concurrent streams in an HTTP/2 connection. */
+#ifndef DEFAULT_HTTP2_MAX_STREAMS
+# define DEFAULT_HTTP2_MAX_STREAMS 100
+#endif
+
+#ifndef DEFAULT_HTTP2_MAX_SESSIONS
+# define DEFAULT_HTTP2_MAX_SESSIONS 128
+#endif
+
+/* Number of independently locked shards in a response cache. */
+#ifndef CACHE_SHARDS
+# define CACHE_SHARDS 16
+#endif
+
+/* Number of independently locked shards in a rate limiter. */
+#ifndef RATELIMIT_SHARDS
+# define RATELIMIT_SHARDS 16
+#endif
+
 #ifndef MAXBUF
 # define MAXBUF      4096
 #endif
@@ -267,6 +328,7 @@ enum
     HTTP_STATUS_METHOD_NOT_ALLOWED,// 405
     HTTP_STATUS_PAYLOAD_TOO_LARGE, // 413
     HTTP_STATUS_URI_TOO_LONG,      // 414
+    HTTP_STATUS_TOO_MANY_REQUESTS, // 429
     HTTP_STATUS_INTERNAL_SERVER_ERROR,          // 500
     HTTP_STATUS_NOT_IMPLEMENTED,   // 501
     HTTP_STATUS_SERVICE_UNAVAILABLE, // 503
@@ -335,10 +397,50 @@ enum
     HEADER_EXPECT,
     HEADER_UPGRADE,
     HEADER_AUTHORIZATION,
+
+    HEADER_CODES       /* Number of header codes.  Must be last. */
   };
 
+/* Per-request memory arena (see arena.c). */
+struct arena_chunk;
+
+struct arena
+{
+  struct arena_chunk *chunks;   /* Chunks, most recent first. */
+  struct arena_chunk *base;     /* Base chunk, retained across resets. */
+  size_t used;                  /* Bytes allocated since the last reset. */
+};
+
+void *arena_alloc (struct arena *a, size_t n);
+char *arena_strndup (struct arena *a, char const *s, size_t n);
+char *arena_strdup (struct arena *a, char const *s);
+void arena_reset (struct arena *a);
+void arena_free (struct arena *a);
+size_t arena_size (struct arena const *a);
+size_t arena_high_water (void);
+unsigned long arena_extra_chunks (void);
+void arena_set_current (struct arena *a);
+struct arena *arena_current (void);
+
+/* Read-copy-update (see rcu.c). */
+struct rcu_head
+{
+  SLIST_ENTRY (rcu_head) next;
+  void (*func) (void *);
+  void *data;
+  unsigned long epoch;
+};
+
+void rcu_read_lock (void);
+void rcu_read_unlock (void);
+void rcu_call (struct rcu_head *head, void (*func) (void *), void *data);
+
+#define rcu_dereference(p) __atomic_load_n (&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n (&(p), (v), __ATOMIC_RELEASE)
+
 struct http_header
 {
+  struct arena *arena;       /* Arena this header is allocated from, or NULL */
   char *header;
   int code;
   size_t name_start;
@@ -346,6 +448,8 @@ struct http_header
   size_t val_start;
   size_t val_end;
   char *value;
+  unsigned long hash;        /* Hash of the header name (see strhash_ci). */
+  struct http_header *index_next; /* Next header in the same index bucket. */
   DLIST_ENTRY (http_header) link;
 };
 
@@ -361,7 +465,22 @@ http_header_name_len (struct http_header *hdr)
   return hdr->name_end - hdr->name_start;
 }
 
-typedef DLIST_HEAD(,http_header) HTTP_HEADER_LIST;
+/* Number of buckets in the header name index.  Must be a power of 2. */
+#define HEADER_INDEX_SIZE 32
+
+/*
+ * List of headers.  Headers are kept in order of their appearance and
+ * indexed for fast lookups.  The name index chains headers with the
+ * same name hash via index_next, preserving their order.
+ */
+typedef struct http_header_list
+{
+  DLIST_HEAD (,http_header) list;   /* Headers in order of appearance. */
+  struct http_header *code_index[HEADER_CODES];
+				    /* First header of each known type. */
+  struct http_header *name_index[HEADER_INDEX_SIZE];
+				    /* Name index. */
+} HTTP_HEADER_LIST;
 
 /* Append modes: what to do if the header with that name already exist. */
 enum
@@ -395,12 +514,14 @@ struct http_request
   QUERY_HEAD query_head;
   char *orig_request_line;   /* Original request line (for logging purposes) */
   int split;
+  struct arena *arena;       /* If not NULL, all strings above (and query
+				parameters) are allocated from this arena */
 };
 
 static inline void http_request_init (struct http_request *http)
 {
   memset (http, 0, sizeof (*http));
-  DLIST_INIT (&http->headers);
+  DLIST_INIT (&http->headers.list);
   DLIST_INIT (&http->query_head);
 }
 
@@ -409,17 +530,32 @@ void http_request_free (struct http_request *);
 #define POUND_TID() ((unsigned long)pthread_self ())
 #define PRItid "lx"
 
-struct cidr;
+struct acl_node;
+struct acl_file;
 
 typedef struct acl
 {
   char *name;                 /* ACL name (optional) */
-  SLIST_HEAD (,cidr) head;    /* List of CIDRs */
+  struct acl_node *tree[2];   /* Radix trees of IPv4 and IPv6 CIDRs */
+  struct acl_file *file;      /* Source file, if read from file */
   SLIST_ENTRY (acl) next;
 } ACL;
 
 typedef SLIST_HEAD (,acl) ACL_HEAD;
 
+/* Error codes returned by acl_add. */
+enum
+  {
+    ACL_OK,
+    ACL_BAD_ADDR,
+    ACL_BAD_FAMILY,
+    ACL_BAD_MASK
+  };
+
+ACL *acl_new (char const *name);
+int acl_add (ACL *acl, char const *str);
+int acl_load_file (ACL *acl, WORKDIR *wd, char const *filename);
+char const *acl_strerror (int ec);
 int acl_match (ACL *acl, struct sockaddr *sa);
 
 enum job_ctl
@@ -465,6 +601,7 @@ typedef enum
     BE_CONTROL,
     BE_ERROR,
     BE_METRICS,
+    BE_CACHE,           /* Response from the service cache. */
     BE_BACKEND_REF,     /* See be_name in BACKEND */
   }
   BACKEND_TYPE;
@@ -481,6 +618,34 @@ char const *resolve_mode_str (int mode);
 
 typedef struct backend_table *BACKEND_TABLE;
 
+/* Active health check configuration. */
+struct health_check
+{
+  char *url;            /* URL to request. */
+  char *host;           /* Value of the Host header or NULL. */
+  unsigned interval;    /* Interval between probes, in seconds. */
+  unsigned timeout;     /* Probe timeout, in seconds. */
+  unsigned rise;        /* Successes needed to mark a dead backend alive. */
+  unsigned fall;        /* Failures needed to mark a live backend dead. */
+  int status_min;       /* Range of HTTP status codes indicating success. */
+  int status_max;
+};
+
+/* Health check state of a regular backend. */
+struct be_health
+{
+  struct health_check *conf; /* Configuration; NULL if not checked. */
+  unsigned rise_count;  /* Consecutive successes while dead. */
+  unsigned fall_count;  /* Consecutive failures while alive. */
+  int last_ok;          /* Result of the last probe; -1 if none yet. */
+  int last_status;      /* HTTP status from the last probe, 0 if none. */
+  char last_error[128]; /* Reason of the last failure or empty string. */
+  uint64_t last_latency; /* Duration of the last probe, ns. */
+  struct timespec last_time; /* When was the last probe finished. */
+  unsigned long checks; /* Total number of probes. */
+  unsigned long failures; /* Number of failed probes. */
+};
+
 struct be_matrix
 {
   char *hostname;       /* Hostname or IP address. */
@@ -496,6 +661,9 @@ struct be_matrix
   unsigned ws_to;	/* websocket time-out */
   SSL_CTX *ctx;		/* CTX for SSL connections */
   char *servername;     /* SNI */
+  unsigned pool_size;   /* Max. number of idle connections to keep. */
+  unsigned pool_to;     /* Idle connection time-out. */
+  struct health_check *health_check; /* Active health check or NULL. */
 
   BACKEND_TABLE betab;  /* Table of regular backends generated from this
 			   matrix. */
@@ -507,6 +675,54 @@ struct be_matrix
 			       dynamically generated. */
 };
 
+/* Idle backend connection. */
+struct be_conn
+{
+  BIO *bio;                      /* Connection BIO chain. */
+  struct timespec expire;        /* Time when it expires. */
+  DLIST_ENTRY (be_conn) link;
+};
+
+typedef DLIST_HEAD (,be_conn) BE_CONN_HEAD;
+
+/* Pool of idle connections to a regular backend. */
+struct be_pool
+{
+  unsigned max_idle;             /* Max. number of idle connections. */
+  unsigned idle_to;              /* Idle time-out. */
+  pthread_mutex_t mut;           /* Mutex protecting the fields below. */
+  BE_CONN_HEAD head;             /* Idle connections, most recent first. */
+  unsigned count;                /* Number of connections in head. */
+  int armed;                     /* True if the expiration job is armed. */
+  unsigned long hits;            /* Number of connections reused. */
+  unsigned long misses;          /* Number of connections opened anew. */
+};
+
+/* Number of independently updated slots in backend request statistics. */
+#ifndef BE_STATS_SLOTS
+# define BE_STATS_SLOTS 16
+#endif
+
+/* Number of finite buckets in the request time histogram. */
+#define BE_STATS_BUCKETS 18
+
+/* Upper bounds of the histogram buckets, in nanoseconds. */
+extern uint64_t const be_stats_bucket_bound[BE_STATS_BUCKETS];
+
+/*
+ * Request statistics of a backend.  Each worker thread updates one of
+ * BE_STATS_SLOTS such structures in its backend, using atomic operations.
+ * Readers merge the slots.
+ */
+struct be_stats
+{
+  uint64_t count;                      /* Number of requests. */
+  uint64_t sum;                        /* Total request time, ns. */
+  double sumsq;                        /* Sum of squared request times. */
+  uint64_t hist[BE_STATS_BUCKETS + 1]; /* Request time histogram.  The
+					  last bucket is +Inf. */
+};
+
 struct be_regular
 {
   struct addrinfo addr;	/* IPv4/6 address */
@@ -516,14 +732,30 @@ struct be_regular
   unsigned ws_to;	/* websocket time-out */
   SSL_CTX *ctx;		/* CTX for SSL connections */
   char *servername;     /* SNI */
+  struct be_pool pool;  /* Idle connection pool. */
+  struct be_health health; /* Active health check state.  Protected by
+			      the backend mutex. */
+  SSL_SESSION *tls_session; /* Last TLS session, for resumption.
+			       Protected by the backend mutex. */
+  unsigned long active;  /* Number of requests in flight. */
+  uint64_t ewma;         /* Moving average of request time, ns (0 if
+			    unknown). */
+  uint64_t ewma_time;    /* Time of the last update of ewma, ns.  These
+			    three are updated atomically. */
 
   struct _backend *parent; /* Points to matrix backend, if this backend was
 			      dynamically generated. */
 };
 
+/* Compiled string expansion program (see expand_compile in http.c). */
+typedef struct expand_prog EXPAND_PROG;
+
+EXPAND_PROG *expand_compile (char const *str);
+
 struct be_redirect
 {
   char *url;		 /* for redirectors */
+  EXPAND_PROG *prog;     /* Compiled url. */
   int status;            /* Redirection status (301, 302, 303, 307, or 308 ) */
   int has_uri;		 /* URL has path and/or query part. */
 };
@@ -533,10 +765,23 @@ struct be_acme
   int wd;                /* Working directory descriptor. */
 };
 
+/*
+ * Pre-rendered HTTP response: status line, headers and content.  Since
+ * the response depends on the HTTP minor version of the request, two
+ * variants are kept, indexed by the version number.
+ */
+struct static_response
+{
+  char *text[2];
+  size_t len[2];
+};
+
 struct be_error
 {
   int status;            /* Pound HTTP status index */
   char *text;            /* Error content page */
+  struct static_response *reply; /* Pre-rendered response, if text
+				    is given */
 };
 
 /* back-end definition */
@@ -554,14 +799,17 @@ typedef struct _backend
   /* Auxiliary fields. */
   int mark;                     /* If set, this backend is a candidate for
 				   deletion. */
+  struct rcu_head rcu;          /* For deferred removal. */
 
 
   /* Statistics */
   pthread_mutex_t mut;		/* mutex for this back-end */
   unsigned long refcount;       /* reference counter */
-  double numreq;		/* number of requests seen */
-  double avgtime;		/* Avg. time per request */
-  double avgsqtime;             /* Avg. squared time per request */
+  struct be_stats stats[BE_STATS_SLOTS]; /* Request statistics. */
+
+  /* Sessions bound to this backend, one list per session table shard.
+     Each list is protected by the mutex of the corresponding shard. */
+  DLIST_HEAD (,session) sessions[SESSION_SHARDS];
 
   /* Data specific for each backend type. */
   union
@@ -604,7 +852,8 @@ typedef struct session
   char *key;
   BACKEND *backend;
   struct timespec expire;
-  DLIST_ENTRY (session) link;
+  DLIST_ENTRY (session) link;     /* Link in the shard expiration list. */
+  DLIST_ENTRY (session) be_link;  /* Link in the backend session list. */
 } SESSION;
 
 #define KEY_SIZE    127
@@ -615,10 +864,21 @@ typedef struct session
 #define HT_NO_HASH_FREE
 #include "ht.h"
 
+typedef struct session_shard
+{
+  pthread_mutex_t mut;          /* Mutex for this shard. */
+  unsigned index;               /* Index of this shard in the table. */
+  SESSION_HASH *hash;           /* Sessions indexed by key. */
+  DLIST_HEAD (,session) head;   /* Sessions ordered by expiration time. */
+} SESSION_SHARD;
+
+/*
+ * Session table.  Sessions are distributed among shards by a hash of
+ * their key.  Each shard is locked independently.
+ */
 typedef struct
 {
-  SESSION_HASH *hash;
-  DLIST_HEAD (,session) head;
+  SESSION_SHARD shard[SESSION_SHARDS];
 } SESSION_TABLE;
 
 SESSION_TABLE *session_table_new (void);
@@ -649,7 +909,8 @@ enum service_cond_type
 		   Host: header */
     COND_BASIC_AUTH,  /* Check if request passes basic auth. */
     COND_STRING_MATCH,/* String match. */
-    COND_CLIENT_CERT
+    COND_CLIENT_CERT,
+    COND_RATE_LIMIT   /* Request rate exceeds the limit. */
   };
 
 typedef struct string_ref
@@ -661,9 +922,22 @@ typedef struct string_ref
 struct string_match
 {
   STRING_REF *string;
+  EXPAND_PROG *prog;     /* Compiled string (COND_STRING_MATCH only). */
   GENPAT re;
 };
 
+struct rate_limit_cond
+{
+  struct rate_limit *limit; /* Rate limiter. */
+  EXPAND_PROG *key;         /* Key expression, or NULL for client address. */
+};
+
+struct host_match
+{
+  GENPAT re;       /* Compiled header regex; overlays the "re" member. */
+  char *prefix;    /* Literal host name prefix, if the pattern is one. */
+};
+
 struct user_pass
 {
   SLIST_ENTRY (user_pass) link;
@@ -689,11 +963,13 @@ typedef struct _service_cond
   {
     ACL *acl;
     GENPAT re;
+    struct host_match host;  /* COND_HOST */
     struct bool_service_cond bool;
     struct _service_cond *cond;
     struct string_match sm;  /* COND_QUERY_PARAM and COND_STRING_MATCH */
     struct pass_file pwfile; /* COND_BASIC_AUTH */
     X509 *x509;              /* COND_CLIENT_CERT */
+    struct rate_limit_cond rl; /* COND_RATE_LIMIT */
   };
   SLIST_ENTRY (_service_cond) next;
 } SERVICE_COND;
@@ -745,6 +1021,8 @@ typedef struct rewrite_op
     } qp;                        /* type == REWRITE_QUERY_PARAM_SET */
     char *str;                   /* type == REWRITE_*_SET */
   } v;
+  EXPAND_PROG *prog;             /* Compiled value, for REWRITE_*_SET
+				    and REWRITE_QUERY_PARAM_SET. */
 } REWRITE_OP;
 
 typedef struct rewrite_rule
@@ -759,6 +1037,8 @@ typedef enum
   {
     BALANCER_ALGO_RANDOM,
     BALANCER_ALGO_IWRR,
+    BALANCER_ALGO_LEASTCONN,
+    BALANCER_ALGO_EWMA,
   } BALANCER_ALGO;
 
 #define PRI_MAX   65535
@@ -769,18 +1049,6 @@ enum
     REWRITE_RESPONSE
   };
 
-struct iwrr_balancer
-{
-  int round;
-  int max_pri;                  /* maximum priority */
-  BACKEND *cur;
-};
-
-struct rand_balancer
-{
-  unsigned long sum_pri;	/* sum of priorities of active backends */
-};
-
 typedef struct balancer
 {
   BALANCER_ALGO algo;
@@ -788,11 +1056,6 @@ typedef struct balancer
   unsigned act_num;             /* number of active backends */
   BACKEND_HEAD backends;
   DLIST_ENTRY (balancer) link;
-  union
-  {
-    struct iwrr_balancer iwrr;
-    struct rand_balancer rand;
-  };
 } BALANCER;
 
 typedef DLIST_HEAD (,balancer) BALANCER_LIST;
@@ -806,6 +1069,7 @@ typedef struct _service
   REWRITE_RULE_HEAD rewrite[2];
   BALANCER_LIST balancers;
   BALANCER_ALGO balancer_algo;
+  struct lb_snapshot *lb;       /* Backend selection snapshot (RCU). */
   pthread_mutex_t mut;		/* mutex for this service */
   SESS_TYPE sess_type;
   unsigned sess_ttl;		/* session time-to-live */
@@ -813,6 +1077,13 @@ typedef struct _service
   SESSION_TABLE *sessions;	/* currently active sessions */
   int disabled;			/* true if the service is disabled */
 
+  /* Response cache */
+  struct http_cache *cache;     /* Cache, or NULL if not configured. */
+  BACKEND *cache_be;            /* Pseudo-backend serving cached responses. */
+
+  /* Response compression */
+  struct http_compress *compress; /* Compression settings, or NULL. */
+
   /* Logging */
   char *forwarded_header;       /* "forwarded" header name */
   ACL *trusted_ips;             /* Trusted IP addresses */
@@ -820,11 +1091,9 @@ typedef struct _service
 				   codes.  A bitmask. */
 
   /* Backend removal */
-  BACKEND_HEAD be_rem_head;     /* List of backends scheduled for removal. */
-  pthread_cond_t be_rem_cond;   /* Condition through which the removal thread
-				   is notified that a backend from the list is
-				   ready for removal.
-				 */
+  BACKEND_HEAD be_rem_head;     /* Backends removed from the service since
+				   the last update of the selection
+				   snapshot. */
 
   SLIST_ENTRY (_service) next;
 } SERVICE;
@@ -867,7 +1136,11 @@ typedef struct _listener
   int mode;                     /* File mode for AF_UNIX */
   int chowner;                  /* Change to effective owner, for AF_UNIX */
   int sock;			/* listening socket */
+  unsigned acceptors;           /* number of acceptor threads (0 - use the
+				   common dispatcher thread) */
+  int *acceptor_sock;           /* sockets of acceptors 1..acceptors-1 */
   POUND_CTX_HEAD ctx_head;	/* CTX for SSL connections */
+  struct sni_index *sni_index;  /* SNI lookup index */
   int clnt_check;		/* client verification mode */
   int noHTTPS11;		/* HTTP 1.1 mode for SSL */
   int header_options;           /* additional header options */
@@ -876,6 +1149,9 @@ typedef struct _listener
   unsigned to;			/* client time-out */
   GENPAT url_pat;	/* pattern to match the request URL against */
   char *http_err[HTTP_STATUS_MAX];	/* error messages */
+  /* Pre-rendered error replies (see listener_static_responses_init) */
+  struct static_response *err_reply[HTTP_STATUS_MAX];
+  struct static_response *err_page[HTTP_STATUS_MAX];
   CONTENT_LENGTH max_req_size;	/* max. request size */
   unsigned max_uri_length;      /* max. URI length */
   int rewr_loc;			/* rewrite location response */
@@ -885,7 +1161,13 @@ typedef struct _listener
   char *forwarded_header;       /* "forwarded" header name */
   ACL *trusted_ips;             /* Trusted IP addresses */
   int allow_client_reneg;	/* Allow Client SSL Renegotiation */
+  long sess_cache_size;         /* TLS session cache size (-1: default) */
+  long sess_timeout;            /* TLS session timeout (-1: default) */
+  struct ticket_keys *ticket_keys; /* TLS session ticket keys */
+  int http2;                    /* Offer HTTP/2 via ALPN */
+  unsigned http2_max_streams;   /* Max. number of concurrent HTTP/2 streams */
   SERVICE_HEAD services;
+  struct service_index *svc_index; /* Service dispatch index */
   SLIST_ENTRY (_listener) next;
 
   /* Used during configuration parsing */
@@ -954,6 +1236,21 @@ typedef enum
   }
   RENEG_STATE;
 
+/*
+ * TLS parameters of a client connection.  These are obtained once by
+ * the HTTP/2 session thread and passed to the streams, which can't
+ * query the SSL object while the session is using it.
+ */
+struct tls_info
+{
+  long verify_result;   /* Result of the peer certificate verification. */
+  char const *version;  /* Protocol version. */
+  char *cipher;         /* Cipher description, or NULL. */
+};
+
+void tls_info_init (struct tls_info *tls, SSL *ssl);
+void tls_info_free (struct tls_info *tls);
+
 typedef struct _pound_http
 {
   /* Input parameters */
@@ -970,15 +1267,20 @@ typedef struct _pound_http
   BIO *be;
   X509 *x509;
   SSL *ssl;
+  struct tls_info const *tls; /* For HTTP/2 streams: TLS parameters of the
+				 session (ssl is NULL) */
   struct submatch_queue smq;
   RENEG_STATE reneg_state;
 
   int ws_state;  /* Websocket state */
   int no_cont;   /* True if no content is expected */
   int conn_closed; /* True if the connection is closed */
+  int be_keepalive; /* True if the backend connection can be reused */
+  int be_reused;    /* True if the backend connection has been used before */
 
   struct http_request request;
   struct http_request response;
+  struct arena arena;        /* Memory arena for request and response data */
 
   struct timespec start_req; /* Time when original request was received */
   struct timespec end_req;   /* Time after the response was sent */
@@ -986,20 +1288,48 @@ typedef struct _pound_http
   char *orig_forwarded_header; /* Original value of forwarded header */
   int response_code;
 
+  struct cache_entry *cache_entry; /* Cache entry being served or filled */
+  BIO *cache_bio;            /* BIO capturing the response for the cache */
+  BIO *compress_bio;         /* BIO compressing the response body */
+  int compress_vary;         /* True if Vary header was added by compression */
+
   CONTENT_LENGTH res_bytes;
 
+  struct http2_session *h2; /* HTTP/2 session, if this is a stream */
+
+  int keepalive;   /* True if the connection is resumed from the idle set */
+  struct timespec idle_expire; /* Expiration time of the idle connection */
+  DLIST_ENTRY (_pound_http) idle_link;
+
   SLIST_ENTRY(_pound_http) next;
 } POUND_HTTP;
 
 typedef SLIST_HEAD(,_pound_http) POUND_HTTP_HEAD;
 
+/* Return true if the client connection of PHTTP uses TLS. */
+static inline int
+pound_http_is_tls (POUND_HTTP const *phttp)
+{
+  return phttp->ssl != NULL || phttp->tls != NULL;
+}
+
 void save_forwarded_header (POUND_HTTP *phttp);
 void http_log (POUND_HTTP *phttp);
 
 /* add a request to the queue */
 int pound_http_enqueue (int sock, LISTENER *lstn, struct sockaddr *sa, socklen_t salen);
+/* add a request for an HTTP/2 stream to the queue */
+int pound_http_enqueue_stream (POUND_HTTP *parent, int sock,
+			       struct http2_session *h2,
+			       struct tls_info const *tls);
+/* serve an HTTP/2 session in a thread of its own */
+int pound_http_session_start (POUND_HTTP *phttp);
+/* Return true if a new HTTP/2 session can be started. */
+int pound_http_session_available (void);
 /* get a request from the queue */
 POUND_HTTP *pound_http_dequeue (void);
+/* Put idle keep-alive connection to the event loop */
+int pound_http_park (POUND_HTTP *phttp);
 /* Free the argument */
 void pound_http_destroy (POUND_HTTP *arg);
 /* get the current queue length */
@@ -1010,6 +1340,30 @@ void active_threads_decr (void);
 /* handle HTTP requests */
 void *thr_http (void *);
 
+/* Return codes for do_http */
+enum
+  {
+    HTTP_CONN_DONE,     /* Connection finished, release it. */
+    HTTP_CONN_IDLE,     /* Keep-alive connection is idle, park it. */
+    HTTP_CONN_DETACHED  /* Connection is served by another thread. */
+  };
+
+/* HTTP/2 support */
+struct http2_session;
+#ifdef ENABLE_HTTP2
+void http2_ctx_init (SSL_CTX *ctx);
+int http2_negotiated (SSL *ssl);
+int http2_serve (POUND_HTTP *phttp);
+int http2_refuse (POUND_HTTP *phttp);
+void http2_stream_release (struct http2_session *h2);
+#else
+# define http2_ctx_init(ctx) ((void) (ctx))
+# define http2_negotiated(ssl) 0
+# define http2_serve(phttp) HTTP_CONN_DONE
+# define http2_refuse(phttp) HTTP_CONN_DONE
+# define http2_stream_release(h2) ((void) (h2))
+#endif
+
 /* Log an error to the syslog or to stderr */
 void logmsg (const int, const char *, ...)
   ATTR_PRINTFLIKE(2,3);
@@ -1024,21 +1378,34 @@ char *str_be (char *buf, size_t size, BACKEND *be);
 
 /* Find the right service for a request */
 SERVICE *get_service (POUND_HTTP *);
+/* Build service dispatch indexes after configuration has been parsed. */
+void service_index_build (void);
 
 /* Find the right back-end for a request */
 BACKEND *get_backend (POUND_HTTP *phttp);
 
+void backend_update_stats (BACKEND *be, struct timespec const *start,
+			   struct timespec const *end);
+void backend_request_begin (BACKEND *be);
+void backend_request_end (BACKEND *be, struct timespec const *start,
+			  struct timespec const *end);
+void backend_stats_read (BACKEND *be, struct be_stats *st);
+double be_stats_stddev (struct be_stats const *st);
+
 #ifdef ENABLE_DYNAMIC_BACKENDS
 void backend_ref (BACKEND *be);
 void backend_unref (BACKEND *be);
 #else
-# define backend_ref(be)
-# define backend_unref(be)
+# define backend_ref(be) ((void) (be))
+# define backend_unref(be) ((void) (be))
 #endif
 
 void backend_matrix_to_regular (struct be_matrix *mtx, struct addrinfo *addr,
 				struct be_regular *reg);
 void backend_matrix_init (BACKEND *be);
+void backend_pool_init (struct be_pool *pool);
+void backend_pool_free (struct be_pool *pool);
+int backend_pool_release (POUND_HTTP *phttp);
 void backend_matrix_disable (BACKEND *be, int disable_mode);
 
 /* Search for a host name, return the addrinfo for it */
@@ -1114,6 +1481,18 @@ balancer_list_get_emerg (BALANCER_LIST *ml)
  */
 int connect_nb (const int, const struct addrinfo *, const int);
 
+/*
+ * Initialize libraries and global data
+ */
+void pound_init (void);
+
+#ifdef POUND_BENCH
+/* Entry points for the micro-benchmarks. */
+int bench_http_request_parse (BIO *in, const LISTENER *lstn,
+			      struct http_request *req);
+char *bench_expand_string (EXPAND_PROG const *prog, POUND_HTTP *phttp);
+#endif
+
 /*
  * Parse arguments/config file
  */
@@ -1142,6 +1521,17 @@ void *thr_timer (void *);
 
 void POUND_SSL_CTX_init (SSL_CTX *ctx);
 int set_ECDHCurve (char *name);
+
+/* TLS session resumption with backends. */
+SSL *backend_ssl_new (BACKEND *be);
+int backend_ssl_new_session (SSL *ssl, SSL_SESSION *sess);
+
+/* TLS session ticket keys. */
+#define TICKET_KEY_NAME_LEN 16
+
+void ticket_keys_add_file (LISTENER *lst, char *name);
+int ticket_keys_load (LISTENER *lst);
+int ticket_keys_setup (LISTENER *lst, SSL_CTX *ctx);
 
 char const *sess_type_to_str (int type);
 int control_response_basic (POUND_HTTP *arg);
@@ -1202,11 +1592,163 @@ void json_error (struct json_value *val, char const *fmt, ...)
 
 int http_status_to_pound (int status);
 int pound_to_http_status (int err);
+struct static_response *error_page_render (int err, char const *text);
+int listener_static_responses_init (LISTENER *lstn, void *data);
+
+/* Access log targets. */
+enum
+  {
+    ACCESS_LOG_FILE,		/* Append to a file. */
+    ACCESS_LOG_STDOUT,		/* Write to standard output. */
+    ACCESS_LOG_UDP,		/* Send to syslog server over UDP. */
+    ACCESS_LOG_TCP		/* Send to syslog server over TCP. */
+  };
+
+/* What to do when access log buffer is full. */
+enum
+  {
+    ACCESS_LOG_DROP,		/* Drop the record. */
+    ACCESS_LOG_BLOCK		/* Wait until there is enough space. */
+  };
+
+struct access_log_config
+{
+  char *target;			/* Target as given in the configuration,
+				   NULL if not configured. */
+  int type;			/* Target type (ACCESS_LOG_* constant). */
+  char const *name;		/* File name or host[:port]. */
+  unsigned bufsize;		/* Per-thread buffer size (power of 2). */
+  int overflow;			/* Overflow policy. */
+  unsigned flush_interval;	/* Flush interval, in milliseconds. */
+};
+
+void access_log_open (void);
+void access_log_start (void);
+void access_log_stop (void);
+int access_log_enabled (void);
+int access_log_write (char const *msg, size_t len);
+unsigned long access_log_dropped (void);
+
+void backend_health_check_start (BACKEND *be);
+void backend_resurrect (BACKEND *be);
 
 struct json_value *workers_serialize (void);
+void workers_count (unsigned *count, unsigned *active);
 struct json_value *pound_serialize (void);
 int metrics_response (POUND_HTTP *phttp);
 
+/* Response cache configuration. */
+struct cache_conf
+{
+  CONTENT_LENGTH size;             /* Max. size of the cache. */
+  CONTENT_LENGTH max_object_size;  /* Max. size of a single response. */
+  unsigned default_ttl;            /* Lifetime of responses without explicit
+				      expiration time. */
+  unsigned lock_timeout;           /* Max. time to wait for a response being
+				      fetched by another thread. */
+};
+
+#define DEFAULT_CACHE_SIZE (64*1024*1024)
+#define DEFAULT_CACHE_MAX_OBJECT_SIZE (1024*1024)
+#define DEFAULT_CACHE_LOCK_TIMEOUT 10
+
+/* Cache lookup results, also used as indices of request counters. */
+enum
+  {
+    CACHE_HIT,          /* Response served from the cache. */
+    CACHE_COALESCED,    /* Same, after waiting for another request. */
+    CACHE_MISS,         /* Response fetched from the backend and stored. */
+    CACHE_BYPASS,       /* Request not eligible for caching. */
+    CACHE_STAT_MAX
+  };
+
+struct http_cache_stats
+{
+  unsigned long requests[CACHE_STAT_MAX];
+  unsigned long evictions;
+  size_t entries;
+  size_t size;
+};
+
+struct http_cache *http_cache_new (struct cache_conf const *conf);
+struct cache_conf const *http_cache_conf (struct http_cache *cache);
+void http_cache_stats (struct http_cache *cache, struct http_cache_stats *st);
+void http_cache_bypass (struct http_cache *cache);
+int cache_lookup (struct http_cache *cache, char const *key, int fill,
+		  int chunked_ok, struct cache_entry **ret);
+void cache_entry_unref (struct cache_entry *ent);
+BIO *cache_entry_fill_begin (struct cache_entry *ent, BIO *out,
+			     char const *head, size_t head_len,
+			     int code, time_t ttl, unsigned age, int chunked);
+void cache_entry_fill_end (struct cache_entry *ent, BIO *tee, int ok);
+char const *cache_entry_head (struct cache_entry *ent, size_t *len);
+int cache_entry_send (struct cache_entry *ent, BIO *out, int head,
+		      CONTENT_LENGTH *res_bytes);
+
+/* Content codings used for response compression. */
+enum
+  {
+    COMPRESS_GZIP,
+    COMPRESS_BROTLI,
+    COMPRESS_MAX
+  };
+
+/* Response compression configuration. */
+struct compress_conf
+{
+  int encv[COMPRESS_MAX];          /* Enabled codings, in order of
+				      preference. */
+  int encc;                        /* Number of elements in encv. */
+  int level[COMPRESS_MAX];         /* Compression level for each coding. */
+  CONTENT_LENGTH min_size;         /* Don't compress smaller responses. */
+  char **types;                    /* Content type patterns. */
+  size_t ntypes;                   /* Number of elements in types. */
+  size_t maxtypes;                 /* Allocated size of types. */
+};
+
+#define DEFAULT_COMPRESS_MIN_SIZE 256
+#define DEFAULT_GZIP_LEVEL 6
+#define DEFAULT_BROTLI_LEVEL 4
+
+struct http_compress_stats
+{
+  unsigned long responses[COMPRESS_MAX]; /* Number of compressed responses. */
+  unsigned long bytes_in[COMPRESS_MAX];  /* Bytes before compression. */
+  unsigned long bytes_out[COMPRESS_MAX]; /* Bytes after compression. */
+};
+
+#ifdef ENABLE_COMPRESSION
+char const *compress_coding_name (int enc);
+int compress_coding_lookup (char const *name);
+struct http_compress *http_compress_new (struct compress_conf const *conf);
+void http_compress_stats (struct http_compress *comp,
+			  struct http_compress_stats *st);
+int compress_negotiate (struct http_compress *comp, char const *accept);
+int compress_content_type_ok (struct http_compress *comp, char const *type);
+CONTENT_LENGTH compress_min_size (struct http_compress *comp);
+BIO *compress_bio_new (struct http_compress *comp, int enc, BIO *out);
+int compress_bio_finish (BIO *bio);
+void compress_bio_free (BIO *bio);
+#else
+# define compress_coding_name(enc) ((char const *) NULL)
+# define http_compress_stats(comp, st) memset (st, 0, sizeof (*(st)))
+# define compress_negotiate(comp, accept) (-1)
+# define compress_content_type_ok(comp, type) 0
+# define compress_min_size(comp) 0
+# define compress_bio_new(comp, enc, out) NULL
+# define compress_bio_finish(bio) (-1)
+# define compress_bio_free(bio) ((void) (bio))
+#endif
+
+/* Default max. number of keys tracked by a rate limiter. */
+#define DEFAULT_RATELIMIT_MAX_KEYS 16384
+
+struct rate_limit *rate_limit_new (char const *locus, char const *key,
+				   double rate, unsigned burst,
+				   size_t max_keys);
+int rate_limit_check (struct rate_limit *rl, char const *key);
+struct json_value *rate_limit_serialize (size_t top);
+
 int match_cond (SERVICE_COND *cond, POUND_HTTP *phttp,
 		struct http_request *req);
 
@@ -1235,8 +1777,7 @@ char const *http_request_orig_line (struct http_request *req);
 int http_request_get_basic_auth (struct http_request *req,
 				 char **u_name, char **u_pass);
 
-void service_lb_init (SERVICE *svc);
-void service_lb_reset (SERVICE *svc, BACKEND *be);
+void service_lb_update (SERVICE *svc);
 
 FILE *fopen_wd (WORKDIR *wd, const char *filename);
 FILE *fopen_include (const char *filename);
@@ -1046,7 +1046,70 @@ command_add_session (BIO *bio, int argc, char **argv)
   return 0;
 }
 
+int
+command_ticket_keys (BIO *bio, int argc, char **argv)
+{
+  char *uri = "";
+  struct json_value *val;
+
+  if (argc == 1)
+    uri = argv[0];
+  else if (argc > 1)
+    {
+      errormsg (1, 0, "too many arguments");
+    }
+  send_request (bio, "POST", "ticketkeys%s", uri);
+  val = read_response (bio);
+  if (json_option)
+    print_json (val, stdout);
+  if (val->type != json_bool)
+    {
+      json_error (val, "unexpected object type");
+      return 1;
+    }
+  if (val->v.b == 0)
+    {
+      errormsg (1, 0, "command failed");
+    }
+  json_value_free (val);
+  return 0;
+}
 
+int
+command_ratelimit (BIO *bio, int argc, char **argv)
+{
+  struct json_value *val;
+
+  if (argc > 1)
+    {
+      errormsg (1, 0, "too many arguments");
+    }
+  if (argc == 1)
+    {
+      if (!*argv[0] || argv[0][strspn (argv[0], "0123456789")] != 0)
+	errormsg (1, 0, "bad number: %s", argv[0]);
+      send_request (bio, "GET", "ratelimit?top=%s", argv[0]);
+    }
+  else
+    send_request (bio, "GET", "ratelimit");
+  val = read_response (bio);
+  if (json_option)
+    print_json (val, stdout);
+  else
+    {
+      TEMPLATE tmpl;
+
+      tmpl = template_lookup (tmpl_name);
+      if (!tmpl)
+	{
+	  errormsg (1, 0, "template %s not defined", tmpl_name);
+	}
+      template_run (tmpl, val, stdout);
+    }
+  json_value_free (val);
+  return 0;
+}
+
 typedef int (*COMMAND) (BIO *, int, char **);
 
 struct dispatch_table
@@ -1064,6 +1127,8 @@ static struct dispatch_table dispatch[] = {
   { "delete", command_delete_session },
   { "del", command_delete_session },
   { "add", command_add_session },
+  { "ticketkeys", command_ticket_keys },
+  { "ratelimit", command_ratelimit },
   { NULL }
 };
 
@@ -1091,6 +1156,10 @@ static char *usage_text[] = {
   "   disable /L/S/B    disable listener, service, or backend.",
   "   delete /L/S KEY   delete session with given key.",
   "   add /L/S/B KEY    add session with given key.",
+  "   ticketkeys [/L]   reload TLS session ticket keys of all listeners,",
+  "                     or of listener L.",
+  "   ratelimit [N]     list rate limiters along with at most N keys",
+  "                     (default 10) with the most rejected requests.",
   "",
   "Shortcuts:",
   "   on                same as enable",
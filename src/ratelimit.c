@@ -0,0 +1,398 @@
+/* Request rate limiting for pound
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each RateLimit condition has its own rate limiter, which keeps a token
+ * bucket per key (client address, by default).  A bucket holds up to
+ * "burst" tokens and is refilled at the configured rate.  Each request
+ * takes one token from its bucket; a request that finds the bucket empty
+ * is over the limit.  Buckets are refilled lazily, when they are
+ * accessed, so no background processing is needed.
+ *
+ * Buckets are kept in shards, each one with its own mutex, hash table
+ * and LRU list.  The number of buckets in a shard is limited: when the
+ * limit is reached, the least recently used bucket is discarded.
+ */
+#include "pound.h"
+#include "extern.h"
+#include "json.h"
+
+typedef struct rate_bucket
+{
+  char *name;                   /* Key. */
+  double tokens;                /* Number of tokens available. */
+  double stamp;                 /* Time of the last refill. */
+  unsigned long passed;         /* Number of requests passed. */
+  unsigned long rejected;       /* Number of requests over the limit. */
+  DLIST_ENTRY (rate_bucket) link; /* Link in the LRU list of the shard. */
+} RATE_BUCKET;
+
+#define HT_TYPE RATE_BUCKET
+#define HT_NO_FOREACH
+#define HT_NO_HASH_FREE
+#include "ht.h"
+
+typedef struct rate_shard
+{
+  pthread_mutex_t mut;          /* Mutex for this shard. */
+  RATE_BUCKET_HASH *hash;       /* Buckets indexed by key. */
+  DLIST_HEAD (,rate_bucket) lru; /* Buckets, most recently used first. */
+  size_t count;                 /* Number of buckets. */
+} RATE_SHARD;
+
+struct rate_limit
+{
+  char *locus;                  /* Location in the configuration file. */
+  char *key;                    /* Key expression, NULL for client address. */
+  double rate;                  /* Tokens added per second. */
+  double burst;                 /* Bucket capacity. */
+  size_t shard_max;             /* Max. number of buckets in a shard. */
+  unsigned long passed;         /* Number of requests passed. */
+  unsigned long rejected;       /* Number of requests over the limit. */
+  unsigned long evictions;      /* Number of buckets evicted. */
+  RATE_SHARD shard[RATELIMIT_SHARDS];
+  SLIST_ENTRY (rate_limit) next;
+};
+
+static SLIST_HEAD (, rate_limit) rate_limits =
+  SLIST_HEAD_INITIALIZER (rate_limits);
+
+/*
+ * Create a new rate limiter.  LOCUS is its location in the configuration
+ * file, KEY is the source key expression (NULL if client address is
+ * used), RATE is the number of requests per second and BURST is the bucket
+ * capacity, i.e. the max. number of requests that can be passed in a row.
+ * At most MAX_KEYS buckets will be kept.
+ */
+struct rate_limit *
+rate_limit_new (char const *locus, char const *key, double rate,
+		unsigned burst, size_t max_keys)
+{
+  struct rate_limit *rl;
+  int i;
+
+  XZALLOC (rl);
+  rl->locus = xstrdup (locus);
+  rl->key = key ? xstrdup (key) : NULL;
+  rl->rate = rate;
+  rl->burst = burst;
+  rl->shard_max = (max_keys + RATELIMIT_SHARDS - 1) / RATELIMIT_SHARDS;
+  for (i = 0; i < RATELIMIT_SHARDS; i++)
+    {
+      RATE_SHARD *shard = &rl->shard[i];
+
+      pthread_mutex_init (&shard->mut, NULL);
+      if ((shard->hash = RATE_BUCKET_HASH_NEW ()) == NULL)
+	xnomem ();
+      DLIST_INIT (&shard->lru);
+    }
+  SLIST_PUSH (&rate_limits, rl, next);
+  return rl;
+}
+
+static RATE_SHARD *
+rate_shard (struct rate_limit *rl, char const *key)
+{
+  /* FNV-1a hash */
+  uint32_t h = 2166136261u;
+  unsigned char const *p;
+
+  for (p = (unsigned char const *) key; *p; p++)
+    {
+      h ^= *p;
+      h *= 16777619;
+    }
+  return &rl->shard[h % RATELIMIT_SHARDS];
+}
+
+static inline double
+monotonic_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Create a full bucket for KEY and insert it at the head of the LRU list,
+ * evicting the least recently used bucket if the shard is full.  The
+ * shard mutex must be locked.
+ */
+static RATE_BUCKET *
+rate_bucket_new (struct rate_limit *rl, RATE_SHARD *shard, char const *key,
+		 double now)
+{
+  RATE_BUCKET *b;
+  size_t len = strlen (key);
+
+  if (shard->count >= rl->shard_max)
+    {
+      b = DLIST_LAST (&shard->lru);
+      DLIST_REMOVE (&shard->lru, b, link);
+      RATE_BUCKET_DELETE (shard->hash, b);
+      shard->count--;
+      free (b);
+      __atomic_add_fetch (&rl->evictions, 1, __ATOMIC_RELAXED);
+    }
+
+  if ((b = malloc (sizeof (*b) + len + 1)) == NULL)
+    return NULL;
+  b->name = (char *) (b + 1);
+  memcpy (b->name, key, len + 1);
+  b->tokens = rl->burst;
+  b->stamp = now;
+  b->passed = b->rejected = 0;
+  if (RATE_BUCKET_INSERT (shard->hash, b) != NULL)
+    {
+      free (b);
+      return NULL;
+    }
+  DLIST_INSERT_HEAD (&shard->lru, b, link);
+  shard->count++;
+  return b;
+}
+
+/*
+ * Account for a request with the given KEY.  Return 1 if it exceeds the
+ * limit and 0 otherwise.  If the bucket can't be allocated, the request
+ * is let through.
+ */
+int
+rate_limit_check (struct rate_limit *rl, char const *key)
+{
+  RATE_SHARD *shard = rate_shard (rl, key);
+  RATE_BUCKET *b, keyb;
+  double now = monotonic_now ();
+  int res;
+
+  keyb.name = (char *) key;
+  pthread_mutex_lock (&shard->mut);
+  if ((b = RATE_BUCKET_RETRIEVE (shard->hash, &keyb)) != NULL)
+    {
+      /* Refill the bucket. */
+      b->tokens += (now - b->stamp) * rl->rate;
+      if (b->tokens > rl->burst)
+	b->tokens = rl->burst;
+      b->stamp = now;
+      /* Move it to the head of the LRU list. */
+      if (DLIST_PREV (b, link))
+	{
+	  DLIST_REMOVE (&shard->lru, b, link);
+	  DLIST_INSERT_HEAD (&shard->lru, b, link);
+	}
+    }
+  else if ((b = rate_bucket_new (rl, shard, key, now)) == NULL)
+    {
+      pthread_mutex_unlock (&shard->mut);
+      lognomem ();
+      return 0;
+    }
+
+  if (b->tokens >= 1)
+    {
+      b->tokens -= 1;
+      b->passed++;
+      res = 0;
+    }
+  else
+    {
+      b->rejected++;
+      res = 1;
+    }
+  pthread_mutex_unlock (&shard->mut);
+
+  __atomic_add_fetch (res ? &rl->rejected : &rl->passed, 1, __ATOMIC_RELAXED);
+  return res;
+}
+
+/* Copy of a bucket's statistics, taken for reporting. */
+struct rate_offender
+{
+  char *key;
+  unsigned long passed;
+  unsigned long rejected;
+};
+
+/*
+ * Collect at most N keys with the greatest number of rejected requests
+ * from RL into the array TOP, sorted in descending order.  Store the
+ * total number of keys in *KEYS.  Return the number of collected keys.
+ */
+static size_t
+rate_limit_top (struct rate_limit *rl, struct rate_offender *top, size_t n,
+		size_t *keys)
+{
+  size_t count = 0;
+  int i;
+
+  *keys = 0;
+  for (i = 0; i < RATELIMIT_SHARDS; i++)
+    {
+      RATE_SHARD *shard = &rl->shard[i];
+      RATE_BUCKET *b;
+
+      pthread_mutex_lock (&shard->mut);
+      *keys += shard->count;
+      DLIST_FOREACH (b, &shard->lru, link)
+	{
+	  size_t j;
+	  char *s;
+
+	  if (b->rejected == 0
+	      || (count == n && (n == 0 || top[n-1].rejected >= b->rejected)))
+	    continue;
+	  if ((s = strdup (b->name)) == NULL)
+	    continue;
+	  if (count == n)
+	    free (top[--count].key);
+	  for (j = count; j > 0 && top[j-1].rejected < b->rejected; j--)
+	    top[j] = top[j-1];
+	  top[j].key = s;
+	  top[j].passed = b->passed;
+	  top[j].rejected = b->rejected;
+	  count++;
+	}
+      pthread_mutex_unlock (&shard->mut);
+    }
+  return count;
+}
+
+/*
+ * Format the rate of RL as N/UNIT, choosing the unit so that N is not
+ * less than 1.
+ */
+static struct json_value *
+rate_serialize (struct rate_limit *rl)
+{
+  char buf[80];
+
+  if (rl->rate >= 1)
+    snprintf (buf, sizeof buf, "%g/s", rl->rate);
+  else if (rl->rate * 60 >= 1)
+    snprintf (buf, sizeof buf, "%g/m", rl->rate * 60);
+  else
+    snprintf (buf, sizeof buf, "%g/h", rl->rate * 3600);
+  return json_new_string (buf);
+}
+
+static struct json_value *
+rate_limit_serialize_one (struct rate_limit *rl, struct rate_offender *top,
+			  size_t n)
+{
+  struct json_value *obj, *arr = NULL;
+  size_t i, count, keys;
+  int err = 1;
+
+  count = rate_limit_top (rl, top, n, &keys);
+
+  if ((obj = json_new_object ()) != NULL
+      && (arr = json_new_array ()) != NULL)
+    {
+      err = json_object_set (obj, "locus", json_new_string (rl->locus))
+	|| (rl->key && json_object_set (obj, "key", json_new_string (rl->key)))
+	|| json_object_set (obj, "rate", rate_serialize (rl))
+	|| json_object_set (obj, "burst", json_new_number (rl->burst))
+	|| json_object_set (obj, "keys", json_new_number (keys))
+	|| json_object_set (obj, "passed",
+			    json_new_number (__atomic_load_n (&rl->passed,
+							      __ATOMIC_RELAXED)))
+	|| json_object_set (obj, "rejected",
+			    json_new_number (__atomic_load_n (&rl->rejected,
+							      __ATOMIC_RELAXED)))
+	|| json_object_set (obj, "evictions",
+			    json_new_number (__atomic_load_n (&rl->evictions,
+							      __ATOMIC_RELAXED)));
+
+      for (i = 0; !err && i < count; i++)
+	{
+	  struct json_value *ent;
+
+	  if ((ent = json_new_object ()) == NULL)
+	    err = 1;
+	  else
+	    {
+	      err = json_object_set (ent, "key", json_new_string (top[i].key))
+		|| json_object_set (ent, "passed",
+				    json_new_number (top[i].passed))
+		|| json_object_set (ent, "rejected",
+				    json_new_number (top[i].rejected))
+		|| json_array_append (arr, ent);
+	      if (err)
+		json_value_free (ent);
+	    }
+	}
+
+      if (!err)
+	{
+	  err = json_object_set (obj, "top", arr);
+	  arr = NULL;
+	}
+    }
+
+  for (i = 0; i < count; i++)
+    free (top[i].key);
+  json_value_free (arr);
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
+
+/*
+ * Serialize all rate limiters.  For each of them, at most TOP keys with
+ * the greatest number of rejected requests are listed.
+ */
+struct json_value *
+rate_limit_serialize (size_t top)
+{
+  struct json_value *obj, *arr;
+  struct rate_offender *tab = NULL;
+  struct rate_limit *rl;
+  int err = 0;
+
+  if (top > 0 && (tab = calloc (top, sizeof (tab[0]))) == NULL)
+    return NULL;
+
+  if ((obj = json_new_object ()) == NULL)
+    err = 1;
+  else if ((arr = json_new_array ()) == NULL
+	   || json_object_set (obj, "ratelimits", arr))
+    err = 1;
+  else
+    {
+      SLIST_FOREACH (rl, &rate_limits, next)
+	{
+	  struct json_value *val = rate_limit_serialize_one (rl, tab, top);
+	  if (val == NULL || json_array_append (arr, val))
+	    {
+	      json_value_free (val);
+	      err = 1;
+	      break;
+	    }
+	}
+    }
+
+  free (tab);
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
@@ -0,0 +1,262 @@
+/* Read-copy-update for pound
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Epoch-based read-copy-update.
+ *
+ * Data that are read often and updated rarely are kept in immutable
+ * objects, published through a pointer.  Readers access them within
+ * read-side critical sections (rcu_read_lock/rcu_read_unlock) without
+ * taking any locks.  Writers build a new copy, publish it with
+ * rcu_assign_pointer and pass the old one to rcu_call, which defers its
+ * disposal until all readers that could have seen it have left their
+ * critical sections.
+ *
+ * To track readers, each thread that enters a critical section gets a
+ * reader record, which holds the global epoch at the time of entry, or
+ * 0 when the thread is outside of any critical section.  Each call to
+ * rcu_call advances the global epoch and marks the callback with its
+ * previous value.  The callback can be run once no active reader holds
+ * an epoch less than or equal to that mark.  Deferred callbacks are run
+ * from a timer job.
+ */
+#include "pound.h"
+
+/* Interval between the checks for expired grace periods, in ms. */
+#define RCU_CHECK_INTERVAL 100
+
+struct rcu_reader
+{
+  unsigned long epoch;          /* Epoch at entry, or 0 if inactive. */
+  unsigned nesting;             /* Nesting level of critical sections. */
+  int in_use;                   /* True if owned by a thread. */
+  SLIST_ENTRY (rcu_reader) next;
+};
+
+static SLIST_HEAD (, rcu_reader) rcu_readers =
+  SLIST_HEAD_INITIALIZER (rcu_readers);
+
+/*
+ * Number of critical sections entered by threads that failed to get a
+ * reader record.  While it is not 0, no callbacks are run.
+ */
+static unsigned long rcu_anon_readers;
+
+static unsigned long rcu_epoch = 1;
+
+static SLIST_HEAD (, rcu_head) rcu_pending =
+  SLIST_HEAD_INITIALIZER (rcu_pending);
+static int rcu_job_armed;
+
+/* Protects the reader list, pending callbacks and rcu_job_armed. */
+static pthread_mutex_t rcu_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Thread-specific data destructor: return the reader record to the pool.
+ * Records are never freed, because the job scanning them doesn't hold
+ * any references.
+ */
+static void
+rcu_reader_release (void *ptr)
+{
+  struct rcu_reader *r = ptr;
+  pthread_mutex_lock (&rcu_mutex);
+  r->in_use = 0;
+  pthread_mutex_unlock (&rcu_mutex);
+}
+
+static void
+rcu_key_create (void)
+{
+  pthread_key_create (&rcu_key, rcu_reader_release);
+}
+
+static struct rcu_reader *
+rcu_reader_get (void)
+{
+  struct rcu_reader *r;
+
+  pthread_once (&rcu_key_once, rcu_key_create);
+  if ((r = pthread_getspecific (rcu_key)) != NULL)
+    return r;
+
+  pthread_mutex_lock (&rcu_mutex);
+  SLIST_FOREACH (r, &rcu_readers, next)
+    {
+      if (!r->in_use)
+	break;
+    }
+  if (r == NULL && (r = malloc (sizeof (*r))) != NULL)
+    {
+      r->epoch = 0;
+      r->nesting = 0;
+      SLIST_PUSH (&rcu_readers, r, next);
+    }
+  if (r)
+    r->in_use = 1;
+  pthread_mutex_unlock (&rcu_mutex);
+
+  if (r == NULL)
+    lognomem ();
+  else
+    pthread_setspecific (rcu_key, r);
+  return r;
+}
+
+/*
+ * Enter read-side critical section.  Critical sections can nest.  They
+ * must not block waiting for an event that may only happen after a
+ * grace period.
+ */
+void
+rcu_read_lock (void)
+{
+  struct rcu_reader *r = rcu_reader_get ();
+
+  if (r == NULL)
+    __atomic_add_fetch (&rcu_anon_readers, 1, __ATOMIC_SEQ_CST);
+  else if (r->nesting++ == 0)
+    __atomic_store_n (&r->epoch,
+		      __atomic_load_n (&rcu_epoch, __ATOMIC_SEQ_CST),
+		      __ATOMIC_SEQ_CST);
+  /*
+   * Make sure the epoch is stored before any protected pointer is
+   * loaded.
+   */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Leave read-side critical section.
+ */
+void
+rcu_read_unlock (void)
+{
+  struct rcu_reader *r = pthread_getspecific (rcu_key);
+
+  if (r == NULL)
+    __atomic_sub_fetch (&rcu_anon_readers, 1, __ATOMIC_RELEASE);
+  else if (--r->nesting == 0)
+    __atomic_store_n (&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return the minimal epoch of the active readers, 0 if there are readers
+ * with unknown epoch, or ULONG_MAX if there are no readers.
+ * Must be called with rcu_mutex locked.
+ */
+static unsigned long
+rcu_min_epoch (void)
+{
+  struct rcu_reader *r;
+  unsigned long min = ULONG_MAX;
+
+  if (__atomic_load_n (&rcu_anon_readers, __ATOMIC_SEQ_CST))
+    return 0;
+  SLIST_FOREACH (r, &rcu_readers, next)
+    {
+      unsigned long e = __atomic_load_n (&r->epoch, __ATOMIC_SEQ_CST);
+      if (e != 0 && e < min)
+	min = e;
+    }
+  return min;
+}
+
+static void rcu_job (enum job_ctl ctl, void *data, const struct timespec *ts);
+
+/*
+ * Schedule the callback job.  To avoid lock order inversion, this is
+ * called with rcu_mutex unlocked, after setting rcu_job_armed.
+ */
+static void
+rcu_job_schedule (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  ts.tv_nsec += RCU_CHECK_INTERVAL * 1000000;
+  if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+  job_enqueue (&ts, rcu_job, NULL);
+}
+
+/*
+ * Periodic job: run the callbacks whose grace periods have expired.
+ */
+static void
+rcu_job (enum job_ctl ctl, void *data, const struct timespec *ts)
+{
+  SLIST_HEAD (, rcu_head) ready = SLIST_HEAD_INITIALIZER (ready);
+  struct rcu_head *head;
+  unsigned long min;
+  int rearm;
+
+  if (ctl != job_ctl_run)
+    return;
+
+  pthread_mutex_lock (&rcu_mutex);
+  min = rcu_min_epoch ();
+  /* Callbacks are ordered by epoch. */
+  while ((head = SLIST_FIRST (&rcu_pending)) != NULL && head->epoch < min)
+    {
+      SLIST_SHIFT (&rcu_pending, next);
+      SLIST_PUSH (&ready, head, next);
+    }
+  rearm = rcu_job_armed = !SLIST_EMPTY (&rcu_pending);
+  pthread_mutex_unlock (&rcu_mutex);
+
+  while ((head = SLIST_FIRST (&ready)) != NULL)
+    {
+      SLIST_SHIFT (&ready, next);
+      head->func (head->data);
+    }
+
+  if (rearm)
+    rcu_job_schedule ();
+}
+
+/*
+ * Call FUNC (DATA) after all read-side critical sections that were active
+ * at the time of the call have been left.  HEAD is an rcu_head structure,
+ * normally embedded in the object being disposed of.  It must stay valid
+ * until the callback is run.
+ *
+ * The object must be made unreachable for new readers before calling
+ * this function.
+ */
+void
+rcu_call (struct rcu_head *head, void (*func) (void *), void *data)
+{
+  int arm;
+
+  head->func = func;
+  head->data = data;
+  pthread_mutex_lock (&rcu_mutex);
+  head->epoch = __atomic_fetch_add (&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+  SLIST_PUSH (&rcu_pending, head, next);
+  if ((arm = !rcu_job_armed) != 0)
+    rcu_job_armed = 1;
+  pthread_mutex_unlock (&rcu_mutex);
+  if (arm)
+    rcu_job_schedule ();
+}
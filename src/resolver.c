@@ -108,79 +108,6 @@ dns_log_cb (adns_state ads, void *logfndata, const char *fmt, va_list ap)
     }
 }
 
-static pthread_key_t dns_state_key;
-static pthread_once_t dns_state_key_once = PTHREAD_ONCE_INIT;
-
-struct thread_dns_state
-{
-  adns_state state;
-  struct stringbuf sb;
-};
-
-static void
-dns_state_free (void *f)
-{
-  if (f)
-    {
-      struct thread_dns_state *s = f;
-      adns_finish (s->state);
-      stringbuf_free (&s->sb);
-      free (f);
-    }
-}
-
-static void
-dns_state_key_create (void)
-{
-  pthread_key_create (&dns_state_key, dns_state_free);
-}
-
-static struct thread_dns_state *
-dns_state_create (void)
-{
-  int flags = adns_if_nosigpipe;
-  struct thread_dns_state *ds;
-
-  ds = calloc (1, sizeof (*ds));
-  if (!ds)
-    lognomem ();
-  else
-    {
-      int rc;
-
-      if (conf.debug)
-	flags |= adns_if_debug;
-      stringbuf_init_log (&ds->sb);
-      rc = adns_init_logfn (&ds->state, flags, conf.config_text,
-			    dns_log_cb, &ds->sb);
-      if (rc)
-	{
-	  logmsg (LOG_ERR, "can't initialize DNS state: %s", strerror (rc));
-	  stringbuf_free (&ds->sb);
-	  free (ds);
-	  ds = NULL;
-	}
-    }
-  return ds;
-}
-
-static adns_state *
-dns_get_state (void)
-{
-  struct thread_dns_state *state;
-
-  pthread_once (&dns_state_key_once, dns_state_key_create);
-  state = pthread_getspecific (dns_state_key);
-  if (!state)
-    {
-      state = dns_state_create ();
-      if (!state)
-	exit (1);
-      pthread_setspecific (dns_state_key, state);
-    }
-  return &state->state;
-}
-
 /* Table of correspondence between ADNS status codes and dns status.
    Values are increased by 1 to be able to tell whether the entry is
    initialized or not. */
@@ -305,7 +232,7 @@ cname_install (CNAME_REF_HASH *hash, unsigned *n, char const *name)
 {
   CNAME_REF *rec, *old;
 
-  rec = malloc (sizeof (*rec));
+  rec = malloc (sizeof (*rec) + strlen (name));
   if (rec == NULL)
     return errno;
   strcpy (rec->name, name);
@@ -318,153 +245,231 @@ cname_install (CNAME_REF_HASH *hash, unsigned *n, char const *name)
   return 0;
 }
 
+static int
+rr_a_conv (int i, struct dns_response *resp, adns_answer *ans)
+{
+  resp->addr[i].s_in.sin_family = AF_INET;
+  resp->addr[i].s_in.sin_port = 0;
+  resp->addr[i].s_in.sin_addr = ans->rrs.inaddr[i];
+  return 0;
+}
+
+static int
+rr_aaaa_conv (int i, struct dns_response *resp, adns_answer *ans)
+{
+  resp->addr[i].s_in6.sin6_family = AF_INET6;
+  resp->addr[i].s_in6.sin6_port = 0;
+  resp->addr[i].s_in6.sin6_addr = ans->rrs.in6addr[i];
+  return 0;
+}
+
+static int
+rr_srv_conv (int i, struct dns_response *resp, adns_answer *ans)
+{
+  resp->srv[i].priority = ans->rrs.srvraw[i].priority;
+  resp->srv[i].weight = ans->rrs.srvraw[i].weight;
+  resp->srv[i].port = ans->rrs.srvraw[i].port;
+  if ((resp->srv[i].host = xstrdup (ans->rrs.srvraw[i].host)) == NULL)
+    {
+      lognomem ();
+      return 1;
+    }
+  return 0;
+}
+
+static int
+srv_cmp (void const *a, void const *b)
+{
+  struct dns_srv const *asrv = a;
+  struct dns_srv const *bsrv = b;
+  int rc = asrv->priority - bsrv->priority;
+  if (rc == 0)
+    {
+      rc = bsrv->weight - asrv->weight;
+      if (rc == 0)
+	rc = strcasecmp (asrv->host, bsrv->host);
+    }
+  return rc;
+}
+
+
 /*
- * dns_query - look up a label NAME of RR type TYPE in the DNS.  Follow
- * CNAME chains of up to dns_max_cname_chain elements.  In other respects
- * the behavior is the same as that of adns_synchronous.
+ * Asynchronous resolver engine.
+ *
+ * All lookups are served by a single resolver thread, which owns the
+ * adns state.  Lookup requests from other threads are put on a request
+ * queue and the resolver thread is woken up via a pipe.  The thread
+ * submits queries to adns as soon as they arrive, so that any number
+ * of them are in flight simultaneously, and polls for answers.  When
+ * an answer arrives, the callback supplied with each request for that
+ * name is invoked from the resolver thread.
  *
- * FIXME: in the presence of a CNAME chain, this function does two
- * extra lookups, compared with the hypothetical libresolv implementation.
- * This is due to the specifics of libadns.
+ * Successful responses are cached until they expire.  Requests for a
+ * name that is already being looked up are attached to the pending
+ * lookup, so that backends sharing a hostname cause a single query.
  */
+
+/* Lookup kinds. */
+enum
+  {
+    DNS_KIND_A,         /* A records */
+    DNS_KIND_AAAA,      /* AAAA records */
+    DNS_KIND_ADDR,      /* Both A and AAAA */
+    DNS_KIND_SRV        /* SRV records */
+  };
+
+/* Interval between cache cleanups, in seconds. */
+#define DNS_CACHE_SWEEP_INTERVAL 60
+
+/* Maximum number of file descriptors to poll. */
+#define DNS_POLLFD_MAX 16
+
+/* Handling of an RR type. */
+struct dns_rr_def
+{
+  adns_rrtype type;     /* adns RR type. */
+  char const *name;     /* Printable name of the type. */
+  enum dns_resp_type resp_type; /* Response type. */
+  int (*conv) (int, struct dns_response *, adns_answer *);
+};
+
+static struct dns_rr_def rr_a = { adns_r_a, "A", dns_resp_addr, rr_a_conv };
+static struct dns_rr_def rr_aaaa = { adns_r_aaaa, "AAAA", dns_resp_addr,
+				     rr_aaaa_conv };
+static struct dns_rr_def rr_srv = { adns_r_srv_raw, "SRV", dns_resp_srv,
+				    rr_srv_conv };
+
+/* Lookup request. */
+struct dns_request
+{
+  DNS_CALLBACK cb;      /* Function to call when the lookup is finished. */
+  void *data;           /* Its data pointer. */
+  int kind;             /* Lookup kind. */
+  DLIST_ENTRY (dns_request) link;
+  char name[1];         /* Name to look up. */
+};
+
+typedef DLIST_HEAD (,dns_request) DNS_REQUEST_HEAD;
+
+typedef struct dns_entry DNS_ENTRY;
+
+/* A single adns query, including the eventual CNAME chain. */
+struct dns_query
+{
+  DNS_ENTRY *entry;             /* Entry this query belongs to. */
+  struct dns_rr_def *rr;        /* RR type being looked up. */
+  char *name;                   /* Name being queried. */
+  adns_query aq;                /* Pending adns query. */
+  int cname;                    /* True if aq is a CNAME query. */
+  int final;                    /* Don't follow CNAMEs any more. */
+  adns_answer *pending;         /* Answer to return if the chain breaks. */
+  CNAME_REF_HASH *cnames;       /* Names seen in the CNAME chain. */
+  unsigned cname_count;         /* Number of entries in cnames. */
+  int status;                   /* Final status. */
+  struct dns_response *resp;    /* Final response. */
+};
+
+/* Lookup cache entry. */
+struct dns_entry
+{
+  char *key;                    /* Lookup kind followed by name. */
+  char const *name;             /* Name (points into key). */
+  int kind;                     /* Lookup kind. */
+  struct dns_response *resp;    /* Cached response, if any. */
+  int npending;                 /* Number of queries in flight. */
+  struct dns_query query[2];    /* Queries. */
+  DNS_REQUEST_HEAD waiters;     /* Requests waiting for the answer. */
+};
+
+static unsigned long
+DNS_ENTRY_hash (const DNS_ENTRY *ent)
+{
+  return strhash_ci (ent->key, strlen (ent->key));
+}
+
 static int
-dns_query (const char *name, adns_rrtype type, adns_answer **ans_ret)
+DNS_ENTRY_cmp (const DNS_ENTRY *a, const DNS_ENTRY *b)
 {
-  adns_state *state = dns_get_state();
-  adns_answer *ans = NULL, *cnans = NULL;
-  int rc;
+  return strcasecmp (a->key, b->key);
+}
 
-  /*
-   * First, look up the requested RR type.  If the actual record is
-   * a CNAME pointing to the requested RR, this will be handled by
-   * adns due to adns_qf_cname_loose flag in DEFAULT_QFLAGS.
-   *
-   * If it is a CNAME pointing to a CNAME, this will result in the
-   * first extra lookup (see FIXME above).
-   */
-  rc = adns_synchronous (*state, name, type, DEFAULT_QFLAGS, &ans);
-  if (rc == 0 && ans->status == adns_s_prohibitedcname
-      && conf.max_cname_chain > 1)
+#define HT_TYPE DNS_ENTRY
+#define HT_TYPE_HASH_FN_DEFINED 1
+#define HT_TYPE_CMP_FN_DEFINED 1
+#define HT_NO_HASH_FREE
+#include "ht.h"
+
+static adns_state dns_state;
+static struct stringbuf dns_log_buf;
+static DNS_ENTRY_HASH *dns_cache;
+
+/* Request queue and means to wake up the resolver thread. */
+static DNS_REQUEST_HEAD dns_request_head =
+  DLIST_HEAD_INITIALIZER (dns_request_head);
+static pthread_mutex_t dns_request_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t dns_engine_once = PTHREAD_ONCE_INIT;
+static int dns_wakeup_fd[2] = { -1, -1 };
+
+static struct dns_response *
+dns_response_copy (struct dns_response const *src)
+{
+  struct dns_response *resp;
+  int i;
+
+  if ((resp = dns_response_alloc (src->type, src->count)) == NULL)
+    return NULL;
+  resp->expires = src->expires;
+  switch (src->type)
     {
-      CNAME_REF_HASH *hash = CNAME_REF_HASH_NEW ();
-      unsigned cname_count = 0;
+    case dns_resp_addr:
+      memcpy (resp->addr, src->addr, src->count * sizeof (src->addr[0]));
+      break;
 
-      /* Record the queried name, first. */
-      if ((rc = cname_install (hash, &cname_count, name)) == 0)
+    case dns_resp_srv:
+      for (i = 0; i < src->count; i++)
 	{
-	  /* Follow the CNAME chain. */
-	  while (cname_count - 1 <= conf.max_cname_chain)
+	  resp->srv[i] = src->srv[i];
+	  if ((resp->srv[i].host = strdup (src->srv[i].host)) == NULL)
 	    {
-	      if ((rc = adns_synchronous (*state, name, adns_r_cname,
-					  DEFAULT_QFLAGS, &cnans)))
-		break;
-	      if (cnans->status == adns_s_ok)
-		{
-		  /*
-		   * CNAME found. Record it and continue.
-		   */
-		  rc = cname_install (hash, &cname_count, cnans->rrs.str[0]);
-		  free (cnans);
-		  if (rc)
-		    {
-		      if (rc == EEXIST)
-			/*
-			 * Loop detected.  The returned ans retains the
-			 * adns_s_prohibitedcname status.
-			 */
-			rc = 0;
-		      break;
-		    }
-		}
-	      else if (cnans->status == adns_s_nodata)
-		{
-		  /*
-		   * RR found, but has a different type.
-		   * Look up the requested type using the last
-		   * recorded name.  This accounts for second
-		   * extra lookup.
-		   */
-		  free (cnans);
-		  rc = adns_synchronous (*state, name, type, DEFAULT_QFLAGS, &ans);
-		  break;
-		}
-	      else
-		{
-		  /*
-		   * Another error.  Replace original answer with
-		   * the last one.
-		   */
-		  free (ans);
-		  ans = cnans;
-		  break;
-		}
+	      resp->count = i;
+	      dns_response_free (resp);
+	      return NULL;
 	    }
-	  CNAME_REF_HASH_FREE (hash);
 	}
+      break;
+
+    case dns_resp_none:
+      break;
     }
-  if (rc == 0)
-    *ans_ret = ans;
-  else
-    free (ans);
-  return adns_to_dns_status (rc);
+  return resp;
 }
 
+/*
+ * Convert adns answer ANS to a dns_response, according to the RR
+ * definition.  Return dns status.
+ */
 static int
-dns_generic_lookup (char const *name, adns_rrtype rrtype, char const *rrname,
-		    int (*conv) (int, struct dns_response *, adns_answer *),
+dns_answer_convert (char const *name, struct dns_rr_def *rr, adns_answer *ans,
 		    struct dns_response **presp)
 {
-  adns_answer *ans = NULL;
-  int err, rc;
+  int rc;
   struct dns_response *resp;
-  enum dns_resp_type resp_type;
 
-  switch (rrtype)
-    {
-    case adns_r_a:
-    case adns_r_aaaa:
-      resp_type = dns_resp_addr;
-      break;
-
-    case adns_r_srv_raw:
-      resp_type = dns_resp_srv;
-      break;
-
-    default:
-      abort ();
-    }
-
-  err = dns_query (name, rrtype, &ans);
-  if (err != 0)
-    {
-      rc = errno_to_dns_status (err);
-      if (rc != dns_not_found)
-	logmsg (LOG_ERR, "Querying for %s records of %s: %s",
-		rrname,
-		name,
-		strerror (err));
-      return rc;
-    }
   if (ans->status != adns_s_ok)
     {
       rc = adns_to_dns_status (ans->status);
       if (rc != dns_not_found)
 	logmsg (LOG_ERR, "Querying for %s records of %s: %s",
-		rrname,
+		rr->name,
 		name,
 		adns_strerror (ans->status));
-
-      free (ans);
       return rc;
     }
   if (ans->nrrs == 0)
-    {
-      free (ans);
-      return dns_not_found;
-    }
+    return dns_not_found;
 
   rc = dns_success;
-  resp = dns_response_alloc (resp_type, ans->nrrs);
+  resp = dns_response_alloc (rr->resp_type, ans->nrrs);
   if (!resp)
     {
       lognomem ();
@@ -477,7 +482,7 @@ dns_generic_lookup (char const *name, adns_rrtype rrtype, char const *rrname,
       resp->expires = ans->expires;
       for (i = 0; i < ans->nrrs; i++)
 	{
-	  if (conv (i, resp, ans))
+	  if (rr->conv (i, resp, ans))
 	    {
 	      resp->count = i;
 	      dns_response_free (resp);
@@ -487,96 +492,196 @@ dns_generic_lookup (char const *name, adns_rrtype rrtype, char const *rrname,
 	    }
 	}
     }
-  free (ans);
   *presp = resp;
   return rc;
 }
 
-static int
-rr_a_conv (int i, struct dns_response *resp, adns_answer *ans)
+static void dns_entry_query_done (DNS_ENTRY *ent);
+
+/* Finish query Q with status RC and response RESP. */
+static void
+dns_query_finish (struct dns_query *q, int rc, struct dns_response *resp)
 {
-  resp->addr[i].s_in.sin_family = AF_INET;
-  resp->addr[i].s_in.sin_port = 0;
-  resp->addr[i].s_in.sin_addr = ans->rrs.inaddr[i];
-  return 0;
+  q->status = rc;
+  q->resp = resp;
+  free (q->pending);
+  q->pending = NULL;
+  if (q->cnames)
+    {
+      CNAME_REF_HASH_FREE (q->cnames);
+      q->cnames = NULL;
+    }
+  free (q->name);
+  q->name = NULL;
+  dns_entry_query_done (q->entry);
 }
 
-static int
-rr_aaaa_conv (int i, struct dns_response *resp, adns_answer *ans)
+/* Finish query Q using adns answer ANS. */
+static void
+dns_query_finish_answer (struct dns_query *q, adns_answer *ans)
 {
-  resp->addr[i].s_in6.sin6_family = AF_INET6;
-  resp->addr[i].s_in6.sin6_port = 0;
-  resp->addr[i].s_in6.sin6_addr = ans->rrs.in6addr[i];
-  return 0;
+  struct dns_response *resp = NULL;
+  int rc = dns_answer_convert (q->entry->name, q->rr, ans, &resp);
+  free (ans);
+  dns_query_finish (q, rc, resp);
 }
 
-static int
-dns_generic_addr_lookup (char const *name, int family,
-			 struct dns_response **presp)
+/* Submit query Q for name Q->name.  Look up CNAME if CNAME is true. */
+static void
+dns_query_submit (struct dns_query *q, int cname)
 {
-  int rr_type;
-  char const *rr_name;
-  int (*rr_conv) (int, struct dns_response *, adns_answer *);
+  int rc;
 
-  switch (family)
+  q->cname = cname;
+  rc = adns_submit (dns_state, q->name, cname ? adns_r_cname : q->rr->type,
+		    DEFAULT_QFLAGS, q, &q->aq);
+  if (rc)
     {
-    case AF_INET:
-      rr_type = adns_r_a;
-      rr_name = "A";
-      rr_conv = rr_a_conv;
-      break;
-
-    case AF_INET6:
-      rr_type = adns_r_aaaa;
-      rr_name = "AAAA";
-      rr_conv = rr_aaaa_conv;
-      break;
-
-    default:
-      abort (); // FIXME
+      logmsg (LOG_ERR, "Querying for %s records of %s: %s",
+	      cname ? "CNAME" : q->rr->name,
+	      q->name, strerror (rc));
+      if (q->pending)
+	{
+	  /* Break the CNAME chain and return the last answer. */
+	  adns_answer *ans = q->pending;
+	  q->pending = NULL;
+	  dns_query_finish_answer (q, ans);
+	}
+      else
+	dns_query_finish (q, errno_to_dns_status (rc), NULL);
     }
+}
 
-  return dns_generic_lookup (name, rr_type, rr_name, rr_conv, presp);
+static void
+dns_query_start (struct dns_query *q, DNS_ENTRY *ent, struct dns_rr_def *rr)
+{
+  memset (q, 0, sizeof (*q));
+  q->entry = ent;
+  q->rr = rr;
+  if ((q->name = strdup (ent->name)) == NULL)
+    {
+      lognomem ();
+      dns_query_finish (q, dns_failure, NULL);
+    }
+  else
+    dns_query_submit (q, 0);
 }
 
-int
-dns_addr_lookup (char const *name, int family, struct dns_response **presp)
+/*
+ * Process adns answer ANS to the query Q.
+ *
+ * A CNAME pointing to the requested RR is handled by adns itself, due
+ * to adns_qf_cname_loose in DEFAULT_QFLAGS.  A longer chain results in
+ * adns_s_prohibitedcname.  In that case, look up the CNAME record and
+ * retry the query with its target, until the chain ends, a loop is
+ * detected or the chain becomes longer than max_cname_chain.
+ */
+static void
+dns_query_answer (struct dns_query *q, adns_answer *ans)
 {
   int rc;
-  struct dns_response *r4 = NULL, *r6 = NULL;
 
-  switch (family)
+  q->aq = NULL;
+  if (!q->cname)
     {
-    case AF_INET:
-    case AF_INET6:
-      return dns_generic_addr_lookup (name, family, presp);
-
-    case AF_UNSPEC:
-      break;
-
-    default:
-      abort();
+      if (ans->status == adns_s_prohibitedcname
+	  && conf.max_cname_chain > 1 && !q->final)
+	{
+	  if (q->cnames == NULL)
+	    {
+	      /* Record the queried name, first. */
+	      if ((q->cnames = CNAME_REF_HASH_NEW ()) == NULL
+		  || cname_install (q->cnames, &q->cname_count, q->name))
+		{
+		  lognomem ();
+		  dns_query_finish_answer (q, ans);
+		  return;
+		}
+	    }
+	  if (q->cname_count - 1 <= conf.max_cname_chain)
+	    {
+	      free (q->pending);
+	      q->pending = ans;
+	      dns_query_submit (q, 1);
+	      return;
+	    }
+	}
+      dns_query_finish_answer (q, ans);
+      return;
     }
 
-  rc = dns_generic_addr_lookup (name, AF_INET, &r4);
-  switch (dns_generic_addr_lookup (name, AF_INET6, &r6))
+  /* Answer to the CNAME query. */
+  switch (ans->status)
     {
-    case dns_success:
-      rc = 0;
+    case adns_s_ok:
+      /* CNAME found. Record it and continue with its target. */
+      rc = cname_install (q->cnames, &q->cname_count, ans->rrs.str[0]);
+      if (rc == 0)
+	{
+	  char *name = strdup (ans->rrs.str[0]);
+	  if (name)
+	    {
+	      free (ans);
+	      free (q->name);
+	      q->name = name;
+	      dns_query_submit (q, 0);
+	      return;
+	    }
+	  rc = ENOMEM;
+	}
+      free (ans);
+      if (rc == EEXIST)
+	{
+	  /*
+	   * Loop detected.  Return the last answer, which retains the
+	   * adns_s_prohibitedcname status.
+	   */
+	  ans = q->pending;
+	  q->pending = NULL;
+	  dns_query_finish_answer (q, ans);
+	}
+      else
+	{
+	  lognomem ();
+	  dns_query_finish (q, dns_failure, NULL);
+	}
       break;
 
-    case dns_not_found:
-      if (rc != dns_success)
-	return dns_not_found;
+    case adns_s_nodata:
+      /*
+       * RR found, but has a different type.  Look up the requested
+       * type once more, without following CNAMEs.
+       */
+      free (ans);
+      q->final = 1;
+      dns_query_submit (q, 0);
       break;
 
-    case dns_temp_failure:
-      if (rc != dns_success)
-	return rc;
+    default:
+      /* Another error.  Return this answer. */
+      dns_query_finish_answer (q, ans);
+    }
+}
+
+/*
+ * Combine results of the A and AAAA lookups into a single response.
+ * The lookup succeeds if any of the two succeeded.
+ */
+static int
+dns_addr_merge (DNS_ENTRY *ent, struct dns_response **presp)
+{
+  struct dns_query *q4 = &ent->query[0], *q6 = &ent->query[1];
+  struct dns_response *r4 = q4->resp, *r6 = q6->resp;
+  int rc4 = q4->status, rc6 = q6->status;
 
-    case dns_failure:
-      if (rc != dns_success)
-	return dns_failure;
+  q4->resp = q6->resp = NULL;
+  if (rc4 != dns_success && rc6 != dns_success)
+    {
+      if (rc4 == dns_temp_failure || rc6 == dns_temp_failure)
+	return dns_temp_failure;
+      if (rc4 == dns_not_found || rc6 == dns_not_found)
+	return dns_not_found;
+      return dns_failure;
     }
 
   if (r4 == NULL)
@@ -596,56 +701,362 @@ dns_addr_lookup (char const *name, int family, struct dns_response **presp)
 	    resp->addr[i] = r4->addr[j];
 	  for (j = 0; j < r6->count; i++, j++)
 	    resp->addr[i] = r6->addr[j];
-
-	  *presp = resp;
 	}
-      else
-	rc = dns_failure;
-
       dns_response_free (r4);
       dns_response_free (r6);
+      if (!resp)
+	{
+	  lognomem ();
+	  return dns_failure;
+	}
+      *presp = resp;
     }
-  return rc;
+  return dns_success;
 }
-
-static int
-rr_srv_conv (int i, struct dns_response *resp, adns_answer *ans)
+
+/* Deliver status RC and response RESP to the request REQ and free it. */
+static void
+dns_request_complete (struct dns_request *req, int rc,
+		      struct dns_response const *resp)
 {
-  resp->srv[i].priority = ans->rrs.srvraw[i].priority;
-  resp->srv[i].weight = ans->rrs.srvraw[i].weight;
-  resp->srv[i].port = ans->rrs.srvraw[i].port;
-  if ((resp->srv[i].host = xstrdup (ans->rrs.srvraw[i].host)) == NULL)
+  struct dns_response *copy = NULL;
+
+  if (rc == dns_success && (copy = dns_response_copy (resp)) == NULL)
     {
       lognomem ();
-      return 1;
+      rc = dns_failure;
     }
-  return 0;
+  req->cb (rc, copy, req->data);
+  free (req);
 }
 
-static int
-srv_cmp (void const *a, void const *b)
+/*
+ * Called when one of the entry queries is finished.  When all of them
+ * are, compute the result, cache it and notify all waiting requests.
+ */
+static void
+dns_entry_query_done (DNS_ENTRY *ent)
 {
-  struct dns_srv const *asrv = a;
-  struct dns_srv const *bsrv = b;
-  int rc = asrv->priority - bsrv->priority;
-  if (rc == 0)
+  struct dns_response *resp = NULL;
+  struct dns_request *req;
+  int rc;
+
+  if (--ent->npending > 0)
+    return;
+
+  if (ent->kind == DNS_KIND_ADDR)
+    rc = dns_addr_merge (ent, &resp);
+  else
     {
-      rc = bsrv->weight - asrv->weight;
-      if (rc == 0)
-	rc = strcasecmp (asrv->host, bsrv->host);
+      rc = ent->query[0].status;
+      resp = ent->query[0].resp;
+      ent->query[0].resp = NULL;
+      if (rc == dns_success && ent->kind == DNS_KIND_SRV)
+	qsort (resp->srv, resp->count, sizeof (resp->srv[0]), srv_cmp);
+    }
+
+  if (ent->resp)
+    dns_response_free (ent->resp);
+  ent->resp = rc == dns_success ? resp : NULL;
+
+  while ((req = DLIST_FIRST (&ent->waiters)) != NULL)
+    {
+      DLIST_SHIFT (&ent->waiters, link);
+      dns_request_complete (req, rc, resp);
     }
-  return rc;
 }
 
-int
-dns_srv_lookup (char const *name, struct dns_response **presp)
+static DNS_ENTRY *
+dns_entry_lookup (int kind, char const *name)
 {
-  struct dns_response *resp;
-  int rc = dns_generic_lookup (name, adns_r_srv_raw, "SRV", rr_srv_conv, &resp);
-  if (rc == dns_success)
+  DNS_ENTRY key, *ent;
+  size_t len = strlen (name);
+
+  if ((key.key = malloc (len + 3)) == NULL)
+    return NULL;
+  key.key[0] = '0' + kind;
+  key.key[1] = ':';
+  memcpy (key.key + 2, name, len + 1);
+
+  if ((ent = DNS_ENTRY_RETRIEVE (dns_cache, &key)) != NULL)
+    free (key.key);
+  else if ((ent = calloc (1, sizeof (*ent))) == NULL)
+    free (key.key);
+  else
     {
-      qsort (resp->srv, resp->count, sizeof (resp->srv[0]), srv_cmp);
-      *presp = resp;
+      ent->key = key.key;
+      ent->name = key.key + 2;
+      ent->kind = kind;
+      DLIST_INIT (&ent->waiters);
+      DNS_ENTRY_INSERT (dns_cache, ent);
     }
-  return rc;
+  return ent;
+}
+
+/* Start processing the request REQ. */
+static void
+dns_request_start (struct dns_request *req, time_t now)
+{
+  DNS_ENTRY *ent;
+
+  if ((ent = dns_entry_lookup (req->kind, req->name)) == NULL)
+    {
+      lognomem ();
+      req->cb (dns_failure, NULL, req->data);
+      free (req);
+      return;
+    }
+
+  if (ent->resp && ent->resp->expires > now)
+    {
+      /* Cache hit. */
+      dns_request_complete (req, dns_success, ent->resp);
+      return;
+    }
+
+  DLIST_INSERT_TAIL (&ent->waiters, req, link);
+  if (ent->npending > 0)
+    /* Lookup already in progress. */
+    return;
+
+  switch (ent->kind)
+    {
+    case DNS_KIND_A:
+      ent->npending = 1;
+      dns_query_start (&ent->query[0], ent, &rr_a);
+      break;
+
+    case DNS_KIND_AAAA:
+      ent->npending = 1;
+      dns_query_start (&ent->query[0], ent, &rr_aaaa);
+      break;
+
+    case DNS_KIND_ADDR:
+      /*
+       * Account for both queries before starting any of them, so that
+       * an immediate failure of the first one doesn't finish the entry.
+       */
+      ent->npending = 2;
+      dns_query_start (&ent->query[0], ent, &rr_a);
+      dns_query_start (&ent->query[1], ent, &rr_aaaa);
+      break;
+
+    case DNS_KIND_SRV:
+      ent->npending = 1;
+      dns_query_start (&ent->query[0], ent, &rr_srv);
+      break;
+
+    default:
+      abort ();
+    }
+}
+
+/*
+ * Remove the cache entry ENT if it has expired and has no lookups in
+ * progress.
+ */
+static void
+dns_cache_sweep_entry (DNS_ENTRY *ent, void *data)
+{
+  time_t now = *(time_t*)data;
+
+  if (ent->npending == 0
+      && (ent->resp == NULL || ent->resp->expires <= now))
+    {
+      DNS_ENTRY_DELETE (dns_cache, ent);
+      if (ent->resp)
+	dns_response_free (ent->resp);
+      free (ent->key);
+      free (ent);
+    }
+}
+
+static void
+dns_cache_sweep (time_t now)
+{
+  DNS_ENTRY_FOREACH_SAFE (dns_cache, dns_cache_sweep_entry, &now);
+}
+
+static void
+dns_wakeup (void)
+{
+  static char c;
+  /* Ignore EAGAIN: the pipe being full means a wakeup is pending. */
+  if (write (dns_wakeup_fd[1], &c, 1) == -1 && errno != EAGAIN)
+    logmsg (LOG_ERR, "resolver wakeup: %s", strerror (errno));
+}
+
+static void
+dns_wakeup_drain (void)
+{
+  char buf[64];
+  while (read (dns_wakeup_fd[0], buf, sizeof (buf)) > 0)
+    ;
+}
+
+static void *
+thr_dns_engine (void *arg)
+{
+  time_t sweep_time = 0;
+
+  for (;;)
+    {
+      DNS_REQUEST_HEAD head;
+      struct dns_request *req;
+      struct pollfd fds[DNS_POLLFD_MAX];
+      int nfds, timeout, rc;
+      struct timeval now;
+      adns_query aq;
+      adns_answer *ans;
+      void *ctx;
+
+      /* Fetch pending requests and submit them. */
+      pthread_mutex_lock (&dns_request_mutex);
+      head = dns_request_head;
+      DLIST_INIT (&dns_request_head);
+      pthread_mutex_unlock (&dns_request_mutex);
+
+      gettimeofday (&now, NULL);
+      while ((req = DLIST_FIRST (&head)) != NULL)
+	{
+	  DLIST_SHIFT (&head, link);
+	  dns_request_start (req, now.tv_sec);
+	}
+
+      if (now.tv_sec >= sweep_time)
+	{
+	  dns_cache_sweep (now.tv_sec);
+	  sweep_time = now.tv_sec + DNS_CACHE_SWEEP_INTERVAL;
+	}
+
+      /* Wait for answers or new requests. */
+      fds[0].fd = dns_wakeup_fd[0];
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+      nfds = DNS_POLLFD_MAX - 1;
+      timeout = (sweep_time - now.tv_sec) * 1000;
+      rc = adns_beforepoll (dns_state, fds + 1, &nfds, &timeout, &now);
+      if (rc)
+	{
+	  logmsg (LOG_ERR, "adns_beforepoll: %s", strerror (rc));
+	  nfds = 0;
+	}
+
+      if (poll (fds, nfds + 1, timeout) == -1)
+	{
+	  if (errno != EINTR)
+	    logmsg (LOG_ERR, "resolver: poll: %s", strerror (errno));
+	  continue;
+	}
+
+      if (fds[0].revents & POLLIN)
+	dns_wakeup_drain ();
+
+      gettimeofday (&now, NULL);
+      adns_afterpoll (dns_state, fds + 1, nfds, &now);
+
+      /* Process all answers that have arrived. */
+      for (;;)
+	{
+	  aq = NULL;
+	  if (adns_check (dns_state, &aq, &ans, &ctx))
+	    break;
+	  dns_query_answer (ctx, ans);
+	}
+    }
+  return NULL;
+}
+
+static void
+dns_engine_init (void)
+{
+  int flags = adns_if_nosigpipe;
+  int rc;
+  pthread_t tid;
+
+  if (conf.debug)
+    flags |= adns_if_debug;
+  stringbuf_init_log (&dns_log_buf);
+  rc = adns_init_logfn (&dns_state, flags, conf.config_text,
+			dns_log_cb, &dns_log_buf);
+  if (rc)
+    {
+      logmsg (LOG_ERR, "can't initialize DNS state: %s", strerror (rc));
+      exit (1);
+    }
+
+  if ((dns_cache = DNS_ENTRY_HASH_NEW ()) == NULL)
+    xnomem ();
+
+  if (pipe (dns_wakeup_fd))
+    {
+      logmsg (LOG_ERR, "can't create resolver pipe: %s", strerror (errno));
+      exit (1);
+    }
+  fcntl (dns_wakeup_fd[0], F_SETFL, O_NONBLOCK);
+  fcntl (dns_wakeup_fd[1], F_SETFL, O_NONBLOCK);
+
+  if ((rc = pthread_create (&tid, &thread_attr_detached, thr_dns_engine,
+			    NULL)) != 0)
+    {
+      logmsg (LOG_ERR, "can't create resolver thread: %s", strerror (rc));
+      exit (1);
+    }
+}
+
+static void
+dns_lookup_async (int kind, char const *name, DNS_CALLBACK cb, void *data)
+{
+  struct dns_request *req;
+  size_t len = strlen (name);
+
+  pthread_once (&dns_engine_once, dns_engine_init);
+
+  if ((req = malloc (sizeof (*req) + len)) == NULL)
+    {
+      lognomem ();
+      cb (dns_failure, NULL, data);
+      return;
+    }
+  req->cb = cb;
+  req->data = data;
+  req->kind = kind;
+  memcpy (req->name, name, len + 1);
+
+  pthread_mutex_lock (&dns_request_mutex);
+  DLIST_INSERT_TAIL (&dns_request_head, req, link);
+  pthread_mutex_unlock (&dns_request_mutex);
+  dns_wakeup ();
+}
+
+void
+dns_addr_lookup_async (char const *name, int family, DNS_CALLBACK cb,
+		       void *data)
+{
+  int kind;
+
+  switch (family)
+    {
+    case AF_INET:
+      kind = DNS_KIND_A;
+      break;
+
+    case AF_INET6:
+      kind = DNS_KIND_AAAA;
+      break;
+
+    case AF_UNSPEC:
+      kind = DNS_KIND_ADDR;
+      break;
+
+    default:
+      abort ();
+    }
+  dns_lookup_async (kind, name, cb, data);
+}
+
+void
+dns_srv_lookup_async (char const *name, DNS_CALLBACK cb, void *data)
+{
+  dns_lookup_async (DNS_KIND_SRV, name, cb, data);
 }
@@ -67,9 +67,17 @@ struct dns_response
   };
 };
 
-int dns_lookup (char const *name, int family, struct dns_response **presp);
-int dns_addr_lookup (char const *name, int family, struct dns_response **presp);
-int dns_srv_lookup (char const *name, struct dns_response **presp);
+/*
+ * Callback invoked when an asynchronous lookup is finished.  If STATUS
+ * is dns_success, RESP is the response, which the callee is responsible
+ * for freeing.  Otherwise, RESP is NULL.
+ */
+typedef void (*DNS_CALLBACK) (int status, struct dns_response *resp,
+			      void *data);
+
+void dns_addr_lookup_async (char const *name, int family, DNS_CALLBACK cb,
+			    void *data);
+void dns_srv_lookup_async (char const *name, DNS_CALLBACK cb, void *data);
 void dns_response_free (struct dns_response *resp);
 void resolver_set_config (struct resolver_config *);
 void get_negative_expire_time (struct timespec *ts, BACKEND *be);
@@ -27,16 +27,52 @@ static void init_rsa (void);
 static void do_RSAgen (enum job_ctl, void *, const struct timespec *);
 #endif
 
-/* Periodic jobs */
+/*
+ * Periodic jobs
+ *
+ * Pending jobs are kept in a binary min-heap ordered by their due time,
+ * so that arming a job and removing it from the queue are O(log n).
+ * Each job also lives in a hash table indexed by its ID, which makes
+ * lookups in job_cancel and job_get_timestamp O(1).
+ *
+ * The timer thread moves jobs that become due to the run queue, which is
+ * served by a small pool of job runner threads.  Runner threads are
+ * created on demand, up to JOB_RUNNER_MAX of them, and terminate after
+ * being idle for JOB_RUNNER_IDLE_TIMEOUT seconds.  This way, a job that
+ * takes long to complete (e.g. a DNS lookup) doesn't delay other jobs.
+ */
+#define JOB_RUNNER_MAX 8
+#define JOB_RUNNER_IDLE_TIMEOUT 60
+
 typedef struct job
 {
   JOB_ID id;
   struct timespec ts;
   JOB_FUNC func;
   void *data;
-  DLIST_ENTRY (job) link;
+  size_t index;                 /* Index of this job in job_heap. */
+  DLIST_ENTRY (job) link;       /* Link in the run queue. */
 } JOB;
 
+static unsigned long
+JOB_hash (const JOB *job)
+{
+  return job->id;
+}
+
+static int
+JOB_cmp (const JOB *a, const JOB *b)
+{
+  return a->id != b->id;
+}
+
+#define HT_TYPE JOB
+#define HT_TYPE_HASH_FN_DEFINED 1
+#define HT_TYPE_CMP_FN_DEFINED 1
+#define HT_NO_HASH_FREE
+#define HT_NO_FOREACH
+#include "ht.h"
+
 typedef DLIST_HEAD (,job) JOB_HEAD;
 
 typedef struct jobcancel
@@ -47,7 +83,20 @@ typedef struct jobcancel
 
 typedef DLIST_HEAD (,jobcancel) JOBCNCL_HEAD;
 
-static JOB_HEAD job_head = DLIST_HEAD_INITIALIZER (job_head);
+/* Heap of pending jobs. */
+static JOB **job_heap;
+static size_t job_heap_count;
+static size_t job_heap_max;
+/* Pending jobs indexed by ID. */
+static JOB_HASH *job_hash;
+
+/* Run queue: jobs that are due and wait for a runner thread. */
+static JOB_HEAD job_run_queue = DLIST_HEAD_INITIALIZER (job_run_queue);
+static size_t job_run_count;    /* Number of jobs in the run queue. */
+static unsigned job_runner_count; /* Number of runner threads. */
+static unsigned job_runner_idle;  /* Number of idle runner threads. */
+static pthread_cond_t job_run_cond = PTHREAD_COND_INITIALIZER;
+
 static JOBCNCL_HEAD jobcncl_head = SLIST_HEAD_INITIALIZER (jobcncl_head);
 static JOB_ID job_next_id;
 static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
@@ -59,6 +108,8 @@ static void
 job_mutex_init (void)
 {
   pthread_mutex_init (&_job_mutex, &mutex_attr_recursive);
+  if ((job_hash = JOB_HASH_NEW ()) == NULL)
+    xnomem ();
 }
 
 static pthread_mutex_t *
@@ -68,6 +119,86 @@ job_mutex (void)
   return &_job_mutex;
 }
 
+/*
+ * Return true if job A must be run before job B.  Jobs with the same
+ * due time are run in the order of their arming.
+ */
+static inline int
+job_before (JOB const *a, JOB const *b)
+{
+  int rc = timespec_cmp (&a->ts, &b->ts);
+  return rc < 0 || (rc == 0 && a->id < b->id);
+}
+
+static inline void
+job_heap_set (size_t i, JOB *job)
+{
+  job_heap[i] = job;
+  job->index = i;
+}
+
+static void
+job_heap_sift_up (size_t i)
+{
+  JOB *job = job_heap[i];
+
+  while (i > 0)
+    {
+      size_t parent = (i - 1) / 2;
+      if (!job_before (job, job_heap[parent]))
+	break;
+      job_heap_set (i, job_heap[parent]);
+      i = parent;
+    }
+  job_heap_set (i, job);
+}
+
+static void
+job_heap_sift_down (size_t i)
+{
+  JOB *job = job_heap[i];
+
+  for (;;)
+    {
+      size_t child = 2 * i + 1;
+
+      if (child >= job_heap_count)
+	break;
+      if (child + 1 < job_heap_count
+	  && job_before (job_heap[child + 1], job_heap[child]))
+	child++;
+      if (!job_before (job_heap[child], job))
+	break;
+      job_heap_set (i, job_heap[child]);
+      i = child;
+    }
+  job_heap_set (i, job);
+}
+
+static void
+job_heap_insert (JOB *job)
+{
+  if (job_heap_count == job_heap_max)
+    job_heap = x2nrealloc (job_heap, &job_heap_max, sizeof (job_heap[0]));
+  job_heap_set (job_heap_count++, job);
+  job_heap_sift_up (job->index);
+}
+
+static void
+job_heap_remove (JOB *job)
+{
+  size_t i = job->index;
+
+  if (--job_heap_count > i)
+    {
+      job_heap_set (i, job_heap[job_heap_count]);
+      if (i > 0 && job_before (job_heap[i], job_heap[(i - 1) / 2]))
+	job_heap_sift_up (i);
+      else
+	job_heap_sift_down (i);
+    }
+}
+
 static JOB *
 job_alloc (struct timespec const *ts, JOB_FUNC func, void *data)
 {
@@ -83,23 +214,13 @@ job_alloc (struct timespec const *ts, JOB_FUNC func, void *data)
 static JOB_ID
 job_arm_unlocked (JOB *job)
 {
-  JOB *t;
   JOB_ID jid = job_next_id++;
-  
-  job->id = jid;
-  
-  DLIST_FOREACH (t, &job_head, link)
-    {
-      if (timespec_cmp (&job->ts, &t->ts) < 0)
-	break;
-    }
 
-  if (t == NULL)
-    DLIST_INSERT_TAIL (&job_head, job, link);
-  else
-    DLIST_INSERT_BEFORE (&job_head, t, job, link);
+  job->id = jid;
+  JOB_INSERT (job_hash, job);
+  job_heap_insert (job);
 
-  if (DLIST_PREV (job, link) == NULL)
+  if (job->index == 0)
     pthread_cond_broadcast (&job_cond);
 
   return jid;
@@ -141,21 +262,26 @@ job_enqueue_after (unsigned t, JOB_FUNC func, void *data)
   return jid;
 }
 
+static JOB *
+job_lookup (JOB_ID jid)
+{
+  JOB key;
+  key.id = jid;
+  return JOB_RETRIEVE (job_hash, &key);
+}
+
 static void
 job_remove (JOB_ID jid)
 {
-  JOB *job, *tmp;
-  DLIST_FOREACH_SAFE (job, tmp, &job_head, link)
+  JOB *job = job_lookup (jid);
+  if (job)
     {
-      if (job->id == jid)
-	{
-	  struct timespec ts;
-	  clock_gettime (CLOCK_REALTIME, &ts);
-	  job->func (job_ctl_cancel, job->data, &ts);
-	  DLIST_REMOVE (&job_head, job, link);
-	  free (job);
-	  break;
-	}
+      struct timespec ts;
+      clock_gettime (CLOCK_REALTIME, &ts);
+      job->func (job_ctl_cancel, job->data, &ts);
+      JOB_DELETE (job_hash, job);
+      job_heap_remove (job);
+      free (job);
     }
 }
 
@@ -165,14 +291,10 @@ job_get_timestamp (JOB_ID jid, struct timespec *ts)
   int rc = 1;
   JOB *job;
   pthread_mutex_lock (job_mutex ());
-  DLIST_FOREACH (job, &job_head, link)
+  if ((job = job_lookup (jid)) != NULL)
     {
-      if (job->id == jid)
-	{
-	  *ts = job->ts;
-	  rc = 0;
-	  break;
-	}
+      *ts = job->ts;
+      rc = 0;
     }
   pthread_mutex_unlock (job_mutex ());
   return rc;
@@ -196,13 +318,99 @@ timer_cleanup (void *ptr)
   pthread_mutex_unlock (job_mutex ());
 }
 
-void *
+/*
+ * Job runner thread: run jobs from the run queue until it stays empty
+ * for JOB_RUNNER_IDLE_TIMEOUT seconds.
+ */
+static void *
 thr_job_runner (void *arg)
 {
-  JOB *job = arg;
-  job->func (job_ctl_run, job->data, &job->ts);
-  free (job);
-  return NULL;
+  pthread_mutex_lock (job_mutex ());
+  /* The thread was accounted as idle when created. */
+  job_runner_idle--;
+  for (;;)
+    {
+      JOB *job;
+
+      while ((job = DLIST_FIRST (&job_run_queue)) == NULL)
+	{
+	  struct timespec ts;
+	  int rc;
+
+	  clock_gettime (CLOCK_REALTIME, &ts);
+	  ts.tv_sec += JOB_RUNNER_IDLE_TIMEOUT;
+	  job_runner_idle++;
+	  rc = pthread_cond_timedwait (&job_run_cond, job_mutex (), &ts);
+	  job_runner_idle--;
+	  if (rc == ETIMEDOUT && DLIST_EMPTY (&job_run_queue))
+	    {
+	      job_runner_count--;
+	      pthread_mutex_unlock (job_mutex ());
+	      return NULL;
+	    }
+	}
+      DLIST_SHIFT (&job_run_queue, link);
+      job_run_count--;
+      pthread_mutex_unlock (job_mutex ());
+
+      job->func (job_ctl_run, job->data, &job->ts);
+      free (job);
+
+      pthread_mutex_lock (job_mutex ());
+    }
+}
+
+/*
+ * Move all jobs that are due by NOW from the heap to the run queue and
+ * make sure there are runner threads to serve them.
+ */
+static void
+job_dispatch (struct timespec const *now)
+{
+  while (job_heap_count > 0 && timespec_cmp (&job_heap[0]->ts, now) <= 0)
+    {
+      JOB *job = job_heap[0];
+      JOB_DELETE (job_hash, job);
+      job_heap_remove (job);
+      DLIST_PUSH (&job_run_queue, job, link);
+      job_run_count++;
+    }
+
+  while (job_run_count > job_runner_idle
+	 && job_runner_count < JOB_RUNNER_MAX)
+    {
+      pthread_t tid;
+      int rc;
+
+      if ((rc = pthread_create (&tid, &thread_attr_detached,
+				thr_job_runner, NULL)) != 0)
+	{
+	  logmsg (LOG_ERR, "can't create job runner thread: %s",
+		  strerror (rc));
+	  break;
+	}
+      job_runner_count++;
+      job_runner_idle++;
+    }
+
+  if (job_runner_count == 0)
+    {
+      /*
+       * Last resort: no runner thread could be created.  Run the jobs
+       * in the timer thread.
+       */
+      JOB *job;
+
+      while ((job = DLIST_FIRST (&job_run_queue)) != NULL)
+	{
+	  DLIST_SHIFT (&job_run_queue, link);
+	  job_run_count--;
+	  job->func (job_ctl_run, job->data, &job->ts);
+	  free (job);
+	}
+    }
+  else
+    pthread_cond_broadcast (&job_run_cond);
 }
 
 /*
@@ -223,7 +431,7 @@ thr_timer (void *arg)
   for (;;)
     {
       int rc;
-      JOB *job;
+      struct timespec now, ts;
 
       while (!DLIST_EMPTY (&jobcncl_head))
 	{
@@ -233,62 +441,91 @@ thr_timer (void *arg)
 	  free (jc);
 	}
       
-      if (DLIST_EMPTY (&job_head))
+      if (job_heap_count == 0)
 	{
 	  pthread_cond_wait (&job_cond, job_mutex ());
 	  continue;
 	}
 
-      job = DLIST_FIRST (&job_head);
-
-      rc = pthread_cond_timedwait (&job_cond, job_mutex (), &job->ts);
-      if (rc == 0)
+      clock_gettime (CLOCK_REALTIME, &now);
+      if (timespec_cmp (&job_heap[0]->ts, &now) <= 0)
 	{
+	  job_dispatch (&now);
 	  continue;
 	}
-      else if (rc == ETIMEDOUT)
-	{	  
-	  if (job != DLIST_FIRST (&job_head))
-	    /* Job was removed or its time changed */
-	    continue;
-	  else
-	    {
-	      pthread_t tid;
-	      DLIST_SHIFT (&job_head, link);
-	      pthread_create (&tid, &thread_attr_detached, thr_job_runner,
-			      job);
-	    }
-	}
-      else
+
+      ts = job_heap[0]->ts;
+      rc = pthread_cond_timedwait (&job_cond, job_mutex (), &ts);
+      if (rc != 0 && rc != ETIMEDOUT)
 	abend ("unexpected error from pthread_cond_timedwait: %s",
-	       strerror (errno));
+	       strerror (rc));
     }
   pthread_cleanup_pop (1);
 }
-
+
 /* Session functions */
 
 SESSION_TABLE *
 session_table_new (void)
 {
   SESSION_TABLE *st;
+  int i;
+
   XZALLOC (st);
-  if ((st->hash = SESSION_HASH_NEW ()) == NULL)
-    xnomem ();
-  DLIST_INIT (&st->head);
+  for (i = 0; i < SESSION_SHARDS; i++)
+    {
+      SESSION_SHARD *shard = &st->shard[i];
+
+      pthread_mutex_init (&shard->mut, NULL);
+      shard->index = i;
+      if ((shard->hash = SESSION_HASH_NEW ()) == NULL)
+	xnomem ();
+      DLIST_INIT (&shard->head);
+    }
   return st;
 }
 
+/*
+ * Return the shard of the session table TAB where the session with the
+ * given KEY belongs.
+ */
+static SESSION_SHARD *
+session_shard (SESSION_TABLE *tab, char const *key)
+{
+  /* FNV-1a hash */
+  uint32_t h = 2166136261u;
+  unsigned char const *p;
+
+  for (p = (unsigned char const *) key; *p; p++)
+    {
+      h ^= *p;
+      h *= 16777619;
+    }
+  return &tab->shard[h % SESSION_SHARDS];
+}
+
+static inline void
+session_link_at_tail (SESSION_SHARD *shard, SESSION *sess)
+{
+  DLIST_INSERT_TAIL (&shard->head, sess, link);
+}
+
+static inline void
+session_unlink (SESSION_SHARD *shard, SESSION *sess)
+{
+  DLIST_REMOVE (&shard->head, sess, link);
+}
+
 static inline void
-session_link_at_tail (SESSION_TABLE *tab, SESSION *sess)
+session_backend_link (SESSION_SHARD *shard, SESSION *sess)
 {
-  DLIST_INSERT_TAIL (&tab->head, sess, link);
+  DLIST_INSERT_TAIL (&sess->backend->sessions[shard->index], sess, be_link);
 }
 
 static inline void
-session_unlink (SESSION_TABLE *tab, SESSION *sess)
+session_backend_unlink (SESSION_SHARD *shard, SESSION *sess)
 {
-  DLIST_REMOVE (&tab->head, sess, link);
+  DLIST_REMOVE (&sess->backend->sessions[shard->index], sess, be_link);
 }
 
 static void
@@ -296,157 +533,186 @@ session_free (SESSION *sess)
 {
   free (sess);
 }
-
+
 /*
- * Periodic job to remove expired sessions within the given service (passed
- * as the DATA argument),  Sessions within the session table are ordered
- * by their expiration time.  The expire_sessions cronjob is normally scheduled
- * to the expiration time of the first session in the list, i.e. the least
- * recently used one.
+ * Remove the session from its shard and free it.
+ *
+ * The shard mutex must be locked.
+ */
+static void
+session_delete (SESSION_SHARD *shard, SESSION *sess)
+{
+  SESSION_DELETE (shard->hash, sess);
+  session_unlink (shard, sess);
+  session_backend_unlink (shard, sess);
+  session_free (sess);
+}
+
+/*
+ * Periodic job to remove expired sessions within the given session table
+ * shard (passed as the DATA argument),  Sessions within the shard are
+ * ordered by their expiration time.  The expire_sessions cronjob is
+ * normally scheduled to the expiration time of the first session in the
+ * list, i.e. the least recently used one.
  *
  * Before returning, the function rearms the periodic job if necessary.
  */
 static void
 expire_sessions (enum job_ctl ctl, void *data, const struct timespec *now)
 {
-  SERVICE *svc = data;
-  SESSION_TABLE *tab;
+  SESSION_SHARD *shard = data;
   SESSION *sess;
 
   if (ctl != job_ctl_run)
     return;
   
-  pthread_mutex_lock (&svc->mut);
+  pthread_mutex_lock (&shard->mut);
 
-  tab = svc->sessions;
-  while ((sess = DLIST_FIRST (&tab->head)) != NULL &&
+  while ((sess = DLIST_FIRST (&shard->head)) != NULL &&
 	 timespec_cmp (&sess->expire, now) <= 0)
-    {
-      SESSION_DELETE (tab->hash, sess);
-      session_unlink (tab, sess);
-      session_free (sess);
-    }
+    session_delete (shard, sess);
 
-  if (!DLIST_EMPTY (&tab->head))
-    job_enqueue (&DLIST_FIRST (&tab->head)->expire, expire_sessions, svc);
-  pthread_mutex_unlock (&svc->mut);
+  if (!DLIST_EMPTY (&shard->head))
+    job_enqueue (&DLIST_FIRST (&shard->head)->expire, expire_sessions, shard);
+  pthread_mutex_unlock (&shard->mut);
 }
 
 /*
  * Promote the given session by updating its expiration time and
  * moving it to the end of the session list.
  *
- * The service mutex must be locked.
+ * The shard mutex must be locked.
  */
 static void
-service_session_promote (SERVICE *svc, SESSION *sess)
+service_session_promote (SERVICE *svc, SESSION_SHARD *shard, SESSION *sess)
 {
-  SESSION_TABLE *tab = svc->sessions;
-  session_unlink (tab, sess);
+  session_unlink (shard, sess);
   clock_gettime (CLOCK_REALTIME, &sess->expire);
   sess->expire.tv_sec += svc->sess_ttl;
-  session_link_at_tail (tab, sess);
+  session_link_at_tail (shard, sess);
 }
 
 /*
  * Add a new key/backend pair to the session table of SVC.  If this is
- * going to be the the first session in the session list, schedule the
- * expiration job.
+ * going to be the the first session in the shard, schedule the expiration
+ * job.
  *
- * The service mutex must be locked.
+ * If a session with this key already exists, it is rebound to BE if
+ * REPLACE is true, and left unchanged otherwise.  In both cases the
+ * session is promoted.
+ *
+ * Return the backend the session is bound to, with its reference count
+ * incremented.
  */
-static void
-service_session_add (SERVICE *svc, const char *key, BACKEND *be)
+static BACKEND *
+service_session_add (SERVICE *svc, const char *key, BACKEND *be, int replace)
 {
-  SESSION_TABLE *tab = svc->sessions;
-  SESSION *t, *old;
-  size_t keylen = strlen (key);
+  SESSION_SHARD *shard = session_shard (svc->sessions, key);
+  SESSION t, *sess;
+  size_t keylen;
 
-  if ((t = malloc (sizeof (SESSION) + keylen + 1)) == NULL)
+  pthread_mutex_lock (&shard->mut);
+  t.key = (char*) key;
+  if ((sess = SESSION_RETRIEVE (shard->hash, &t)) != NULL)
     {
-      logmsg (LOG_WARNING, "service_session_add() content malloc");
-      return;
+      if (replace && sess->backend != be)
+	{
+	  session_backend_unlink (shard, sess);
+	  sess->backend = be;
+	  session_backend_link (shard, sess);
+	}
+      service_session_promote (svc, shard, sess);
+      be = sess->backend;
     }
-  t->key = (char*)(t + 1);
-  strcpy (t->key, key);
-  t->backend = be;
-  clock_gettime (CLOCK_REALTIME, &t->expire);
-  t->expire.tv_sec += svc->sess_ttl;
-  if ((old = SESSION_INSERT (tab->hash, t)) != NULL)
+  else
     {
-      session_unlink (svc->sessions, old);
-      session_free (old);
-      logmsg (LOG_WARNING, "service_session_add() DUP");
+      keylen = strlen (key);
+      if ((sess = malloc (sizeof (SESSION) + keylen + 1)) == NULL)
+	logmsg (LOG_WARNING, "service_session_add() content malloc");
+      else
+	{
+	  sess->key = (char*)(sess + 1);
+	  strcpy (sess->key, key);
+	  sess->backend = be;
+	  clock_gettime (CLOCK_REALTIME, &sess->expire);
+	  sess->expire.tv_sec += svc->sess_ttl;
+	  SESSION_INSERT (shard->hash, sess);
+	  session_link_at_tail (shard, sess);
+	  session_backend_link (shard, sess);
+	  if (DLIST_NEXT (DLIST_FIRST (&shard->head), link) == 0)
+	    job_enqueue (&sess->expire, expire_sessions, shard);
+	}
     }
-  session_link_at_tail (tab, t);
-  if (DLIST_NEXT (DLIST_FIRST (&tab->head), link) == 0)
-    job_enqueue (&t->expire, expire_sessions, svc);
+  backend_ref (be);
+  pthread_mutex_unlock (&shard->mut);
+  return be;
 }
 
 /*
  * Look up the service session table for the given key.  If found,
- * return the corresponding backend and promote the session.
- *
- * The service mutex must be locked.
+ * promote the session and return the corresponding backend, with its
+ * reference count incremented.
  */
 static BACKEND *
 service_session_find (SERVICE *svc, char *const key)
 {
-  SESSION_TABLE *tab = svc->sessions;
+  SESSION_SHARD *shard = session_shard (svc->sessions, key);
   SESSION t, *res;
+  BACKEND *be = NULL;
 
   t.key = key;
-  if ((res = SESSION_RETRIEVE (tab->hash, &t)) != NULL)
+  pthread_mutex_lock (&shard->mut);
+  if ((res = SESSION_RETRIEVE (shard->hash, &t)) != NULL)
     {
-      service_session_promote (svc, res);
-      return res->backend;
+      service_session_promote (svc, shard, res);
+      be = res->backend;
+      backend_ref (be);
     }
-  return NULL;
+  pthread_mutex_unlock (&shard->mut);
+  return be;
 }
 
 /*
  * Delete from the service session table a session corresponding to the
  * given key.
- *
- * The service mutex must be locked.
  */
 static void
 service_session_remove_by_key (SERVICE *svc, char const *key)
 {
-  SESSION_TABLE *tab = svc->sessions;
+  SESSION_SHARD *shard = session_shard (svc->sessions, key);
   SESSION t, *res;
 
   t.key = (char*) key;
-  if ((res = SESSION_DELETE (tab->hash, &t)) != NULL)
-    {
-      session_unlink (tab, res);
-      session_free (res);
-    }
-  return;
+  pthread_mutex_lock (&shard->mut);
+  if ((res = SESSION_RETRIEVE (shard->hash, &t)) != NULL)
+    session_delete (shard, res);
+  pthread_mutex_unlock (&shard->mut);
 }
 
 /*
  * Remove from the service session table all sessions with the given backend.
  *
- * The service mutex must be locked.
+ * If the service mutex is locked, it must be locked before the shard
+ * mutexes.
  */
 void
 service_session_remove_by_backend (SERVICE *svc, BACKEND *be)
 {
   SESSION_TABLE *tab = svc->sessions;
-  SESSION *sess, *tmp;
+  int i;
 
-  DLIST_FOREACH_SAFE (sess, tmp, &tab->head, link)
+  for (i = 0; i < SESSION_SHARDS; i++)
     {
-      if (sess->backend == be)
-	{
-	  SESSION_DELETE (tab->hash, sess);
-	  session_unlink (tab, sess);
-	  session_free (sess);
-	}
+      SESSION_SHARD *shard = &tab->shard[i];
+      SESSION *sess;
+
+      pthread_mutex_lock (&shard->mut);
+      while ((sess = DLIST_FIRST (&be->sessions[i])) != NULL)
+	session_delete (shard, sess);
+      pthread_mutex_unlock (&shard->mut);
     }
 }
-
+
 /*
  * Translate inet/inet6 address/port into a string
  */
@@ -551,6 +817,10 @@ str_be (char *buf, size_t size, BACKEND *be)
       strncpy (buf, "metrics", size);
       break;
 
+    case BE_CACHE:
+      strncpy (buf, "cache", size);
+      break;
+
     default:
       abort ();
     }
@@ -571,42 +841,483 @@ match_service (SERVICE *svc, POUND_HTTP *phttp)
 }
 
 /*
- * Find the right service for a request
+ * Service dispatch index.
+ *
+ * A request can match a service only if it satisfies each top-level
+ * condition of that service.  Conditions that require a literal prefix
+ * of the Host header value or of the request path are entered into prefix
+ * trees keyed on that literal.  Walking these trees along the actual
+ * Host value and path of a request yields the set of indexed services
+ * that can possibly match it.  These, together with the services that
+ * could not be indexed, are then tried in their configuration order, so
+ * that the first-match semantics is preserved.
  */
-SERVICE *
-get_service (POUND_HTTP *phttp)
+
+enum
+  {
+    SVCIDX_HOST,        /* Host header value (case-insensitive). */
+    SVCIDX_PATH,        /* Request path. */
+    SVCIDX_PATH_CI,     /* Request path (case-insensitive). */
+    SVCIDX_MAX
+  };
+
+struct svcidx_node
 {
-  SERVICE *svc;
+  int ch;                                /* Key character. */
+  SLIST_HEAD (,svcidx_node) children;    /* Child nodes. */
+  SLIST_ENTRY (svcidx_node) next;        /* Next sibling. */
+  size_t *ordv;                          /* Ordinals of services with the */
+  size_t ordc;                           /*  key ending at this node. */
+  size_t ordmax;
+};
+
+struct service_index
+{
+  SERVICE **svcv;                        /* Services in configuration order. */
+  size_t svcc;                           /* Number of services. */
+  struct svcidx_node any;                /* Services that can't be indexed. */
+  struct svcidx_node root[SVCIDX_MAX];   /* Prefix trees. */
+};
+
+#define SVCIDX_WORD_BITS (sizeof (unsigned long) * CHAR_BIT)
+#define SVCIDX_BITBUF_WORDS 16
+
+static void
+svcidx_node_add (struct svcidx_node *node, size_t n)
+{
+  /* Avoid duplicates arising from disjunctions. */
+  if (node->ordc > 0 && node->ordv[node->ordc - 1] == n)
+    return;
+  if (node->ordc == node->ordmax)
+    node->ordv = x2nrealloc (node->ordv, &node->ordmax,
+			     sizeof (node->ordv[0]));
+  node->ordv[node->ordc++] = n;
+}
 
-  SLIST_FOREACH (svc, &phttp->lstn->services, next)
+static void
+svcidx_insert (struct svcidx_node *node, char const *key, int ci, size_t n)
+{
+  for (; *key; key++)
     {
-      if (svc->disabled)
-	continue;
-      if (match_service (svc, phttp))
-	return svc;
+      struct svcidx_node *p;
+      int c = ci ? tolower ((unsigned char) *key) : (unsigned char) *key;
+
+      SLIST_FOREACH (p, &node->children, next)
+	if (p->ch == c)
+	  break;
+      if (!p)
+	{
+	  XZALLOC (p);
+	  p->ch = c;
+	  SLIST_INIT (&p->children);
+	  SLIST_PUSH (&node->children, p, next);
+	}
+      node = p;
     }
+  svcidx_node_add (node, n);
+}
 
-  /* try global services */
-  SLIST_FOREACH (svc, &services, next)
+/* Return the number of literal keys of a simple condition COND. */
+static size_t
+svcidx_cond_nkeys (SERVICE_COND *cond)
+{
+  switch (cond->type)
     {
-      if (svc->disabled)
-	continue;
-      if (match_service (svc, phttp))
-	return svc;
-    }
+    case COND_HOST:
+      return 1;
 
-  /* nothing matched */
-  return NULL;
+    case COND_PATH:
+      return genpat_literal_count (cond->re);
+
+    default:
+      break;
+    }
+  return 0;
 }
 
 /*
- * Calculate a uniformly distributed random number less than max.
- * avoiding "modulo bias".
- *
- * The code is based on arc4random_uniform from OpenBSD, see
- * http://cvsweb.openbsd.org/cgi-bin/cvsweb/~checkout~/src/lib/libc/crypt/arc4r\
-andom_uniform.c
- *
+ * Return the index kind of the Ith literal key of a simple condition COND
+ * and store the key in *KEY.  Return -1 if it cannot be indexed.
+ */
+static int
+svcidx_cond_key (SERVICE_COND *cond, size_t i, char const **key)
+{
+  int type, ci;
+
+  switch (cond->type)
+    {
+    case COND_HOST:
+      if (i == 0 && cond->host.prefix)
+	{
+	  *key = cond->host.prefix;
+	  return SVCIDX_HOST;
+	}
+      break;
+
+    case COND_PATH:
+      if (genpat_literal (cond->re, i, &type, key, &ci) == 0
+	  && (type == GENPAT_PREFIX || type == GENPAT_EXACT))
+	return ci ? SVCIDX_PATH_CI : SVCIDX_PATH;
+      break;
+
+    default:
+      break;
+    }
+  return -1;
+}
+
+/*
+ * Return the index kind of COND, or -1 if it cannot be indexed.  Apart
+ * from simple conditions with a single key, this allows for pattern sets
+ * and disjunctions, all members of which are indexable and of the same
+ * kind (e.g. a list of host names read from file).
+ */
+static int
+svcidx_cond_kind (SERVICE_COND *cond)
+{
+  char const *key;
+  int kind = -1;
+  size_t i, n;
+
+  if (cond->type == COND_BOOL)
+    {
+      SERVICE_COND *sub;
+
+      if (cond->bool.op != BOOL_OR)
+	return -1;
+      SLIST_FOREACH (sub, &cond->bool.head, next)
+	{
+	  int k = svcidx_cond_kind (sub);
+	  if (k == -1 || (kind != -1 && k != kind))
+	    return -1;
+	  kind = k;
+	}
+      return kind;
+    }
+
+  n = svcidx_cond_nkeys (cond);
+  for (i = 0; i < n; i++)
+    {
+      int k = svcidx_cond_key (cond, i, &key);
+      if (k == -1 || (kind != -1 && k != kind))
+	return -1;
+      kind = k;
+    }
+  return kind;
+}
+
+static void
+svcidx_cond_insert (struct service_index *idx, SERVICE_COND *cond, size_t n)
+{
+  if (cond->type == COND_BOOL)
+    {
+      SERVICE_COND *sub;
+      SLIST_FOREACH (sub, &cond->bool.head, next)
+	svcidx_cond_insert (idx, sub, n);
+    }
+  else
+    {
+      size_t i, nkeys = svcidx_cond_nkeys (cond);
+
+      for (i = 0; i < nkeys; i++)
+	{
+	  char const *key;
+	  int kind = svcidx_cond_key (cond, i, &key);
+	  svcidx_insert (&idx->root[kind], key, kind != SVCIDX_PATH, n);
+	}
+    }
+}
+
+/*
+ * Select the condition to index the service by among the conjuncts of
+ * COND.  Host conditions are preferred over path ones.
+ */
+static SERVICE_COND *
+svcidx_select (SERVICE_COND *cond, SERVICE_COND *best)
+{
+  if (cond->type == COND_BOOL && cond->bool.op == BOOL_AND)
+    {
+      SERVICE_COND *sub;
+      SLIST_FOREACH (sub, &cond->bool.head, next)
+	best = svcidx_select (sub, best);
+    }
+  else
+    {
+      int kind = svcidx_cond_kind (cond);
+      if (kind != -1
+	  && (best == NULL
+	      || (kind == SVCIDX_HOST && svcidx_cond_kind (best) != SVCIDX_HOST)))
+	best = cond;
+    }
+  return best;
+}
+
+static void
+svcidx_node_free (struct svcidx_node *node)
+{
+  struct svcidx_node *p;
+
+  while ((p = SLIST_FIRST (&node->children)) != NULL)
+    {
+      SLIST_SHIFT (&node->children, next);
+      svcidx_node_free (p);
+      free (p);
+    }
+  free (node->ordv);
+}
+
+static void
+service_index_free (struct service_index *idx)
+{
+  int i;
+
+  if (!idx)
+    return;
+  for (i = 0; i < SVCIDX_MAX; i++)
+    svcidx_node_free (&idx->root[i]);
+  svcidx_node_free (&idx->any);
+  free (idx->svcv);
+  free (idx);
+}
+
+/*
+ * Create dispatch index for the service list HEAD.  Return NULL if none
+ * of the services can be indexed.
+ */
+static struct service_index *
+service_index_new (SERVICE_HEAD *head)
+{
+  struct service_index *idx;
+  SERVICE *svc;
+  size_t n = 0, indexed = 0;
+  int i;
+
+  XZALLOC (idx);
+  SLIST_INIT (&idx->any.children);
+  for (i = 0; i < SVCIDX_MAX; i++)
+    SLIST_INIT (&idx->root[i].children);
+
+  SLIST_FOREACH (svc, head, next)
+    n++;
+  idx->svcv = xcalloc (n, sizeof (idx->svcv[0]));
+
+  SLIST_FOREACH (svc, head, next)
+    {
+      SERVICE_COND *cond = svcidx_select (&svc->cond, NULL);
+
+      if (cond)
+	{
+	  svcidx_cond_insert (idx, cond, idx->svcc);
+	  indexed++;
+	}
+      else
+	svcidx_node_add (&idx->any, idx->svcc);
+      idx->svcv[idx->svcc++] = svc;
+    }
+
+  if (indexed == 0)
+    {
+      service_index_free (idx);
+      idx = NULL;
+    }
+  return idx;
+}
+
+static struct service_index *global_service_index;
+
+static int
+listener_index_build (LISTENER *lstn, void *data)
+{
+  service_index_free (lstn->svc_index);
+  lstn->svc_index = service_index_new (&lstn->services);
+  return 0;
+}
+
+void
+service_index_build (void)
+{
+  foreach_listener (listener_index_build, NULL);
+  service_index_free (global_service_index);
+  global_service_index = service_index_new (&services);
+}
+
+static inline void
+svcidx_mark (struct svcidx_node *node, unsigned long *bits)
+{
+  size_t i;
+
+  for (i = 0; i < node->ordc; i++)
+    {
+      size_t n = node->ordv[i];
+      bits[n / SVCIDX_WORD_BITS] |= 1UL << (n % SVCIDX_WORD_BITS);
+    }
+}
+
+/*
+ * Mark services keyed by all prefixes of the string S.
+ */
+static void
+svcidx_walk (struct svcidx_node *node, char const *s, int ci,
+	     unsigned long *bits)
+{
+  for (;;)
+    {
+      struct svcidx_node *p;
+      int c;
+
+      svcidx_mark (node, bits);
+      if (*s == 0)
+	break;
+      c = ci ? tolower ((unsigned char) *s) : (unsigned char) *s;
+      s++;
+      SLIST_FOREACH (p, &node->children, next)
+	if (p->ch == c)
+	  break;
+      if (!p)
+	break;
+      node = p;
+    }
+}
+
+/*
+ * Mark services keyed by prefixes of the Host header values of the
+ * request.  A COND_HOST regex is anchored at the beginning of a header
+ * line, so every line beginning with "Host:" is considered.
+ */
+static void
+svcidx_walk_host (struct svcidx_node *root, struct http_request *req,
+		  unsigned long *bits)
+{
+  struct http_header *hdr;
+
+  DLIST_FOREACH (hdr, &req->headers.list, link)
+    {
+      char const *s;
+
+      if ((s = hdr->header) == NULL)
+	continue;
+      do
+	{
+	  if (strncasecmp (s, "host:", 5) == 0)
+	    {
+	      char const *p = s + 5;
+	      while (isspace ((unsigned char) *p))
+		p++;
+	      svcidx_walk (root, p, 1, bits);
+	    }
+	}
+      while ((s = strchr (s, '\n')) != NULL && *++s);
+    }
+}
+
+static int
+svcidx_empty (struct svcidx_node *node)
+{
+  return node->ordc == 0 && SLIST_EMPTY (&node->children);
+}
+
+static SERVICE *
+service_index_lookup (struct service_index *idx, POUND_HTTP *phttp)
+{
+  unsigned long bitbuf[SVCIDX_BITBUF_WORDS], *bits;
+  size_t nw = (idx->svcc + SVCIDX_WORD_BITS - 1) / SVCIDX_WORD_BITS;
+  char const *path;
+  SERVICE *res = NULL;
+  size_t i;
+
+  if (nw <= SVCIDX_BITBUF_WORDS)
+    bits = bitbuf;
+  else if ((bits = malloc (nw * sizeof (bits[0]))) == NULL)
+    {
+      lognomem ();
+      return NULL;
+    }
+  memset (bits, 0, nw * sizeof (bits[0]));
+
+  svcidx_mark (&idx->any, bits);
+  if (!svcidx_empty (&idx->root[SVCIDX_HOST]))
+    svcidx_walk_host (&idx->root[SVCIDX_HOST], &phttp->request, bits);
+  if ((!svcidx_empty (&idx->root[SVCIDX_PATH])
+       || !svcidx_empty (&idx->root[SVCIDX_PATH_CI]))
+      && http_request_get_path (&phttp->request, &path) == 0 && path)
+    {
+      svcidx_walk (&idx->root[SVCIDX_PATH], path, 0, bits);
+      svcidx_walk (&idx->root[SVCIDX_PATH_CI], path, 1, bits);
+    }
+
+  for (i = 0; i < idx->svcc; i++)
+    {
+      unsigned long w = bits[i / SVCIDX_WORD_BITS];
+
+      if (w == 0)
+	{
+	  /* Skip to the next word. */
+	  i |= SVCIDX_WORD_BITS - 1;
+	  continue;
+	}
+      if (w & (1UL << (i % SVCIDX_WORD_BITS)))
+	{
+	  SERVICE *svc = idx->svcv[i];
+	  if (!svc->disabled && match_service (svc, phttp))
+	    {
+	      res = svc;
+	      break;
+	    }
+	}
+    }
+
+  if (bits != bitbuf)
+    free (bits);
+  return res;
+}
+
+/*
+ * Find the first service from the list HEAD matching the request.  Use
+ * the dispatch index IDX, if available.
+ */
+static SERVICE *
+service_list_match (struct service_index *idx, SERVICE_HEAD *head,
+		    POUND_HTTP *phttp)
+{
+  SERVICE *svc;
+
+  if (idx)
+    return service_index_lookup (idx, phttp);
+
+  SLIST_FOREACH (svc, head, next)
+    {
+      if (svc->disabled)
+	continue;
+      if (match_service (svc, phttp))
+	return svc;
+    }
+  return NULL;
+}
+
+/*
+ * Find the right service for a request
+ */
+SERVICE *
+get_service (POUND_HTTP *phttp)
+{
+  SERVICE *svc;
+
+  if ((svc = service_list_match (phttp->lstn->svc_index,
+				 &phttp->lstn->services, phttp)) != NULL)
+    return svc;
+
+  /* try global services */
+  return service_list_match (global_service_index, &services, phttp);
+}
+
+/*
+ * Calculate a uniformly distributed random number less than max.
+ * avoiding "modulo bias".
+ *
+ * The code is based on arc4random_uniform from OpenBSD, see
+ * http://cvsweb.openbsd.org/cgi-bin/cvsweb/~checkout~/src/lib/libc/crypt/arc4r\
+andom_uniform.c
+ *
  * Uniformity is achieved by generating new random numbers until the one
  * returned is outside the range [0, 2**32 % max).  This
  * guarantees the selected random number will be inside
@@ -628,211 +1339,466 @@ random_in_range (unsigned long max)
   return r % max;
 }
 
-static void
-rand_pri_init (BALANCER *bl)
+/*
+ * Backend selection snapshots.
+ *
+ * Request processing threads select backends from an immutable snapshot
+ * of the service backend lists, instead of the lists themselves.  The
+ * snapshot contains only active backends, grouped by balancers.  It is
+ * rebuilt when the set of active backends or their priorities change
+ * (i.e. each time service priorities are recomputed, under the service
+ * mutex) and is published using RCU, so that selecting a backend doesn't
+ * require locking the service.
+ */
+
+struct lb_entry
 {
-  bl->rand.sum_pri = 0;
-}
+  BACKEND *be;
+  int priority;
+};
 
-static int
-rand_pri_update (BALANCER *bl, BACKEND *be)
+/*
+ * IWRR schedule.  In round R, IWRR selects each backend with priority
+ * greater than R.  When backends are sorted by decreasing priority,
+ * these are the first N of them, N being constant in each range of
+ * rounds delimited by two adjacent distinct priorities.  Such a range
+ * is described by a block.
+ */
+struct iwrr_block
+{
+  unsigned long end;            /* Offset of the end of the block in
+				   the schedule. */
+  size_t count;                 /* Backends selected in each round. */
+};
+
+struct lb_group
+{
+  BALANCER_ALGO algo;
+  size_t count;                 /* Number of backends. */
+  struct lb_entry *entries;     /* Backends; for IWRR sorted by decreasing
+				   priority. */
+  unsigned long sum_pri;        /* Sum of priorities. */
+  /* IWRR-specific: */
+  size_t nblocks;               /* Number of schedule blocks. */
+  struct iwrr_block *blocks;    /* Schedule blocks. */
+  unsigned long seq;            /* Sequence number of the next selection.
+				   Updated atomically. */
+};
+
+struct lb_snapshot
+{
+  struct rcu_head rcu;
+  size_t ngroups;
+  struct lb_group groups[1];
+};
+
+static struct lb_entry *
+rand_select (struct lb_group *grp)
 {
-  if (LONG_MAX - bl->rand.sum_pri < be->priority)
+  long pri;
+  size_t i;
+
+  if (grp->sum_pri == 0)
+    return NULL;
+  pri = random_in_range (grp->sum_pri);
+  for (i = 0; i < grp->count; i++)
     {
-      logmsg (LOG_ERR, "%s: this backend overflows the sum of priorities",
-	      be->locus_str);
-      return 1;
+      if ((pri -= grp->entries[i].priority) < 0)
+	return &grp->entries[i];
     }
-  bl->rand.sum_pri += be->priority;
-  return 0;
+  return NULL;
 }
 
-static BACKEND *
-rand_select (BALANCER *balancer)
+static void
+iwrr_init (struct lb_group *grp)
 {
-  BACKEND *be;
-  int pri;
+  size_t i, j;
+  unsigned long end = 0;
+  int prev = 0;
 
-  if (DLIST_EMPTY (&balancer->backends))
-    return NULL;
-  
-  pri = random_in_range (balancer->rand.sum_pri);
-  DLIST_FOREACH (be, &balancer->backends, link)
+  /* Stable sort by decreasing priority. */
+  for (i = 1; i < grp->count; i++)
     {
-      if (backend_is_active (be) && (pri -= be->priority) < 0)
-	break;
+      struct lb_entry ent = grp->entries[i];
+      for (j = i; j > 0 && grp->entries[j-1].priority < ent.priority; j--)
+	grp->entries[j] = grp->entries[j-1];
+      grp->entries[j] = ent;
+    }
+
+  /* Build the schedule, starting from the lowest priority. */
+  grp->nblocks = 0;
+  for (i = grp->count; i > 0; )
+    {
+      int pri = grp->entries[i-1].priority;
+
+      if (pri > prev)
+	{
+	  end += (unsigned long) (pri - prev) * i;
+	  grp->blocks[grp->nblocks].end = end;
+	  grp->blocks[grp->nblocks].count = i;
+	  grp->nblocks++;
+	  prev = pri;
+	}
+      while (i > 0 && grp->entries[i-1].priority == pri)
+	i--;
     }
-  return be;
 }
 
-static void
-iwrr_init (BALANCER *balancer)
+static struct lb_entry *
+iwrr_select (struct lb_group *grp)
 {
-  balancer->iwrr.round = 0;
-  balancer->iwrr.cur = DLIST_FIRST (&balancer->backends);
+  unsigned long n, start = 0;
+  size_t i;
+
+  if (grp->nblocks == 0)
+    return NULL;
+  n = __atomic_fetch_add (&grp->seq, 1, __ATOMIC_RELAXED)
+	% grp->blocks[grp->nblocks-1].end;
+  for (i = 0; n >= grp->blocks[i].end; i++)
+    start = grp->blocks[i].end;
+  return &grp->entries[(n - start) % grp->blocks[i].count];
 }
 
-static void
-iwrr_reset (BALANCER *balancer, BACKEND *be)
+/*
+ * Return the number of requests currently being processed by BE.
+ */
+static inline unsigned long
+backend_active_requests (BACKEND *be)
 {
-  if (balancer->iwrr.cur == be)
-    {
-      iwrr_init (balancer);
-    }
+  if (be->be_type != BE_REGULAR)
+    return 0;
+  return __atomic_load_n (&be->v.reg.active, __ATOMIC_RELAXED);
 }
 
-static BACKEND *
-iwrr_select (BALANCER *bal)
+static inline uint64_t
+backend_ewma (BACKEND *be)
 {
-  BACKEND *be = NULL;
+  if (be->be_type != BE_REGULAR)
+    return 0;
+  return __atomic_load_n (&be->v.reg.ewma, __ATOMIC_RELAXED);
+}
 
-  if (bal->iwrr.cur == NULL)
-    {
-      iwrr_init (bal);
-      if (bal->iwrr.cur == NULL)
-	return NULL;
-    }
-  
-  do
+/*
+ * Time constant of the decay of request time averages, in seconds.
+ * The average of a backend that has not been used for BE_EWMA_DECAY
+ * seconds is halved when comparing it with others, so that a backend
+ * which was slow once eventually gets a chance to prove otherwise.
+ */
+#define BE_EWMA_DECAY 10
+
+/*
+ * Return the moving average of request times of BE, decayed according
+ * to the time elapsed since its last update.  NOW is the current time
+ * in nanoseconds.
+ */
+static double
+backend_ewma_decayed (BACKEND *be, uint64_t now)
+{
+  uint64_t e = backend_ewma (be);
+  uint64_t t;
+
+  if (e == 0)
+    return 0;
+  t = __atomic_load_n (&be->v.reg.ewma_time, __ATOMIC_RELAXED);
+  if (now <= t)
+    return e;
+  return e / (1 + (double) (now - t) / ((uint64_t) BE_EWMA_DECAY * 1000000000));
+}
+
+/*
+ * Least outstanding requests: select the backend with the minimal number
+ * of requests in flight per unit of priority.  Ties are broken randomly.
+ */
+static struct lb_entry *
+leastconn_select (struct lb_group *grp)
+{
+  struct lb_entry *best = NULL;
+  unsigned long best_load = 0;
+  unsigned long nties = 0;
+  size_t i;
+
+  for (i = 0; i < grp->count; i++)
     {
-      if (backend_is_active (bal->iwrr.cur))
+      struct lb_entry *ent = &grp->entries[i];
+      unsigned long load, lhs, rhs;
+
+      load = backend_active_requests (ent->be) + 1;
+      if (best == NULL)
+	{
+	  best = ent;
+	  best_load = load;
+	  nties = 1;
+	  continue;
+	}
+      /* Compare load/priority of both backends. */
+      lhs = load * best->priority;
+      rhs = best_load * ent->priority;
+      if (lhs < rhs)
 	{
-	  if (bal->iwrr.round < bal->iwrr.cur->priority)
-	    be = bal->iwrr.cur;
+	  best = ent;
+	  best_load = load;
+	  nties = 1;
 	}
-      if ((bal->iwrr.cur = DLIST_NEXT (bal->iwrr.cur, link)) == NULL)
+      else if (lhs == rhs && random_in_range (++nties) == 0)
 	{
-	  bal->iwrr.cur = DLIST_FIRST (&bal->backends);
-	  bal->iwrr.round = (bal->iwrr.round + 1) % (bal->iwrr.max_pri + 1);
+	  best = ent;
+	  best_load = load;
 	}
     }
-  while (be == NULL);
-  return be;
+  return best;
 }
 
-static void
-iwrr_pri_init (BALANCER *bal)
+/*
+ * Return true if the expected cost of sending a request to A is lower
+ * than that of sending it to B.  The cost is the moving average of the
+ * request time multiplied by the number of requests in flight plus one,
+ * per unit of priority.  If the average is not yet known for either of
+ * the backends, only the number of requests is compared.
+ */
+static int
+ewma_cost_less (struct lb_entry *a, struct lb_entry *b)
 {
-  bal->iwrr.max_pri = 0;
+  struct timespec ts;
+  uint64_t now;
+  double ca = (double) (backend_active_requests (a->be) + 1) / a->priority;
+  double cb = (double) (backend_active_requests (b->be) + 1) / b->priority;
+  double ea, eb;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  ea = backend_ewma_decayed (a->be, now);
+  eb = backend_ewma_decayed (b->be, now);
+  if (ea > 0 && eb > 0)
+    {
+      ca *= ea;
+      cb *= eb;
+    }
+  return ca < cb;
 }
 
-static int
-iwrr_pri_update (BALANCER *bal, BACKEND *be)
+/* Number of attempts to pick a second backend different from the first. */
+#define EWMA_PICK_TRIES 3
+
+/*
+ * Power of two choices: pick two backends at random, weighted by their
+ * priorities, and select the one with the lower expected cost.
+ */
+static struct lb_entry *
+ewma_select (struct lb_group *grp)
 {
-  if (be->priority == INT_MAX)
+  struct lb_entry *a, *b = NULL;
+  int i;
+
+  if ((a = rand_select (grp)) == NULL || grp->count < 2)
+    return a;
+  for (i = 0; i < EWMA_PICK_TRIES; i++)
     {
-      logmsg (LOG_ERR, "%s: priority value too big", be->locus_str);
-      return 1;
+      if ((b = rand_select (grp)) != a)
+	break;
     }
-  if (bal->iwrr.max_pri < be->priority)
-    bal->iwrr.max_pri = be->priority;
-  return 0;
+  if (b == NULL || b == a)
+    return a;
+  return ewma_cost_less (b, a) ? b : a;
 }
 
 struct balancer_def
 {
-  void (*init) (BALANCER *);
-  void (*reset) (BALANCER *, BACKEND *be);
-  BACKEND *(*select) (BALANCER *);
-  void (*pri_init) (BALANCER *);
-  int (*pri_update) (BALANCER *, BACKEND *);
+  void (*init) (struct lb_group *);
+  struct lb_entry *(*select) (struct lb_group *);
 };
 
 static struct balancer_def balancer_tab[] = {
   [BALANCER_ALGO_RANDOM] = {
     .select = rand_select,
-    .pri_init = rand_pri_init,
-    .pri_update = rand_pri_update
   },
   [BALANCER_ALGO_IWRR] = {
     .init = iwrr_init,
-    .reset = iwrr_reset,
     .select = iwrr_select,
-    .pri_init = iwrr_pri_init,
-    .pri_update = iwrr_pri_update
+  },
+  [BALANCER_ALGO_LEASTCONN] = {
+    .select = leastconn_select
+  },
+  [BALANCER_ALGO_EWMA] = {
+    .select = ewma_select,
   }
 };
 
 static inline BACKEND *
-balancer_select_backend (BALANCER *balancer)
+lb_group_select_backend (struct lb_group *grp)
 {
+  struct lb_entry *ent;
+
+  if (grp->count == 1)
+    return grp->entries[0].be;
+  if ((ent = balancer_tab[grp->algo].select (grp)) == NULL)
+    return NULL;
+  return ent->be;
+}
+
+/*
+ * Create a backend selection snapshot of the service SVC.  Return NULL
+ * if the service has no active backends, or if out of memory (in which
+ * case *ERR is set to 1).
+ *
+ * The service must be locked.
+ */
+static struct lb_snapshot *
+lb_snapshot_create (SERVICE *svc, int *err)
+{
+  struct lb_snapshot *snap;
+  BALANCER *bl;
   BACKEND *be;
+  size_t ngroups = 0, nentries = 0;
+  struct lb_group *grp;
+  struct lb_entry *ent;
+  struct iwrr_block *blk;
+
+  *err = 0;
+  DLIST_FOREACH (bl, &svc->balancers, link)
+    {
+      size_t n = 0;
+      DLIST_FOREACH (be, &bl->backends, link)
+	{
+	  if (backend_is_active (be))
+	    n++;
+	}
+      if (n > 0)
+	{
+	  ngroups++;
+	  nentries += n;
+	}
+    }
+
+  if (ngroups == 0)
+    return NULL;
 
-  if (DLIST_NEXT (DLIST_FIRST (&balancer->backends), link) == NULL)
+  snap = malloc (offsetof (struct lb_snapshot, groups)
+		 + ngroups * sizeof (snap->groups[0])
+		 + nentries * (sizeof (*ent) + sizeof (*blk)));
+  if (snap == NULL)
     {
-      be = DLIST_FIRST (&balancer->backends);
-      if (backend_is_active (be))
-	return be;
+      *err = 1;
       return NULL;
     }
-  return balancer_tab[balancer->algo].select (balancer);
-}
+  snap->ngroups = ngroups;
+  ent = (struct lb_entry *) (snap->groups + ngroups);
+  blk = (struct iwrr_block *) (ent + nentries);
 
-static inline void
-balancer_init (BALANCER *balancer)
-{
-  if (balancer_tab[balancer->algo].init)
-    balancer_tab[balancer->algo].init (balancer);
-}
+  grp = snap->groups;
+  DLIST_FOREACH (bl, &svc->balancers, link)
+    {
+      grp->algo = bl->algo;
+      grp->count = 0;
+      grp->entries = ent;
+      grp->sum_pri = 0;
+      grp->nblocks = 0;
+      grp->blocks = blk;
+      grp->seq = 0;
+      DLIST_FOREACH (be, &bl->backends, link)
+	{
+	  if (backend_is_active (be))
+	    {
+	      ent->be = be;
+	      ent->priority = be->priority;
+	      grp->sum_pri += be->priority;
+	      ent++;
+	      grp->count++;
+	    }
+	}
+      if (grp->count > 0)
+	{
+	  if (balancer_tab[grp->algo].init)
+	    balancer_tab[grp->algo].init (grp);
+	  blk += grp->count;
+	  grp++;
+	}
+    }
 
-static inline void
-balancer_reset (BALANCER *balancer, BACKEND *be)
-{
-  if (balancer_tab[balancer->algo].reset)
-    balancer_tab[balancer->algo].reset (balancer, be);
+  return snap;
 }
 
-static inline void
-balancer_pri_init (BALANCER *balancer)
+static void
+lb_snapshot_free (void *ptr)
 {
-  if (balancer_tab[balancer->algo].pri_init)
-    balancer_tab[balancer->algo].pri_init (balancer);
+  free (ptr);
 }
 
-static inline int
-balancer_pri_update (BALANCER *balancer, BACKEND *be)
+static void
+backend_rcu_unref (void *ptr)
 {
-  if (balancer_tab[balancer->algo].pri_update)
-    return balancer_tab[balancer->algo].pri_update (balancer, be);
-  return 0;
+  backend_unref (ptr);
 }
 
-BACKEND *
-service_lb_select_backend (SERVICE *svc)
+/*
+ * Rebuild and publish the backend selection snapshot of the service SVC.
+ * The old snapshot is freed after a grace period.  So are the backends
+ * that were scheduled for removal.
+ *
+ * The service must be locked.
+ */
+void
+service_lb_update (SERVICE *svc)
 {
-  BALANCER *balancer;
-  DLIST_FOREACH (balancer, &svc->balancers, link)
+  struct lb_snapshot *snap, *old;
+  BACKEND *be;
+  int err;
+
+  snap = lb_snapshot_create (svc, &err);
+  if (err)
     {
-      BACKEND *be = balancer_select_backend (balancer);
-      if (be)
-	return be;
+      /*
+       * Keep the old snapshot.  Backends it refers to can't be removed
+       * until the next successful update.
+       */
+      lognomem ();
+      return;
     }
-  return NULL;
-}
+  old = svc->lb;
+  rcu_assign_pointer (svc->lb, snap);
+  if (old)
+    rcu_call (&old->rcu, lb_snapshot_free, old);
 
-void
-service_lb_init (SERVICE *svc)
-{
-  BALANCER *balancer;
-  DLIST_FOREACH (balancer, &svc->balancers, link)
+  /*
+   * Drop the references held by the backend tables.  Each backend will
+   * be freed when the last reference to it is gone.
+   */
+  while ((be = DLIST_FIRST (&svc->be_rem_head)) != NULL)
     {
-      balancer_init (balancer);
+      DLIST_REMOVE (&svc->be_rem_head, be, link);
+      rcu_call (&be->rcu, backend_rcu_unref, be);
     }
 }
 
-void
-service_lb_reset (SERVICE *svc, BACKEND *be)
+/*
+ * Select a backend from the service SVC.  Return it with the reference
+ * count incremented, or NULL if no backend is available.
+ */
+static BACKEND *
+service_lb_select_backend (SERVICE *svc)
 {
-  BALANCER *balancer;
-  DLIST_FOREACH (balancer, &svc->balancers, link)
+  struct lb_snapshot *snap;
+  BACKEND *be = NULL;
+
+  rcu_read_lock ();
+  if ((snap = rcu_dereference (svc->lb)) != NULL)
     {
-      balancer_reset (balancer, be);
+      size_t i;
+
+      for (i = 0; i < snap->ngroups; i++)
+	{
+	  if ((be = lb_group_select_backend (&snap->groups[i])) != NULL)
+	    break;
+	}
+      backend_ref (be);
     }
+  rcu_read_unlock ();
+  return be;
 }
 
 /*
  * Find backend by session key.  If no session with the given key is found,
- * create one and associate it with a randomly selected backend.
+ * create one and associate it with a randomly selected backend.  The
+ * reference count of the returned backend is incremented.
  */
 static BACKEND *
 find_backend_by_key (SERVICE *svc, char const *key)
@@ -849,8 +1815,17 @@ find_backend_by_key (SERVICE *svc, char const *key)
   if ((res = service_session_find (svc, keybuf)) == NULL)
     {
       /* no session yet - create one */
-      if ((res = service_lb_select_backend (svc)) != NULL)
-	service_session_add (svc, keybuf, res);
+      BACKEND *be;
+
+      if ((be = service_lb_select_backend (svc)) != NULL)
+	{
+	  /*
+	   * The same session could have been created meanwhile by another
+	   * thread, in which case its backend is returned.
+	   */
+	  res = service_session_add (svc, keybuf, be, 0);
+	  backend_unref (be);
+	}
     }
 
   return res;
@@ -970,16 +1945,14 @@ key_cookie (char const *hval, char const *sid, char *ret_key)
   return 1;
 }
 
-static int
+static inline int
 service_has_backends (SERVICE *svc)
 {
-  BALANCER *bl;
-  DLIST_FOREACH (bl, &svc->balancers, link)
-    {
-      if (bl->act_num > 0)
-	return 1;
-    }
-  return 0;
+  /*
+   * Only the pointer is examined, so there's no need for a critical
+   * section.
+   */
+  return rcu_dereference (svc->lb) != NULL;
 }
 
 /*
@@ -993,8 +1966,11 @@ get_backend (POUND_HTTP *phttp)
   char keybuf[KEY_SIZE + 1];
   char const *key;
 
-  pthread_mutex_lock (&svc->mut);
-
+  /*
+   * Neither session lookups nor backend selection lock the service:
+   * the former lock only the corresponding session table shard, the
+   * latter use the backend selection snapshot.
+   */
   if (service_has_backends (svc))
     {
       switch (svc->sess_type)
@@ -1040,10 +2016,7 @@ get_backend (POUND_HTTP *phttp)
 
       if (!res)
 	res = service_lb_select_backend (svc);
-      backend_ref (res);
-    }
-  
-  pthread_mutex_unlock (&svc->mut);
+    }
 
   return res;
 }
@@ -1079,24 +2052,17 @@ upd_session (SERVICE *svc, HTTP_HEADER_LIST *headers, BACKEND *be)
       return;
     }
 
-  pthread_mutex_lock (&svc->mut);
   if (find_key_by_header (headers, hname, keyfun, svc->sess_id, key) == 0)
-    {
-      if (service_session_find (svc, key) == NULL)
-	service_session_add (svc, key, be);
-    }
-  pthread_mutex_unlock (&svc->mut);
+    backend_unref (service_session_add (svc, key, be, 0));
 }
 
 /*
- * Recompute max. backend priority and sum of priorities for the backend list.
+ * Recompute the number of active backends in the backend list.
  * If call-back function cb is supplied, call it for each backend.
  *
- * NOTICE:
- *  1. The service should be locked prior to calling this function.
- *  2. Sum of priorities of all the backends should not overflow the type
- *     of svc->tot_pri.  For static backends, this is always true.  For
- *     dynamic backends, this should be ensured when allocating them.
+ * The service should be locked prior to calling this function.  Notice,
+ * that this function doesn't update the backend selection snapshot:
+ * the caller must call service_lb_update when done.
  */
 void
 balancer_recompute_pri_unlocked (BALANCER *bl,
@@ -1104,23 +2070,21 @@ balancer_recompute_pri_unlocked (BALANCER *bl,
 				 void *data)
 {
   BACKEND *b;
-  
+
   bl->act_num = 0;
-  balancer_pri_init (bl);
   DLIST_FOREACH (b, &bl->backends, link)
     {
       if (cb)
 	cb (b, data);
       if (backend_is_active (b))
-	{
-	  if (balancer_pri_update (bl, b))
-	    b->disabled = 1;
-	  else
-	    bl->act_num++;
-	}
+	bl->act_num++;
     }
 }
 
+/*
+ * Recompute all backend lists of the service and update its backend
+ * selection snapshot.  The service should be locked.
+ */
 void
 service_recompute_pri_unlocked (SERVICE *svc,
 				void (*cb) (BACKEND *, void *),
@@ -1131,17 +2095,17 @@ service_recompute_pri_unlocked (SERVICE *svc,
     {
       balancer_recompute_pri_unlocked (bl, cb, data);
     }
-}  
+  service_lb_update (svc);
+}
 
 /*
- * Recompute max. backend priority and sum of priorities for the given
- * backend list of the service.  If call-back function cb is supplied,
+ * Recompute the given backend list of the service and update its
+ * backend selection snapshot.  If call-back function cb is supplied,
  * call it for each backend.
  *
  * If bl == NULL, recompute all backend lists.
  *
- * Locks the svc mutex prior to use.  See second notice to
- * balancer_recompute_pri_unlocked, above.
+ * Locks the svc mutex prior to use.
  */
 void
 service_recompute_pri (SERVICE *svc, BALANCER *bl,
@@ -1150,16 +2114,14 @@ service_recompute_pri (SERVICE *svc, BALANCER *bl,
 {
   pthread_mutex_lock (&svc->mut);
   if (bl)
-    balancer_recompute_pri_unlocked (bl, cb, data);
-  else
     {
-      DLIST_FOREACH (bl, &svc->balancers, link)
-	{
-	  balancer_recompute_pri_unlocked (bl, cb, data);
-	}
+      balancer_recompute_pri_unlocked (bl, cb, data);
+      service_lb_update (svc);
     }
+  else
+    service_recompute_pri_unlocked (svc, cb, data);
   pthread_mutex_unlock (&svc->mut);
-}  
+}
 
 struct disable_closure
 {
@@ -1209,8 +2171,12 @@ cb_backend_disable (BACKEND *b, void *data)
 	  logmsg (LOG_NOTICE, "(%"PRItid") Backend %s dead (killed)",
 		  POUND_TID (), buf);
 	  service_session_remove_by_backend (b->service, b);
-	  backend_ref (b);
-	  job_enqueue_after (alive_to, touch_be, b);
+	  /* With active health checks, the probe job resurrects it. */
+	  if (b->v.reg.health.conf == NULL)
+	    {
+	      backend_ref (b);
+	      job_enqueue_after (alive_to, touch_be, b);
+	    }
 	  break;
 
 	case BE_ENABLE:
@@ -1644,6 +2610,24 @@ backend_probe (BACKEND *be)
   return rc == 0 ? BACKEND_OK : BACKEND_DEAD;
 }
 
+/*
+ * Mark the dead regular backend BE as alive and return it to the pool
+ * of backends.
+ */
+void
+backend_resurrect (BACKEND *be)
+{
+  char buf[MAXBUF];
+
+  be->v.reg.alive = 1;
+  /* Forget the request times observed before the backend died. */
+  __atomic_store_n (&be->v.reg.ewma, 0, __ATOMIC_RELAXED);
+  str_be (buf, sizeof (buf), be);
+  logmsg (LOG_NOTICE, "Backend %s resurrected", buf);
+  if (!be->disabled)
+    service_recompute_pri (be->service, be->balancer, NULL, NULL);
+}
+
 /*
  * Periodic job: check if the backend passed as argument is alive.
  * If so, return it to the pool of backends.  Otherwise, reschedule
@@ -1653,25 +2637,13 @@ static void
 touch_be (enum job_ctl ctl, void *data, const struct timespec *ts)
 {
   BACKEND *be = data;
-  char buf[MAXBUF];
 
   if (ctl == job_ctl_run && be->be_type == BE_REGULAR && be->refcount > 1)
     {
       if (!be->v.reg.alive)
 	{
 	  if (backend_probe (be) == BACKEND_OK)
-	    {
-	      be->v.reg.alive = 1;
-	      str_be (buf, sizeof (buf), be);
-	      logmsg (LOG_NOTICE, "Backend %s resurrected", buf);
-	      if (!be->disabled)
-		{
-		  pthread_mutex_lock (&be->service->mut);
-		  balancer_pri_update (be->balancer, be);
-		  be->balancer->act_num++;
-		  pthread_mutex_unlock (&be->service->mut);
-		}
-	    }
+	    backend_resurrect (be);
 	  else
 	    {
 	      job_enqueue_after (alive_to, touch_be, be);
@@ -1848,6 +2820,62 @@ POUND_SSL_CTX_init (SSL_CTX *ctx)
 }
 #endif
 
+/* Index of the backend pointer in the ex_data of backend SSL objects. */
+static int backend_ssl_index = -1;
+static pthread_once_t backend_ssl_once = PTHREAD_ONCE_INIT;
+
+static void
+backend_ssl_index_init (void)
+{
+  backend_ssl_index = SSL_get_ex_new_index (0, NULL, NULL, NULL, NULL);
+}
+
+/*
+ * Create new SSL object for connecting to the HTTPS backend BE.  If a
+ * session has been established with this backend earlier, arrange for
+ * its resumption.
+ */
+SSL *
+backend_ssl_new (BACKEND *be)
+{
+  SSL *ssl;
+
+  pthread_once (&backend_ssl_once, backend_ssl_index_init);
+  if ((ssl = SSL_new (be->v.reg.ctx)) == NULL)
+    return NULL;
+  SSL_set_ex_data (ssl, backend_ssl_index, be);
+  if (be->v.reg.servername)
+    SSL_set_tlsext_host_name (ssl, be->v.reg.servername);
+  pthread_mutex_lock (&be->mut);
+  if (be->v.reg.tls_session)
+    SSL_set_session (ssl, be->v.reg.tls_session);
+  pthread_mutex_unlock (&be->mut);
+  return ssl;
+}
+
+/*
+ * New session callback for backend SSL contexts.  Keeps the most
+ * recent session established with each backend.
+ */
+int
+backend_ssl_new_session (SSL *ssl, SSL_SESSION *sess)
+{
+  BACKEND *be;
+  SSL_SESSION *old;
+
+  if (backend_ssl_index == -1
+      || (be = SSL_get_ex_data (ssl, backend_ssl_index)) == NULL)
+    return 0;
+  pthread_mutex_lock (&be->mut);
+  old = be->v.reg.tls_session;
+  be->v.reg.tls_session = sess;
+  pthread_mutex_unlock (&be->mut);
+  if (old)
+    SSL_SESSION_free (old);
+  /* The reference to sess is retained. */
+  return 1;
+}
+
 static char *
 get_param (char const *url, char const *param, size_t *ret_len)
 {
@@ -1911,11 +2939,39 @@ service_session_serialize (SERVICE *svc)
       obj = json_new_array ();
       if (obj && svc->sessions)
 	{
-	  SESSION *sess;
+	  SESSION_TABLE *tab = svc->sessions;
+	  SESSION *cur[SESSION_SHARDS];
+	  int i;
+
+	  /*
+	   * Lock all shards and merge their lists, so that sessions are
+	   * listed in the order of their expiration.
+	   */
+	  for (i = 0; i < SESSION_SHARDS; i++)
+	    {
+	      pthread_mutex_lock (&tab->shard[i].mut);
+	      cur[i] = DLIST_FIRST (&tab->shard[i].head);
+	    }
 
-	  DLIST_FOREACH (sess, &svc->sessions->head, link)
+	  for (;;)
 	    {
-	      struct json_value *s = json_new_object ();
+	      SESSION *sess = NULL;
+	      int n = 0;
+	      struct json_value *s;
+
+	      for (i = 0; i < SESSION_SHARDS; i++)
+		if (cur[i]
+		    && (!sess || timespec_cmp (&cur[i]->expire,
+					       &sess->expire) < 0))
+		  {
+		    sess = cur[i];
+		    n = i;
+		  }
+	      if (!sess)
+		break;
+	      cur[n] = DLIST_NEXT (sess, link);
+
+	      s = json_new_object ();
 
 	      if (!s)
 		{
@@ -1937,6 +2993,9 @@ service_session_serialize (SERVICE *svc)
 		  break;
 		}
 	    }
+
+	  for (i = 0; i < SESSION_SHARDS; i++)
+	    pthread_mutex_unlock (&tab->shard[i].mut);
 	}
     }
 
@@ -1974,6 +3033,9 @@ backend_type_str (BACKEND_TYPE t)
     case BE_METRICS:
       return "metrics";
 
+    case BE_CACHE:
+      return "cache";
+
     default: /* BE_REGULAR_REF can't happen at this stage. */
       break;
     }
@@ -2016,6 +3078,201 @@ nsqrt (double a, double prec)
   return x1;
 }
 
+/* Backend statistics */
+
+uint64_t const be_stats_bucket_bound[BE_STATS_BUCKETS] = {
+  100000,       250000,      500000,	/* 0.1 - 0.5 ms */
+  1000000,      2500000,     5000000,	/* 1 - 5 ms */
+  10000000,     25000000,    50000000,	/* 10 - 50 ms */
+  100000000,    250000000,   500000000,	/* 0.1 - 0.5 s */
+  1000000000,   2500000000,  5000000000,	/* 1 - 5 s */
+  10000000000,  25000000000, 50000000000	/* 10 - 50 s */
+};
+
+static pthread_key_t stats_slot_key;
+static pthread_once_t stats_slot_key_once = PTHREAD_ONCE_INIT;
+static unsigned long stats_slot_next;
+
+static void
+stats_slot_key_create (void)
+{
+  pthread_key_create (&stats_slot_key, NULL);
+}
+
+/*
+ * Return the index of the statistics slot used by the calling thread.
+ * Slots are assigned to threads in round-robin fashion, so that as long
+ * as there are no more than BE_STATS_SLOTS workers, each one updates its
+ * own slot.
+ */
+static unsigned
+stats_slot_index (void)
+{
+  uintptr_t n;
+
+  pthread_once (&stats_slot_key_once, stats_slot_key_create);
+  if ((n = (uintptr_t) pthread_getspecific (stats_slot_key)) == 0)
+    {
+      n = __atomic_add_fetch (&stats_slot_next, 1, __ATOMIC_RELAXED);
+      pthread_setspecific (stats_slot_key, (void *) n);
+    }
+  return (n - 1) % BE_STATS_SLOTS;
+}
+
+static inline void
+atomic_add_double (double *p, double v)
+{
+  double oldval, newval;
+
+  __atomic_load (p, &oldval, __ATOMIC_RELAXED);
+  do
+    newval = oldval + v;
+  while (!__atomic_compare_exchange (p, &oldval, &newval, 1,
+				     __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static int
+stats_bucket (uint64_t t)
+{
+  int i;
+
+  for (i = 0; i < BE_STATS_BUCKETS; i++)
+    if (t <= be_stats_bucket_bound[i])
+      break;
+  return i;
+}
+
+/*
+ * Account for a request to BE that started at START and finished at END.
+ */
+void
+backend_update_stats (BACKEND *be, struct timespec const *start,
+		      struct timespec const *end)
+{
+  struct be_stats *st = &be->stats[stats_slot_index ()];
+  struct timespec diff;
+  uint64_t t;
+
+  diff = timespec_sub (end, start);
+  t = (uint64_t) diff.tv_sec * 1000000000 + diff.tv_nsec;
+
+  __atomic_add_fetch (&st->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&st->sum, t, __ATOMIC_RELAXED);
+  atomic_add_double (&st->sumsq, (double) t * t);
+  __atomic_add_fetch (&st->hist[stats_bucket (t)], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Smoothing factor of the moving average of request times: each new
+ * sample contributes 1/BE_EWMA_WEIGHT to the result.
+ */
+#define BE_EWMA_WEIGHT 8
+
+/*
+ * Account for a new request sent to the regular backend BE.
+ */
+void
+backend_request_begin (BACKEND *be)
+{
+  __atomic_add_fetch (&be->v.reg.active, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Account for completion of a request to BE that started at START and
+ * finished at END.  Updates the number of requests in flight and the
+ * moving average of request times.
+ */
+void
+backend_request_end (BACKEND *be, struct timespec const *start,
+		     struct timespec const *end)
+{
+  struct timespec diff;
+  uint64_t t, oldval, newval;
+
+  __atomic_sub_fetch (&be->v.reg.active, 1, __ATOMIC_RELAXED);
+
+  diff = timespec_sub (end, start);
+  t = (uint64_t) diff.tv_sec * 1000000000 + diff.tv_nsec;
+  oldval = __atomic_load_n (&be->v.reg.ewma, __ATOMIC_RELAXED);
+  do
+    {
+      if (oldval == 0)
+	newval = t;
+      else
+	newval = oldval + ((int64_t) t - (int64_t) oldval) / BE_EWMA_WEIGHT;
+      if (newval == 0)
+	newval = 1;  /* 0 means "unknown". */
+    }
+  while (!__atomic_compare_exchange_n (&be->v.reg.ewma, &oldval, newval, 1,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  __atomic_store_n (&be->v.reg.ewma_time,
+		    (uint64_t) end->tv_sec * 1000000000 + end->tv_nsec,
+		    __ATOMIC_RELAXED);
+}
+
+/*
+ * Merge request statistics of BE into ST.
+ */
+void
+backend_stats_read (BACKEND *be, struct be_stats *st)
+{
+  int i, j;
+
+  memset (st, 0, sizeof (*st));
+  for (i = 0; i < BE_STATS_SLOTS; i++)
+    {
+      struct be_stats *slot = &be->stats[i];
+      double d;
+
+      st->count += __atomic_load_n (&slot->count, __ATOMIC_RELAXED);
+      st->sum += __atomic_load_n (&slot->sum, __ATOMIC_RELAXED);
+      __atomic_load (&slot->sumsq, &d, __ATOMIC_RELAXED);
+      st->sumsq += d;
+      for (j = 0; j <= BE_STATS_BUCKETS; j++)
+	st->hist[j] += __atomic_load_n (&slot->hist[j], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Return standard deviation of the request time in ST.  ST must
+ * account for at least one request.
+ */
+double
+be_stats_stddev (struct be_stats const *st)
+{
+  double avg = (double) st->sum / st->count;
+  return nsqrt (st->sumsq / st->count - avg * avg, 0.5);
+}
+
+static struct json_value *
+backend_histogram_serialize (struct be_stats *st)
+{
+  struct json_value *obj, *bounds, *counts;
+  int i, err = 0;
+
+  if ((obj = json_new_object ()) == NULL)
+    return NULL;
+  if ((bounds = json_new_array ()) == NULL
+      || json_object_set (obj, "bounds", bounds)
+      || (counts = json_new_array ()) == NULL
+      || json_object_set (obj, "counts", counts))
+    err = 1;
+  for (i = 0; !err && i <= BE_STATS_BUCKETS; i++)
+    {
+      if (i < BE_STATS_BUCKETS)
+	err = json_array_append (bounds,
+				 json_new_number (be_stats_bucket_bound[i]));
+      if (!err)
+	err = json_array_append (counts, json_new_number (st->hist[i]));
+    }
+  if (err)
+    {
+      json_value_free (obj);
+      obj = NULL;
+    }
+  return obj;
+}
+
 static struct json_value *
 backend_stats_serialize (BACKEND *be)
 {
@@ -2024,17 +3281,92 @@ backend_stats_serialize (BACKEND *be)
   if ((obj = json_new_object ()) != NULL)
     {
       int err = 0;
+      struct be_stats st;
 
-      pthread_mutex_lock (&be->mut);
-      err |= json_object_set (obj, "request_count", json_new_number (be->numreq));
-      if (be->numreq > 0)
+      backend_stats_read (be, &st);
+      err |= json_object_set (obj, "request_count", json_new_number (st.count));
+      if (st.count > 0)
 	{
 	  err |= json_object_set (obj, "request_time_avg",
-				  json_new_number (be->avgtime))
+				  json_new_number ((double) st.sum / st.count))
 	    || json_object_set (obj, "request_time_stddev",
-				json_new_number (nsqrt (be->avgsqtime - be->avgtime * be->avgtime, 0.5)));
+				json_new_number (be_stats_stddev (&st)))
+	    || json_object_set (obj, "request_time_sum",
+				json_new_number (st.sum))
+	    || json_object_set (obj, "request_time_histogram",
+				backend_histogram_serialize (&st));
+	}
+      if (err)
+	{
+	  json_value_free (obj);
+	  obj = NULL;
+	}
+    }
+  return obj;
+}
+
+static struct json_value *
+backend_pool_serialize (struct be_pool *pool)
+{
+  struct json_value *obj;
+
+  if ((obj = json_new_object ()) != NULL)
+    {
+      int err;
+
+      pthread_mutex_lock (&pool->mut);
+      err = json_object_set (obj, "max_idle", json_new_integer (pool->max_idle))
+	|| json_object_set (obj, "idle_to", json_new_integer (pool->idle_to))
+	|| json_object_set (obj, "idle", json_new_integer (pool->count))
+	|| json_object_set (obj, "hits", json_new_number (pool->hits))
+	|| json_object_set (obj, "misses", json_new_number (pool->misses));
+      pthread_mutex_unlock (&pool->mut);
+      if (err)
+	{
+	  json_value_free (obj);
+	  obj = NULL;
 	}
+    }
+  return obj;
+}
+
+static struct json_value *
+backend_health_serialize (BACKEND *be)
+{
+  struct json_value *obj;
+
+  if ((obj = json_new_object ()) != NULL)
+    {
+      struct be_health *hp = &be->v.reg.health;
+      int err;
+
+      pthread_mutex_lock (&be->mut);
+      err = json_object_set (obj, "url", json_new_string (hp->conf->url))
+	|| json_object_set (obj, "interval",
+			    json_new_integer (hp->conf->interval))
+	|| json_object_set (obj, "checks", json_new_number (hp->checks))
+	|| json_object_set (obj, "failures", json_new_number (hp->failures))
+	|| json_object_set (obj, "rise_count",
+			    json_new_integer (hp->rise_count))
+	|| json_object_set (obj, "fall_count",
+			    json_new_integer (hp->fall_count));
+      if (err == 0 && hp->last_ok != -1)
+	err = json_object_set (obj, "ok", json_new_bool (hp->last_ok))
+	  || json_object_set (obj, "status",
+			      json_new_integer (hp->last_status))
+	  || json_object_set (obj, "latency",
+			      json_new_number (hp->last_latency))
+	  || json_object_set (obj, "time", timespec_serialize (&hp->last_time))
+	  || json_object_set (obj, "error",
+			      hp->last_error[0]
+			      ? json_new_string (hp->last_error)
+			      : json_new_null ());
       pthread_mutex_unlock (&be->mut);
+      if (err)
+	{
+	  json_value_free (obj);
+	  obj = NULL;
+	}
     }
   return obj;
 }
@@ -2165,7 +3497,17 @@ backend_serialize (BACKEND *be)
 					  be->v.reg.servername
 					  ? json_new_string (be->v.reg.servername)
 					  : json_new_null ())
+		      || json_object_set (obj, "active",
+					  json_new_number (backend_active_requests (be)))
+		      || json_object_set (obj, "ewma",
+					  json_new_number (backend_ewma (be)))
 		      || backend_serialize_dyninfo (obj, be);
+		    if (err == 0 && be->v.reg.pool.max_idle > 0)
+		      err = json_object_set (obj, "pool",
+					     backend_pool_serialize (&be->v.reg.pool));
+		    if (err == 0 && be->v.reg.health.conf)
+		      err = json_object_set (obj, "health",
+					     backend_health_serialize (be));
 		    break;
 
 		  case BE_REDIRECT:
@@ -2177,6 +3519,7 @@ backend_serialize (BACKEND *be)
 		  case BE_ACME:
 		  case BE_CONTROL:
 		  case BE_METRICS:
+		  case BE_CACHE:
 		    /* FIXME */
 		    break;
 		    
@@ -2874,9 +4217,7 @@ session_remove_handler (BIO *c, OBJECT *obj, char const *url, void *data)
   strncpy (keybuf, key, keylen);
   keybuf[keylen] = 0;
 
-  pthread_mutex_lock (&svc->mut);
   service_session_remove_by_key (svc, keybuf);
-  pthread_mutex_unlock (&svc->mut);
 
   if ((val = service_serialize (svc)) != NULL)
     {
@@ -2918,9 +4259,7 @@ session_add_handler (BIO *c, OBJECT *obj, char const *url, void *data)
   strncpy (keybuf, key, keylen);
   keybuf[keylen] = 0;
 
-  pthread_mutex_lock (&svc->mut);
-  service_session_add (svc, keybuf, be);
-  pthread_mutex_unlock (&svc->mut);
+  backend_unref (service_session_add (svc, keybuf, be, 1));
 
   if ((val = service_serialize (svc)) != NULL)
     {
@@ -2948,6 +4287,96 @@ control_add_session (BIO *c, char const *url)
   return HTTP_STATUS_NOT_FOUND;
 }
 
+static int
+ticket_keys_handler (BIO *c, OBJECT *obj, char const *url, void *data)
+{
+  struct json_value *val;
+  LISTENER *lstn;
+  int ok = 1;
+  int rc;
+
+  if (*url && *url != '?')
+    return HTTP_STATUS_NOT_FOUND;
+  if (obj->type != OBJ_LISTENER)
+    return HTTP_STATUS_BAD_REQUEST;
+
+  if (obj->lstn)
+    {
+      if (obj->lstn->ticket_keys == NULL)
+	return HTTP_STATUS_BAD_REQUEST;
+      ok = ticket_keys_load (obj->lstn) == 0;
+    }
+  else
+    {
+      SLIST_FOREACH (lstn, &listeners, next)
+	{
+	  if (ticket_keys_load (lstn))
+	    ok = 0;
+	}
+    }
+
+  if (ok)
+    logmsg (LOG_NOTICE, "ticket keys reloaded");
+
+  if ((val = json_new_bool (ok)) == NULL)
+    rc = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  else
+    {
+      rc = send_json_reply (c, val, url);
+      json_value_free (val);
+    }
+  return rc;
+}
+
+static int
+control_reload_ticket_keys (BIO *c, char const *url)
+{
+  if (*url == 0 || *url == '?')
+    url = "/";
+  if (*url == '/')
+    return ctl_listener (ticket_keys_handler, NULL, c, url);
+  return HTTP_STATUS_NOT_FOUND;
+}
+
+/* Default and max. number of keys to list for each rate limiter. */
+#define RATELIMIT_TOP_DEFAULT 10
+#define RATELIMIT_TOP_MAX     1000
+
+static int
+control_list_ratelimit (BIO *c, char const *url)
+{
+  struct json_value *val;
+  size_t top = RATELIMIT_TOP_DEFAULT;
+  char *p;
+  size_t len;
+  int rc;
+
+  if (*url == '/')
+    url++;
+  if (*url && *url != '?')
+    return HTTP_STATUS_NOT_FOUND;
+  if ((p = get_param (url, "top", &len)) != NULL)
+    {
+      char *end;
+      unsigned long n;
+
+      errno = 0;
+      n = strtoul (p, &end, 10);
+      if (errno || end != p + len || len == 0)
+	return HTTP_STATUS_BAD_REQUEST;
+      top = n > RATELIMIT_TOP_MAX ? RATELIMIT_TOP_MAX : n;
+    }
+
+  if ((val = rate_limit_serialize (top)) == NULL)
+    rc = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+  else
+    {
+      rc = send_json_reply (c, val, url);
+      json_value_free (val);
+    }
+  return rc;
+}
+
 struct endpoint
 {
   char *uri;
@@ -2963,11 +4392,13 @@ static struct endpoint control_endpoint[] = {
   { S("/listener"), METH_GET, control_list_listener },
   { S("/listener"), METH_DELETE, control_disable_listener },
   { S("/listener"), METH_PUT, control_enable_listener },
+  { S("/ratelimit"), METH_GET, control_list_ratelimit },
   { S("/service"), METH_GET, control_list_service },
   { S("/service"), METH_DELETE, control_disable_service },
   { S("/service"), METH_PUT, control_enable_service },
   { S("/session"), METH_DELETE, control_delete_session },
   { S("/session"), METH_PUT, control_add_session },
+  { S("/ticketkeys"), METH_POST, control_reload_ticket_keys },
 #undef S
   { NULL }
 };
@@ -0,0 +1,288 @@
+/* TLS session ticket keys for pound
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pound.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Session tickets are encrypted with keys read from files, so that
+ * several pound instances, as well as a restarted pound, can resume
+ * each other's sessions.  Each file contains a single key: 48 bytes
+ * for AES-128 or 80 bytes for AES-256 encryption, in the same format as
+ * used by nginx.  The first key of a listener is used to encrypt new
+ * tickets, the rest are only used to decrypt tickets issued earlier.
+ * The keys can be reloaded at run time, which allows to rotate them
+ * without restarting pound.
+ */
+#include "pound.h"
+#include "extern.h"
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+#endif
+
+struct ticket_key
+{
+  unsigned char name[TICKET_KEY_NAME_LEN];
+  unsigned char hmac_key[32];
+  unsigned char aes_key[32];
+  size_t size;                  /* Key size: 48 or 80. */
+};
+
+struct ticket_keys
+{
+  pthread_rwlock_t rwl;         /* Protects keys. */
+  char **files;                 /* Key file names. */
+  size_t count;                 /* Number of files (and keys). */
+  struct ticket_key *keys;      /* Keys; keys[0] encrypts new tickets. */
+};
+
+/* Add key file NAME to the listener LST. */
+void
+ticket_keys_add_file (LISTENER *lst, char *name)
+{
+  struct ticket_keys *tk;
+
+  if ((tk = lst->ticket_keys) == NULL)
+    {
+      XZALLOC (tk);
+      pthread_rwlock_init (&tk->rwl, NULL);
+      lst->ticket_keys = tk;
+    }
+  tk->files = xrealloc (tk->files, (tk->count + 1) * sizeof (tk->files[0]));
+  tk->files[tk->count++] = name;
+}
+
+/*
+ * Read the key from file NAME into KEY.  Return 0 on success and -1
+ * on error.
+ */
+static int
+ticket_key_read (char const *name, struct ticket_key *key)
+{
+  unsigned char buf[80];
+  struct stat st;
+  int fd;
+  ssize_t n;
+
+  if ((fd = open (name, O_RDONLY)) == -1)
+    {
+      logmsg (LOG_ERR, "can't open ticket key file %s: %s", name,
+	      strerror (errno));
+      return -1;
+    }
+  if (fstat (fd, &st))
+    {
+      logmsg (LOG_ERR, "can't stat ticket key file %s: %s", name,
+	      strerror (errno));
+      close (fd);
+      return -1;
+    }
+  if (st.st_size != 48 && st.st_size != 80)
+    {
+      logmsg (LOG_ERR, "%s: ticket key file must be 48 or 80 bytes long",
+	      name);
+      close (fd);
+      return -1;
+    }
+  n = read (fd, buf, st.st_size);
+  close (fd);
+  if (n != st.st_size)
+    {
+      logmsg (LOG_ERR, "error reading ticket key file %s: %s", name,
+	      n == -1 ? strerror (errno) : "short read");
+      return -1;
+    }
+
+  key->size = n;
+  memcpy (key->name, buf, TICKET_KEY_NAME_LEN);
+  if (n == 48)
+    {
+      memcpy (key->aes_key, buf + 16, 16);
+      memcpy (key->hmac_key, buf + 32, 16);
+    }
+  else
+    {
+      memcpy (key->hmac_key, buf + 16, 32);
+      memcpy (key->aes_key, buf + 48, 32);
+    }
+  OPENSSL_cleanse (buf, sizeof (buf));
+  return 0;
+}
+
+/*
+ * Load (or reload) ticket keys of the listener LST.  On error, the
+ * keys in use remain unchanged.  Return 0 on success and -1 on error.
+ */
+int
+ticket_keys_load (LISTENER *lst)
+{
+  struct ticket_keys *tk = lst->ticket_keys;
+  struct ticket_key *keys, *old;
+  size_t i;
+
+  if (tk == NULL)
+    return 0;
+
+  keys = xcalloc (tk->count, sizeof (keys[0]));
+  for (i = 0; i < tk->count; i++)
+    {
+      if (ticket_key_read (tk->files[i], &keys[i]))
+	{
+	  OPENSSL_cleanse (keys, tk->count * sizeof (keys[0]));
+	  free (keys);
+	  return -1;
+	}
+    }
+
+  pthread_rwlock_wrlock (&tk->rwl);
+  old = tk->keys;
+  tk->keys = keys;
+  pthread_rwlock_unlock (&tk->rwl);
+
+  if (old)
+    {
+      OPENSSL_cleanse (old, tk->count * sizeof (old[0]));
+      free (old);
+    }
+  return 0;
+}
+
+/*
+ * Find the key to use.  If ENC is true, return the encryption key.
+ * Otherwise, look up the key with the given NAME.  On success, copy
+ * the key to KEY and return its index.  Return -1 if not found.
+ */
+static int
+ticket_key_find (struct ticket_keys *tk, unsigned char const *name, int enc,
+		 struct ticket_key *key)
+{
+  size_t i;
+  int rc = -1;
+
+  pthread_rwlock_rdlock (&tk->rwl);
+  if (tk->keys)
+    {
+      if (enc)
+	rc = 0;
+      else
+	{
+	  for (i = 0; i < tk->count; i++)
+	    if (memcmp (tk->keys[i].name, name, TICKET_KEY_NAME_LEN) == 0)
+	      {
+		rc = i;
+		break;
+	      }
+	}
+      if (rc != -1)
+	*key = tk->keys[rc];
+    }
+  pthread_rwlock_unlock (&tk->rwl);
+  return rc;
+}
+
+static inline EVP_CIPHER const *
+ticket_key_cipher (struct ticket_key const *key)
+{
+  return key->size == 48 ? EVP_aes_128_cbc () : EVP_aes_256_cbc ();
+}
+
+static inline size_t
+ticket_key_hmac_len (struct ticket_key const *key)
+{
+  return key->size == 48 ? 16 : 32;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TICKET_HMAC_CTX;
+
+static int
+ticket_hmac_init (TICKET_HMAC_CTX *hctx, struct ticket_key *key)
+{
+  OSSL_PARAM params[3];
+
+  params[0] = OSSL_PARAM_construct_octet_string (OSSL_MAC_PARAM_KEY,
+						 key->hmac_key,
+						 ticket_key_hmac_len (key));
+  params[1] = OSSL_PARAM_construct_utf8_string (OSSL_MAC_PARAM_DIGEST,
+						"sha256", 0);
+  params[2] = OSSL_PARAM_construct_end ();
+  return EVP_MAC_CTX_set_params (hctx, params);
+}
+#else
+typedef HMAC_CTX TICKET_HMAC_CTX;
+
+static int
+ticket_hmac_init (TICKET_HMAC_CTX *hctx, struct ticket_key *key)
+{
+  return HMAC_Init_ex (hctx, key->hmac_key, ticket_key_hmac_len (key),
+		       EVP_sha256 (), NULL);
+}
+#endif
+
+/*
+ * Ticket key callback.  See SSL_CTX_set_tlsext_ticket_key_cb(3) for
+ * the description of arguments and return values.
+ */
+static int
+ticket_key_cb (SSL *ssl, unsigned char *name, unsigned char *iv,
+	       EVP_CIPHER_CTX *ectx, TICKET_HMAC_CTX *hctx, int enc)
+{
+  LISTENER *lst = SSL_CTX_get_app_data (SSL_get_SSL_CTX (ssl));
+  struct ticket_key key;
+  int n, rc;
+
+  if (lst == NULL || lst->ticket_keys == NULL
+      || (n = ticket_key_find (lst->ticket_keys, name, enc, &key)) == -1)
+    return 0;
+
+  if (enc)
+    {
+      memcpy (name, key.name, TICKET_KEY_NAME_LEN);
+      if (RAND_bytes (iv, EVP_MAX_IV_LENGTH) != 1
+	  || EVP_EncryptInit_ex (ectx, ticket_key_cipher (&key), NULL,
+				 key.aes_key, iv) != 1
+	  || ticket_hmac_init (hctx, &key) != 1)
+	rc = -1;
+      else
+	rc = 1;
+    }
+  else if (ticket_hmac_init (hctx, &key) != 1
+	   || EVP_DecryptInit_ex (ectx, ticket_key_cipher (&key), NULL,
+				  key.aes_key, iv) != 1)
+    rc = -1;
+  else
+    /* Ask to renew tickets encrypted with an older key. */
+    rc = n == 0 ? 1 : 2;
+
+  OPENSSL_cleanse (&key, sizeof (key));
+  return rc;
+}
+
+/*
+ * Install ticket key callback in CTX, which belongs to the listener
+ * LST.
+ */
+int
+ticket_keys_setup (LISTENER *lst, SSL_CTX *ctx)
+{
+  if (lst->ticket_keys == NULL)
+    return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  return SSL_CTX_set_tlsext_ticket_key_evp_cb (ctx, ticket_key_cb) == 1
+	   ? 0 : -1;
+#else
+  return SSL_CTX_set_tlsext_ticket_key_cb (ctx, ticket_key_cb) == 1 ? 0 : -1;
+#endif
+}
@@ -0,0 +1,72 @@
+/* This file is part of pound testsuite.
+ * Copyright (C) 2025 Sergey Poznyakoff
+ *
+ * Pound is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Pound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pound.h"
+
+void
+xnomem (void)
+{
+  fprintf (stderr, "%s\n", "out of memory");
+  exit (1);
+}
+
+/*
+ * Usage: arenarun OP...
+ * Each OP is either a decimal number N, meaning allocate N bytes from the
+ * arena, or one of the following letters:
+ *   r    reset the arena;
+ *   f    free the arena;
+ *   p    print the total size of arena chunks and the number of extra
+ *        chunks allocated so far.
+ */
+int
+main (int argc, char **argv)
+{
+  struct arena a = { NULL, NULL, 0 };
+  int i;
+
+  for (i = 1; i < argc; i++)
+    {
+      char *arg = argv[i];
+
+      if (strcmp (arg, "r") == 0)
+	arena_reset (&a);
+      else if (strcmp (arg, "f") == 0)
+	arena_free (&a);
+      else if (strcmp (arg, "p") == 0)
+	printf ("%zu %lu\n", arena_size (&a), arena_extra_chunks ());
+      else
+	{
+	  char *end;
+	  unsigned long n;
+	  void *p;
+
+	  errno = 0;
+	  n = strtoul (arg, &end, 10);
+	  if (errno || *end)
+	    {
+	      fprintf (stderr, "%s: bad argument: %s\n", argv[0], arg);
+	      return 2;
+	    }
+	  if ((p = arena_alloc (&a, n)) == NULL)
+	    xnomem ();
+	  memset (p, 0, n);
+	}
+    }
+  arena_free (&a);
+  return 0;
+}
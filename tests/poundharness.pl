@@ -388,7 +388,7 @@ EOT
 	} elsif (/^\s*(Backend|Emergency)/i) {
 	    $be_loc = "$infile:$.";
 	    unshift @state, ST_BACKEND;
-	} elsif (/^\s*((Match)|(Rewrite)|(TrustedIP)|(ACL)|(CombineHeaders))\b/i) {
+	} elsif (/^\s*((Match)|(Rewrite)|(TrustedIP)|(ACL)|(CombineHeaders)|(HealthCheck)|(Cache))\b/i) {
 	    unshift @state, ST_SECTION
 	} elsif (/^(\s*)End/i) {
 	    if ($state[0] == ST_BACKEND) {
@@ -859,7 +859,7 @@ sub parse_req {
 	    next;
 	}
 	if (m/^run\s+(.+)$/) {
-	    $self->parse_runcom($1);
+	    $self->parse_runcom($self->expandvars($1));
 	    next;
 	}
 	if (/^end$/) {
@@ -1285,9 +1285,9 @@ sub parse_expect_body {
 	# }
 
 	if (/\\(.*)/) {
-	    push @{$self->{EXP}{BODY}}, $1;
+	    push @{$self->{EXP}{BODY}}, $self->expandvars($1);
 	} else {
-	    push @{$self->{EXP}{BODY}}, $_;
+	    push @{$self->{EXP}{BODY}}, $self->expandvars($_);
 	}
     }
     $self->{eof} = 1;
@@ -1564,15 +1564,31 @@ sub http_echo {
 	'x-backend-ident' => $http->header('x-backend-ident'),
 	'x-backend-number' => $http->backend->number,
 	'x-orig-uri' => $http->uri,
+	'x-backend-conn-seq' => $http->seq,
 	);
     while (my ($k, $v) = each %{$http->header}) {
 	$headers{'x-orig-header-' . $k} = $v;
     }
+    if ($http->header('x-stale') && $http->seq > 1) {
+	# Simulate a connection closed by the backend while idle.
+	$http->close;
+	return;
+    }
+
     my @argv = (200, "OK", headers => \%headers);
 
+    if (my $delay = $http->header('x-delay')) {
+	my ($sec, $n) = split ' ', $delay;
+	select(undef, undef, undef, $sec)
+	    if !defined($n) || $n == $http->backend->number;
+    }
+
     if (my $body = $http->body) {
 	push @argv, body => $body
     }
+    if (my $size = $http->header('x-chunked')) {
+	push @argv, chunked => $size
+    }
     $http->reply(@argv);
 }
 
@@ -1585,31 +1601,45 @@ sub http_redirect {
     });
 }
 
+sub http_upgrade {
+    my $http = shift;
+    if (lc($http->header('upgrade') // '') ne 'websocket') {
+	$http->reply(400, "Bad Request");
+	return;
+    }
+    $http->switch_protocols('websocket');
+}
+
 sub process_http_request {
     my ($sock, $backend) = @_;
 
     my %endpoints = (
 	'echo' => \&http_echo,
 	'redirect' => \&http_redirect,
+	'upgrade' => \&http_upgrade,
     );
 
     local $| = 1;
-    my $http = HTTPServ->new($sock, $backend);
-    $http->parse();
-    if ($http->uri =~ m{^/([^/]+)(/.*)?}) {
-	my ($dir, $rest) = ($1, $2);
-	if (my $ep = $endpoints{$dir}) {
-	    &{$ep}($http, $2);
+    my $seq = 0;
+    my $http;
+    do {
+	$http = HTTPServ->new($sock, $backend, ++$seq);
+	$http->parse();
+	if ($http->uri =~ m{^/([^/]+)(/.*)?}) {
+	    my ($dir, $rest) = ($1, $2);
+	    if (my $ep = $endpoints{$dir}) {
+		&{$ep}($http, $2);
+	    } else {
+		$http->reply(404, "Not found",
+			     headers => {
+				 'x-orig-uri' => $http->uri,
+				 map { ('x-orig-header-' . $_) => $http->header->{$_} } keys %{$http->header}
+			     });
+	    }
 	} else {
-	    $http->reply(404, "Not found",
-			 headers => {
-			     'x-orig-uri' => $http->uri,
-			     map { ('x-orig-header-' . $_) => $http->header->{$_} } keys %{$http->header}
-			 });
+	    $http->reply(500, "Malformed URI");
 	}
-    } else {
-	$http->reply(500, "Malformed URI");
-    }
+    } while ($http->keepalive && !eof($sock));
     $http->close;
 }
 
@@ -1620,14 +1650,22 @@ package HTTPServ;
 use strict;
 use warnings;
 use Socket qw(:crlf);
+use IO::Handle;
 use Carp;
 
 sub new {
-    my ($class, $fh, $backend) = @_;
-    bless { fh => $fh, backend => $backend }, $class;
+    my ($class, $fh, $backend, $seq) = @_;
+    bless { fh => $fh, backend => $backend, seq => $seq // 1 }, $class;
 }
 
 sub backend { shift->{backend} }
+sub seq { shift->{seq} }
+# Keep the connection open after replying, if requested so by the
+# X-Keepalive header.
+sub keepalive {
+    my $http = shift;
+    return $http->version eq 'HTTP/1.1' && $http->header('x-keepalive');
+}
 sub ident { shift->backend->ident }
 sub method { shift->{METHOD} }
 sub version { shift->{VERSION} }
@@ -1717,14 +1755,46 @@ sub reply {
 	    print $fh "$h: ".$opt{headers}{$h}.$CRLF;
 	}
     }
-    print $fh "connection: close$CRLF";
-    print $fh "content-length: ". ($opt{body} ? length($opt{body}) : 0) . $CRLF;
-    print $fh $CRLF;
-    if ($opt{body}) {
-	print $fh $opt{body};
+    print $fh "connection: close$CRLF" unless $http->keepalive;
+    if ($opt{chunked}) {
+	print $fh "transfer-encoding: chunked$CRLF";
+	print $fh $CRLF;
+	my $body = $opt{body} // '';
+	for (my $i = 0; $i < length($body); $i += $opt{chunked}) {
+	    my $chunk = substr($body, $i, $opt{chunked});
+	    printf $fh "%x$CRLF%s$CRLF", length($chunk), $chunk;
+	}
+	print $fh "0$CRLF$CRLF";
+    } else {
+	print $fh "content-length: ". ($opt{body} ? length($opt{body}) : 0) . $CRLF;
+	print $fh $CRLF;
+	if ($opt{body}) {
+	    print $fh $opt{body};
+	}
     }
+    $fh->flush if $http->keepalive;
 }
 
+# Reply with 101 and echo back whatever arrives until EOF.  The client
+# must wait for the reply before sending data, since anything already
+# read into the input buffer along with the request would be lost.
+sub switch_protocols {
+    my ($http, $proto) = @_;
+    my $fh = $http->{fh};
+    print $fh "$http->{VERSION} 101 Switching Protocols$CRLF";
+    print $fh "upgrade: $proto$CRLF";
+    print $fh "connection: upgrade$CRLF";
+    print $fh $CRLF;
+    $fh->flush;
+    while ((my $n = sysread($fh, my $buf, 65536)) > 0) {
+	for (my $off = 0; $off < $n; ) {
+	    my $rc = syswrite($fh, $buf, $n - $off, $off);
+	    return unless defined $rc;
+	    $off += $rc;
+	}
+    }
+}
+
 package PoundControl;
 use strict;
 use warnings;
@@ -2013,8 +2083,9 @@ Headers may be followed by a newline and response body (content).  If
 present, it will be matched literally against the actual response.
 The response is terminated with the word B<end> on a line alone.
 
-Values of both request and expected headers may contain the following
-I<variables>, which are expanded when reading the file:
+Values of both request and expected headers, as well as the expected
+body, may contain the following I<variables>, which are expanded when
+reading the file:
 
 =over 4
 
@@ -2084,7 +2155,9 @@ exit code, standard output and error streams.  It is included mainly for
 testing the B<poundctl> command.
 
 The stanza begins with the keyword B<run> followed by the command
-and its argument.  It can be followed by one or more of expect statements:
+and its argument.  Listener and backend variables (see above) are
+expanded in the command line.  It can be followed by one or more of
+expect statements:
 
 =over 4
 
@@ -2246,6 +2319,10 @@ corresponding B<Backend> keyword is located.
 
 Copy of the original URI.
 
+=item B<x-backend-conn-seq>
+
+Ordinal number of the request within the backend connection (1-based).
+
 =item B<x-orig-header->I<header>
 
 The value of the header I<header> in the request.
@@ -2255,6 +2332,21 @@ The value of the header I<header> in the request.
 If the body was sent using B<chunked> encoding, it is reproduced
 verbatim, instead of reconstructing it as per RFC 9112, 7.1.3.
 
+If the request contains the B<x-delay> header, the reply is delayed.
+The header value is the delay in seconds (fractional values are
+allowed), optionally followed by whitespace and the backend number.
+In the latter case, only the backend with that number delays its reply.
+This is used to simulate slow backends.
+
+If the request contains the B<x-chunked> header, the reply is sent using
+B<chunked> transfer encoding, with chunks of the size given by the
+header value.
+
+If the request contains the B<x-stale> header and is not the first one
+received over its connection, the backend closes the connection without
+replying.  This is used to simulate reused connections that have been
+closed by the backend.
+
 =head2 /redirect
 
 Redirects the request to the B</echo> endpoint.  The value of the
@@ -2271,6 +2363,20 @@ will get the following response:
 
 This backend is used to test the B<RewriteLocation> functionality.
 
+=head2 /upgrade
+
+If the request contains the B<Upgrade: websocket> header, the backend
+replies with the status 101 and then echoes back all data it receives
+until the connection is closed.  The client must wait for the reply
+before sending any data.  Requests without that header are replied
+with the status 400.
+
+=head2 Keep-alive connections
+
+Normally, backends close the connection after replying to each request.
+If the request uses HTTP/1.1 and contains the B<x-keepalive> header, the
+connection is kept open for the next request.
+
 =head1 FILES
 
 =over 4